@@ -16,6 +16,6 @@
 @set LIBPNG=libpng\png.c libpng\pngerror.c libpng\pngget.c libpng\pngmem.c libpng\pngset.c libpng\pngwio.c libpng\pngwrite.c libpng\pngwtran.c libpng\pngwutil.c
 @set LIBPNG=%LIBPNG% %ZLIB%
 
-@set NATIVE=bmzip.cpp Bytes.cpp Files.cpp FileSecurity.cpp PEFile.cpp PEFileResources.cpp WIM.cpp Trace.cpp
-@set MIXED=Bootmgr.cpp Bcd.cpp Bootres.cpp FileUpdater.cpp MessageTable.cpp Patch.cpp PDB.cpp PEFiles.cpp PngConverter.cpp UI-native.cpp Updater.cpp Utilities.cpp WinXXX.cpp Zip.cpp
+@set NATIVE=bmzip.cpp Bytes.cpp Files.cpp FileSecurity.cpp PEFile.cpp PEFileDiff.cpp PEFileResources.cpp PEFileStorage.cpp WIM.cpp wimzip.cpp Trace.cpp
+@set MIXED=Bootmgr.cpp Bcd.cpp Bootres.cpp FileUpdater.cpp MessageTable.cpp Patch.cpp PDB.cpp PEFiles.cpp PngConverter.cpp UI-native.cpp Updater.cpp Utilities.cpp WimCache.cpp WinXXX.cpp Zip.cpp
 @set PURE=Animation.cpp BootSkin.cpp MultipartFile.cpp Resources.cpp UI.cpp Winload.cpp Winresume.cpp WMI.cpp
@@ -23,6 +23,7 @@
 
 #include "Bootmgr.h"
 #include "Bootres.h"
+#include "WimCache.h"
 
 #include "WinXXX.h"
 #include "Winload.h"
@@ -75,7 +75,7 @@ static PEFile *load(string path, uint *err, ushort *lang, Bytes &data, Bytes &pr
 
 	data.setCount(program2-data); // set the size of the stub to be up to program 2
 
-	decomp = bmzip_decompress(program2);
+	decomp = bmzip_decompress_mt(program2);
 	if (decomp == NULL) { free(data); data = NULL; return NULL; }
 
 	UI::Inc();
@@ -127,7 +127,7 @@ uint Bootmgr::Update(FileUpdater fu) {
 	// 2 increments
 	if (!patch->Apply(bm) || !UI::Inc())											{ error = ERROR_BOOTMGR_HACK; }
 	else if ((error = Save(bm, ERROR_BOOTMGR_BASE)) != ERROR_SUCCESS)				{ /* error = error; */ }
-	else if (!decomp.setCount(bm->getSize()) || !(comp = bmzip_compress(decomp)))	{ error = ERROR_BOOTMGR_COMPRESS; }
+	else if (!(comp = bmzip_compress_mt(Bytes(bm->get(), bm->getSize()), OptimalCompression ? (BMZIP_DEFAULT_DEPTH | BMZIP_OPTIMAL) : BMZIP_DEFAULT_DEPTH)))	{ error = ERROR_BOOTMGR_COMPRESS; }
 
 	// 1 increment
 	else if ((f = CreateFile(as_native(fu.path), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_HIDDEN|FILE_ATTRIBUTE_SYSTEM, NULL)) == INVALID_HANDLE_VALUE)	{ error = ERROR_BOOTMGR_SAVE; }
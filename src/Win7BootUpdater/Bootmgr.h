@@ -33,6 +33,9 @@ namespace Win7BootUpdater {
 		/// <summary>The default path for bootmgr in case the real bootmgr path cannot be found</summary>
 		static initonly string defFallBack = System::IO::Path::Combine(System::IO::Path::GetPathRoot(System::Environment::GetFolderPath(System::Environment::SpecialFolder::System)), L"bootmgr");
 
+		/// <summary>If true bootmgr is compressed with optimal parsing, which is a few percent smaller but several times slower than the default</summary>
+		static bool OptimalCompression = false;
+
 		/// <summary>Checks if a particular path is on a hidden partition</summary>
 		/// <param name="path">The path to check</param>
 		/// <returns>True if the path is on a hidden partition, false otherwise</returns>
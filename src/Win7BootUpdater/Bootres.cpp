@@ -28,8 +28,7 @@
 #include "PEFile.h"
 #include "PEFiles.h"
 #include "WIM.h"
-
-#undef GetTempPath
+#include "WimCache.h"
 
 using namespace Win7BootUpdater;
 using namespace Win7BootUpdater::Files;
@@ -59,24 +58,6 @@ uint Bootres::Check(string path) {
 	return (error == ERROR_SUCCESS) ? ERROR_SUCCESS : (error + ERROR_BOOTRES_BASE);
 }
 
-static string GetTempDir() {
-	Random ^r = gcnew Random();
-	string path;
-	do {
-		path = Path::Combine(Path::GetTempPath(), L"wim"+r->Next());
-	} while (File::Exists(path) || Directory::Exists(path));
-	try {
-		Directory::CreateDirectory(path);
-	} catch (Exception ^) { return nullptr; }
-	return path;
-}
-
-static void DeleteDir(string s) {
-	try {
-		Directory::Delete(s, true);
-	} catch (Exception ^) {}
-}
-
 Bitmap ^Bootres::GetAnimation(string path) {
 	void *bootres = NULL, *data = NULL;
 	try {
@@ -97,17 +78,17 @@ Bitmap ^Bootres::GetAnimation(string path) {
 }
 
 // 4 increments
-static uint SaveActivityBMP(Image ^anim, string% path, string% activity, Color bgColor, Image ^bgImg) {
-	if ((path = GetTempDir()) == nullptr) { return ERROR_GET_TEMP_DIR; }	UI::Inc();
-	activity = Path::Combine(path, Bootres::activity);
+static uint SaveActivityBMP(Image ^anim, array<byte>^% bmp, Color bgColor, Image ^bgImg) {
 	Image ^i = nullptr;
 	try {
 		i = Animation::ResolveTransparency(anim, Animation::Width, Animation::FullHeight, bgColor, bgImg);
-		i->Save(activity, ImageFormat::Bmp);
+		UI::Inc();
+		MemoryStream ^s = gcnew MemoryStream();
+		i->Save(s, ImageFormat::Bmp);
+		bmp = s->ToArray();
 		UI::Inc(3); // 3 increments
 		return ERROR_SUCCESS;
 	} catch (Exception ^) {
-		DeleteDir(path);
 		return ERROR_BOOTRES_ANIM_SAVE;
 	} finally {
 		if (i) delete i;
@@ -115,48 +96,49 @@ static uint SaveActivityBMP(Image ^anim, string% path, string% activity, Color b
 }
 
 // 8 increments
-static uint CreateWIM(string path, Bytes &data, string activity) {
+static uint CreateWIM(array<byte>^ bmp, Bytes &data, array<byte>^ key) {
 	UI::ProgressText = UI::GetMessage(Msg::CompressingAnimation);
-
-	WCHAR wim[MAX_PATH] = {0};
-	if (!GetTempFile(wim)) {
-		return ERROR_GET_TEMP_FILE;
-	}
 	UI::Inc();
 
-	uint error = ERROR_SUCCESS;
-
-	// 6 increments + 1
-	if (!WIM::Create(as_native(path), wim, as_native(activity)))	{ error = ERROR_BOOTRES_WIM_CAPTURE; }
-	else if ((data = ReadAll(wim)) == NULL)							{ error = ERROR_BOOTRES_WIM_READ; }
+	// The chunks are compressed in parallel, one thread per processor
+	pin_ptr<byte> p = &bmp[0];
+	size_t size = 0;
+	void *wim = WIM::Create(as_native(Bootres::activity), p, bmp->Length, &size);
+	if (wim == NULL) { return ERROR_BOOTRES_WIM_CAPTURE; }
+	data = Bytes((LPBYTE)wim, size);
+	UI::Inc(6);
 
+	WimCache::Add(key, wim, size);
 	UI::Inc();
-
-	DeleteFile(wim);
-	return error;
+	return ERROR_SUCCESS;
 }
 
 uint Bootres::Update(Image ^anim, Color bgColor, Image ^bgImg, FileUpdater f) {
 	uint error = ERROR_SUCCESS;
 	PEFile *bootres;
 	ushort lang = 0;
-	string dest = nullptr, act = nullptr;
-	Bytes data;
+	array<byte>^ bmp = nullptr;
+
+	// Look for the WIM in the cache, if it is there the animation doesn't need to be compiled or compressed
+	array<byte>^ key = WimCache::GetKey(anim, bgColor, bgImg);
+	size_t size = 0;
+	Bytes data((LPBYTE)WimCache::Get(key, activity, Animation::Width, Animation::FullHeight, &size), size);
+	bool cached = data;
 
 	// Compile activity.bmp (4 increments)
-	if ((error = SaveActivityBMP(anim, dest, act, bgColor, bgImg)) != ERROR_SUCCESS)	{ return error; }
+	if (cached) { UI::Inc(4); }
+	else if ((error = SaveActivityBMP(anim, bmp, bgColor, bgImg)) != ERROR_SUCCESS)	{ return error; }
 
 	// Load bootres (2 increments)
-	else if ((bootres = load(f.path, &error, &lang, false)) == NULL)	{ error += ERROR_BOOTRES_BASE; }
+	if ((bootres = load(f.path, &error, &lang, false)) == NULL)	{ error += ERROR_BOOTRES_BASE; }
 
-	// Create the new WIM (8 increments)
-	else if ((error = CreateWIM(dest, data, act)) != ERROR_SUCCESS)		{ /* error = error;*/ }
+	// Create the new WIM, unless it was cached (8 increments)
+	else if (!cached && (error = CreateWIM(bmp, data, key)) != ERROR_SUCCESS)		{ /* error = error;*/ }
 
 	// Modify WIM resource in bootres (2 increments)
-	else { error = ModifyResAndSave(bootres, RT_RCDATA, MAKEINTRESOURCE(1), lang, data, ERROR_BOOTRES_BASE, false); }
+	else { if (cached) { UI::Inc(8); } error = ModifyResAndSave(bootres, RT_RCDATA, MAKEINTRESOURCE(1), lang, data, ERROR_BOOTRES_BASE, false); }
 
 	// Clean up (1 increment)
-	DeleteDir(dest);
 	if (data)		free(data);
 	if (bootres)	delete bootres;
 	UI::Inc();
@@ -17,6 +17,7 @@
  */
 
 #include "Bytes.h"
+#include "Cpu.h"
 
 #ifdef __cplusplus_cli
 #pragma unmanaged
@@ -41,58 +42,10 @@ Bytes& Bytes::operator =(const Bytes& x) { if (this != &x) { count = x.count; da
 Bytes& Bytes::operator =(unsigned char* x) { data = x; if (x == NULL) { count = 0; } return *this; } // size must be set on its own
 
 size_t Bytes::setCount(size_t count) { return (this->count = count); }
-Bytes Bytes::find(const Bytes& target) const { return find(target.data, target.count); }
-Bytes Bytes::find(const unsigned char *target, size_t t_count) const {
-	if (t_count == 0 || count == 0) return Null;
-
-	Bytes data(this->data, count), d(this->data, count);
-	do {
-		// Find the first byte of target in data
-		d = (unsigned char*)memchr(data, (int)target[0], *d);
-
-		// Could not find start
-		if (d == NULL) { break; }
-
-		// Move the next search position one ahead so that we skip the current byte
-		d.count = count-(d.data-this->data);
-		data = d+1;
-
-		// Too short
-		if (d.count < t_count) { return Null; }
-
-		// Compare the current data to target
-	} while (memcmp(d, target, t_count) != 0);
-	return d;
-}
-
-static bool equal(const unsigned char *a, const unsigned char *b, size_t n, unsigned char wildcard) {
-	for (size_t i = 0; i < n; ++i) if (a[i] != b[i] && b[i] != wildcard) return false;
-	return true;
-}
-Bytes Bytes::find(const Bytes& target, byte wildcard) const { return find(target.data, target.count, wildcard); }
-Bytes Bytes::find(const unsigned char *target, size_t t_count, byte wildcard) const {
-	if (t_count == 0 || count == 0) return Null;
-	if (target[0] == wildcard) return find(target, t_count);
-	
-	Bytes data(this->data, count), d(this->data, count);
-	do {
-		// Find the first byte of target in data
-		d = (unsigned char*)memchr(data, (int)target[0], *d);
-
-		// Could not find start
-		if (d == NULL) { break; }
-
-		// Move the next search position one ahead so that we skip the current byte
-		d.count = count-(d.data-this->data);
-		data = d+1;
-		
-		// Too short
-		if (d.count < t_count) { return Null; }
-
-		// Compare the current data to target (using the wildcard)
-	} while (!equal(d, target, t_count, wildcard));
-	return d;
-}
+Bytes Bytes::find(const Bytes& target) const { return SearchPattern(target).find(*this); }
+Bytes Bytes::find(const unsigned char *target, size_t t_count) const { return SearchPattern(target, t_count).find(*this); }
+Bytes Bytes::find(const Bytes& target, byte wildcard) const { return SearchPattern(target, wildcard).find(*this); }
+Bytes Bytes::find(const unsigned char *target, size_t t_count, byte wildcard) const { return SearchPattern(target, t_count, wildcard).find(*this); }
 void Bytes::set(const Bytes &target) {
 	memcpy(this->data, target.data, (count < target.count) ? count : target.count);
 }
@@ -132,7 +85,7 @@ bool Bytes::operator <(const size_t x) const { return (size_t)this->data < x; }
 bool Bytes::operator >=(const size_t x) const { return (size_t)this->data >= x; }
 bool Bytes::operator <=(const size_t x) const { return (size_t)this->data <= x; }*/
 
-bool Bytes::operator ==(const int x) const { return (int)this->data == x; }
+bool Bytes::operator ==(const int x) const { return (size_t)this->data == (size_t)x; }
 /*bool Bytes::operator !=(const int x) const { return (int)this->data != x; }
 bool Bytes::operator >(const int x) const { return (int)this->data > x; }
 bool Bytes::operator <(const int x) const { return (int)this->data < x; }
@@ -163,3 +116,181 @@ unsigned char *Bytes::operator ()(size_t x) { return data+x; };
 Bytes::operator bool() const { return data != NULL; }
 Bytes::operator unsigned char*() const { return data; }
 Bytes::operator void*() const { return data; }
+
+
+// Whether to search using SSE2, decided once at startup
+static const bool use_sse2 = CpuHasSSE2();
+
+// Bytes that are common in executable code and data, most common first, used to pick the anchors
+static const unsigned char common[] = {
+	0x00, 0xFF, 0x8B, 0x48, 0x89, 0xE8, 0x0F, 0x24, 0x4C, 0x83, 0x01, 0x44, 0xC0, 0x85, 0x8D,
+	0x74, 0x75, 0x45, 0x33, 0xCC, 0x90, 0x08, 0x04, 0x10, 0x02, 0x20, 0xC3, 0x41, 0x65,
+};
+static size_t rarity(unsigned char x) {
+	const unsigned char *c = (const unsigned char*)memchr(common, x, sizeof(common));
+	return c ? c - common : sizeof(common);
+}
+
+SearchPattern::SearchPattern(const Bytes& target) { init(~target, *target, false, 0); }
+SearchPattern::SearchPattern(const unsigned char *target, size_t count) { init(target, count, false, 0); }
+SearchPattern::SearchPattern(const Bytes& target, byte wildcard) { init(~target, *target, *target && (~target)[0] != wildcard, wildcard); }
+SearchPattern::SearchPattern(const unsigned char *target, size_t count, byte wildcard) { init(target, count, count && target[0] != wildcard, wildcard); }
+SearchPattern::~SearchPattern() { free(this->target); }
+
+void SearchPattern::init(const unsigned char *target, size_t count, bool wildcards, byte wildcard) {
+	size_t i, dflt, best1 = 0, best2 = 0;
+	this->count = count;
+	this->wild = NULL;
+	this->anchor1 = this->anchor2 = 0;
+	if ((this->target = (unsigned char*)malloc(count + (wildcards ? count*sizeof(bool) : 0))) == NULL) { this->count = 0; return; }
+	memcpy(this->target, target, count);
+	if (wildcards) {
+		this->wild = (bool*)(this->target+count);
+		for (i = 0; i < count; ++i) { this->wild[i] = target[i] == wildcard; }
+	}
+
+	// Horspool skips: a wildcard matches any byte, so none can skip past the last wildcard
+	for (i = 0, dflt = count; i + 1 < count; ++i) { if (wildcards && this->wild[i]) { dflt = count-1-i; } }
+	for (i = 0; i < 256; ++i) { this->skip[i] = dflt; }
+	for (i = 0; i + 1 < count; ++i) { if (!wildcards || !this->wild[i]) { this->skip[target[i]] = (count-1-i < dflt) ? count-1-i : dflt; } }
+
+	// The anchors are the two rarest non-wildcard bytes, the first byte is never a wildcard
+	for (i = 0; i < count; ++i) {
+		if (wildcards && this->wild[i]) { continue; }
+		const size_t r = rarity(target[i]);
+		if (r >= best1) { this->anchor2 = this->anchor1; best2 = best1; this->anchor1 = i; best1 = r; }
+		else if (r >= best2 || this->anchor2 == this->anchor1) { this->anchor2 = i; best2 = r; }
+	}
+}
+
+bool SearchPattern::matches(const unsigned char *x) const {
+	if (x[this->anchor1] != this->target[this->anchor1] || x[this->anchor2] != this->target[this->anchor2]) { return false; }
+	if (this->wild == NULL) { return memcmp(x, this->target, this->count) == 0; }
+	for (size_t i = 0; i < this->count; ++i) { if (x[i] != this->target[i] && !this->wild[i]) { return false; } }
+	return true;
+}
+
+size_t SearchPattern::length() const { return this->count; }
+
+Bytes SearchPattern::find(const Bytes& data) const {
+	const size_t n = *data, m = this->count;
+	unsigned char *d = ~data;
+	size_t i = 0, last;
+	if (m == 0 || n < m) { return Bytes::Null; }
+	last = n - m; // the last possible starting position
+
+	if (use_sse2) {
+		// Check both anchors for 16 starting positions at a time, only fully checking where both are found
+		const __m128i a1 = _mm_set1_epi8((char)this->target[this->anchor1]), a2 = _mm_set1_epi8((char)this->target[this->anchor2]);
+		for (; i + 15 <= last; i += 16) {
+			unsigned long mask = (unsigned long)_mm_movemask_epi8(_mm_and_si128(
+				_mm_cmpeq_epi8(a1, _mm_loadu_si128((const __m128i*)(d+i+this->anchor1))),
+				_mm_cmpeq_epi8(a2, _mm_loadu_si128((const __m128i*)(d+i+this->anchor2)))));
+			while (mask) {
+				unsigned long k;
+				_BitScanForward(&k, mask);
+				if (this->matches(d+i+k)) { return Bytes(d+i+k, n-i-k); }
+				mask &= mask - 1;
+			}
+		}
+	}
+
+	// Horspool for everything else
+	for (; i <= last; i += this->skip[d[i+m-1]]) {
+		if (this->matches(d+i)) { return Bytes(d+i, n-i); }
+	}
+	return Bytes::Null;
+}
+
+
+// Longer runs make for a larger automaton without finding fewer false matches
+#define MAX_KEY	32
+
+MultiPattern::MultiPattern() : built(false) {}
+MultiPattern::~MultiPattern() { for (size_t i = 0; i < this->patterns.size(); ++i) { delete this->patterns[i]; } }
+
+size_t MultiPattern::add(const unsigned char *target, size_t count, byte wildcard) {
+	SearchPattern *p = new SearchPattern(target, count, wildcard);
+	size_t i, start = 0, best_start = 0, best_len = 0;
+
+	// Find the longest run of non-wildcard bytes
+	for (i = 0; i <= p->count; ++i) {
+		if (i == p->count || (p->wild && p->wild[i])) {
+			if (i - start > best_len) { best_start = start; best_len = i - start; }
+			start = i + 1;
+		}
+	}
+	if (best_len > MAX_KEY) { best_len = MAX_KEY; }
+
+	this->patterns.push_back(p);
+	this->key_starts.push_back(best_start);
+	this->key_ends.push_back(best_start + best_len);
+	this->built = false;
+	return this->patterns.size() - 1;
+}
+size_t MultiPattern::count() const { return this->patterns.size(); }
+const SearchPattern &MultiPattern::operator [](size_t i) const { return *this->patterns[i]; }
+
+void MultiPattern::build() {
+	std::vector<unsigned int> fail(1, 0), queue;
+	size_t i, j, q;
+	unsigned int s, c;
+
+	// Build the trie of runs, state 0 is the root so a transition to it means there isn't one yet
+	this->next.assign(256, 0);
+	this->outputs.assign(1, std::vector<size_t>());
+	for (i = 0; i < this->patterns.size(); ++i) {
+		if (this->key_starts[i] == this->key_ends[i]) { continue; } // empty target, never found
+		for (s = 0, j = this->key_starts[i]; j < this->key_ends[i]; ++j) {
+			unsigned int &t = this->next[s*256 + this->patterns[i]->target[j]];
+			if (t == 0) {
+				t = (unsigned int)this->outputs.size();
+				this->next.resize(this->next.size() + 256, 0);
+				this->outputs.push_back(std::vector<size_t>());
+				fail.push_back(0);
+			}
+			s = this->next[s*256 + this->patterns[i]->target[j]]; // the resize may have moved t
+		}
+		this->outputs[s].push_back(i);
+	}
+
+	// Fill in the missing transitions breadth-first, each state also outputs everything its fail state does
+	for (c = 0; c < 256; ++c) { if (this->next[c]) { queue.push_back(this->next[c]); } }
+	for (q = 0; q < queue.size(); ++q) {
+		s = queue[q];
+		const std::vector<size_t> &out = this->outputs[fail[s]];
+		this->outputs[s].insert(this->outputs[s].end(), out.begin(), out.end());
+		for (c = 0; c < 256; ++c) {
+			const unsigned int f = this->next[fail[s]*256 + c];
+			unsigned int &t = this->next[s*256 + c];
+			if (t) { fail[t] = f; queue.push_back(t); }
+			else   { t = f; }
+		}
+	}
+	this->built = true;
+}
+
+void MultiPattern::find(const Bytes& data, size_t *pos) {
+	const size_t n = *data, count = this->patterns.size();
+	const unsigned char *d = ~data;
+	size_t i, j, k, left = count;
+	unsigned int s = 0;
+
+	if (!this->built) { this->build(); }
+	for (i = 0; i < count; ++i) { pos[i] = NotFound; }
+
+	for (j = 0; j < n && left; ++j) {
+		s = this->next[s*256 + d[j]];
+		const std::vector<size_t> &out = this->outputs[s];
+		for (k = 0; k < out.size(); ++k) {
+			// The run of target i ends at j, see if the whole target fits and matches
+			i = out[k];
+			if (pos[i] != NotFound) { continue; }
+			const size_t start = j + 1 - this->key_ends[i];
+			if (j + 1 >= this->key_ends[i] && start + this->patterns[i]->count <= n && this->patterns[i]->matches(d + start)) {
+				pos[i] = start;
+				--left;
+			}
+		}
+	}
+}
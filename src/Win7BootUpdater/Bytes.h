@@ -18,6 +18,8 @@
 
 #pragma once
 
+#include <vector>
+
 class Bytes {
 protected:
 	size_t count;
@@ -132,3 +134,62 @@ public:
 	operator unsigned char*() const;
 	operator void*() const;
 };
+
+// A search target that is prepared once and can then be searched for quickly any number of times
+// Bytes in the target equal to the wildcard match any byte, except that if the wildcard is the same as the first byte there are no wildcards
+class SearchPattern {
+protected:
+	size_t count;
+	unsigned char *target;
+	bool *wild;				// which bytes of target are wildcards, NULL if there are none
+	size_t skip[256];		// how far the search can move ahead based on the last byte of the current window
+	size_t anchor1, anchor2;// the two least common non-wildcard bytes of target, checked before the rest
+
+	void init(const unsigned char *target, size_t count, bool wildcards, byte wildcard);
+
+	friend class MultiPattern;
+
+private:
+	SearchPattern(const SearchPattern&);				// not copyable
+	SearchPattern& operator =(const SearchPattern&);	// not copyable
+
+public:
+	SearchPattern(const Bytes& target);
+	SearchPattern(const unsigned char *target, size_t count);
+	SearchPattern(const Bytes& target, byte wildcard);
+	SearchPattern(const unsigned char *target, size_t count, byte wildcard);
+	~SearchPattern();
+
+	size_t length() const;
+	bool matches(const unsigned char *x) const; // checks if the target is at x, which must have at least length() bytes
+	Bytes find(const Bytes& data) const; // finds the first occurrence in data, Bytes::Null if not found
+};
+
+// Many search targets that are all found with a single pass over the data
+// The longest run of non-wildcard bytes in each target is found with an Aho-Corasick automaton and then the rest of the target is checked
+class MultiPattern {
+protected:
+	std::vector<SearchPattern*> patterns;
+	std::vector<size_t> key_starts, key_ends;	// the run of each target that is used in the automaton
+	std::vector<unsigned int> next;				// the automaton transitions, 256 for each state
+	std::vector<std::vector<size_t> > outputs;	// the targets whose runs end at each state
+	bool built;
+
+	void build();
+
+private:
+	MultiPattern(const MultiPattern&);				// not copyable
+	MultiPattern& operator =(const MultiPattern&);	// not copyable
+
+public:
+	static const size_t NotFound = (size_t)-1;
+
+	MultiPattern();
+	~MultiPattern();
+
+	size_t add(const unsigned char *target, size_t count, byte wildcard); // returns the index of the target, the wildcard is treated like SearchPattern
+	size_t count() const;
+	const SearchPattern &operator [](size_t i) const;
+
+	void find(const Bytes& data, size_t *pos); // sets pos[i] to the position of the first occurrence of each target, NotFound if not found
+};
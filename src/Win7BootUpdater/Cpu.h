@@ -0,0 +1,48 @@
+/*
+ * Windows 7 Boot Updater (github.com/coderforlife/windows-7-boot-updater)
+ * Copyright (C) 2021  Jeffrey Bush - Coder for Life
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// Runtime detection of processor features for the native code
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+// GCC and Clang equivalent of the Visual C++ intrinsic
+inline unsigned char _BitScanForward(unsigned long *index, unsigned long mask) {
+	if (mask == 0) { return 0; }
+	*index = (unsigned long)__builtin_ctzl(mask);
+	return 1;
+}
+#endif
+#include <emmintrin.h>
+
+// Checks if the processor supports SSE2, which all 64-bit processors do
+inline bool CpuHasSSE2() {
+#if defined(_M_X64) || defined(__x86_64__)
+	return true;
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	return (info[3] & (1 << 26)) != 0;
+#else
+	unsigned int a, b, c, d;
+	return __get_cpuid(1, &a, &b, &c, &d) && (d & (1 << 26)) != 0;
+#endif
+}
@@ -19,7 +19,6 @@
 #include "PDB.h"
 
 #include "PEFile.h"
-#include "Bytes.h"
 #include "Utilities.h"
 
 using namespace Win7BootUpdater;
@@ -36,65 +35,99 @@ static string Utf8ToString(const char* str) {
 	return Encoding::UTF8->GetString(Utilities::GetManagedArray((const byte*)str, strlen(str)));
 }
 
-static bytes read_stream(const bytes data, const DWORD* blocks, DWORD nbytes,
-						 DWORD num_blocks, DWORD block_size) {
-	bytes out = (bytes)malloc(nbytes);
+#define NIL_STREAM 0xFFFFFFFF // the size of deleted streams
+
+void* MSF::Arena::alloc(size_t size) {
+	const size_t BLOCK = 0x10000;
+	size = (size + 7) & ~(size_t)7;
+	if (size > left) {
+		size_t n = size > BLOCK ? size : BLOCK;
+		byte* b = (byte*)malloc(n);
+		if (!b) { return NULL; }
+		blocks.push_back(b);
+		if (size == n) { return b; } // keep using the rest of the current block
+		pos = b; left = n;
+	}
+	void* p = pos;
+	pos += size; left -= size;
+	return p;
+}
+void MSF::Arena::clear() {
+	for (size_t i = 0; i < blocks.size(); ++i) { free(blocks[i]); }
+	blocks.clear();
+	pos = NULL; left = 0;
+}
+
+// Gets the data of a stream, straight from the file if its blocks are in order, otherwise they are copied together
+const void* MSF::gather(const DWORD* blocks, DWORD nbytes) const {
+	const bytes data = storage->getData();
+	DWORD n = (nbytes+bs-1)/bs, i;
+	for (i = 0; i < n; i++) { if (blocks[i] >= nblocks) { return NULL; } }
+	for (i = 1; i < n && blocks[i] == blocks[i-1]+1; i++);
+	if (i >= n) { return data+(size_t)blocks[0]*bs; }
+	bytes out = (bytes)arena.alloc(nbytes);
 	if (!out) { return NULL; }
-	DWORD n = (nbytes+block_size-1)/block_size;
-	for (DWORD i = 0; i < n; i++) {
-		if (blocks[i] > num_blocks) { return NULL; }
-		memcpy(out+i*block_size, data+blocks[i]*block_size, (i == n-1) ? (nbytes % block_size) : block_size);
+	for (i = 0; i < n; i++) {
+		memcpy(out+i*bs, data+(size_t)blocks[i]*bs, (i == n-1) ? (nbytes-i*bs) : bs);
 	}
 	return out;
 }
 
-MSF::MSF(const void* _data, size_t len) : num(0), sizes(NULL), streams(NULL) {
+MSF::MSF(PEFileStorage* storage) : storage(storage), bs(0), nblocks(0), num(0), sizes(NULL), firsts(NULL), streams(NULL) {
+	if (!storage) { return; }
+	const bytes data = storage->getData();
+	size_t len = storage->getSize();
 	if (len < sizeof(SuperBlock)) { return; }
-	const bytes data = (const bytes)_data;
-	SuperBlock header = *(const SuperBlock*)data;
-	DWORD bs = header.BlockSize;
-	if (memcmp(header.FileMagic, MSF_Magic, sizeof(MSF_Magic)) != 0 ||
-		header.NumBlocks*bs != len ||
-		header.BlockMapAddr >= header.NumBlocks) { return; }
-		
-	// Read the stream directory
-	DWORD num_entries = (header.NumDirectoryBytes+bs-1)/bs;
-	if (num_entries*sizeof(DWORD) > bs) { return; }
-	DWORD* dir = (DWORD*)read_stream(data, (const DWORD*)(data+header.BlockMapAddr*bs),
-									 header.NumDirectoryBytes, header.NumBlocks, bs);
+	const SuperBlock* header = (const SuperBlock*)data;
+	bs = header->BlockSize;
+	nblocks = header->NumBlocks;
+	if (memcmp(header->FileMagic, MSF_Magic, sizeof(MSF_Magic)) != 0 || bs == 0 ||
+		(ULONGLONG)nblocks*bs != len ||
+		header->BlockMapAddr >= nblocks) { return; }
+
+	// Get the stream directory
+	DWORD num_entries = (header->NumDirectoryBytes+bs-1)/bs;
+	if (num_entries*sizeof(DWORD) > bs || header->NumDirectoryBytes < sizeof(DWORD)) { return; }
+	const DWORD* dir = (const DWORD*)gather((const DWORD*)(data+(size_t)header->BlockMapAddr*bs), header->NumDirectoryBytes);
 	if (!dir) { return; }
 	
-	// Parse the stream directory and read the streams
-	num = dir[0];
-	DWORD off = num+1, size = header.NumDirectoryBytes / sizeof(DWORD);
-	if (off > size) { free(dir); dealloc(); return; }
-	sizes = (DWORD*)malloc(num*sizeof(DWORD));
-	streams = (void**)malloc(num*sizeof(void*));
-	if (!sizes || !streams) { free(dir); dealloc(); return; }
-
-	memcpy(sizes, dir+1, num*sizeof(DWORD));
-	memset(streams, 0, num*sizeof(void*));
-	for (DWORD i = 0; i < num; i++) {
-		if (sizes[i] == 0) { continue; }
-		streams[i] = read_stream(data, dir+off, sizes[i], header.NumBlocks, bs);
-		off += (sizes[i]+bs-1)/bs;
-		if (!streams[i] || off > size) { free(dir); dealloc(); return; }
+	// Find where the blocks of each stream are listed, but don't read any streams yet
+	DWORD n = dir[0], off = n+1, size = header->NumDirectoryBytes / sizeof(DWORD);
+	if (n >= size) { return; }
+	firsts = (DWORD*)malloc(n*sizeof(DWORD));
+	streams = (void**)calloc(n, sizeof(void*));
+	if (!firsts || !streams) { dealloc(); return; }
+	sizes = dir+1;
+	for (DWORD i = 0; i < n; i++) {
+		firsts[i] = off;
+		if (sizes[i] != NIL_STREAM) { off += (sizes[i]+bs-1)/bs; }
+		if (off > size) { dealloc(); return; }
 	}
-	free(dir);
+	num = n;
 }
 
 void MSF::dealloc() {
 	num = 0;
-	free(sizes);
 	sizes = NULL;
-	if (streams) {
-		for (DWORD i = 0; i < num; i++) { free(streams[i]); streams[i] = NULL; }
-		free(streams);
-		streams = NULL;
-	}
+	free(firsts); firsts = NULL;
+	free(streams); streams = NULL;
+	arena.clear();
+	delete storage; storage = NULL;
+}
+
+const void* MSF::resolve(DWORD i) const {
+	if (!streams[i]) { streams[i] = (void*)gather(sizes-1+firsts[i], sizes[i]); } // firsts is relative to the start of the directory
+	return streams[i];
 }
 
-PDB::PDB(const void* data, size_t len) : MSF(data, len), header(NULL), dbi(NULL), sects(NULL) {
+const void* MSF::getStream(DWORD i, DWORD* sz) const {
+	if (i >= num || sizes[i] == 0 || sizes[i] == NIL_STREAM) { if (sz) { *sz = 0; } return NULL; }
+	const void* s = resolve(i);
+	if (sz) { *sz = s ? sizes[i] : 0; }
+	return s;
+}
+
+PDB::PDB(PEFileStorage* storage) : MSF(storage), header(NULL), dbi(NULL), sects(NULL), nsects(0) {
 	if (num < 4) { dealloc(); return; }
 	
 	DWORD sz;
@@ -115,34 +148,82 @@ PDB::PDB(const void* data, size_t len) : MSF(data, len), header(NULL), dbi(NULL)
 	
 	if (SECTION_HEADERS*sizeof(WORD) < dbi->DebugHeaderSize) {
 		WORD strm = ((WORD*)((bytes)s + sz - dbi->DebugHeaderSize))[SECTION_HEADERS];
-		if (strm < num) { sects = (IMAGE_SECTION_HEADER*)getStream(strm); }
+		if (strm < num) { sects = (IMAGE_SECTION_HEADER*)getStream(strm, &sz); nsects = sz / sizeof(IMAGE_SECTION_HEADER); }
+	}
+}
+
+// The public symbols are matched without the decorations of C functions: leading _ and trailing @ and digits
+static size_t UndecoratedName(const char* name, size_t len, const char** start) {
+	while (len && *name == '_') { ++name; --len; }
+	size_t i = len;
+	while (i && isdigit((byte)name[i-1])) { --i; }
+	if (i && i < len && name[i-1] == '@') { len = i-1; }
+	*start = name;
+	return len;
+}
+static DWORD HashName(const char* name, size_t len) {
+	DWORD h = 2166136261u; // FNV-1a
+	for (size_t i = 0; i < len; ++i) { h = (h ^ (byte)name[i]) * 16777619u; }
+	return h;
+}
+
+// Builds the hash table of the public symbols with a single pass through the symbol record stream
+bool PDB::loadPublics() const {
+	if (!publics.empty()) { return true; }
+	DWORD sz, pos, count = 0, n = 16;
+	const bytes data = (const bytes)getStream(dbi->SymbolRecordStreamIndex, &sz);
+	if (!data) { return false; }
+	for (pos = 0; pos + offsetof(FunctionSymbol, name) < sz; pos += ((const FunctionSymbol*)(data+pos))->length + 2) {
+		if (((const FunctionSymbol*)(data+pos))->type == S_PUB32) { ++count; }
+	}
+	while (n < 2*count) { n <<= 1; }
+	publics.resize(n, 0);
+	for (pos = 0; pos + offsetof(FunctionSymbol, name) < sz; pos += ((const FunctionSymbol*)(data+pos))->length + 2) {
+		const FunctionSymbol* sym = (const FunctionSymbol*)(data+pos);
+		if (sym->type != S_PUB32 || sym->length + 2u > sz - pos || sym->length + 2u <= offsetof(FunctionSymbol, name)) { continue; }
+		size_t max = sym->length + 2 - offsetof(FunctionSymbol, name), len = 0;
+		while (len < max && sym->name[len]) { ++len; }
+		if (len == max) { continue; } // not terminated
+		const char* name;
+		len = UndecoratedName(sym->name, len, &name);
+		DWORD i = HashName(name, len) & (n-1);
+		while (publics[i]) { i = (i+1) & (n-1); }
+		publics[i] = pos + 1;
+	}
+	return true;
+}
+
+// Finds a public symbol, an exact match of the name is preferred over one that only matches without decorations
+const PDB::FunctionSymbol* PDB::findPublic(const char* name) const {
+	if (!loadPublics()) { return NULL; }
+	const bytes data = (const bytes)getStream(dbi->SymbolRecordStreamIndex);
+	const char* undec;
+	size_t len = UndecoratedName(name, strlen(name), &undec);
+	const DWORD n = (DWORD)publics.size();
+	const FunctionSymbol* found = NULL;
+	for (DWORD i = HashName(undec, len) & (n-1); publics[i]; i = (i+1) & (n-1)) {
+		const FunctionSymbol* sym = (const FunctionSymbol*)(data+publics[i]-1);
+		const char* x;
+		if (UndecoratedName(sym->name, strlen(sym->name), &x) != len || memcmp(x, undec, len) != 0) { continue; }
+		if (strcmp(sym->name, name) == 0) { return sym; }
+		if (!found) { found = sym; }
 	}
+	return found;
 }
 
 uint PDB::getFunctionVA(const char* name) const {
-	// Leading _ and trailing @ are optional
-	DWORD len = strlen(name);
-	DWORD sz;
-	const Bytes data((byte*)getStream(dbi->SymbolRecordStreamIndex, &sz), sz);
-	const Bytes found = data.find((const bytes)name, len);
-	if (found == NULL) { return 0; }
-	uint name_off = (uint)(found - data);
-	if (name_off+len >= sz) { return 0; }
-	if (data[name_off+len] == '@') {
-		len++;
-		while (name_off+len < sz && isdigit(data[name_off+len])) { len++; }
+	const FunctionSymbol* sym = findPublic(name);
+	if (sym == NULL) { return 0; }
+	return sym->rva + ((sects == NULL || sym->sect_id == 0 || sym->sect_id > nsects) ? 0 : sects[sym->sect_id-1].VirtualAddress);
+}
+
+bool PDB::getFunctionVAs(const char* const* names, size_t count, uint* vas) const {
+	bool all = loadPublics();
+	for (size_t i = 0; i < count; ++i) {
+		vas[i] = names[i] ? getFunctionVA(names[i]) : 0;
+		if (names[i] && vas[i] == 0) { all = false; }
 	}
-	if (name_off+len >= sz || data[name_off+len]) { return 0; } 
-	while (name_off > 0 && data[name_off-1] == '_') { name_off--; len++; }
-	if (name_off < 14) { return 0; }
-	
-	// Name goes from name_off to name_off+len (which is the null terminator)
-	// Get the rest of the symbol
-	FunctionSymbol* sym = (FunctionSymbol*)data(name_off-14);
-	DWORD sym_len = 15 + len;
-	if (sym_len % sizeof(DWORD)) { sym_len += sizeof(DWORD) - sym_len % sizeof(DWORD); }
-	if (sym_len != sym->length+2u || sym->type != 0x110Eu) { return 0; }
-	return sym->rva + ((sects == NULL || sym->sect_id == 0) ? 0 : sects[sym->sect_id-1].VirtualAddress);
+	return all;
 }
 
 const PDB::CODEVIEW_DEBUG_DIRECTORY_ENTRY* PDB::GetCVDebugDirectoryEntry(const PEFile* pe) {
@@ -205,9 +286,9 @@ static array<Byte>^ RawDownload(string path, string guid, DWORD age) {
 	return memory->ToArray();
 }
 
-static PDB* LoadPDB(array<Byte>^ data, GUID guid, DWORD age) {
-	pin_ptr<Byte> ptr = &data[0];
-	PDB* pdb = new PDB((bytes)ptr, data->Length);
+static PDB* LoadPDB(PEFileStorage* storage, GUID guid, DWORD age) {
+	if (!storage) { return NULL; }
+	PDB* pdb = new PDB(storage);
 	if (!pdb->isLoaded() || !pdb->matches(guid, age)) {
 		delete pdb;
 		return NULL;
@@ -215,6 +296,13 @@ static PDB* LoadPDB(array<Byte>^ data, GUID guid, DWORD age) {
 	return pdb;
 }
 
+static PDB* LoadPDB(array<Byte>^ data, GUID guid, DWORD age) {
+	void* copy = malloc(data->Length);
+	if (!copy) { return NULL; }
+	Marshal::Copy(data, 0, (IntPtr)copy, data->Length);
+	return LoadPDB(PEFileStorage::createFromMemory(copy, data->Length), guid, age);
+}
+
 array<Byte>^ PDB::Download(const PEFile* pe) {
 	const CODEVIEW_DEBUG_DIRECTORY_ENTRY* cvdde = GetCVDebugDirectoryEntry(pe);
 	return cvdde ? RawDownload(Utf8ToString(cvdde->Path), FormatGUID(cvdde->Guid), cvdde->Age) : nullptr;
@@ -262,7 +350,7 @@ PDB* PDB::Get(const PEFile* pe) {
 		for (int j = 0; j < dirs->Length; j++) {
 			string p = Path::Combine(dirs[j], files[i]);
 			if (File::Exists(p)) {
-				PDB* pdb = LoadPDB(File::ReadAllBytes(p), cvdde->Guid, cvdde->Age);
+				PDB* pdb = LoadPDB(PEFileStorage::createFromFile(as_native(p), true), cvdde->Guid, cvdde->Age);
 				if (pdb) { return pdb; }
 			}
 		}
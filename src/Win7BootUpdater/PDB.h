@@ -23,6 +23,8 @@
 namespace Win7BootUpdater {
 	const byte MSF_Magic[32] = "Microsoft C/C++ MSF 7.00\x0D\x0A\x1A\x44\x53\x00\x00"; // one more null character automatically included
 
+	// A multi-stream file, the streams are made of blocks scattered throughout the file
+	// Streams are only found when first used: if its blocks are in order it is used right from the file, otherwise it is gathered
 	class MSF {
 	protected:
 		struct SuperBlock {
@@ -34,17 +36,34 @@ namespace Win7BootUpdater {
 			DWORD Unknown;
 			DWORD BlockMapAddr;
 		};
+		// The memory for gathered streams, all freed at once
+		class Arena {
+			std::vector<byte*> blocks;
+			byte* pos;
+			size_t left;
+		public:
+			inline Arena() : pos(NULL), left(0) { }
+			inline ~Arena() { clear(); }
+			void* alloc(size_t size);
+			void clear();
+		};
+		PEFileStorage* storage;
+		DWORD bs, nblocks;
 		DWORD num;
-		DWORD* sizes;
-		void** streams;
+		const DWORD* sizes;		// from the stream directory, which is followed by the blocks of each stream
+		DWORD* firsts;			// where the blocks of each stream start in the stream directory
+		mutable void** streams;	// NULL until first used
+		mutable Arena arena;
 		void dealloc();
+		const void* gather(const DWORD* blocks, DWORD nbytes) const;
+		const void* resolve(DWORD i) const;
 	public:
-		MSF(const void* _data, size_t len);
+		MSF(PEFileStorage* storage); // the storage is deleted along with this
 		inline ~MSF() { dealloc(); }
 		inline bool isLoaded() const { return num != 0; }
 		inline DWORD streamCount() const { return num; }
-		inline void* getStream(DWORD i, DWORD* sz=NULL) { if (sz) { *sz = sizes[i]; } return streams[i]; }
-		inline const void* getStream(DWORD i, DWORD* sz=NULL) const { if (sz) { *sz = sizes[i]; } return streams[i]; }
+		inline void* getStream(DWORD i, DWORD* sz=NULL) { return (void*)((const MSF*)this)->getStream(i, sz); }
+		const void* getStream(DWORD i, DWORD* sz=NULL) const;
 	};
 	class PDB : public MSF {
 	public:
@@ -111,14 +130,15 @@ namespace Win7BootUpdater {
 			byte* data;
 		};
 		struct FunctionSymbol {
-			// Not sure about this format actually
-			WORD length;
-			WORD type; // always 0x110E
-			DWORD unknown; // always 0x02
-			DWORD rva;
+			// An S_PUB32 record from the symbol record stream
+			WORD length; // not including itself
+			WORD type; // always S_PUB32
+			DWORD flags; // 0x02 for functions
+			DWORD rva; // relative to the section
 			WORD sect_id;
 			char name[1]; // null terminated
 		};
+		static const WORD S_PUB32 = 0x110E;
 		enum DEBUG_HEADER_INDEX {
 			FPO = 0,
 			EXC = 1,
@@ -145,17 +165,23 @@ namespace Win7BootUpdater {
 		//void* TPI;
 		DBIHeader* dbi;
 		IMAGE_SECTION_HEADER* sects;
+		DWORD nsects;
+		mutable std::vector<DWORD> publics; // hash table of the offsets of the S_PUB32 records (plus one, 0 is empty), built when first needed
+		bool loadPublics() const;
+		const FunctionSymbol* findPublic(const char* name) const;
 	public:
 		static const CODEVIEW_DEBUG_DIRECTORY_ENTRY* PDB::GetCVDebugDirectoryEntry(const PEFile* pe);
 		static PDB* Get(const PEFile* pe);
 		static array<byte>^ Download(const PEFile* pe);
 		static string DownloadToDefault(const PEFile* pe);
 		
-		PDB(const void* data, size_t len);
+		PDB(PEFileStorage* storage); // the storage is deleted along with this
 		inline Header* getPDBHeader() { return header; }
 		inline const Header* getPDBHeader() const { return header; }
 		inline bool matches(GUID guid, DWORD age) const { return memcmp(&header->Guid, &guid, sizeof(GUID)) == 0 && dbi->Age == age; }
 		inline bool hasSectionHeaders() const { return sects != NULL; }
-		uint getFunctionVA(const char* name) const;
+		// Looks up functions by name in the public symbols, leading _ and trailing @ are optional
+		uint getFunctionVA(const char* name) const; // 0 if not found
+		bool getFunctionVAs(const char* const* names, size_t count, uint* vas) const; // false if any are not found (and those are 0)
 	};
 }
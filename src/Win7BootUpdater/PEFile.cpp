@@ -20,11 +20,15 @@
 #include "PEFileResources.h"
 #include "PEFile.h"
 
+#include <algorithm>
+
 #ifdef __cplusplus_cli
 #pragma unmanaged
 #endif
 
+#ifdef _WIN32
 #pragma comment(lib, "Version.lib")		// for VerQueryValueW to read file versions
+#endif
 
 #define SAVE_ERR()			DWORD _err_ = GetLastError()
 #define SET_ERR()			SetLastError(_err_)
@@ -61,7 +65,7 @@ inline static IMAGE_RESOURCE_DIRECTORY *FindEntryInt(const IMAGE_RESOURCE_DIRECT
 	return NULL;
 }
 inline static IMAGE_RESOURCE_DIRECTORY *FindEntry(const IMAGE_RESOURCE_DIRECTORY *dir, LPCWSTR id, const LPBYTE rsrc, LPCWSTR *out = NULL) {
-	return (id == FIRST_ENTRY) ? FirstEntry(dir, rsrc, out) : (IS_INTRESOURCE(id) ? FindEntryInt(dir, (WORD)id, rsrc) : FindEntryString(dir, id, rsrc));
+	return (id == FIRST_ENTRY) ? FirstEntry(dir, rsrc, out) : (IS_INTRESOURCE(id) ? FindEntryInt(dir, (WORD)(size_t)id, rsrc) : FindEntryString(dir, id, rsrc));
 }
 static const LPVOID GetResourceDirectInRsrc(const LPBYTE data, const IMAGE_SECTION_HEADER *rsrcSect, LPCWSTR type, LPCWSTR name, LPCWSTR *out_name = NULL, WORD *lang = NULL, size_t *size = NULL) {
 	if (!rsrcSect || rsrcSect->PointerToRawData == 0 || rsrcSect->SizeOfRawData == 0)	{ return NULL; }
@@ -111,97 +115,29 @@ const LPVOID PEFile::GetResourceDirect(const LPVOID _data, LPCWSTR type, LPCWSTR
 }
 #pragma endregion
 
-#pragma region Memory Map Management Functions
-///////////////////////////////////////////////////////////////////////////////
-///// Memory Map Management Functions
-///////////////////////////////////////////////////////////////////////////////
-#include <map>
-#include <vector>
-typedef BOOL (WINAPI *UNMAP_OR_CLOSE)(void*);
-typedef std::map<LPCWSTR, std::vector<LPVOID> > MMFViews;
-static MMFViews mmfHndls, mmfViews;
-static HANDLE AddMMF    (LPCWSTR file, HANDLE hMap) { if (hMap != NULL) mmfHndls[file].push_back(hMap); return hMap; }
-static LPVOID AddMMFView(LPCWSTR file, LPVOID view) { if (view != NULL) mmfViews[file].push_back(view); return view; }
-static void _RemoveMMF(MMFViews &mmfs, LPCWSTR file, LPVOID x) {
-	MMFViews::iterator v = mmfs.find(file);
-	if (v != mmfs.end()) {
-		size_t size = v->second.size();
-		for (size_t i = 0; i < size; ++i) {
-			if (v->second[i] == x) {
-				if (size == 1) {
-					mmfs.erase(v);
-				} else {
-					if (i != size-1) // make the removed element the last element
-						v->second[i] = v->second[size-1];
-					v->second.pop_back(); // remove the last element
-				}
-				break;
-			}
-		}
-	}
-}
-static void RemoveMMF    (LPCWSTR file, HANDLE hMap) { _RemoveMMF(mmfHndls, file, hMap); }
-static void RemoveMMFView(LPCWSTR file, LPVOID view) { _RemoveMMF(mmfViews, file, view); }
-static void _UnmapAll(MMFViews &mmfs, LPCWSTR file, UNMAP_OR_CLOSE func) {
-	MMFViews::iterator v = mmfs.find(file);
-	if (v != mmfs.end()) {
-		size_t size = v->second.size();
-		for (size_t i = 0; i < size; ++i)
-			func(v->second[i]);
-		mmfs.erase(v);
-	}
-}
-void PEFile::UnmapAllViewsOfFile(LPCWSTR file) {
-	_UnmapAll(mmfHndls, file, &CloseHandle);
-	_UnmapAll(mmfViews, file, (UNMAP_OR_CLOSE)&UnmapViewOfFile);
-}
-#pragma endregion
-
 #pragma region Loading Functions
 ///////////////////////////////////////////////////////////////////////////////
 ///// Loading Functions
 ///////////////////////////////////////////////////////////////////////////////
 PEFile::PEFile(LPVOID data, size_t size, bool readonly)
-	: sections(NULL), res(NULL), hFile(NULL), hMap(NULL), orig_data((LPBYTE)data), size(size), data(NULL), readonly(readonly), version(0), modified(false) {
-	this->original[0] = 0;
-	if (!map() || !this->load(true))
-		this->unload();
+	: sections(NULL), res(NULL), readonly(readonly), store(PEFileStorage::createFromMemory(data, size, readonly)), size(0), data(NULL), version(0), modified(false), chkSum(0), chkSumKnown(false), hdrSize(0), relocsIndexed(false), batch(0) {
+	this->open();
 }
 PEFile::PEFile(LPCWSTR file, bool readonly)
-	: sections(NULL), res(NULL), hFile(NULL), hMap(NULL), orig_data(NULL), size(0), data(NULL), readonly(readonly), version(0), modified(false) {
-	this->original[0] = 0;
-	if (!GetFullPathName(file, ARRAYSIZE(this->original), this->original, NULL) ||
-		(this->hFile = CreateFile(this->original, (readonly ? GENERIC_READ : (GENERIC_READ | GENERIC_WRITE)), FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL)) == INVALID_HANDLE_VALUE ||
-		(this->size = GetFileSize(this->hFile, 0)) == INVALID_FILE_SIZE ||
-		!this->map() || !this->load(true)) {
-			this->unload();
-	}
+	: sections(NULL), res(NULL), readonly(readonly), store(PEFileStorage::createFromFile(file, readonly)), size(0), data(NULL), version(0), modified(false), chkSum(0), chkSumKnown(false), hdrSize(0), relocsIndexed(false), batch(0) {
+	this->open();
 }
-bool PEFile::map() { // only call this from an unmapped state
-	if (this->orig_data) {
-		if (this->readonly) {
-			DWORD old_protect = 0;
-			return (this->data = (LPBYTE)VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE)) != NULL &&
-				memcpy(this->data, this->orig_data, size) && VirtualProtect(this->data, size, PAGE_READONLY, &old_protect);
-		} else {
-			this->data = this->orig_data;
-			return true;
-		}
-	} else {
-		return (this->hMap = AddMMF(this->original, CreateFileMapping(this->hFile, NULL, (this->readonly ? PAGE_READONLY : PAGE_READWRITE), 0, 0, NULL))) != NULL &&
-			(this->data = (LPBYTE)AddMMFView(this->original, MapViewOfFile(this->hMap, (this->readonly ? FILE_MAP_READ : FILE_MAP_ALL_ACCESS), 0, 0, 0))) != NULL;
-	}
+PEFile::PEFile(PEFileStorage *store)
+	: sections(NULL), res(NULL), readonly(!store || store->isReadOnly()), store(store), size(0), data(NULL), version(0), modified(false), chkSum(0), chkSumKnown(false), hdrSize(0), relocsIndexed(false), batch(0) {
+	this->open();
 }
-void PEFile::unmap() {
-	this->flush();
-	if (this->orig_data && this->data) {
-		if (this->readonly) { VirtualFree(this->data, 0, MEM_RELEASE); }
-		this->data = NULL;
-	}
-	if (this->hMap) {
-		if (this->data) { UnmapViewOfFile(this->data); RemoveMMFView(this->original, this->data); this->data = NULL; }
-		RemoveMMF(this->original, this->hMap); CloseHandle(this->hMap); this->hMap = NULL;
+void PEFile::open() {
+	if (this->store) {
+		this->data = this->store->getData();
+		this->size = this->store->getSize();
 	}
+	if (!this->store || !this->load(true))
+		this->unload();
 }
 bool PEFile::load(bool incRes) {
 	this->dosh = (IMAGE_DOS_HEADER*)this->data;
@@ -220,37 +156,55 @@ bool PEFile::load(bool incRes) {
 
 	this->dataDir = is64bit ? this->nth64->OptionalHeader.DataDirectory : this->nth32->OptionalHeader.DataDirectory;
 	this->sections = (IMAGE_SECTION_HEADER*)(this->data+this->peOffset+4+IMAGE_SIZEOF_FILE_HEADER+this->header->SizeOfOptionalHeader);
+	this->hdrSize = is64bit ? this->nth64->OptionalHeader.SizeOfHeaders : this->nth32->OptionalHeader.SizeOfHeaders;
+	if (this->hdrSize > this->size) { this->hdrSize = (DWORD)this->size; }
+	this->relocsIndexed = false; // every resize (including the ones in createSection and getExpandedSectionHdr) may move .reloc
 
 	// Load resources
 	if (incRes) {
-		IMAGE_SECTION_HEADER *sect = this->getSectionHeader(".rsrc");
-
-		// Create resources object
-		if ((this->res = Rsrc::createFromRSRCSection(this->data, this->size, sect)) == NULL)
-			return false;
+		// The checksum of the original data is only summed once something needs it
+		this->chkSumKnown = false;
 
-		// Get the current version and modification information from the resources
-		VS_FIXEDFILEINFO *v = GetVersionInfo(GetResourceDirectInRsrc(this->data, sect, RT_VERSION, FIRST_ENTRY));
+		// Get the current version and modification information from the resources (the rest of the resources are loaded when needed)
+		VS_FIXEDFILEINFO *v = GetVersionInfo(GetResourceDirectInRsrc(this->data, this->getSectionHeader(".rsrc"), RT_VERSION, FIRST_ENTRY));
 		if (v) {
 			this->version = ((ULONGLONG)v->dwFileVersionMS << 32) | v->dwFileVersionLS;
 			this->modified = (v->dwFileFlagsMask & v->dwFileFlags & (VS_FF_PATCHED | VS_FF_SPECIALBUILD)) > 0;
 		}
+	} else {
+		this->rebaseResources();
 	}
 
 	return true;
 }
-PEFile::~PEFile() { unload(); if (this->orig_data) free(this->orig_data); }
+PEFile::~PEFile() { unload(); }
 void PEFile::unload() {
 	SAVE_ERR();
+	if (this->batch && this->data && this->store->getSize() != this->size) { this->store->resize(this->size); } // an unfinished batch still gives the right size
+	this->batch = 0;
 	if (this->res) { delete this->res; this->res = NULL; }
-	unmap();
-	if (this->hFile && this->hFile != INVALID_HANDLE_VALUE) { CloseHandle(this->hFile); this->hFile = NULL; }
+	if (this->store) { delete this->store; this->store = NULL; } // flushes
+	this->data = NULL;
 	this->sections = NULL;
 	SET_ERR();
 }
+bool PEFile::loadResources() const {
+	if (this->res) { return true; }
+	const IMAGE_SECTION_HEADER *sect = this->getSectionHeader(".rsrc");
+	this->res = sect ? Rsrc::createFromRSRCSection(this->data, this->size, (IMAGE_SECTION_HEADER*)sect) : Rsrc::createEmpty();
+	if (!this->res) { SetLastError(ERROR_INVALID_DATA); return false; }
+	return true;
+}
+void PEFile::rebaseResources() {
+	// Unchanged resources are read straight from the .rsrc section, so they need to follow it when the data moves
+	IMAGE_SECTION_HEADER *sect;
+	if (this->res && (sect = this->getSectionHeader(".rsrc")) != NULL)
+		this->res->rebase(this->data, sect);
+}
+void PEFile::UnmapAllViewsOfFile(LPCWSTR file) { PEFileStorage::UnmapAllViewsOfFile(file); }
 bool PEFile::isLoaded() const { return this->sections != NULL; }
 bool PEFile::isReadOnly() const { return this->readonly; }
-bool PEFile::usesMemoryMappedFile() const { return this->orig_data == NULL; }
+bool PEFile::usesMemoryMappedFile() const { return this->store && this->store->isFile(); }
 #pragma endregion
 
 #pragma region Header Functions
@@ -376,6 +330,7 @@ IMAGE_SECTION_HEADER *PEFile::getExpandedSectionHdr(int i, DWORD room) {
 		if (chars & IMAGE_SCN_CNT_UNINITIALIZED_DATA)	h->SizeOfUninitializedData += move;
 	}
 
+	this->rebaseResources();
 	this->flush();
 
 	return sect;
@@ -470,6 +425,7 @@ IMAGE_SECTION_HEADER *PEFile::createSection(int i, const char *name, DWORD room,
 		if (chars & IMAGE_SCN_CNT_UNINITIALIZED_DATA)	h->SizeOfUninitializedData += raw_size;
 	}
 
+	this->rebaseResources();
 	this->flush();
 
 	return this->sections+i;
@@ -495,14 +451,19 @@ bool PEFile::setSize(size_t dwSize, bool grow_only) {
 	if (this->readonly)									{ return false; }
 	bool shrinking = dwSize < this->size;
 	if (dwSize == this->size || grow_only && shrinking) { return true; }
-	this->unmap();
-	bool retval = (this->orig_data ?
-		((this->orig_data = (LPBYTE)realloc(this->orig_data, dwSize)) != NULL) :
-		SetFilePointer(this->hFile, dwSize, NULL, FILE_BEGIN) != INVALID_SET_FILE_POINTER && SetEndOfFile(this->hFile)) && this->map();
+	if (shrinking) { this->chkSumSub((DWORD)dwSize, this->size - dwSize); } // growing only adds 0s
+	bool retval = true;
+	if (!this->batch) {
+		retval = this->store->resize(dwSize);
+	} else if (shrinking) {
+		memset(this->data+dwSize, 0, this->size-dwSize); // the storage is trimmed at commit
+	} else if (dwSize > this->store->getSize()) {
+		size_t grow = this->store->getSize() + this->store->getSize() / 4;
+		retval = this->store->resize(dwSize > grow ? dwSize : grow);
+	}
 	if (retval) {
+		this->data = this->store->getData();
 		this->size = dwSize;
-		if (!shrinking)
-			memset(this->data+this->size, 0, dwSize-this->size); // set new memory to 0
 		retval = this->load(false);
 	}
 	if (!retval) this->unload();
@@ -515,15 +476,30 @@ bool PEFile::setSize(size_t dwSize, bool grow_only) {
 ///// Resource Shortcut Functions
 ///////////////////////////////////////////////////////////////////////////////
 #ifdef EXPOSE_DIRECT_RESOURCES
-Rsrc *PEFile::getResources() { return this->res; }
-const Rsrc *PEFile::getResources() const { return this->res; }
+Rsrc *PEFile::getResources() { return this->loadResources() ? this->res : NULL; }
+const Rsrc *PEFile::getResources() const { return this->loadResources() ? this->res : NULL; }
 #endif
-bool PEFile::resourceExists(LPCWSTR type, LPCWSTR name, WORD lang) const { return this->res->exists(type, name, lang); }
-bool PEFile::resourceExists(LPCWSTR type, LPCWSTR name, WORD* lang) const { return this->res->exists(type, name, lang); }
-LPVOID PEFile::getResource(LPCWSTR type, LPCWSTR name, WORD lang, size_t* size) const { return this->res->get(type, name, lang, size); }
-LPVOID PEFile::getResource(LPCWSTR type, LPCWSTR name, WORD* lang, size_t* size) const { return this->res->get(type, name, lang, size); }
-bool PEFile::removeResource(LPCWSTR type, LPCWSTR name, WORD lang) { return !this->readonly && this->res->remove(type, name, lang); }
-bool PEFile::addResource(LPCWSTR type, LPCWSTR name, WORD lang, const LPVOID data, size_t size, DWORD overwrite) { return !this->readonly && this->res->add(type, name, lang, data, size, overwrite); }
+// Until something changes the resources they are looked up directly in the .rsrc section instead of loading all of them
+bool PEFile::resourceExists(LPCWSTR type, LPCWSTR name, WORD lang) const { size_t size; return this->getResourceView(type, name, lang, &size) != NULL; }
+bool PEFile::resourceExists(LPCWSTR type, LPCWSTR name, WORD* lang) const { size_t size; return this->getResourceView(type, name, lang, &size) != NULL; }
+LPVOID PEFile::getResource(LPCWSTR type, LPCWSTR name, WORD lang, size_t* size) const {
+	if (this->res) { return this->res->get(type, name, lang, size); }
+	const LPVOID view = this->getResourceView(type, name, lang, size);
+	return view ? memcpy(malloc(*size), view, *size) : NULL;
+}
+LPVOID PEFile::getResource(LPCWSTR type, LPCWSTR name, WORD* lang, size_t* size) const {
+	if (this->res) { return this->res->get(type, name, lang, size); }
+	const LPVOID view = this->getResourceView(type, name, lang, size);
+	return view ? memcpy(malloc(*size), view, *size) : NULL;
+}
+const LPVOID PEFile::getResourceView(LPCWSTR type, LPCWSTR name, WORD lang, size_t* size) const {
+	return this->res ? this->res->getView(type, name, lang, size) : Rsrc::getViewFromRSRCSection(this->data, this->size, this->getSectionHeader(".rsrc"), type, name, lang, size);
+}
+const LPVOID PEFile::getResourceView(LPCWSTR type, LPCWSTR name, WORD* lang, size_t* size) const {
+	return this->res ? this->res->getView(type, name, lang, size) : Rsrc::getViewFromRSRCSection(this->data, this->size, this->getSectionHeader(".rsrc"), type, name, lang, size);
+}
+bool PEFile::removeResource(LPCWSTR type, LPCWSTR name, WORD lang) { return !this->readonly && this->loadResources() && this->res->remove(type, name, lang); }
+bool PEFile::addResource(LPCWSTR type, LPCWSTR name, WORD lang, const LPVOID data, size_t size, DWORD overwrite) { return !this->readonly && this->loadResources() && this->res->add(type, name, lang, data, size, overwrite); }
 #pragma endregion
 
 #pragma region Direct Data Functions
@@ -532,11 +508,47 @@ bool PEFile::addResource(LPCWSTR type, LPCWSTR name, WORD lang, const LPVOID dat
 ///////////////////////////////////////////////////////////////////////////////
 LPBYTE PEFile::get(DWORD dwOffset, DWORD *dwSize) { if (dwSize) *dwSize = this->size - dwOffset; return this->data + dwOffset; }
 const LPBYTE PEFile::get(DWORD dwOffset, DWORD *dwSize) const { if (dwSize) *dwSize = this->size - dwOffset; return this->data + dwOffset; }
-bool PEFile::set(const LPVOID lpBuffer, DWORD dwSize, DWORD dwOffset) { return !this->readonly && (dwOffset + dwSize <= this->size) && memcpy(this->data + dwOffset, lpBuffer, dwSize); }
-bool PEFile::zero(DWORD dwSize, DWORD dwOffset) { return !this->readonly && (dwOffset + dwSize <= this->size) && memset(this->data + dwOffset, 0, dwSize); }
-bool PEFile::move(DWORD dwOffset, DWORD dwSize, int dwDistanceToMove) { return !this->readonly && (dwOffset + dwSize + dwDistanceToMove <= this->size) && memmove(this->data+dwOffset+dwDistanceToMove, this->data+dwOffset, dwSize); }
+bool PEFile::set(const LPVOID lpBuffer, DWORD dwSize, DWORD dwOffset) {
+	if (this->readonly || dwOffset + dwSize > this->size) { return false; }
+	this->chkSumSub(dwOffset, dwSize);
+	memcpy(this->data + dwOffset, lpBuffer, dwSize);
+	this->chkSumAdd(dwOffset, dwSize);
+	return true;
+}
+bool PEFile::zero(DWORD dwSize, DWORD dwOffset) {
+	if (this->readonly || dwOffset + dwSize > this->size) { return false; }
+	this->chkSumSub(dwOffset, dwSize);
+	memset(this->data + dwOffset, 0, dwSize); // 0s add nothing to the sum
+	return true;
+}
+bool PEFile::move(DWORD dwOffset, DWORD dwSize, int dwDistanceToMove) {
+	if (this->readonly || dwOffset + dwSize + dwDistanceToMove > this->size) { return false; }
+	this->chkSumSub(dwOffset + dwDistanceToMove, dwSize);
+	memmove(this->data+dwOffset+dwDistanceToMove, this->data+dwOffset, dwSize);
+	this->chkSumAdd(dwOffset + dwDistanceToMove, dwSize);
+	return true;
+}
 bool PEFile::shift(DWORD dwOffset, int dwDistanceToMove) { return move(dwOffset, this->size - dwOffset - dwDistanceToMove, dwDistanceToMove); }
-bool PEFile::flush() { return !this->readonly && (!this->hMap || FlushViewOfFile(this->data, 0)) && (!this->hFile || FlushFileBuffers(this->hFile)); }
+bool PEFile::flush() { return !this->readonly && this->store && (this->batch || this->store->flush()); }
+bool PEFile::beginBatch(size_t room) {
+	if (this->readonly || !this->store)					{ return false; }
+	if (this->batch++ == 0 && room && this->size + room > this->store->getSize()) {
+		if (!this->store->resize(this->size + room))	{ this->unload(); return false; }
+		this->data = this->store->getData();
+		if (!this->load(false))							{ this->unload(); return false; }
+	}
+	return true;
+}
+bool PEFile::commit() {
+	if (this->readonly || !this->store || !this->batch)	{ return false; }
+	if (--this->batch) { return true; }
+	if (this->store->getSize() != this->size) {
+		if (!this->store->resize(this->size))			{ this->unload(); return false; }
+		this->data = this->store->getData();
+		if (!this->load(false))							{ this->unload(); return false; }
+	}
+	return this->updatePEChkSum(); // flushes
+}
 #pragma endregion
 
 #pragma region General Query and Settings Functions
@@ -545,29 +557,57 @@ bool PEFile::flush() { return !this->readonly && (!this->hMap || FlushViewOfFile
 ///////////////////////////////////////////////////////////////////////////////
 #define CHK_SUM_FOLD(c) (((c)&0xffff) + ((c)>>16))
 #define CHK_SUM_OFFSET	(peOffset+sizeof(DWORD)+sizeof(IMAGE_FILE_HEADER)+offsetof(IMAGE_OPTIONAL_HEADER, CheckSum))
-bool PEFile::UpdatePEChkSum(LPBYTE data, size_t dwSize, size_t peOffset, DWORD dwOldCheck) {
-	USHORT *ptr = (USHORT*)data;
-	size_t len = dwSize/sizeof(USHORT);
+// The sum is a ones-complement sum so parts of it can be taken out and put back in, values are always folded to 16 bits
+#define CHK_SUM_ADD(a, b)	CHK_SUM_FOLD((a) + (b))
+#define CHK_SUM_SUB(a, b)	CHK_SUM_FOLD((a) + 0xFFFF - (b))
+static DWORD SumWords(const LPBYTE data, size_t off, size_t len) { // bytes at odd offsets are the high byte of their word
 	DWORD c = 0;
-	while (len) {
-		size_t l = (len < 0x4000) ? len : 0x4000;
-		len -= l;
+	if (len && (off & 1)) { c = data[off++] << 8; --len; }
+	const USHORT *ptr = (USHORT*)(data+off);
+	for (size_t n = len/sizeof(USHORT); n; ) {
+		size_t l = (n < 0x4000) ? n : 0x4000;
+		n -= l;
 		for (size_t j=0; j<l; ++j)
 			c += *ptr++;
 		c = CHK_SUM_FOLD(c);
 	}
-	DWORD dwCheck = (DWORD)(WORD)CHK_SUM_FOLD(c);
-	if (dwSize & 1) {
-		dwCheck += data[dwSize-1];
-		dwCheck = CHK_SUM_FOLD(dwCheck);
-	}
+	if (len & 1)
+		c += data[off+len-1];
+	return CHK_SUM_FOLD(CHK_SUM_FOLD(c));
+}
+static DWORD ChkSum(DWORD sum, size_t dwSize, DWORD dwOldCheck) {
+	DWORD dwCheck = (sum % 0xFFFF) ? (sum % 0xFFFF) : 0xFFFF; // a sum that isn't all 0s never folds to 0
 	dwCheck = ((dwCheck-1<dwOldCheck)?(dwCheck-1):dwCheck) - dwOldCheck;
 	dwCheck = CHK_SUM_FOLD(dwCheck);
 	dwCheck = CHK_SUM_FOLD(dwCheck);
-	*(DWORD*)(data+CHK_SUM_OFFSET) = (DWORD)(dwCheck + dwSize);
+	return (DWORD)(dwCheck + dwSize);
+}
+bool PEFile::UpdatePEChkSum(LPBYTE data, size_t dwSize, size_t peOffset, DWORD dwOldCheck) {
+	*(DWORD*)(data+CHK_SUM_OFFSET) = ChkSum(SumWords(data, 0, dwSize), dwSize, dwOldCheck);
 	return true;
 }
-bool PEFile::updatePEChkSum() { return !this->readonly && UpdatePEChkSum(this->data, this->size, this->peOffset, this->is64bit() ? this->nth64->OptionalHeader.CheckSum : this->nth32->OptionalHeader.CheckSum) && this->flush(); }
+void PEFile::initChkSum() {
+	// The sum of everything after the headers is taken the first time the file is changed or its checksum is updated and then kept up to date
+	// The stored checksum can't be used for this since it may be wrong, and then every saved file would be wrong as well
+	this->chkSum = SumWords(this->data, this->hdrSize, this->size - this->hdrSize);
+	this->chkSumKnown = true;
+}
+DWORD PEFile::sumWords(DWORD dwOffset, size_t dwSize) const {
+	size_t start = (dwOffset < this->hdrSize) ? this->hdrSize : dwOffset, end = (dwOffset + dwSize > this->size) ? this->size : dwOffset + dwSize;
+	return (start < end) ? SumWords(this->data, start, end - start) : 0;
+}
+void PEFile::chkSumSub(DWORD dwOffset, size_t dwSize) {
+	if (!this->chkSumKnown) { this->initChkSum(); } // the data hasn't changed yet so it can be summed now
+	this->chkSum = CHK_SUM_SUB(this->chkSum, this->sumWords(dwOffset, dwSize));
+}
+void PEFile::chkSumAdd(DWORD dwOffset, size_t dwSize) { if (this->chkSumKnown) { this->chkSum = CHK_SUM_ADD(this->chkSum, this->sumWords(dwOffset, dwSize)); } } // an unknown sum will include the new data when it is taken
+bool PEFile::updatePEChkSum(bool full) {
+	if (this->readonly) { return false; }
+	DWORD &check = this->is64bit() ? this->nth64->OptionalHeader.CheckSum : this->nth32->OptionalHeader.CheckSum;
+	if (full || !this->chkSumKnown) { this->initChkSum(); }
+	check = ChkSum(CHK_SUM_ADD(this->chkSum, SumWords(this->data, 0, this->hdrSize)), this->size, check);
+	return this->flush();
+}
 //------------------------------------------------------------------------------
 static const BYTE TinyDosStub[] = {0x0E, 0x1F, 0xBA, 0x0E, 0x00, 0xB4, 0x09, 0xCD, 0x21, 0xB8, 0x01, 0x4C, 0xCD, 0x21, 0x57, 0x69, 0x6E, 0x20, 0x4F, 0x6E, 0x6C, 0x79, 0x0D, 0x0A, 0x24, 0x00, 0x00, 0x00};
 bool PEFile::hasExtraData() const { return this->dosh->e_crlc == 0x0000 && this->dosh->e_cparhdr == 0x0002 && this->dosh->e_lfarlc == 0x0020; }
@@ -592,7 +632,7 @@ bool PEFile::clearCertificateTable() {
 	IMAGE_DATA_DIRECTORY d = this->dataDir[IMAGE_DIRECTORY_ENTRY_SECURITY];
 	if (d.VirtualAddress && d.Size) {
 		// Zero out the certificate
-		memset(this->data + d.VirtualAddress, 0, d.Size);
+		this->zero(d.Size, d.VirtualAddress);
 		
 		// Find out if the certificate was at the end
 		DWORD i;
@@ -610,6 +650,45 @@ bool PEFile::clearCertificateTable() {
 	return true;
 }
 //------------------------------------------------------------------------------
+#ifndef _WIN32
+// VerQueryValueW only exists on Windows so the version blocks are walked directly
+// Each block is its length, the length of its value, its type (1 for text), its key, then its value and its children (all DWORD aligned)
+static bool VerKeyMatches(LPCWSTR key, LPCWSTR part, size_t len) {
+	for (size_t i = 0; i < len; ++i) {
+		WCHAR a = key[i], b = part[i];
+		if (a >= L'A' && a <= L'Z') { a += L'a' - L'A'; }
+		if (b >= L'A' && b <= L'Z') { b += L'a' - L'A'; }
+		if (a != b) { return false; }
+	}
+	return key[len] == 0;
+}
+static BOOL VerQueryValueW(const LPVOID ver, LPCWSTR query, LPVOID *buffer, PUINT len) {
+	LPBYTE block = (LPBYTE)ver;
+	for (;;) {
+		WORD blockLen = ((WORD*)block)[0], valueLen = ((WORD*)block)[1], type = ((WORD*)block)[2];
+		size_t value = roundUpTo<4>(3*sizeof(WORD) + (wcslen((LPCWSTR)(block+3*sizeof(WORD)))+1)*sizeof(WCHAR));
+		size_t child = roundUpTo<4>(value + (type ? valueLen*sizeof(WCHAR) : valueLen));
+
+		while (*query == L'\\') { ++query; }
+		if (!*query) {
+			*buffer = block+value;
+			*len = valueLen;
+			return valueLen != 0;
+		}
+		size_t n = 0;
+		while (query[n] && query[n] != L'\\') { ++n; }
+
+		// Find the child with the next part of the query
+		LPBYTE next = NULL;
+		for (WORD childLen; child + 3*sizeof(WORD) < blockLen && (childLen = *(WORD*)(block+child)) != 0; child = roundUpTo<4>(child + childLen)) {
+			if (VerKeyMatches((LPCWSTR)(block+child+3*sizeof(WORD)), query, n)) { next = block+child; break; }
+		}
+		if (!next) { return FALSE; }
+		block = next;
+		query += n;
+	}
+}
+#endif
 bool PEFile::GetVersionInfo(const LPVOID ver, LPCWSTR query, LPVOID *buffer, PUINT len) { return VerQueryValueW(ver, query, buffer, len) != 0; }
 VS_FIXEDFILEINFO *PEFile::GetVersionInfo(const LPVOID ver) { VS_FIXEDFILEINFO *v = NULL; UINT count; return (ver && VerQueryValueW(ver, L"\\", (LPVOID*)&v, &count)) ? v : NULL; }
 ULONGLONG PEFile::getFileVersion() const { return this->version; }
@@ -623,8 +702,11 @@ bool PEFile::setModifiedFlag() {
 		LPVOID ver = GetResourceDirectInRsrc(this->data, this->getSectionHeader(".rsrc"), RT_VERSION, FIRST_ENTRY, &name, &lang, &size);
 		VS_FIXEDFILEINFO *v = PEFile::GetVersionInfo(ver);
 		if (ver && v) {
+			DWORD pos = (DWORD)((LPBYTE)&v->dwFileFlags - this->data);
+			this->chkSumSub(pos, sizeof(DWORD));
 			v->dwFileFlags |= v->dwFileFlagsMask & (VS_FF_PATCHED | VS_FF_SPECIALBUILD);
-			this->modified = this->res->add(RT_VERSION, name, lang, ver, size, OVERWRITE_ONLY);
+			this->chkSumAdd(pos, sizeof(DWORD));
+			this->modified = !this->res || this->res->add(RT_VERSION, name, lang, ver, size, OVERWRITE_ONLY); // unloaded resources already see the change
 			this->flush();
 		}
 	}
@@ -641,17 +723,39 @@ typedef union _Reloc {
 #define RELOCS(e)		(Reloc*)((LPBYTE)e+sizeof(IMAGE_BASE_RELOCATION))
 #define NEXT_RELOCS(e)	(IMAGE_BASE_RELOCATION*)((LPBYTE)e+e->SizeOfBlock)
 #define COUNT_RELOCS(e)	(e->SizeOfBlock - sizeof(IMAGE_BASE_RELOCATION)) / sizeof(WORD)
-bool PEFile::removeRelocs(DWORD start, DWORD end, bool reverse) {
-	if (end < start)							{ return false; }
-
-	// Read the relocs
+struct RelocSlotCmp {
+	bool operator()(const RelocSlot &a, const RelocSlot &b) const { return a.rva < b.rva; }
+	bool operator()(const RelocSlot &a, DWORD rva) const { return a.rva < rva; }
+	bool operator()(DWORD rva, const RelocSlot &b) const { return rva < b.rva; }
+};
+void PEFile::indexRelocs() {
 	//IMAGE_DATA_DIRECTORY dir = f->getDataDirectory(IMAGE_DIRECTORY_ENTRY_BASERELOC);
 	//DWORD size = dir.Size, pntr = dir.VirtualAddress;
+	this->relocs.clear();
+	this->relocsIndexed = true;
 	IMAGE_SECTION_HEADER *sect = this->getSectionHeader(".reloc");
-	if (sect == NULL)							{ return true; } // no relocations exist, so nothing to remove!
+	if (sect == NULL) { return; } // no relocations exist
 
-	DWORD size = sect->SizeOfRawData, pntr = sect->PointerToRawData;
-	LPBYTE data = this->get(pntr);
+	// Every slot is indexed, even ones that are already 'removed', since they may be restored later
+	// The blocks are not assumed to be in order
+	DWORD pntr = sect->PointerToRawData, size = sect->SizeOfRawData;
+	if (pntr > this->size || size > this->size - pntr) { size = (DWORD)(this->size - pntr); }
+	LPBYTE data = this->data + pntr;
+	void *entry_end = data + size;
+	for (IMAGE_BASE_RELOCATION *entry = (IMAGE_BASE_RELOCATION*)data; entry+1 <= entry_end && entry->SizeOfBlock > 0; entry = NEXT_RELOCS(entry)) {
+		DWORD count = COUNT_RELOCS(entry);
+		Reloc *relocs = RELOCS(entry);
+		if ((LPBYTE)(relocs+count) > entry_end) { count = (DWORD)((Reloc*)entry_end - relocs); }
+		for (DWORD i = 0; i < count; ++i) {
+			RelocSlot r = { entry->VirtualAddress + relocs[i].Offset, (DWORD)((LPBYTE)(relocs+i) - this->data) };
+			this->relocs.push_back(r);
+		}
+	}
+	std::stable_sort(this->relocs.begin(), this->relocs.end(), RelocSlotCmp());
+}
+bool PEFile::removeRelocs(DWORD start, DWORD end, bool reverse) {
+	if (end < start)							{ return false; }
+	if (!this->relocsIndexed) { this->indexRelocs(); }
 
 	//IMAGE_REL_BASED_ABSOLUTE	= IMAGE_REL_I386_ABSOLUTE or IMAGE_REL_AMD64_ABSOLUTE
 	//IMAGE_REL_BASED_HIGHLOW	=> ??? or IMAGE_REL_AMD64_ADDR32NB (32-bit address w/o image base (RVA))
@@ -659,28 +763,18 @@ bool PEFile::removeRelocs(DWORD start, DWORD end, bool reverse) {
 	WORD new_type = reverse ? (this->is64bit() ? IMAGE_REL_BASED_DIR64 : IMAGE_REL_BASED_HIGHLOW) : IMAGE_REL_BASED_ABSOLUTE;
 
 	// Remove everything that is between start and end
-	// We do a thorough search for possible relocations and do not assume that they are in order
-	void *entry_end = data + size;
-	for (IMAGE_BASE_RELOCATION *entry = (IMAGE_BASE_RELOCATION*)data; entry < entry_end && entry->SizeOfBlock > 0; entry = NEXT_RELOCS(entry)) {
-
-		// Check that the ranges overlap
-		if (entry->VirtualAddress+0xFFF < start || entry->VirtualAddress > end) continue;
-
-		// Go through each reloc in this entry
-		DWORD count = COUNT_RELOCS(entry);
-		Reloc *relocs = RELOCS(entry);
-		for (DWORD i = 0; i < count; ++i) {
-			// Already 'removed'
-			if ((!reverse && relocs[i].Type == IMAGE_REL_BASED_ABSOLUTE) ||
-				(reverse && (relocs[i].Type != IMAGE_REL_BASED_ABSOLUTE || relocs[i].Offset == 0))) continue;
-
-			// Check the virtual address and possibly clear it
-			DWORD va = entry->VirtualAddress + relocs[i].Offset;
-			if (va >= start && va <= end) {
-				//relocs[i].Reloc = 0;
-				relocs[i].Type = new_type;
-			}
-		}
+	std::vector<RelocSlot>::const_iterator i = std::lower_bound(this->relocs.begin(), this->relocs.end(), start, RelocSlotCmp());
+	for (; i != this->relocs.end() && i->rva <= end; ++i) {
+		Reloc *r = (Reloc*)(this->data + i->pos);
+
+		// Already 'removed'
+		if ((!reverse && r->Type == IMAGE_REL_BASED_ABSOLUTE) ||
+			(reverse && (r->Type != IMAGE_REL_BASED_ABSOLUTE || r->Offset == 0))) continue;
+
+		this->chkSumSub(i->pos, sizeof(Reloc));
+		//r->Reloc = 0;
+		r->Type = new_type;
+		this->chkSumAdd(i->pos, sizeof(Reloc));
 	}
 	return true;
 }
@@ -701,83 +795,120 @@ inline static void adjustAddr(DWORD &addr, size_t rAddr, size_t rNewSize, size_t
 	if (addr != 0 && addr >= rAddr + rOldSize)
 		addr = (DWORD)((addr + rNewSize) - rOldSize); // subtraction needs to be last b/c these are unsigned
 }
-bool PEFile::save() {
-	if (this->readonly) { return false; }
-
-	// Compile the .rsrc, get its size, and get all the information about it
+// Where everything goes when the .rsrc section is replaced by one with a different size
+struct RsrcLayout {
+	DWORD pntr;					// the start of the .rsrc section in the file
+	size_t rSize, rRawSize, rRawSizeOld;
+	DWORD fileSize, fileSizeOld;
+};
+void PEFile::layoutResources(LPBYTE hdrs, int rIndx, RsrcLayout &l) const {
+	// The headers may be a copy of the file's headers, so everything is found relative to them
 	bool is64bit = this->is64bit();
-	DWORD fAlign = is64bit ? this->getNtHeaders64()->OptionalHeader.FileAlignment    : this->getNtHeaders32()->OptionalHeader.FileAlignment;
-	DWORD sAlign = is64bit ? this->getNtHeaders64()->OptionalHeader.SectionAlignment : this->getNtHeaders32()->OptionalHeader.SectionAlignment;
-	int rIndx = 0;
-	IMAGE_SECTION_HEADER *rSect = this->getSectionHeader(".rsrc", &rIndx);
-	if (!rSect) {
-		this->createSection(".rsrc", 0, CHARS_INIT_DATA_SECTION_R);
-		rSect = this->getSectionHeader(".rsrc", &rIndx);
-	}
-	size_t rSize = 0;
-	LPVOID rsrc = this->res->compile(&rSize, rSect->VirtualAddress);
-	size_t rRawSize = roundUpTo(rSize, fAlign);
+	IMAGE_NT_HEADERS32 *nth32 = (IMAGE_NT_HEADERS32*)(hdrs+this->peOffset);
+	IMAGE_NT_HEADERS64 *nth64 = (IMAGE_NT_HEADERS64*)(hdrs+this->peOffset);
+	IMAGE_FILE_HEADER *header = &nth32->FileHeader;
+	IMAGE_DATA_DIRECTORY *dataDir = (IMAGE_DATA_DIRECTORY*)(hdrs+((LPBYTE)this->dataDir-this->data));
+	IMAGE_SECTION_HEADER *sections = (IMAGE_SECTION_HEADER*)(hdrs+((LPBYTE)this->sections-this->data)), *rSect = sections+rIndx;
+
+	// Get all the information about the .rsrc
+	DWORD fAlign = is64bit ? nth64->OptionalHeader.FileAlignment    : nth32->OptionalHeader.FileAlignment;
+	DWORD sAlign = is64bit ? nth64->OptionalHeader.SectionAlignment : nth32->OptionalHeader.SectionAlignment;
+	size_t rSize = l.rSize;
+	size_t rRawSize = l.rRawSize = roundUpTo(rSize, fAlign);
 	size_t rVirSize = roundUpTo(rSize, sAlign);
 	//size_t rSizeOld = rSect->Misc.VirtualSize;
-	size_t rRawSizeOld = rSect->SizeOfRawData;
+	size_t rRawSizeOld = l.rRawSizeOld = rSect->SizeOfRawData;
 	size_t rVirSizeOld = roundUpTo(rSect->Misc.VirtualSize, sAlign);
-	DWORD pntr = rSect->PointerToRawData;
+	l.pntr = rSect->PointerToRawData;
 	DWORD imageSize = 0, imageSizeOld = 0;
-	DWORD fileSize = 0, fileSizeOld = this->size;
+	DWORD fileSize = 0;
+	l.fileSizeOld = (DWORD)this->size;
 
 	// Update PointerToSymbolTable
-	adjustAddr(this->header->PointerToSymbolTable, rSect->VirtualAddress, rVirSize, rVirSizeOld);
+	adjustAddr(header->PointerToSymbolTable, rSect->VirtualAddress, rVirSize, rVirSizeOld);
 
 	// Update Optional Header
 	if (is64bit) {
-		this->nth64->OptionalHeader.SizeOfInitializedData = (DWORD)this->getSizeOf(IMAGE_SCN_CNT_INITIALIZED_DATA, rIndx, rRawSize);
-		adjustAddr(this->nth64->OptionalHeader.AddressOfEntryPoint, rSect->VirtualAddress, rVirSize, rVirSizeOld);
-		adjustAddr(this->nth64->OptionalHeader.BaseOfCode, rSect->VirtualAddress, rVirSize, rVirSizeOld);
-		imageSizeOld = this->nth64->OptionalHeader.SizeOfImage;
+		nth64->OptionalHeader.SizeOfInitializedData = (DWORD)this->getSizeOf(IMAGE_SCN_CNT_INITIALIZED_DATA, rIndx, rRawSize);
+		adjustAddr(nth64->OptionalHeader.AddressOfEntryPoint, rSect->VirtualAddress, rVirSize, rVirSizeOld);
+		adjustAddr(nth64->OptionalHeader.BaseOfCode, rSect->VirtualAddress, rVirSize, rVirSizeOld);
+		imageSizeOld = nth64->OptionalHeader.SizeOfImage;
 	} else {
-		this->nth32->OptionalHeader.SizeOfInitializedData = (DWORD)this->getSizeOf(IMAGE_SCN_CNT_INITIALIZED_DATA, rIndx, rRawSize);
-		adjustAddr(this->nth32->OptionalHeader.AddressOfEntryPoint, rSect->VirtualAddress, rVirSize, rVirSizeOld);
-		adjustAddr(this->nth32->OptionalHeader.BaseOfCode, rSect->VirtualAddress, rVirSize, rVirSizeOld);
-		adjustAddr(this->nth32->OptionalHeader.BaseOfData, rSect->VirtualAddress, rVirSize, rVirSizeOld);
-		imageSizeOld = this->nth32->OptionalHeader.SizeOfImage;
+		nth32->OptionalHeader.SizeOfInitializedData = (DWORD)this->getSizeOf(IMAGE_SCN_CNT_INITIALIZED_DATA, rIndx, rRawSize);
+		adjustAddr(nth32->OptionalHeader.AddressOfEntryPoint, rSect->VirtualAddress, rVirSize, rVirSizeOld);
+		adjustAddr(nth32->OptionalHeader.BaseOfCode, rSect->VirtualAddress, rVirSize, rVirSizeOld);
+		adjustAddr(nth32->OptionalHeader.BaseOfData, rSect->VirtualAddress, rVirSize, rVirSizeOld);
+		imageSizeOld = nth32->OptionalHeader.SizeOfImage;
 	}
 
 	// Update the Data Directories
-	this->dataDir[IMAGE_DIRECTORY_ENTRY_RESOURCE].Size = (DWORD)rSize;
+	dataDir[IMAGE_DIRECTORY_ENTRY_RESOURCE].Size = (DWORD)rSize;
 	DWORD ddCount = this->getDataDirectoryCount();
 	for (DWORD i = 0; i < ddCount; i++) {
 		if (i == IMAGE_DIRECTORY_ENTRY_SECURITY) { // the virtual address of IMAGE_DIRECTORY_ENTRY_SECURITY is actually a file address, not a virtual address
-			adjustAddr(this->dataDir[i].VirtualAddress, rSect->PointerToRawData, rRawSize, rRawSizeOld);
-			if (this->dataDir[i].VirtualAddress + this->dataDir[i].Size > fileSize)
-				fileSize = this->dataDir[i].VirtualAddress + this->dataDir[i].Size;
+			adjustAddr(dataDir[i].VirtualAddress, rSect->PointerToRawData, rRawSize, rRawSizeOld);
+			if (dataDir[i].VirtualAddress + dataDir[i].Size > fileSize)
+				fileSize = dataDir[i].VirtualAddress + dataDir[i].Size;
 		} else {
-			adjustAddr(this->dataDir[i].VirtualAddress, rSect->VirtualAddress, rVirSize, rVirSizeOld);
-			if (this->dataDir[i].VirtualAddress + this->dataDir[i].Size > imageSize)
-				imageSize = this->dataDir[i].VirtualAddress + this->dataDir[i].Size;
+			adjustAddr(dataDir[i].VirtualAddress, rSect->VirtualAddress, rVirSize, rVirSizeOld);
+			if (dataDir[i].VirtualAddress + dataDir[i].Size > imageSize)
+				imageSize = dataDir[i].VirtualAddress + dataDir[i].Size;
 		}
 	}
 	
 	// Update all section headers
-	for (WORD i = (WORD)rIndx; i < this->header->NumberOfSections; i++) {
-		if (strncmp((CHAR*)this->sections[i].Name, ".rsrc", IMAGE_SIZEOF_SHORT_NAME) == 0) {
-			this->sections[i].Misc.VirtualSize = (DWORD)rSize;
-			this->sections[i].SizeOfRawData = (DWORD)rRawSize;
+	for (WORD i = (WORD)rIndx; i < header->NumberOfSections; i++) {
+		if (strncmp((CHAR*)sections[i].Name, ".rsrc", IMAGE_SIZEOF_SHORT_NAME) == 0) {
+			sections[i].Misc.VirtualSize = (DWORD)rSize;
+			sections[i].SizeOfRawData = (DWORD)rRawSize;
 		} else {
-			adjustAddr(this->sections[i].VirtualAddress, rSect->VirtualAddress, rVirSize, rVirSizeOld);
-			adjustAddr(this->sections[i].PointerToRawData, rSect->PointerToRawData, rRawSize, rRawSizeOld);
+			adjustAddr(sections[i].VirtualAddress, rSect->VirtualAddress, rVirSize, rVirSizeOld);
+			adjustAddr(sections[i].PointerToRawData, rSect->PointerToRawData, rRawSize, rRawSizeOld);
 		}
-		adjustAddr(this->sections[i].PointerToLinenumbers, rSect->PointerToRawData, rRawSize, rRawSizeOld);
-		adjustAddr(this->sections[i].PointerToRelocations, rSect->PointerToRawData, rRawSize, rRawSizeOld);
-		if (this->sections[i].VirtualAddress + this->sections[i].Misc.VirtualSize > imageSize)
-			imageSize = this->sections[i].VirtualAddress + this->sections[i].Misc.VirtualSize;
-		if (this->sections[i].PointerToRawData + this->sections[i].SizeOfRawData > fileSize)
-			fileSize = this->sections[i].PointerToRawData + this->sections[i].SizeOfRawData;
+		adjustAddr(sections[i].PointerToLinenumbers, rSect->PointerToRawData, rRawSize, rRawSizeOld);
+		adjustAddr(sections[i].PointerToRelocations, rSect->PointerToRawData, rRawSize, rRawSizeOld);
+		if (sections[i].VirtualAddress + sections[i].Misc.VirtualSize > imageSize)
+			imageSize = sections[i].VirtualAddress + sections[i].Misc.VirtualSize;
+		if (sections[i].PointerToRawData + sections[i].SizeOfRawData > fileSize)
+			fileSize = sections[i].PointerToRawData + sections[i].SizeOfRawData;
 	}
+	l.fileSize = fileSize;
 	
 	// Update the ImageSize
 	imageSize = (DWORD)roundUpTo(imageSize, sAlign);
-	if (is64bit)	this->nth64->OptionalHeader.SizeOfImage = imageSize;
-	else			this->nth32->OptionalHeader.SizeOfImage = imageSize;
+	if (is64bit)	nth64->OptionalHeader.SizeOfImage = imageSize;
+	else			nth32->OptionalHeader.SizeOfImage = imageSize;
+}
+bool PEFile::save() {
+	if (this->readonly) { return false; }
+
+	// When the resources were never loaded they could not have changed
+	if (!this->res) { return updatePEChkSum(); }
+
+	// When the resources only changed in ways that still fit in the .rsrc section, they are written where they are
+	int rIndx = 0;
+	IMAGE_SECTION_HEADER *rSect = this->getSectionHeader(".rsrc", &rIndx);
+	if (rSect) {
+		this->chkSumSub(rSect->PointerToRawData, rSect->SizeOfRawData);
+		bool inPlace = this->res->compileInPlace();
+		this->chkSumAdd(rSect->PointerToRawData, rSect->SizeOfRawData);
+		if (inPlace) { return updatePEChkSum(); }
+	}
+
+	// Compile the .rsrc and update the headers for its new size
+	if (!rSect) {
+		this->createSection(".rsrc", 0, CHARS_INIT_DATA_SECTION_R);
+		rSect = this->getSectionHeader(".rsrc", &rIndx);
+	}
+	RsrcLayout l;
+	LPVOID rsrc = this->res->compile(&l.rSize, rSect->VirtualAddress);
+	this->layoutResources(this->data, rIndx, l);
+	DWORD pntr = l.pntr, fileSize = l.fileSize, fileSizeOld = l.fileSizeOld;
+	size_t rSize = l.rSize, rRawSize = l.rRawSize, rRawSizeOld = l.rRawSizeOld;
+
+	// Everything from the resources to the end of the file is moved or changed, so it is summed again afterwards
+	this->chkSumSub(pntr, fileSizeOld - pntr);
+	DWORD sum = this->chkSum;
 
 	// Increase file size (invalidates all local pointers to the file data)
 	if (fileSize > fileSizeOld && !this->setSize(fileSize))			{ free(rsrc); return false; }
@@ -793,8 +924,74 @@ bool PEFile::save() {
 
 	// Decrease file size (invalidates all local pointers to the file data)
 	if (fileSize < fileSizeOld && !this->setSize(fileSize, false))	{ return false; }
+	this->chkSum = sum;
+	this->chkSumAdd(pntr, fileSize - pntr);
+	this->relocsIndexed = false; // .reloc may have moved without the size changing
+
+	// The resources were laid out again, so they are read from the new section the next time they are needed (also frees the changed resources)
+	delete this->res;
+	this->res = NULL;
 
 	// Finish Up
 	return updatePEChkSum();
 }
+static bool WriteZeros(PEFileSink *sink, size_t size) {
+	static const BYTE zeros[0x1000] = {0};
+	for (size_t n; size; size -= n)
+		if (!sink->write((LPVOID)zeros, n = (size < sizeof(zeros)) ? size : sizeof(zeros))) { return false; }
+	return true;
+}
+bool PEFile::saveTo(PEFileSink *sink) {
+	if (!sink || !this->store)							{ SetLastError(ERROR_INVALID_PARAMETER); return false; }
+
+	// The headers are the only part of the file that is changed in place, and only in a copy of them
+	size_t hdrLen = (LPBYTE)(this->sections+this->header->NumberOfSections) - this->data;
+	if (hdrLen < this->hdrSize) { hdrLen = this->hdrSize; }
+	LPBYTE hdrs = (LPBYTE)memcpy(malloc(hdrLen), this->data, hdrLen);
+
+	// Changed resources are compiled into a new .rsrc section (the file must already have one), otherwise the rest of the file is copied as-is
+	int rIndx = 0;
+	const IMAGE_SECTION_HEADER *rSect = this->getSectionHeader(".rsrc", &rIndx);
+	RsrcLayout l = { (DWORD)this->size, 0, 0, 0, (DWORD)this->size, (DWORD)this->size };
+	LPVOID rsrc = NULL;
+	if (this->res && !rSect && !this->res->getTypes().empty())	{ free(hdrs); SetLastError(ERROR_NOT_SUPPORTED); return false; }
+	if (this->res && rSect) {
+		if (rSect->PointerToRawData < hdrLen)			{ free(hdrs); SetLastError(ERROR_INVALID_DATA); return false; }
+		rsrc = this->res->compile(&l.rSize, rSect->VirtualAddress);
+		this->layoutResources(hdrs, rIndx, l);
+	}
+	size_t end = l.pntr + l.rRawSize, endOld = l.pntr + l.rRawSizeOld;
+	size_t tail = (l.fileSize > end) ? l.fileSize - end : 0, tailSrc = (l.fileSizeOld > endOld) ? l.fileSizeOld - endOld : 0;
+	if (tailSrc > tail) { tailSrc = tail; } // the file may be cut short, like setSize does in save
+
+	// Sum the new file using the known sum of the unchanged parts when possible
+	DWORD sum;
+	if (this->chkSumKnown && hdrLen == this->hdrSize) {
+		sum = CHK_SUM_SUB(this->chkSum, this->sumWords(l.pntr, l.fileSizeOld - l.pntr));
+	} else {
+		sum = SumWords(this->data, hdrLen, l.pntr - hdrLen);
+	}
+	if (rsrc) { sum = CHK_SUM_ADD(sum, SumWords((LPBYTE)rsrc, 0, l.rSize)); } // the sections are aligned so the parity of each position is unchanged
+	sum = CHK_SUM_ADD(sum, SumWords(this->data, endOld, tailSrc));
+	DWORD &check = this->is64bit() ? ((IMAGE_NT_HEADERS64*)(hdrs+this->peOffset))->OptionalHeader.CheckSum : ((IMAGE_NT_HEADERS32*)(hdrs+this->peOffset))->OptionalHeader.CheckSum;
+	check = ChkSum(CHK_SUM_ADD(sum, SumWords(hdrs, 0, hdrLen)), l.fileSize, check);
+
+	// Write the headers, everything before the resources, the resources, and everything after them
+	bool retval = sink->write(hdrs, hdrLen) && sink->copy(this->store, hdrLen, l.pntr - hdrLen) &&
+		(!rsrc || (sink->write(rsrc, l.rSize) && WriteZeros(sink, l.rRawSize - l.rSize))) &&
+		sink->copy(this->store, endOld, tailSrc) && WriteZeros(sink, tail - tailSrc) &&
+		sink->finish();
+	free(hdrs);
+	free(rsrc);
+	return retval;
+}
+bool PEFile::saveTo(LPCWSTR file) {
+	PEFileSink *sink = PEFileSink::createForFile(file);
+	if (!sink) { return false; }
+	bool retval = this->saveTo(sink);
+	SAVE_ERR();
+	delete sink;
+	SET_ERR();
+	return retval;
+}
 #pragma endregion
@@ -21,8 +21,17 @@
 //#define EXPOSE_DIRECT_RESOURCES
 
 #include "PEFileResources.h"
+#include "PEFileStorage.h"
 
-#define LARGE_PATH 32767
+#include <vector>
+
+// A single base relocation, the position is the file offset of its WORD in the .reloc section
+struct RelocSlot {
+	DWORD rva;
+	DWORD pos;
+};
+
+struct RsrcLayout;
 
 class PEFile {
 protected:
@@ -33,34 +42,56 @@ protected:
 	IMAGE_FILE_HEADER *header;		// part of nth32/nth64 header
 	IMAGE_DATA_DIRECTORY *dataDir;	// part of nth32/nth64 header
 	IMAGE_SECTION_HEADER *sections;
-	Rsrc *res;
+	mutable Rsrc *res;	// only loaded once the resources are changed or listed, before that they are looked up straight from the .rsrc section
 	
 	bool readonly;
-	WCHAR original[LARGE_PATH];
-	HANDLE hFile, hMap;
-	size_t size;
-	LPBYTE orig_data, data;
+	PEFileStorage *store;
+	size_t size;	// the size and data of the store, updated whenever it is resized
+	LPBYTE data;
 
 	ULONGLONG version;
 	bool modified;
 
+	// The checksum is kept up to date by the functions that change the file, the headers are summed when needed since they are changed through pointers
+	DWORD chkSum;		// the folded sum of all 16-bit words after the headers
+	bool chkSumKnown;	// false until the first change or checksum update, so files that are only read are never summed
+	DWORD hdrSize;
+	void initChkSum();	// sums everything after the headers
+	DWORD sumWords(DWORD dwOffset, size_t dwSize) const;	// only sums the part that is after the headers
+	void chkSumSub(DWORD dwOffset, size_t dwSize);	// call before changing the data
+	void chkSumAdd(DWORD dwOffset, size_t dwSize);	// call after changing the data
+
+	// All base relocations sorted by RVA, built by the first removeRelocs and dropped whenever the sections may have moved
+	std::vector<RelocSlot> relocs;
+	bool relocsIndexed;
+	void indexRelocs();
+
+	// While in a batch flushes are skipped and the storage only grows, in large steps, so it is rarely remapped
+	// The storage can be larger than size until the batch is committed, the extra bytes are always 0s
+	int batch;
+
 	size_t getSizeOf(DWORD cnt, int rsrcIndx, size_t rsrcRawSize) const;
+	void layoutResources(LPBYTE hdrs, int rIndx, RsrcLayout &l) const; // updates the headers for a new .rsrc section of l.rSize bytes
 
-	bool map();
-	void unmap();
-	
 	bool usesMemoryMappedFile() const;
 
+	void open();
 	bool load(bool incRes);
 	void unload();
+
+	bool loadResources() const;
+	void rebaseResources();
 public:
 	PEFile(LPVOID data, size_t size, bool readonly = false); // data is freed when the PEFile is deleted
 	PEFile(LPCWSTR filename, bool readonly = false);
+	PEFile(PEFileStorage *store); // the store is deleted when the PEFile is deleted
 	~PEFile();
 	bool isLoaded() const;
 	bool isReadOnly() const;
 
 	bool save(); // flushes
+	bool saveTo(PEFileSink *sink);	// writes the saved file to the sink without changing this file, finishes the sink
+	bool saveTo(LPCWSTR file);		// as above, replacing the file all at once
 
 	bool is32bit() const;
 	bool is64bit() const;
@@ -101,7 +132,7 @@ public:
 	size_t getSize() const;
 	bool setSize(size_t dwSize, bool grow_only = true);				// invalidates all pointers returned by functions, flushes
 
-	LPBYTE get(DWORD dwOffset = 0, DWORD *dwSize = NULL);			// pointer can modify the file
+	LPBYTE get(DWORD dwOffset = 0, DWORD *dwSize = NULL);			// pointer can modify the file, but past the headers only set/zero/move keep the checksum up to date
 	const LPBYTE get(DWORD dwOffset = 0, DWORD *dwSize = NULL) const;
 	bool set(const LPVOID lpBuffer, DWORD dwSize, DWORD dwOffset);	// shorthand for memcpy(f->get(dwOffset), lpBuffer, dwSize) with bounds checking
 	bool zero(DWORD dwSize, DWORD dwOffset);						// shorthand for memset(f->get(dwOffset), 0, dwSize) with bounds checking
@@ -109,7 +140,10 @@ public:
 	bool shift(DWORD dwOffset, int dwDistanceToMove);				// shorthand for f->move(dwOffset, f->getSize() - dwOffset - dwDistanceToMove, dwDistanceToMove)
 	bool flush();
 
-	bool updatePEChkSum();				// flushes
+	bool beginBatch(size_t room = 0);	// until commit, changes are not flushed and growing the file rarely remaps it (invalidating pointers), room reserves space up front, batches can be nested
+	bool commit();						// ends a batch, the outermost one trims the file, updates the checksum, and flushes
+
+	bool updatePEChkSum(bool full = false);	// flushes, full sums the entire file instead of only what was changed (to verify)
 	bool hasExtraData() const;
 	LPVOID getExtraData(DWORD *size);	// pointer can modify the file, when first enabling it will flush
 	bool clearCertificateTable();		// may invalidate all pointers returned by functions, flushes
@@ -126,6 +160,8 @@ public:
 	bool resourceExists(LPCWSTR type, LPCWSTR name, WORD* lang) const;
 	LPVOID getResource (LPCWSTR type, LPCWSTR name, WORD lang, size_t* size) const;	// must be freed
 	LPVOID getResource (LPCWSTR type, LPCWSTR name, WORD* lang, size_t* size) const;	// must be freed
+	const LPVOID getResourceView(LPCWSTR type, LPCWSTR name, WORD lang, size_t* size) const;	// must not be freed, invalidated by any function that invalidates pointers or changes the resource
+	const LPVOID getResourceView(LPCWSTR type, LPCWSTR name, WORD* lang, size_t* size) const;	// as above
 	bool removeResource(LPCWSTR type, LPCWSTR name, WORD lang);
 	bool addResource   (LPCWSTR type, LPCWSTR name, WORD lang, const LPVOID data, size_t size, DWORD overwrite = OVERWRITE_ALWAYS);
 	
@@ -0,0 +1,276 @@
+/*
+ * Windows 7 Boot Updater (github.com/coderforlife/windows-7-boot-updater)
+ * Copyright (C) 2021  Jeffrey Bush - Coder for Life
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _DECLARE_ALL_PE_FILE_RESOURCES_
+#include "PEFileResources.h"
+#include "PEFileDiff.h"
+
+#ifdef __cplusplus_cli
+#pragma unmanaged
+#endif
+
+#pragma region Resource and Section Differences
+///////////////////////////////////////////////////////////////////////////////
+///// Resource and Section Differences
+///////////////////////////////////////////////////////////////////////////////
+PEFileDiff::PEFileDiff() : orig(NULL), updated(NULL) { }
+PEFileDiff::~PEFileDiff() { delete this->orig; delete this->updated; }
+static Rsrc *LoadResources(const PEFile *f) {
+	const IMAGE_SECTION_HEADER *sect = f->getSectionHeader(".rsrc");
+	return sect ? Rsrc::createFromRSRCSection(f->get(), f->getSize(), (IMAGE_SECTION_HEADER*)sect) : Rsrc::createEmpty();
+}
+PEFileDiff* PEFileDiff::create(const PEFile *orig, const PEFile *updated) {
+	if (!orig || !updated || !orig->isLoaded() || !updated->isLoaded())	{ SetLastError(ERROR_INVALID_PARAMETER); return NULL; }
+	PEFileDiff *d = new PEFileDiff();
+	if ((d->orig = LoadResources(orig)) == NULL || (d->updated = LoadResources(updated)) == NULL) { delete d; SetLastError(ERROR_INVALID_DATA); return NULL; }
+	d->diffResources();
+	d->diffSections(orig, updated);
+	return d;
+}
+const std::vector<PEResourceDiff> &PEFileDiff::getResources() const { return this->resources; }
+const std::vector<PESectionDiff> &PEFileDiff::getSections() const { return this->sections; }
+
+static void AddResourceDiff(std::vector<PEResourceDiff> &v, LPCWSTR type, LPCWSTR name, WORD lang, PEResourceDiff::Change change) {
+	PEResourceDiff r = { type, name, lang, change };
+	v.push_back(r);
+}
+void PEFileDiff::diffResources() {
+	// Everything in the original was either removed or is compared, then everything not in the original was added
+	std::vector<LPCWSTR> types = this->orig->getTypes();
+	for (size_t t = 0; t < types.size(); ++t) {
+		std::vector<LPCWSTR> names = this->orig->getNames(types[t]);
+		for (size_t n = 0; n < names.size(); ++n) {
+			std::vector<WORD> langs = this->orig->getLangs(types[t], names[n]);
+			for (size_t l = 0; l < langs.size(); ++l) {
+				size_t a = 0, b = 0;
+				const LPVOID x = this->orig->getView(types[t], names[n], langs[l], &a), y = this->updated->getView(types[t], names[n], langs[l], &b);
+				if (!y)												{ AddResourceDiff(this->resources, types[t], names[n], langs[l], PEResourceDiff::Removed); }
+				else if (a != b || (x != y && memcmp(x, y, a) != 0))	{ AddResourceDiff(this->resources, types[t], names[n], langs[l], PEResourceDiff::Changed); }
+			}
+		}
+	}
+	types = this->updated->getTypes();
+	for (size_t t = 0; t < types.size(); ++t) {
+		std::vector<LPCWSTR> names = this->updated->getNames(types[t]);
+		for (size_t n = 0; n < names.size(); ++n) {
+			std::vector<WORD> langs = this->updated->getLangs(types[t], names[n]);
+			for (size_t l = 0; l < langs.size(); ++l)
+				if (!this->orig->exists(types[t], names[n], langs[l]))
+					AddResourceDiff(this->resources, types[t], names[n], langs[l], PEResourceDiff::Added);
+		}
+	}
+}
+
+static void AddSectionDiff(std::vector<PESectionDiff> &v, const IMAGE_SECTION_HEADER *s, DWORD offset, DWORD size) {
+	PESectionDiff d;
+	memcpy(d.name, s->Name, IMAGE_SIZEOF_SHORT_NAME);
+	d.name[IMAGE_SIZEOF_SHORT_NAME] = 0;
+	d.offset = offset;
+	d.size = size;
+	v.push_back(d);
+}
+static const IMAGE_SECTION_HEADER *FindSection(const PEFile *f, const IMAGE_SECTION_HEADER *s) {
+	for (int i = 0, n = f->getSectionHeaderCount(); i < n; ++i)
+		if (strncmp((CHAR*)f->getSectionHeader(i)->Name, (CHAR*)s->Name, IMAGE_SIZEOF_SHORT_NAME) == 0)
+			return f->getSectionHeader(i);
+	return NULL;
+}
+static DWORD GetRawSize(const PEFile *f, const IMAGE_SECTION_HEADER *s) { // cut short if the file is
+	size_t size = f->getSize();
+	return (s->PointerToRawData >= size) ? 0 : (DWORD)((s->SizeOfRawData < size - s->PointerToRawData) ? s->SizeOfRawData : (size - s->PointerToRawData));
+}
+void PEFileDiff::diffSections(const PEFile *orig, const PEFile *updated) {
+	for (int i = 0, n = orig->getSectionHeaderCount(); i < n; ++i) {
+		const IMAGE_SECTION_HEADER *a = orig->getSectionHeader(i), *b = FindSection(updated, a);
+		DWORD aSize = GetRawSize(orig, a), bSize = b ? GetRawSize(updated, b) : 0, same = (aSize < bSize) ? aSize : bSize;
+		if (!b) { AddSectionDiff(this->sections, a, 0, aSize); continue; }
+
+		// Differences that are close together are reported as a single range
+		const LPBYTE x = orig->get(a->PointerToRawData), y = updated->get(b->PointerToRawData);
+		for (DWORD k = 0; k < same; ) {
+			if (x[k] == y[k]) { ++k; continue; }
+			DWORD start = k, last = k;
+			for (++k; k < same && k - last <= 8; ++k)
+				if (x[k] != y[k]) last = k;
+			AddSectionDiff(this->sections, a, start, last + 1 - start);
+			k = last + 1;
+		}
+		if (aSize != bSize) { AddSectionDiff(this->sections, a, same, ((aSize > bSize) ? aSize : bSize) - same); }
+	}
+	for (int i = 0, n = updated->getSectionHeaderCount(); i < n; ++i) {
+		const IMAGE_SECTION_HEADER *b = updated->getSectionHeader(i);
+		if (!FindSection(orig, b)) { AddSectionDiff(this->sections, b, 0, GetRawSize(updated, b)); }
+	}
+}
+#pragma endregion
+
+#pragma region Deltas
+///////////////////////////////////////////////////////////////////////////////
+///// Deltas
+///////////////////////////////////////////////////////////////////////////////
+// The delta starts with a header, then a list of ops that each add the next part of the updated file
+// Each op is a varint of (length << 1 | copy), copies are followed by a zigzag varint of how far their source is from where the last copy ended, data is followed by the bytes
+#define DELTA_MAGIC			0x4C444550 // "PEDL"
+#define DELTA_VERSION		1
+#define DELTA_HEADER_SIZE	(sizeof(DWORD)*4 + sizeof(ULONGLONG)*2) // magic, version, original size, updated size, original hash, updated hash
+#define DELTA_BLOCK			32		// the original is indexed in blocks of this size, which is also the shortest copy searched for
+#define DELTA_CANDIDATES	8		// the most blocks with the same hash that are checked
+#define DELTA_HASH_MULT		0x01000193
+#define DELTA_NONE			0xFFFFFFFF
+
+static ULONGLONG Hash(const BYTE *data, size_t size) { // FNV-1a
+	ULONGLONG h = 0xCBF29CE484222325ull;
+	for (size_t i = 0; i < size; ++i) { h ^= data[i]; h *= 0x100000001B3ull; }
+	return h;
+}
+static DWORD BlockHash(const BYTE *data) { DWORD h = 0; for (DWORD i = 0; i < DELTA_BLOCK; ++i) { h = h * DELTA_HASH_MULT + data[i]; } return h; }
+static DWORD BlockHashOut() { DWORD p = 1; for (DWORD i = 1; i < DELTA_BLOCK; ++i) { p *= DELTA_HASH_MULT; } return p; } // the multiplier of the byte leaving the window
+inline static DWORD Bucket(DWORD h, DWORD mask) { return (h ^ (h >> 15)) & mask; }
+
+static void PutVarint(std::vector<BYTE> &out, ULONGLONG x) { while (x >= 0x80) { out.push_back((BYTE)(x | 0x80)); x >>= 7; } out.push_back((BYTE)x); }
+static bool GetVarint(const BYTE *&p, const BYTE *end, ULONGLONG *x) {
+	*x = 0;
+	for (int shift = 0; p < end && shift < 64; shift += 7) {
+		BYTE b = *p++;
+		*x |= (ULONGLONG)(b & 0x7F) << shift;
+		if (!(b & 0x80)) { return true; }
+	}
+	return false;
+}
+static void PutData(std::vector<BYTE> &out, const BYTE *data, size_t len) {
+	if (len == 0) { return; }
+	PutVarint(out, (ULONGLONG)len << 1);
+	out.insert(out.end(), data, data + len);
+}
+static void PutCopy(std::vector<BYTE> &out, size_t src, size_t expected, size_t len) {
+	LONGLONG diff = (LONGLONG)src - (LONGLONG)expected;
+	PutVarint(out, ((ULONGLONG)len << 1) | 1);
+	PutVarint(out, (diff < 0) ? ((~(ULONGLONG)diff << 1) | 1) : ((ULONGLONG)diff << 1));
+}
+static void PutDword(std::vector<BYTE> &out, DWORD x) { out.insert(out.end(), (BYTE*)&x, (BYTE*)(&x+1)); }
+static void PutQword(std::vector<BYTE> &out, ULONGLONG x) { out.insert(out.end(), (BYTE*)&x, (BYTE*)(&x+1)); }
+
+LPVOID PEFileDiff::CreateDelta(const LPVOID _orig, size_t origSize, const LPVOID _updated, size_t updatedSize, size_t *size) {
+	const BYTE *orig = (const BYTE*)_orig, *updated = (const BYTE*)_updated;
+	if (!orig || !updated || !size || origSize > 0xFFFFFFFF || updatedSize > 0xFFFFFFFF) { SetLastError(ERROR_INVALID_PARAMETER); return NULL; }
+
+	std::vector<BYTE> out;
+	PutDword(out, DELTA_MAGIC);
+	PutDword(out, DELTA_VERSION);
+	PutDword(out, (DWORD)origSize);
+	PutDword(out, (DWORD)updatedSize);
+	PutQword(out, Hash(orig, origSize));
+	PutQword(out, Hash(updated, updatedSize));
+
+	// Index every block of the original by its hash
+	DWORD nBlocks = (DWORD)(origSize / DELTA_BLOCK), nBuckets = 1;
+	while (nBuckets < nBlocks * 2) { nBuckets <<= 1; }
+	std::vector<DWORD> buckets(nBuckets, DELTA_NONE), chain(nBlocks);
+	for (DWORD b = nBlocks; b-- > 0; ) { // first blocks first in each chain
+		DWORD i = Bucket(BlockHash(orig + b * DELTA_BLOCK), nBuckets - 1);
+		chain[b] = buckets[i];
+		buckets[i] = b;
+	}
+
+	// Go through the updated file with a rolling hash, anything that doesn't start a copy of at least a block is stored as-is
+	const DWORD out_mult = BlockHashOut();
+	size_t p = 0, data = 0, lastEnd = 0, lastSrc = 0; // data is where the bytes not yet copied start, last* are the ends of the last copy
+	DWORD h = (updatedSize >= DELTA_BLOCK) ? BlockHash(updated) : 0;
+	while (p + DELTA_BLOCK <= updatedSize) {
+		size_t best = 0, bestSrc = 0;
+
+		// Most of the file is the same, so the position right after the last copy is checked first
+		size_t cand = lastSrc + (p - lastEnd);
+		if (cand + DELTA_BLOCK <= origSize && memcmp(orig + cand, updated + p, DELTA_BLOCK) == 0) {
+			best = DELTA_BLOCK; bestSrc = cand;
+			while (p + best < updatedSize && bestSrc + best < origSize && orig[bestSrc + best] == updated[p + best]) { ++best; }
+		}
+		for (DWORD b = buckets[Bucket(h, nBuckets - 1)], c = 0; b != DELTA_NONE && c < DELTA_CANDIDATES; b = chain[b], ++c) {
+			size_t src = (size_t)b * DELTA_BLOCK;
+			if ((best && src == bestSrc) || memcmp(orig + src, updated + p, DELTA_BLOCK) != 0) { continue; }
+			size_t len = DELTA_BLOCK;
+			while (p + len < updatedSize && src + len < origSize && orig[src + len] == updated[p + len]) { ++len; }
+			if (len > best) { best = len; bestSrc = src; }
+		}
+
+		if (best) {
+			// Include anything before the match that also matches
+			while (p > data && bestSrc > 0 && orig[bestSrc - 1] == updated[p - 1]) { --p; --bestSrc; ++best; }
+			PutData(out, updated + data, p - data);
+			PutCopy(out, bestSrc, lastSrc, best);
+			data = lastEnd = p += best;
+			lastSrc = bestSrc + best;
+			if (p + DELTA_BLOCK <= updatedSize) { h = BlockHash(updated + p); }
+		} else {
+			if (p + DELTA_BLOCK < updatedSize) { h = (h - updated[p] * out_mult) * DELTA_HASH_MULT + updated[p + DELTA_BLOCK]; }
+			++p;
+		}
+	}
+	PutData(out, updated + data, updatedSize - data);
+
+	LPVOID delta = malloc(out.size());
+	if (!delta) { SetLastError(ERROR_NOT_ENOUGH_MEMORY); return NULL; }
+	*size = out.size();
+	return memcpy(delta, &out[0], out.size());
+}
+LPVOID PEFileDiff::CreateDelta(const PEFile *orig, const PEFile *updated, size_t *size) {
+	if (!orig || !updated || !orig->isLoaded() || !updated->isLoaded()) { SetLastError(ERROR_INVALID_PARAMETER); return NULL; }
+	return CreateDelta(orig->get(), orig->getSize(), updated->get(), updated->getSize(), size);
+}
+LPVOID PEFileDiff::ApplyDelta(const LPVOID _orig, size_t origSize, const LPVOID _delta, size_t deltaSize, size_t *size) {
+	const BYTE *orig = (const BYTE*)_orig, *p = (const BYTE*)_delta, *end = p + deltaSize;
+	if (!orig || !p || !size)										{ SetLastError(ERROR_INVALID_PARAMETER); return NULL; }
+
+	// Check that the delta is for this file
+	DWORD magic, version, dOrigSize, updatedSize;
+	ULONGLONG origHash, updatedHash;
+	if (deltaSize < DELTA_HEADER_SIZE)								{ SetLastError(ERROR_INVALID_DATA); return NULL; }
+	memcpy(&magic, p, sizeof(DWORD));				p += sizeof(DWORD);
+	memcpy(&version, p, sizeof(DWORD));				p += sizeof(DWORD);
+	memcpy(&dOrigSize, p, sizeof(DWORD));			p += sizeof(DWORD);
+	memcpy(&updatedSize, p, sizeof(DWORD));			p += sizeof(DWORD);
+	memcpy(&origHash, p, sizeof(ULONGLONG));		p += sizeof(ULONGLONG);
+	memcpy(&updatedHash, p, sizeof(ULONGLONG));		p += sizeof(ULONGLONG);
+	if (magic != DELTA_MAGIC || version != DELTA_VERSION || dOrigSize != origSize || Hash(orig, origSize) != origHash) { SetLastError(ERROR_INVALID_DATA); return NULL; }
+
+	// Run all of the ops
+	LPBYTE out = (LPBYTE)malloc(updatedSize ? updatedSize : 1);
+	if (!out)														{ SetLastError(ERROR_NOT_ENOUGH_MEMORY); return NULL; }
+	size_t pos = 0, src = 0;
+	while (p < end) {
+		ULONGLONG op, z;
+		if (!GetVarint(p, end, &op) || (op >> 1) > updatedSize - pos)	{ break; }
+		size_t len = (size_t)(op >> 1);
+		if (op & 1) {
+			if (!GetVarint(p, end, &z))								{ break; }
+			ULONGLONG s = src + ((z & 1) ? ~(z >> 1) : (z >> 1)); // wraps around for negative distances
+			if (s > origSize || len > origSize - s)					{ break; }
+			memcpy(out + pos, orig + s, len);
+			src = (size_t)s + len;
+		} else {
+			if (len > (size_t)(end - p))							{ break; }
+			memcpy(out + pos, p, len);
+			p += len;
+		}
+		pos += len;
+	}
+	if (p != end || pos != updatedSize || Hash(out, updatedSize) != updatedHash) { free(out); SetLastError(ERROR_INVALID_DATA); return NULL; }
+	*size = updatedSize;
+	return out;
+}
+#pragma endregion
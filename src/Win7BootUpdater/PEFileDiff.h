@@ -0,0 +1,67 @@
+/*
+ * Windows 7 Boot Updater (github.com/coderforlife/windows-7-boot-updater)
+ * Copyright (C) 2021  Jeffrey Bush - Coder for Life
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "PEFile.h"
+
+#include <vector>
+
+// A resource that is different between the original and updated file
+// The type and name are IDs or point into the diff and are only valid as long as it is
+struct PEResourceDiff {
+	enum Change { Added, Removed, Changed };
+	LPCWSTR type, name;
+	WORD lang;
+	Change change;
+};
+
+// A range of a section's raw data that is different between the original and updated file, relative to the start of the section
+// Sections that are only in one of the files (or that changed size) have a range that covers all of it (or the part that only one has)
+struct PESectionDiff {
+	CHAR name[IMAGE_SIZEOF_SHORT_NAME+1];
+	DWORD offset, size;
+};
+
+// The differences between two versions of a PE file
+class PEFileDiff {
+	Rsrc *orig, *updated;
+	std::vector<PEResourceDiff> resources;
+	std::vector<PESectionDiff> sections;
+
+	PEFileDiff();
+	PEFileDiff(const PEFileDiff&);
+	PEFileDiff& operator=(const PEFileDiff&);
+
+	void diffResources();
+	void diffSections(const PEFile *orig, const PEFile *updated);
+public:
+	~PEFileDiff();
+
+	static PEFileDiff* create(const PEFile *orig, const PEFile *updated); // NULL if the resources of either file cannot be read
+
+	const std::vector<PEResourceDiff> &getResources() const;
+	const std::vector<PESectionDiff> &getSections() const;
+
+	// A delta recreates the updated file exactly from the original file, copying every part that is anywhere in the original and only storing the rest
+	// It is not compressed, but what it stores compresses just as well as the file itself would (e.g. with bmzip)
+	// Applying checks that the original is the one the delta was made from and that the result is the updated file, failing with ERROR_INVALID_DATA otherwise
+	static LPVOID CreateDelta(const LPVOID orig, size_t origSize, const LPVOID updated, size_t updatedSize, size_t *size); // must be freed
+	static LPVOID CreateDelta(const PEFile *orig, const PEFile *updated, size_t *size); // must be freed
+	static LPVOID ApplyDelta(const LPVOID orig, size_t origSize, const LPVOID delta, size_t deltaSize, size_t *size); // must be freed
+};
@@ -19,6 +19,8 @@
 #define _DECLARE_ALL_PE_FILE_RESOURCES_
 #include "PEFileResources.h"
 
+#include <algorithm>
+
 #ifdef __cplusplus_cli
 #pragma unmanaged
 #endif
@@ -27,12 +29,9 @@
 class ResLoadFailure {};
 static ResLoadFailure resLoadFailure;
 
-bool ResCmp::operator()(LPCWSTR a, LPCWSTR b) const { return IS_INTRESOURCE(a) ? (IS_INTRESOURCE(b) ? ((WORD)a < (WORD)b) : false) : (IS_INTRESOURCE(b) ? true : wcscmp(a, b) < 0); }
+bool ResCmp::operator()(LPCWSTR a, LPCWSTR b) const { return IS_INTRESOURCE(a) ? (IS_INTRESOURCE(b) ? ((WORD)(size_t)a < (WORD)(size_t)b) : false) : (IS_INTRESOURCE(b) ? true : wcscmp(a, b) < 0); }
 //int ResCmp::operator()(LPCWSTR a, LPCWSTR b) const { return (IS_INTRESOURCE(a) ? (IS_INTRESOURCE(b) ? ((WORD)a - (WORD)b) : 1) : (IS_INTRESOURCE(b) ? -1 : wcscmp(a, b)); }
 
-inline static LPWSTR dup(LPCWSTR id) { return IS_INTRESOURCE(id) ? MAKEINTRESOURCE(((WORD)id)) : _wcsdup(id); }
-inline static void free_id(LPWSTR id) { if (!IS_INTRESOURCE(id)) free(id); }
-
 #pragma region RSRC Utility Functions
 
 static IMAGE_RESOURCE_DIRECTORY_ENTRY *GetEntries(const LPBYTE data, size_t size, size_t offset, DWORD *nEntries) {
@@ -43,23 +42,6 @@ static IMAGE_RESOURCE_DIRECTORY_ENTRY *GetEntries(const LPBYTE data, size_t size
 	if (offset + *nEntries*sizeof(IMAGE_RESOURCE_DIRECTORY_ENTRY) >= size) { throw resLoadFailure; }
 	return (IMAGE_RESOURCE_DIRECTORY_ENTRY*)(data+offset);
 }
-static LPWSTR GetResourceName(const LPBYTE data, size_t size, size_t offset, const IMAGE_RESOURCE_DIRECTORY_ENTRY & entry) {
-	if (entry.NameIsString) {
-		offset += entry.NameOffset;
-
-		if (offset + sizeof(WORD) > size) { return NULL; }
-		WORD len = *(WORD*)(data+offset);
-		offset += sizeof(WORD);
-
-		if (offset + sizeof(WCHAR)*len > size) { return NULL; }
-		WCHAR *str = wcsncpy((WCHAR*)malloc((len+1)*sizeof(WCHAR)), (WCHAR*)(data+offset), len);
-		str[len] = 0;
-
-		return str;
-	} else {
-		return MAKEINTRESOURCE(entry.Id);
-	}
-}
 static void WriteResDir(LPBYTE data, size_t& pos, WORD nNamed, WORD nId) {
 	IMAGE_RESOURCE_DIRECTORY dir;
 	dir.Characteristics = 0;
@@ -71,11 +53,10 @@ static void WriteResDir(LPBYTE data, size_t& pos, WORD nNamed, WORD nId) {
 	memcpy(data+pos, &dir, sizeof(IMAGE_RESOURCE_DIRECTORY));
 	pos += sizeof(IMAGE_RESOURCE_DIRECTORY);
 }
-template <class Iterator>
-static void WriteResDir(LPBYTE data, size_t &pos, Iterator start, Iterator end) {
+static void WriteResDir(LPBYTE data, size_t &pos, const RsrcDir *dirs, size_t count) {
 	WORD nNamed = 0, nId = 0;
-	for (Iterator i = start; i != end; ++i) {
-		if (IS_INTRESOURCE(i->first))
+	for (size_t i = 0; i < count; ++i) {
+		if (IS_INTRESOURCE(dirs[i].id))
 			nId += 1;
 		else
 			nNamed += 1;
@@ -96,7 +77,7 @@ static void WriteResDirEntry(LPBYTE data, LPCWSTR name, size_t headerSize, size_
 		memcpy(data+posData+sizeof(WORD), name, len*sizeof(WCHAR));
 		posData += roundUpTo<4>(len*sizeof(WCHAR)+sizeof(WORD));
 	} else {
-		entry.Name = (DWORD)name;
+		entry.Name = (DWORD)(size_t)name;
 	}
 
 	memcpy(data+pos, &entry, sizeof(IMAGE_RESOURCE_DIRECTORY_ENTRY));
@@ -182,7 +163,7 @@ static const WORD ResMemoryFlags[] = {
 static size_t GetRESHeaderIDExtraLen(LPCWSTR id) { return IS_INTRESOURCE(id) ? 0 : (wcslen(id) - 1) * sizeof(WCHAR); }
 static size_t WriteRESHeaderID(LPBYTE data, LPCWSTR id, DWORD *hdrSize) {
 	if (IS_INTRESOURCE(id)) {
-		*((DWORD*)data) = (((DWORD)((WORD)id)) << 16) | 0xFFFF;
+		*((DWORD*)data) = (((DWORD)((WORD)(size_t)id)) << 16) | 0xFFFF;
 		return 0;
 	} else {
 		size_t len = (wcslen(id) + 1) * sizeof(WCHAR);
@@ -200,29 +181,86 @@ static size_t WriteRESHeader(LPBYTE data, LPCWSTR type, LPCWSTR name, WORD lang,
 	data += WriteRESHeaderID(data, type, hdrSize) + sizeof(DWORD);
 	data += WriteRESHeaderID(data, name, hdrSize) + sizeof(DWORD);
 	memset(data, 0, sizeof(DWORD)*3 + sizeof(WORD)*2); // DataVersion, *, Version, Characteristics
-	((WORD*)data)[2] = (IS_INTRESOURCE(type) && (((WORD)type) < ARRAYSIZE(ResMemoryFlags))) ? ResMemoryFlags[(WORD)type] : DefResMemoryFlags; // MemoryFlags
+	((WORD*)data)[2] = (IS_INTRESOURCE(type) && (((WORD)(size_t)type) < ARRAYSIZE(ResMemoryFlags))) ? ResMemoryFlags[(WORD)(size_t)type] : DefResMemoryFlags; // MemoryFlags
 	((WORD*)data)[3] = lang;
 	return *hdrSize;
 }
 #pragma endregion
 
-#pragma region Rsrc
+
+#pragma region RsrcArena
+///////////////////////////////////////////////////////////////////////////////
+///// RsrcArena
+///////////////////////////////////////////////////////////////////////////////
+#define ARENA_BLOCK_SIZE	0x10000
+#define ARENA_LARGE_SIZE	0x1000 // anything larger gets its own block so the rest of the current block isn't wasted
+RsrcArena::RsrcArena() : pos(NULL), left(0) { }
+RsrcArena::~RsrcArena() {
+	for (size_t i = 0; i < this->blocks.size(); ++i)
+		free(this->blocks[i]);
+}
+LPVOID RsrcArena::alloc(size_t size) {
+	size = roundUpTo<sizeof(void*)>(size ? size : 1);
+	if (size > ARENA_LARGE_SIZE) {
+		this->blocks.push_back((LPBYTE)malloc(size));
+		return this->blocks.back();
+	}
+	if (size > this->left) {
+		this->blocks.push_back(this->pos = (LPBYTE)malloc(ARENA_BLOCK_SIZE));
+		this->left = ARENA_BLOCK_SIZE;
+	}
+	LPVOID x = this->pos;
+	this->pos += size;
+	this->left -= size;
+	return x;
+}
+LPCWSTR RsrcArena::dup(LPCWSTR id) {
+	if (IS_INTRESOURCE(id)) { return MAKEINTRESOURCE((WORD)(size_t)id); }
+	size_t len = (wcslen(id)+1)*sizeof(WCHAR);
+	return (LPCWSTR)memcpy(this->alloc(len), id, len);
+}
+#pragma endregion
+
+#pragma region Rsrc Loading
 ///////////////////////////////////////////////////////////////////////////////
-///// Rsrc
+///// Rsrc Loading
 ///////////////////////////////////////////////////////////////////////////////
 Rsrc* Rsrc::createFromRSRCSection(const LPBYTE data, size_t size, IMAGE_SECTION_HEADER *section) { try { return (!data || !size || !section) ? NULL : new Rsrc(data, size, section); } catch (ResLoadFailure&) { return NULL; } }
 Rsrc::Rsrc(const LPBYTE data, size_t size, IMAGE_SECTION_HEADER *section) {
-	DWORD nEntries;
-	IMAGE_RESOURCE_DIRECTORY_ENTRY *entries = GetEntries(data, size, section->PointerToRawData, &nEntries);
-	for (WORD i = 0; i < nEntries; i++) {
-		LPWSTR type = GetResourceName(data, size, section->PointerToRawData, entries[i]);
-		//this->types.set(type), new ResourceType(type, data, size, section->PointerToRawData, section->VirtualAddress, entries[i]));
-		this->types[type] = new ResourceType(type, data, size, section->PointerToRawData, section->VirtualAddress, entries[i]);
+	this->rebase(data, section);
+	this->src.count = 0;
+	this->src.used.push_back(0);
+
+	// Read all three levels of directories, appending the children of each to the next level
+	DWORD start = section->PointerToRawData, startVA = section->VirtualAddress, nTypes, nNames, nLangs;
+	IMAGE_RESOURCE_DIRECTORY_ENTRY *types = GetEntries(data, size, start, &nTypes), *names, *langs;
+	this->types.reserve(nTypes);
+	for (DWORD t = 0; t < nTypes; ++t) {
+		RsrcDir type = { this->readId(data, size, start, types[t]), this->names.size(), 0 };
+		names = GetEntries(data, size, start+types[t].OffsetToDirectory, &nNames);
+		this->src.used.push_back(types[t].OffsetToDirectory);
+		for (DWORD n = 0; n < nNames; ++n) {
+			RsrcDir name = { this->readId(data, size, start, names[n]), this->langs.size(), 0 };
+			langs = GetEntries(data, size, start+names[n].OffsetToDirectory, &nLangs);
+			this->src.used.push_back(names[n].OffsetToDirectory);
+			for (DWORD l = 0; l < nLangs; ++l)
+				this->langs.push_back(this->readData(data, size, start, startVA, langs[l]));
+			name.count = nLangs;
+			this->names.push_back(name);
+		}
+		type.count = nNames;
+		this->types.push_back(type);
 	}
+
+	this->sort();
 	this->cleanup();
+	std::sort(this->src.used.begin(), this->src.used.end());
 }
 Rsrc* Rsrc::createFromRESFile(const LPBYTE data, size_t size) { try { return (!data || !size) ? NULL : new Rsrc(data, size); } catch (ResLoadFailure&) { return NULL; } }
 Rsrc::Rsrc(const LPBYTE data, size_t size) {
+	this->src.base = NULL;
+	this->src.size = 0;
+	this->src.count = 0;
 	RESHEADER *h;
 	size_t pos = 0;
 	while ((h = ReadRESHeader(data, size, pos)) != NULL) {
@@ -230,461 +268,425 @@ Rsrc::Rsrc(const LPBYTE data, size_t size) {
 			this->add(h->Type, h->Name, h->LanguageId, data + pos, h->DataSize);
 			pos += roundUpTo<4>(h->HeaderSize + h->DataSize) - h->HeaderSize;
 		}
+		free(h);
 	}
 	this->cleanup();
 }
 Rsrc* Rsrc::createEmpty() { return new Rsrc(); }
-Rsrc::Rsrc() {  }
-Rsrc::~Rsrc() {
-	for (TypeMap::const_iterator i = this->types.begin(); i != this->types.end(); ++i) {
-		free_id(i->first);
-		delete i->second;
+Rsrc::Rsrc() { this->src.base = NULL; this->src.size = 0; this->src.count = 0; }
+Rsrc::~Rsrc() { } // the arena has all of the memory
+LPCWSTR Rsrc::readId(const LPBYTE data, size_t size, size_t offset, const IMAGE_RESOURCE_DIRECTORY_ENTRY &entry) {
+	if (!entry.NameIsString) { return MAKEINTRESOURCE(entry.Id); }
+
+	offset += entry.NameOffset;
+	if (offset + sizeof(WORD) > size) { throw resLoadFailure; }
+	WORD len = *(WORD*)(data+offset);
+	offset += sizeof(WORD);
+	if (offset + sizeof(WCHAR)*len > size) { throw resLoadFailure; }
+
+	WCHAR *str = (WCHAR*)memcpy(this->arena.alloc((len+1)*sizeof(WCHAR)), data+offset, len*sizeof(WCHAR));
+	str[len] = 0;
+	this->src.used.push_back(entry.NameOffset);
+	return str;
+}
+RsrcData Rsrc::readData(const LPBYTE data, size_t size, DWORD start, DWORD startVA, const IMAGE_RESOURCE_DIRECTORY_ENTRY &entry) {
+	if (start+entry.OffsetToData+sizeof(IMAGE_RESOURCE_DATA_ENTRY) > size) { throw resLoadFailure; }
+	IMAGE_RESOURCE_DATA_ENTRY de = *(IMAGE_RESOURCE_DATA_ENTRY*)(data+start+entry.OffsetToData);
+	if (start+de.OffsetToData-startVA+de.Size > size) { throw resLoadFailure; }
+	RsrcData d = { entry.Id, true, NULL, 0, (DWORD)(de.OffsetToData-startVA), entry.OffsetToData, de.Size };
+	this->src.used.push_back(d.entry);
+	if (de.OffsetToData < startVA || d.offset+d.length > this->src.size) {
+		// the data is outside of the section so it won't move with it, keep a copy instead
+		d.inSource = false;
+		d.data = memcpy(this->arena.alloc(d.capacity = d.length), data+(DWORD)(start+d.offset), d.length);
+	} else {
+		this->src.used.push_back(d.offset);
+		if (d.length) { ++this->src.count; } // empty resources are removed right away
 	}
-	this->types.clear();
-}
-LPCWSTR Rsrc::getId() const { return NULL; }
-bool Rsrc::cleanup() {
-	for (TypeMap::iterator i = this->types.begin(); i != this->types.end(); ++i) {
-		if (i->second->cleanup()) {
-			free_id(i->first);
-			delete i->second;
-			i = this->types.erase(i);
+	return d;
+}
+struct RsrcDirCmp  { bool operator()(const RsrcDir  &a, const RsrcDir  &b) const { return ResCmp()(a.id, b.id); } };
+struct RsrcDataCmp { bool operator()(const RsrcData &a, const RsrcData &b) const { return a.lang < b.lang; } };
+void Rsrc::sort() {
+	// The entries in a file are supposed to be sorted already, but if not then children have to move along with their parents
+	bool sorted = true;
+	for (size_t t = 1; sorted && t < this->types.size(); ++t)
+		sorted = ResCmp()(this->types[t-1].id, this->types[t].id);
+	for (size_t t = 0; sorted && t < this->types.size(); ++t)
+		for (size_t n = this->types[t].first + 1; sorted && n < this->types[t].first + this->types[t].count; ++n)
+			sorted = ResCmp()(this->names[n-1].id, this->names[n].id);
+	for (size_t n = 0; sorted && n < this->names.size(); ++n)
+		for (size_t l = this->names[n].first + 1; sorted && l < this->names[n].first + this->names[n].count; ++l)
+			sorted = this->langs[l-1].lang < this->langs[l].lang;
+	if (sorted) { return; }
+
+	std::vector<RsrcDir> types(this->types), names;
+	std::vector<RsrcData> langs;
+	names.reserve(this->names.size());
+	langs.reserve(this->langs.size());
+	std::stable_sort(types.begin(), types.end(), RsrcDirCmp());
+	for (size_t t = 0; t < types.size(); ++t) {
+		size_t first = names.size();
+		names.insert(names.end(), this->names.begin() + types[t].first, this->names.begin() + types[t].first + types[t].count);
+		std::stable_sort(names.begin() + first, names.end(), RsrcDirCmp());
+		types[t].first = first;
+		for (size_t n = first; n < names.size(); ++n) {
+			size_t firstLang = langs.size();
+			langs.insert(langs.end(), this->langs.begin() + names[n].first, this->langs.begin() + names[n].first + names[n].count);
+			std::stable_sort(langs.begin() + firstLang, langs.end(), RsrcDataCmp());
+			names[n].first = firstLang;
 		}
 	}
-	return this->isEmpty();
+	this->types.swap(types);
+	this->names.swap(names);
+	this->langs.swap(langs);
 }
-bool Rsrc::exists(LPCWSTR type, LPCWSTR name, WORD lang) const {
-	TypeMap::const_iterator iter = this->types.find((const LPWSTR)type);
-	return iter == this->types.end() ? false : iter->second->exists(name, lang);
+void Rsrc::rebase(const LPBYTE data, IMAGE_SECTION_HEADER *section) {
+	// Anything past the virtual size is not loaded so it cannot be used, but some linkers leave the virtual size as 0
+	DWORD vs = section->Misc.VirtualSize, raw = section->SizeOfRawData;
+	this->src.base = data + section->PointerToRawData;
+	this->src.size = (vs && vs < raw) ? vs : raw;
 }
-bool Rsrc::exists(LPCWSTR type, LPCWSTR name, WORD *lang) const {
-	TypeMap::const_iterator iter = this->types.find((const LPWSTR)type);
-	return iter == this->types.end() ? false : iter->second->exists(name, lang);
+#pragma endregion
+
+#pragma region Rsrc Direct Lookup
+///////////////////////////////////////////////////////////////////////////////
+///// Rsrc Direct Lookup
+///////////////////////////////////////////////////////////////////////////////
+static bool IdMatches(const LPBYTE data, size_t size, size_t start, const IMAGE_RESOURCE_DIRECTORY_ENTRY &entry, LPCWSTR id) {
+	if (IS_INTRESOURCE(id)) { return !entry.NameIsString && entry.Id == (WORD)(size_t)id; }
+	if (!entry.NameIsString) { return false; }
+	size_t offset = start + entry.NameOffset;
+	if (offset + sizeof(WORD) > size) { throw resLoadFailure; }
+	WORD len = *(WORD*)(data+offset);
+	offset += sizeof(WORD);
+	if (offset + sizeof(WCHAR)*len > size) { throw resLoadFailure; }
+	return len == wcslen(id) && memcmp(data+offset, id, sizeof(WCHAR)*len) == 0; // the names are not null-terminated
+}
+static DWORD FindDir(const LPBYTE data, size_t size, size_t start, DWORD offset, LPCWSTR id) {
+	DWORD n;
+	IMAGE_RESOURCE_DIRECTORY_ENTRY *entries = GetEntries(data, size, start+offset, &n);
+	for (DWORD i = 0; i < n; ++i) {
+		if (IdMatches(data, size, start, entries[i], id)) {
+			if (!entries[i].DataIsDirectory) { throw resLoadFailure; }
+			return entries[i].OffsetToDirectory;
+		}
+	}
+	return 0; // the root is never a child so this is never a valid directory
 }
+static const LPVOID GetDataView(const LPBYTE data, size_t size, DWORD start, DWORD startVA, const IMAGE_RESOURCE_DIRECTORY_ENTRY &entry, size_t *len) {
+	// Same checks as Rsrc::readData
+	if (start+entry.OffsetToData+sizeof(IMAGE_RESOURCE_DATA_ENTRY) > size) { throw resLoadFailure; }
+	IMAGE_RESOURCE_DATA_ENTRY de = *(IMAGE_RESOURCE_DATA_ENTRY*)(data+start+entry.OffsetToData);
+	if (start+de.OffsetToData-startVA+de.Size > size) { throw resLoadFailure; }
+	*len = de.Size;
+	return data+(DWORD)(start+de.OffsetToData-startVA);
+}
+static const LPVOID GetViewFromRSRCSection(const LPBYTE data, size_t size, const IMAGE_SECTION_HEADER *section, LPCWSTR type, LPCWSTR name, WORD *lang, bool anyLang, size_t *len) {
+	if (!data || !size || !section) { return NULL; }
+	try {
+		DWORD start = section->PointerToRawData, startVA = section->VirtualAddress, offset, nLangs;
+		if ((offset = FindDir(data, size, start, 0, type)) == 0 || (offset = FindDir(data, size, start, offset, name)) == 0) { return NULL; }
+		IMAGE_RESOURCE_DIRECTORY_ENTRY *langs = GetEntries(data, size, start+offset, &nLangs);
+		LPVOID view = NULL;
+		for (DWORD l = 0; l < nLangs; ++l) {
+			if (anyLang ? (view && langs[l].Id >= *lang) : langs[l].Id != *lang) { continue; }
+			size_t n;
+			LPVOID v = GetDataView(data, size, start, startVA, langs[l], &n);
+			if (n == 0) { continue; } // empty resources are treated as removed
+			view = v;
+			*len = n;
+			*lang = langs[l].Id;
+			if (!anyLang) { break; }
+		}
+		return view;
+	} catch (ResLoadFailure&) { return NULL; }
+}
+const LPVOID Rsrc::getViewFromRSRCSection(const LPBYTE data, size_t size, const IMAGE_SECTION_HEADER *section, LPCWSTR type, LPCWSTR name, WORD lang, size_t *len) { return GetViewFromRSRCSection(data, size, section, type, name, &lang, false, len); }
+const LPVOID Rsrc::getViewFromRSRCSection(const LPBYTE data, size_t size, const IMAGE_SECTION_HEADER *section, LPCWSTR type, LPCWSTR name, WORD *lang, size_t *len) { return GetViewFromRSRCSection(data, size, section, type, name, lang, true, len); }
+#pragma endregion
+
+#pragma region Rsrc Accessing and Modifying
+///////////////////////////////////////////////////////////////////////////////
+///// Rsrc Accessing and Modifying
+///////////////////////////////////////////////////////////////////////////////
+// Each of these gives the position where the entry is or would be inserted
+bool Rsrc::findType(LPCWSTR type, size_t *t) const {
+	RsrcDir key = { type, 0, 0 };
+	std::vector<RsrcDir>::const_iterator i = std::lower_bound(this->types.begin(), this->types.end(), key, RsrcDirCmp());
+	*t = i - this->types.begin();
+	return i != this->types.end() && !ResCmp()(type, i->id);
+}
+bool Rsrc::findName(size_t t, LPCWSTR name, size_t *n) const {
+	std::vector<RsrcDir>::const_iterator start = this->names.begin() + this->types[t].first, end = start + this->types[t].count;
+	RsrcDir key = { name, 0, 0 };
+	std::vector<RsrcDir>::const_iterator i = std::lower_bound(start, end, key, RsrcDirCmp());
+	*n = i - this->names.begin();
+	return i != end && !ResCmp()(name, i->id);
+}
+bool Rsrc::findLang(size_t n, WORD lang, size_t *l) const {
+	size_t i = this->names[n].first, end = i + this->names[n].count;
+	while (i < end && this->langs[i].lang < lang) { ++i; } // there are very few languages
+	*l = i;
+	return i != end && this->langs[i].lang == lang;
+}
+const RsrcData *Rsrc::find(LPCWSTR type, LPCWSTR name, WORD lang) const {
+	size_t t, n, l;
+	return (this->findType(type, &t) && this->findName(t, name, &n) && this->findLang(n, lang, &l)) ? &this->langs[l] : NULL;
+}
+const RsrcData *Rsrc::find(LPCWSTR type, LPCWSTR name, WORD *lang) const {
+	size_t t, n;
+	if (!this->findType(type, &t) || !this->findName(t, name, &n) || this->names[n].count == 0) { return NULL; }
+	const RsrcData *d = &this->langs[this->names[n].first];
+	*lang = d->lang;
+	return d;
+}
+const LPVOID Rsrc::view(const RsrcData &d) const { return d.data ? d.data : this->src.base+d.offset; }
+void Rsrc::set(RsrcData &d, const LPVOID data, size_t size) {
+	// the new data may be the source data itself so it is copied before anything else
+	if (!d.data || d.capacity < size) { d.data = this->arena.alloc(d.capacity = size); }
+	memmove(d.data, data, size);
+	d.length = size;
+}
+
+bool Rsrc::exists(LPCWSTR type, LPCWSTR name, WORD lang) const { return this->find(type, name, lang) != NULL; }
+bool Rsrc::exists(LPCWSTR type, LPCWSTR name, WORD *lang) const { return this->find(type, name, lang) != NULL; }
 LPVOID Rsrc::get(LPCWSTR type, LPCWSTR name, WORD lang, size_t *size) const {
-	TypeMap::const_iterator iter = this->types.find((const LPWSTR)type);
-	return iter == this->types.end() ? NULL : iter->second->get(name, lang, size);
+	const RsrcData *d = this->find(type, name, lang);
+	return d ? memcpy(malloc(*size = d->length), this->view(*d), d->length) : NULL;
 }
 LPVOID Rsrc::get(LPCWSTR type, LPCWSTR name, WORD *lang, size_t *size) const {
-	TypeMap::const_iterator iter = this->types.find((const LPWSTR)type);
-	return iter == this->types.end() ? NULL : iter->second->get(name, lang, size);
+	const RsrcData *d = this->find(type, name, lang);
+	return d ? memcpy(malloc(*size = d->length), this->view(*d), d->length) : NULL;
+}
+const LPVOID Rsrc::getView(LPCWSTR type, LPCWSTR name, WORD lang, size_t *size) const {
+	const RsrcData *d = this->find(type, name, lang);
+	return d ? (*size = d->length, this->view(*d)) : NULL;
+}
+const LPVOID Rsrc::getView(LPCWSTR type, LPCWSTR name, WORD *lang, size_t *size) const {
+	const RsrcData *d = this->find(type, name, lang);
+	return d ? (*size = d->length, this->view(*d)) : NULL;
 }
 bool Rsrc::remove(LPCWSTR type, LPCWSTR name, WORD lang) {
-	TypeMap::iterator iter = this->types.find((const LPWSTR)type);
-	if (iter == this->types.end())
-		return false;
-	bool b = iter->second->remove(name, lang);
-	if (iter->second->isEmpty()) {
-		free_id(iter->first);
-		delete iter->second;
-		this->types.erase(iter);
+	size_t t, n, l;
+	if (!this->findType(type, &t) || !this->findName(t, name, &n) || !this->findLang(n, lang, &l)) { return false; }
+
+	// Remove the language and any directories left empty, everything after them moves down
+	this->langs.erase(this->langs.begin() + l);
+	for (size_t i = n + 1; i < this->names.size(); ++i) { --this->names[i].first; }
+	if (--this->names[n].count == 0) {
+		this->names.erase(this->names.begin() + n);
+		for (size_t i = t + 1; i < this->types.size(); ++i) { --this->types[i].first; }
+		if (--this->types[t].count == 0)
+			this->types.erase(this->types.begin() + t);
 	}
-	return b;
+	return true;
 }
 bool Rsrc::add(LPCWSTR type, LPCWSTR name, WORD lang, const LPVOID data, size_t size, DWORD overwrite) {
-	TypeMap::iterator iter = this->types.find((const LPWSTR)type);
-	if (iter == types.end() && (overwrite == OVERWRITE_ALWAYS || overwrite == OVERWRITE_NEVER)) {
-		//types.set(dup(type), new ResourceType(type, name, lang, data, size));
-		types[dup(type)] = new ResourceType(type, name, lang, data, size);
+	size_t t, n, l;
+	bool has_type = this->findType(type, &t), has_name = has_type && this->findName(t, name, &n), has_lang = has_name && this->findLang(n, lang, &l);
+	if (has_lang) {
+		if (overwrite != OVERWRITE_ALWAYS && overwrite != OVERWRITE_ONLY) { return false; }
+		this->set(this->langs[l], data, size);
 		return true;
 	}
-	return iter->second->add(name, lang, data, size, overwrite);
-}
-bool Rsrc::isEmpty() const { return this->types.size() == 0; }
-ResourceType* Rsrc::operator[](LPCWSTR type) {
-	TypeMap::iterator iter = this->types.find((const LPWSTR)type);
-	return iter == this->types.end() ? NULL : iter->second;
-}
-const ResourceType* Rsrc::operator[](LPCWSTR type) const {
-	TypeMap::const_iterator iter = this->types.find((const LPWSTR)type);
-	return iter == this->types.end() ? NULL : iter->second;
+	if (overwrite != OVERWRITE_ALWAYS && overwrite != OVERWRITE_NEVER) { return false; }
+
+	// Insert whatever directories are missing, everything after them moves up
+	if (!has_type) {
+		RsrcDir d = { this->arena.dup(type), (t < this->types.size()) ? this->types[t].first : this->names.size(), 0 };
+		this->types.insert(this->types.begin() + t, d);
+	}
+	if (!has_name) {
+		if (!has_type) { n = this->types[t].first; }
+		RsrcDir d = { this->arena.dup(name), (n < this->names.size()) ? this->names[n].first : this->langs.size(), 0 };
+		this->names.insert(this->names.begin() + n, d);
+		++this->types[t].count;
+		for (size_t i = t + 1; i < this->types.size(); ++i) { ++this->types[i].first; }
+		l = d.first;
+	}
+	RsrcData d = { lang, false, NULL, 0, 0, 0, 0 };
+	this->set(d, data, size);
+	this->langs.insert(this->langs.begin() + l, d);
+	++this->names[n].count;
+	for (size_t i = n + 1; i < this->names.size(); ++i) { ++this->names[i].first; }
+	return true;
 }
+bool Rsrc::isEmpty() const { return this->types.empty(); }
 std::vector<LPCWSTR> Rsrc::getTypes() const {
 	std::vector<LPCWSTR> v;
 	v.reserve(this->types.size());
-	for (TypeMap::const_iterator i = this->types.begin(); i != this->types.end(); ++i)
-		v.push_back(i->first);
+	for (size_t t = 0; t < this->types.size(); ++t)
+		v.push_back(this->types[t].id);
 	return v;
 }
 std::vector<LPCWSTR> Rsrc::getNames(LPCWSTR type) const {
-	TypeMap::const_iterator iter = this->types.find((const LPWSTR)type);
-	return iter == types.end() ? std::vector<LPCWSTR>() : iter->second->getNames();
+	std::vector<LPCWSTR> v;
+	size_t t;
+	if (this->findType(type, &t)) {
+		v.reserve(this->types[t].count);
+		for (size_t n = this->types[t].first; n < this->types[t].first + this->types[t].count; ++n)
+			v.push_back(this->names[n].id);
+	}
+	return v;
 }
 std::vector<WORD> Rsrc::getLangs(LPCWSTR type, LPCWSTR name) const {
-	TypeMap::const_iterator iter = this->types.find((const LPWSTR)type);
-	return iter == this->types.end() ? std::vector<WORD>() : iter->second->getLangs(name);
-}
-size_t Rsrc::getDataSize() const {
-	size_t size = 0;
-	for (TypeMap::const_iterator i = this->types.begin(); i != this->types.end(); ++i) {
-		if (!IS_INTRESOURCE(i->first))
-			size += roundUpTo<4>(sizeof(WORD)+wcslen(i->first)*sizeof(WCHAR));
-		size += i->second->getDataSize();
+	std::vector<WORD> v;
+	size_t t, n;
+	if (this->findType(type, &t) && this->findName(t, name, &n)) {
+		v.reserve(this->names[n].count);
+		for (size_t l = this->names[n].first; l < this->names[n].first + this->names[n].count; ++l)
+			v.push_back(this->langs[l].lang);
 	}
-	return size;
+	return v;
 }
-size_t Rsrc::getHeaderSize() const {
-	size_t size = this->getThisHeaderSize();
-	for (TypeMap::const_iterator i = this->types.begin(); i != this->types.end(); ++i)
-		size += i->second->getHeaderSize();
-	return size;
+bool Rsrc::cleanup() {
+	// Remove all empty resources and directories in a single pass, moving everything that is kept down
+	size_t T = 0, N = 0, L = 0;
+	for (size_t t = 0; t < this->types.size(); ++t) {
+		RsrcDir type = this->types[t];
+		type.first = N;
+		for (size_t n = this->types[t].first; n < this->types[t].first + this->types[t].count; ++n) {
+			RsrcDir name = this->names[n];
+			name.first = L;
+			for (size_t l = this->names[n].first; l < this->names[n].first + this->names[n].count; ++l)
+				if (this->langs[l].length)
+					this->langs[L++] = this->langs[l];
+			if ((name.count = L - name.first) != 0)
+				this->names[N++] = name;
+		}
+		if ((type.count = N - type.first) != 0)
+			this->types[T++] = type;
+	}
+	this->types.resize(T);
+	this->names.resize(N);
+	this->langs.resize(L);
+	return this->isEmpty();
 }
-size_t Rsrc::getThisHeaderSize() const { return sizeof(IMAGE_RESOURCE_DIRECTORY)+this->types.size()*sizeof(IMAGE_RESOURCE_DIRECTORY_ENTRY); }
+#pragma endregion
+
+#pragma region Rsrc Compiling
+///////////////////////////////////////////////////////////////////////////////
+///// Rsrc Compiling
+///////////////////////////////////////////////////////////////////////////////
+inline static size_t GetNameSize(LPCWSTR id) { return IS_INTRESOURCE(id) ? 0 : roundUpTo<4>(sizeof(WORD)+wcslen(id)*sizeof(WCHAR)); }
+inline static size_t GetDirSize(size_t count) { return sizeof(IMAGE_RESOURCE_DIRECTORY)+count*sizeof(IMAGE_RESOURCE_DIRECTORY_ENTRY); }
 LPVOID Rsrc::compile(size_t *size, DWORD startVA) {
 	this->cleanup();
 
-	size_t dataSize = this->getDataSize();
-	size_t headerSize = roundUpTo<4>(this->getHeaderSize()); // DWORD alignment
-	
-	*size = headerSize + dataSize;
+	// The directories come first, then the names, then the data
+	size_t T = this->types.size(), N = this->names.size(), L = this->langs.size(), namesSize = 0, dataSize = 0;
+	size_t headerSize = roundUpTo<4>(sizeof(IMAGE_RESOURCE_DIRECTORY)*(1+T+N) + sizeof(IMAGE_RESOURCE_DIRECTORY_ENTRY)*(T+N+L) + sizeof(IMAGE_RESOURCE_DATA_ENTRY)*L); // DWORD alignment
+	for (size_t t = 0; t < T; ++t) { namesSize += GetNameSize(this->types[t].id); }
+	for (size_t n = 0; n < N; ++n) { namesSize += GetNameSize(this->names[n].id); }
+	for (size_t l = 0; l < L; ++l) { dataSize  += roundUpTo<4>(this->langs[l].length); }
+
+	*size = headerSize + namesSize + dataSize;
 
 	LPBYTE data = (LPBYTE)memset(malloc(*size), 0, *size);
-	
+
 	size_t pos = 0;
-	size_t posDir = this->getThisHeaderSize();
+	size_t posDir = GetDirSize(T);
 	size_t posData = headerSize;
 
-	WriteResDir(data, pos, this->types.begin(), this->types.end());
+	// Type directory
+	WriteResDir(data, pos, T ? &this->types[0] : NULL, T); // an empty tree is just the type directory
+	for (size_t t = 0; t < T; ++t)
+		WriteResDirEntry(data, this->types[t].id, GetDirSize(this->types[t].count), pos, posDir, posData);
+
+	// Name directories
+	for (size_t t = 0; t < T; ++t) {
+		WriteResDir(data, pos, &this->names[this->types[t].first], this->types[t].count);
+		for (size_t n = this->types[t].first; n < this->types[t].first + this->types[t].count; ++n)
+			WriteResDirEntry(data, this->names[n].id, GetDirSize(this->names[n].count), pos, posDir, posData);
+	}
 
-	for (TypeMap::const_iterator i = this->types.begin(); i != this->types.end(); ++i)
-		WriteResDirEntry(data, i->first, i->second->getThisHeaderSize(), pos, posDir, posData);
+	// Language directories
+	for (size_t n = 0; n < N; ++n) {
+		WriteResDir(data, pos, 0, (WORD)this->names[n].count);
+		for (size_t l = this->names[n].first; l < this->names[n].first + this->names[n].count; ++l) {
+			IMAGE_RESOURCE_DIRECTORY_ENTRY entry;
+			entry.DataIsDirectory = FALSE;
+			entry.OffsetToDirectory = posDir;
+			entry.NameIsString = FALSE;
+			entry.Name = this->langs[l].lang;
+			memcpy(data+pos, &entry, sizeof(IMAGE_RESOURCE_DIRECTORY_ENTRY));
+			posDir += sizeof(IMAGE_RESOURCE_DATA_ENTRY);
+			pos += sizeof(IMAGE_RESOURCE_DIRECTORY_ENTRY);
+		}
+	}
 
-	for (TypeMap::const_iterator i = this->types.begin(); i != this->types.end(); ++i)
-		i->second->writeNameDirs(data, pos, posDir, posData);
-	for (TypeMap::const_iterator i = this->types.begin(); i != this->types.end(); ++i)
-		i->second->writeLangDirs(data, pos, posDir);
-	for (TypeMap::const_iterator i = this->types.begin(); i != this->types.end(); ++i)
-		i->second->writeData(data, pos, posData, startVA);
+	// Data entries and the data
+	for (size_t l = 0; l < L; ++l) {
+		const RsrcData &d = this->langs[l];
+		IMAGE_RESOURCE_DATA_ENTRY de = {(DWORD)(posData+startVA), (DWORD)d.length, 0, 0}; // needs to be an RVA
+		memcpy(data+pos, &de, sizeof(IMAGE_RESOURCE_DATA_ENTRY));
+		pos += sizeof(IMAGE_RESOURCE_DATA_ENTRY);
+		memcpy(data+posData, this->view(d), d.length);
+		posData += roundUpTo<4>(d.length);
+	}
 
 	return data;
 }
-size_t Rsrc::getRESSize() const {
-	size_t size = RESHeaderSize;
-	for (TypeMap::const_iterator i = this->types.begin(); i != this->types.end(); ++i)
-		size += i->second->getRESSize();
-	return size;
+bool Rsrc::fitsInPlace(const RsrcData &d) const {
+	if (!d.inSource)	{ return false; }
+	if (!d.data)		{ return true; }
+	// The data can grow until whatever is next in the section, but not if something else shares its place
+	std::vector<size_t>::const_iterator first = std::lower_bound(this->src.used.begin(), this->src.used.end(), d.offset);
+	std::vector<size_t>::const_iterator next  = std::upper_bound(first, this->src.used.end(), d.offset);
+	size_t end = (next == this->src.used.end() || *next > this->src.size) ? this->src.size : *next;
+	return next - first == 1 && d.offset + d.length <= end;
 }
-LPVOID Rsrc::compileRES(size_t *size) {
+bool Rsrc::compileInPlace() {
 	this->cleanup();
 
-	*size = this->getRESSize();
-	LPBYTE data = (LPBYTE)memset(malloc(*size), 0, *size);
-	size_t pos = WriteRESHeader(data, 0, 0, 0, 0);
-
-	for (TypeMap::const_iterator i = this->types.begin(); i != this->types.end(); ++i)
-		i->second->writeRESData(data, pos);
+	// Every resource must still be from the section and be where it was, even if it changed
+	if (!this->src.base || this->langs.size() != this->src.count)	{ return false; }
+	for (size_t l = 0; l < this->langs.size(); ++l)
+		if (!this->fitsInPlace(this->langs[l]))						{ return false; }
+
+	for (size_t l = 0; l < this->langs.size(); ++l) {
+		RsrcData &d = this->langs[l];
+		if (!d.data) { continue; }
+		LPBYTE x = this->src.base + d.offset;
+		IMAGE_RESOURCE_DATA_ENTRY *de = (IMAGE_RESOURCE_DATA_ENTRY*)(this->src.base + d.entry);
+		memcpy(x, d.data, d.length);
+		if (de->Size > d.length)
+			memset(x+d.length, 0, de->Size-d.length);
+		de->Size = (DWORD)d.length;
+		d.data = NULL; // read from the source again, the arena keeps the memory until the resources are destroyed
+		d.capacity = 0;
+	}
 
-	return data;
+	return true;
 }
-#pragma endregion
+LPVOID Rsrc::compileRES(size_t *size) {
+	this->cleanup();
 
-#pragma region ResourceType
-///////////////////////////////////////////////////////////////////////////////
-///// ResourceType
-///////////////////////////////////////////////////////////////////////////////
-ResourceType::ResourceType(LPCWSTR type, const LPBYTE data, size_t size, DWORD start, DWORD startVA, IMAGE_RESOURCE_DIRECTORY_ENTRY entry) : type(dup(type)) {
-	DWORD nEntries;
-	IMAGE_RESOURCE_DIRECTORY_ENTRY *entries = GetEntries(data, size, start+entry.OffsetToDirectory, &nEntries);
-	for (WORD i = 0; i < nEntries; i++) {
-		LPWSTR name = GetResourceName(data, size, start, entries[i]);
-		//this->names.set(name, new ResourceName(name, data, size, start, startVA, entries[i]));
-		this->names[name] = new ResourceName(name, data, size, start, startVA, entries[i]);
-	}
-}
-ResourceType::ResourceType(LPCWSTR type, LPCWSTR name, WORD lang, const LPVOID data, size_t size) : type(dup(type)) {
-	//this->names.set(dup(name), new ResourceName(name, lang, data, size));
-	this->names[dup(name)] = new ResourceName(name, lang, data, size);
-}
-ResourceType::~ResourceType() {
-	for (NameMap::const_iterator i = this->names.begin(); i != this->names.end(); ++i) {
-		free_id(i->first);
-		delete i->second;
-	}
-	this->names.clear();
-	free_id(type);
-}
-LPCWSTR ResourceType::getId() const { return this->type; }
-bool ResourceType::cleanup() {
-	for (NameMap::iterator i = this->names.begin(); i != this->names.end(); ++i) {
-		if (i->second->cleanup()) {
-			free_id(i->first);
-			delete i->second;
-			i = this->names.erase(i);
+	*size = RESHeaderSize;
+	for (size_t t = 0; t < this->types.size(); ++t) {
+		size_t xlen = GetRESHeaderIDExtraLen(this->types[t].id);
+		for (size_t n = this->types[t].first; n < this->types[t].first + this->types[t].count; ++n) {
+			size_t xxlen = xlen + GetRESHeaderIDExtraLen(this->names[n].id);
+			for (size_t l = this->names[n].first; l < this->names[n].first + this->names[n].count; ++l)
+				*size += roundUpTo<4>(this->langs[l].length + RESHeaderSize + xxlen);
 		}
 	}
-	return this->isEmpty();
-}
-bool ResourceType::exists(LPCWSTR name, WORD lang) const {
-	NameMap::const_iterator iter = this->names.find((const LPWSTR)name);
-	return iter == this->names.end() ? false : iter->second->exists(lang);
-}
-bool ResourceType::exists(LPCWSTR name, WORD *lang) const {
-	NameMap::const_iterator iter = this->names.find((const LPWSTR)name);
-	return iter == this->names.end() ? false : iter->second->exists(lang);
-}
-LPVOID ResourceType::get(LPCWSTR name, WORD lang, size_t *size) const {
-	NameMap::const_iterator iter = this->names.find((const LPWSTR)name);
-	return iter == this->names.end() ? NULL : iter->second->get(lang, size);
-}
-LPVOID ResourceType::get(LPCWSTR name, WORD *lang, size_t *size) const {
-	NameMap::const_iterator iter = this->names.find((const LPWSTR)name);
-	return iter == this->names.end() ? NULL : iter->second->get(lang, size);
-}
-bool ResourceType::remove(LPCWSTR name, WORD lang) {
-	NameMap::iterator iter = this->names.find((const LPWSTR)name);
-	if (iter == this->names.end())
-		return false;
-	bool b = iter->second->remove(lang);
-	if (iter->second->isEmpty()) {
-		free_id(iter->first);
-		delete iter->second;
-		this->names.erase(iter);
-	}
-	return b;
-}
-bool ResourceType::add(LPCWSTR name, WORD lang, const LPVOID data, size_t size, DWORD overwrite) {
-	NameMap::iterator iter = this->names.find((const LPWSTR)name);
-	if (iter == this->names.end() && (overwrite == OVERWRITE_ALWAYS || overwrite == OVERWRITE_NEVER)) {
-		//this->names.set(dup(name), new ResourceName(name, lang, data, size));
-		this->names[dup(name)] = new ResourceName(name, lang, data, size);
-		return true;
-	}
-	return iter->second->add(lang, data, size, overwrite);
-}
-bool ResourceType::isEmpty() const { return this->names.empty(); }
-ResourceName* ResourceType::operator[](LPCWSTR name) {
-	NameMap::iterator iter = this->names.find((const LPWSTR)name);
-	return iter == this->names.end() ? NULL : iter->second;
-}
-const ResourceName* ResourceType::operator[](LPCWSTR name) const {
-	NameMap::const_iterator iter = this->names.find((const LPWSTR)name);
-	return iter == this->names.end() ? NULL : iter->second;
-}
-std::vector<LPCWSTR> ResourceType::getNames() const {
-	std::vector<LPCWSTR> v;
-	v.reserve(this->names.size());
-	for (NameMap::const_iterator i = this->names.begin(); i != this->names.end(); ++i)
-		v.push_back(i->first);
-	return v;
-}
-std::vector<WORD> ResourceType::getLangs(LPCWSTR name) const {
-	NameMap::const_iterator iter = this->names.find((const LPWSTR)name);
-	return iter == this->names.end() ? std::vector<WORD>() : iter->second->getLangs();
-}
-size_t ResourceType::getDataSize() const {
-	size_t size = 0;
-	for (NameMap::const_iterator i = this->names.begin(); i != this->names.end(); ++i) {
-		if (!IS_INTRESOURCE(i->first))
-			size += roundUpTo<4>(sizeof(WORD)+wcslen(i->first)*sizeof(WCHAR));
-		size += i->second->getDataSize();
-	}
-	return size;
-}
-size_t ResourceType::getHeaderSize() const {
-	size_t size = this->getThisHeaderSize();
-	for (NameMap::const_iterator i = this->names.begin(); i != this->names.end(); ++i)
-		size += i->second->getHeaderSize();
-	return size;
-}
-size_t ResourceType::getThisHeaderSize() const { return sizeof(IMAGE_RESOURCE_DIRECTORY)+this->names.size()*sizeof(IMAGE_RESOURCE_DIRECTORY_ENTRY); }
-void ResourceType::writeNameDirs(LPBYTE data, size_t& pos, size_t& posDir, size_t& posData) const {
-	WriteResDir(data, pos, this->names.begin(), this->names.end());
-	for (NameMap::const_iterator i = this->names.begin(); i != this->names.end(); ++i)
-		WriteResDirEntry(data, i->first, i->second->getThisHeaderSize(), pos, posDir, posData);
-}
-void ResourceType::writeLangDirs(LPBYTE data, size_t& pos, size_t& posDir) const {
-	for (NameMap::const_iterator i = this->names.begin(); i != this->names.end(); ++i)
-		i->second->writeLangDirs(data, pos, posDir);
-}
-void ResourceType::writeData(LPBYTE data, size_t& posDataEntry, size_t& posData, DWORD startVA) const {
-	for (NameMap::const_iterator i = this->names.begin(); i != this->names.end(); ++i)
-		i->second->writeData(data, posDataEntry, posData, startVA);
-}
-size_t ResourceType::getRESSize() const {
-	size_t xlen = GetRESHeaderIDExtraLen(this->type), size = 0;
-	for (NameMap::const_iterator i = this->names.begin(); i != this->names.end(); ++i)
-		size += i->second->getRESSize(xlen);
-	return size;
-}
-void ResourceType::writeRESData(LPBYTE data, size_t& pos) const {
-	for (NameMap::const_iterator i = this->names.begin(); i != this->names.end(); ++i)
-		i->second->writeRESData(data, pos, this->type);
-}
-#pragma endregion
 
-#pragma region ResourceName
-///////////////////////////////////////////////////////////////////////////////
-///// ResourceName
-///////////////////////////////////////////////////////////////////////////////
-ResourceName::ResourceName(LPCWSTR name, const LPBYTE data, size_t size, DWORD start, DWORD startVA, IMAGE_RESOURCE_DIRECTORY_ENTRY entry) : name(dup(name)) {
-	DWORD nEntries;
-	IMAGE_RESOURCE_DIRECTORY_ENTRY *entries = GetEntries(data, size, start+entry.OffsetToDirectory, &nEntries);
-	for (WORD i = 0; i < nEntries; i++)
-		//this->langs.set(entries[i].Id, new ResourceLang(entries[i].Id, data, size, start, startVA, entries[i]));
-		this->langs[entries[i].Id] = new ResourceLang(entries[i].Id, data, size, start, startVA, entries[i]);
-}
-ResourceName::ResourceName(LPCWSTR name, WORD lang, const LPVOID data, size_t size) : name(dup(name)) {
-	//this->langs.set(lang, new ResourceLang(lang, data, size));
-	this->langs[lang] = new ResourceLang(lang, data, size);
-}
-ResourceName::~ResourceName() {
-	for (LangMap::const_iterator i = this->langs.begin(); i != this->langs.end(); ++i) {
-		delete i->second;
-	}
-	this->langs.clear();
-	free_id(this->name);
-}
-LPCWSTR ResourceName::getId() const { return this->name; }
-bool ResourceName::cleanup() {
-	for (LangMap::iterator i = this->langs.begin(); i != this->langs.end(); ++i) {
-		if (i->second->getDataSize() == 0) {
-			delete i->second;
-			i = this->langs.erase(i);
+	LPBYTE data = (LPBYTE)memset(malloc(*size), 0, *size);
+	size_t pos = WriteRESHeader(data, 0, 0, 0, 0);
+
+	for (size_t t = 0; t < this->types.size(); ++t) {
+		for (size_t n = this->types[t].first; n < this->types[t].first + this->types[t].count; ++n) {
+			for (size_t l = this->names[n].first; l < this->names[n].first + this->names[n].count; ++l) {
+				const RsrcData &d = this->langs[l];
+				pos += WriteRESHeader(data+pos, this->types[t].id, this->names[n].id, d.lang, d.length);
+				memcpy(data+pos, this->view(d), d.length);
+				pos = roundUpTo<4>(pos + d.length);
+			}
 		}
 	}
-	return this->isEmpty();
-}
-bool ResourceName::exists(WORD lang) const { return this->langs.find(lang) != this->langs.end(); }
-bool ResourceName::exists(WORD *lang) const {
-	if (this->langs.size() > 0) {
-		*lang = this->langs.begin()->first;
-		return true;
-	}
-	return false;
-}
-LPVOID ResourceName::get(WORD lang, size_t *size) const {
-	LangMap::const_iterator iter = this->langs.find(lang);
-	return iter == this->langs.end() ? NULL : iter->second->get(size);
-}
-LPVOID ResourceName::get(WORD *lang, size_t *size) const {
-	if (this->langs.size() > 0) {
-		LangMap::const_iterator iter = this->langs.begin();
-		*lang = iter->first;
-		return iter->second->get(size);
-	}
-	return NULL;
-}
-bool ResourceName::remove(WORD lang) {
-	LangMap::iterator iter = this->langs.find(lang);
-	if (iter == this->langs.end())
-		return false;
-	delete iter->second;
-	this->langs.erase(iter);
-	return true;
-}
-bool ResourceName::add(WORD lang, const LPVOID data, size_t size, DWORD overwrite) {
-	LangMap::iterator iter = this->langs.find(lang);
-	if (iter == this->langs.end() && (overwrite == OVERWRITE_ALWAYS || overwrite == OVERWRITE_NEVER)) {
-		//this->langs.set(lang, new ResourceLang(lang, data, size));
-		this->langs[lang] = new ResourceLang(lang, data, size);
-		return true;
-	} else if (overwrite == OVERWRITE_ALWAYS || overwrite == OVERWRITE_ONLY) {
-		return iter->second->set(data, size);
-	}
-	return false;
-}
-bool ResourceName::isEmpty() const { return this->langs.empty(); }
-ResourceLang* ResourceName::operator[](WORD lang) {
-	LangMap::iterator iter = this->langs.find(lang);
-	return iter == this->langs.end() ? NULL : iter->second;
-}
-const ResourceLang* ResourceName::operator[](WORD lang) const {
-	LangMap::const_iterator iter = this->langs.find(lang);
-	return iter == this->langs.end() ? NULL : iter->second;
-}
-std::vector<WORD> ResourceName::getLangs() const {
-	std::vector<WORD> v;
-	v.reserve(this->langs.size());
-	for (LangMap::const_iterator i = this->langs.begin(); i != this->langs.end(); ++i)
-		v.push_back(i->first);
-	return v;
-}
-size_t ResourceName::getDataSize() const {
-	size_t size = 0;
-	for (LangMap::const_iterator i = this->langs.begin(); i != this->langs.end(); ++i)
-		size += roundUpTo<4>(i->second->getDataSize());
-	return size;
-}
-size_t ResourceName::getHeaderSize() const {
-	size_t size = this->getThisHeaderSize();
-	for (LangMap::const_iterator i = this->langs.begin(); i != this->langs.end(); ++i)
-		size += i->second->getHeaderSize();
-	return size;
-}
-size_t ResourceName::getThisHeaderSize() const { return sizeof(IMAGE_RESOURCE_DIRECTORY)+this->langs.size()*sizeof(IMAGE_RESOURCE_DIRECTORY_ENTRY); }
-void ResourceName::writeLangDirs(LPBYTE data, size_t& pos, size_t& posDir) const {
-	WriteResDir(data, pos, 0, (WORD)this->langs.size());
-	for (LangMap::const_iterator i = this->langs.begin(); i != this->langs.end(); ++i) {
-		IMAGE_RESOURCE_DIRECTORY_ENTRY entry;
-		entry.DataIsDirectory = FALSE;
-		entry.OffsetToDirectory = posDir;
-		entry.NameIsString = FALSE;
-		entry.Name = i->first;
-
-		memcpy(data+pos, &entry, sizeof(IMAGE_RESOURCE_DIRECTORY_ENTRY));
-
-		posDir += i->second->getThisHeaderSize();
-		pos += sizeof(IMAGE_RESOURCE_DIRECTORY_ENTRY);
-	}
-}
-void ResourceName::writeData(LPBYTE data, size_t& posDataEntry, size_t& posData, DWORD startVA) const {
-	for (LangMap::const_iterator i = this->langs.begin(); i != this->langs.end(); ++i)
-		i->second->writeData(data, posDataEntry, posData, startVA);
-}
-size_t ResourceName::getRESSize(size_t addl_hdr_size) const {
-	size_t xlen = addl_hdr_size + GetRESHeaderIDExtraLen(this->name), size = 0;
-	for (LangMap::const_iterator i = this->langs.begin(); i != this->langs.end(); ++i)
-		size += i->second->getRESSize(xlen);
-	return size;
-}
-void ResourceName::writeRESData(LPBYTE data, size_t& pos, LPCWSTR type) const {
-	for (LangMap::const_iterator i = this->langs.begin(); i != this->langs.end(); ++i)
-		i->second->writeRESData(data, pos, type, this->name);
-}
-
-#pragma endregion
 
-#pragma region ResourceLang
-///////////////////////////////////////////////////////////////////////////////
-///// ResourceLang
-///////////////////////////////////////////////////////////////////////////////
-ResourceLang::ResourceLang(WORD lang, const LPBYTE data, size_t size, DWORD start, DWORD startVA, IMAGE_RESOURCE_DIRECTORY_ENTRY entry) : lang(lang) {
-	if (start+entry.OffsetToData+sizeof(IMAGE_RESOURCE_DATA_ENTRY) > size) { throw resLoadFailure; }
-	IMAGE_RESOURCE_DATA_ENTRY de = *(IMAGE_RESOURCE_DATA_ENTRY*)(data+start+entry.OffsetToData);
-	if (start+de.OffsetToData-startVA+de.Size > size) { throw resLoadFailure; }
-	this->data = malloc(this->length = de.Size);
-	if (this->length == 0) { return; }
-	memcpy(this->data, data+start+de.OffsetToData-startVA, this->length);
-}
-ResourceLang::ResourceLang(WORD lang, const LPVOID data, size_t size) : lang(lang), length(size) {
-	this->data = memcpy(malloc(size), data, length);
-}
-ResourceLang::~ResourceLang() { free(this->data); }
-LPCWSTR ResourceLang::getId() const { return MAKEINTRESOURCE(this->lang); }
-LPVOID ResourceLang::get(size_t *size) const { return memcpy(malloc(this->length), this->data, *size = this->length); }
-bool ResourceLang::set(const LPVOID data, size_t size) {
-	if (this->length != size)
-	{
-		free(this->data);
-		this->data = malloc(this->length = size);
-	}
-	memcpy(this->data, data, size);
-	return true;
-}
-size_t ResourceLang::getDataSize() const		{ return this->length; }
-size_t ResourceLang::getHeaderSize() const		{ return sizeof(IMAGE_RESOURCE_DATA_ENTRY); }
-size_t ResourceLang::getThisHeaderSize() const	{ return sizeof(IMAGE_RESOURCE_DATA_ENTRY); }
-void ResourceLang::writeData(LPBYTE data, size_t& posDataEntry, size_t& posData, size_t startVA) const {
-	IMAGE_RESOURCE_DATA_ENTRY de = {(DWORD)(posData+startVA), (DWORD)this->length, 0, 0}; // needs to be an RVA
-	memcpy(data+posDataEntry, &de, sizeof(IMAGE_RESOURCE_DATA_ENTRY));
-	posDataEntry += sizeof(IMAGE_RESOURCE_DATA_ENTRY);
-	memcpy(data+posData, this->data, this->length);
-	posData += roundUpTo<4>(this->length);
-}
-size_t ResourceLang::getRESSize(size_t addl_hdr_size) const { return roundUpTo<4>(this->length + RESHeaderSize + addl_hdr_size); }
-void ResourceLang::writeRESData(LPBYTE data, size_t& pos, LPCWSTR type, LPCWSTR name) const {
-	pos += WriteRESHeader(data+pos, type, name, this->lang, this->length);
-	memcpy(data+pos, this->data, this->length);
-	pos = roundUpTo<4>(pos + this->length);
+	return data;
 }
 #pragma endregion
@@ -34,157 +34,70 @@ class Rsrc;
 
 #else
 
-#include <map>
 #include <vector>
 
 // Functions / Macros used by both PEFile and PEFileResources
 template<unsigned int MULT> inline static size_t roundUpTo(size_t x) { size_t mod = x % MULT; return (mod == 0) ? x : (x + MULT - mod); }
-template<> inline static size_t roundUpTo<2>(size_t x) { return (x + 1) & ~0x1; }
-template<> inline static size_t roundUpTo<4>(size_t x) { return (x + 3) & ~0x3; }
+template<> inline size_t roundUpTo<2>(size_t x) { return (x + 1) & ~0x1; }
+template<> inline size_t roundUpTo<4>(size_t x) { return (x + 3) & ~0x3; }
 inline static size_t roundUpTo(size_t x, size_t mult) { size_t mod = x % mult; return (mod == 0) ? x : (x + mult - mod); }
 
 // A comparator for resource names
 struct ResCmp { bool operator()(LPCWSTR a, LPCWSTR b) const; };
 
-// A resource (directory) entry
-class Resource {
-public:
-	virtual LPCWSTR getId() const = 0;
-private:
-	virtual size_t getDataSize() const = 0;
-	virtual size_t getHeaderSize() const = 0;
-	virtual size_t getThisHeaderSize() const = 0;
-};
-
-// Forward Declarations
-class ResourceLang;
-class ResourceName;
-class ResourceType;
-class Rsrc;
-
-// The final resource directory, contains the data for the resource
-class ResourceLang : Resource {
-	friend ResourceName;
+// A bump allocator for the names and changed data of resources, everything is freed at once when it is destroyed
+class RsrcArena {
+	std::vector<LPBYTE> blocks;
+	LPBYTE pos;
+	size_t left;
 
-	WORD lang;
-	LPVOID data;
-	size_t length;
-
-	ResourceLang(WORD lang, const LPBYTE data, size_t size, DWORD start, DWORD startVA, IMAGE_RESOURCE_DIRECTORY_ENTRY entry);
-	ResourceLang(WORD lang, const LPVOID data, size_t size);
+	RsrcArena(const RsrcArena&);
+	RsrcArena& operator=(const RsrcArena&);
 public:
-	~ResourceLang();
-
-	LPCWSTR getId() const;
-
-	bool isLoaded() const;
-	LPVOID get(size_t* size) const; // must be freed
-	bool set(const LPVOID data, size_t size);
-
-private:
-	virtual size_t getDataSize() const;
-	virtual size_t getHeaderSize() const;
-	virtual size_t getThisHeaderSize() const;
-	void writeData(LPBYTE data, size_t& posDataEntry, size_t& posData, size_t startVA) const;
-
-	virtual size_t getRESSize(size_t addl_hdr_size) const;
-	void writeRESData(LPBYTE data, size_t& pos, LPCWSTR type, LPCWSTR name) const;
+	RsrcArena();
+	~RsrcArena();
+	LPVOID alloc(size_t size);
+	LPCWSTR dup(LPCWSTR id); // integer ids are not copied
 };
 
-typedef std::map<WORD, ResourceLang*> LangMap;
-
-// The named resource directory, the second level
-class ResourceName : Resource {
-	friend ResourceType;
-
-	LPWSTR name;
-	LangMap langs;
-
-	ResourceName(LPCWSTR name, const LPBYTE data, size_t size, DWORD start, DWORD startVA, IMAGE_RESOURCE_DIRECTORY_ENTRY entry);
-	ResourceName(LPCWSTR name, WORD lang, const LPVOID data, size_t size);
-public:
-	~ResourceName();
-
-	LPCWSTR getId() const;
-
-	bool exists(WORD lang) const;
-	bool exists(WORD* lang) const;
-	LPVOID get(WORD lang, size_t* size) const;
-	LPVOID get(WORD* lang, size_t* size) const;
-	bool remove(WORD lang);
-	bool add(WORD lang, const LPVOID data, size_t size, DWORD overwrite = OVERWRITE_ALWAYS);
-
-	bool isEmpty() const;
-	
-	ResourceLang* operator[](WORD lang);
-	const ResourceLang* operator[](WORD lang) const;
-
-	std::vector<WORD> getLangs() const;
-
-private:
-	bool cleanup();
-	virtual size_t getDataSize() const;
-	virtual size_t getHeaderSize() const;
-	virtual size_t getThisHeaderSize() const;
-	void writeLangDirs(LPBYTE data, size_t& pos, size_t& posDir) const;
-	void writeData(LPBYTE data, size_t& posDataEntry, size_t& posData, DWORD startVA) const;
-
-	virtual size_t getRESSize(size_t addl_hdr_size) const;
-	void writeRESData(LPBYTE data, size_t& pos, LPCWSTR type) const;
+// Where resources loaded from a ".rsrc" section are read from until they are changed
+struct RsrcSource {
+	LPBYTE base;				// the start of the section in the file data
+	size_t size;				// the used size of the section
+	size_t count;				// the number of resources loaded from the section
+	std::vector<size_t> used;	// the sorted offsets of everything in the section, limits how much a resource can grow in place
 };
 
-typedef std::map<LPWSTR, ResourceName*, ResCmp> NameMap;
-
-// The typed resource directory, the first level
-class ResourceType : Resource {
-	friend Rsrc;
-
-	LPWSTR type;
-	NameMap names;
-
-	ResourceType(LPCWSTR type, const LPBYTE data, size_t size, DWORD start, DWORD startVA, IMAGE_RESOURCE_DIRECTORY_ENTRY entry);
-	ResourceType(LPCWSTR type, LPCWSTR name, WORD lang, const LPVOID data, size_t size);
-public:
-	~ResourceType();
-
-	LPCWSTR getId() const;
-
-	bool exists(LPCWSTR name, WORD lang) const;
-	bool exists(LPCWSTR name, WORD* lang) const;
-	LPVOID get (LPCWSTR name, WORD lang, size_t* size) const;
-	LPVOID get (LPCWSTR name, WORD* lang, size_t* size) const;
-	bool remove(LPCWSTR name, WORD lang);
-	bool add(LPCWSTR name, WORD lang, const LPVOID data, size_t size, DWORD overwrite = OVERWRITE_ALWAYS);
-
-	bool isEmpty() const;
-	
-	ResourceName* operator[](LPCWSTR name);
-	const ResourceName* operator[](LPCWSTR name) const;
-
-	std::vector<LPCWSTR> getNames() const;
-	std::vector<WORD> getLangs(LPCWSTR name) const;
-
-private:
-	bool cleanup();
-	virtual size_t getDataSize() const;
-	virtual size_t getHeaderSize() const;
-	virtual size_t getThisHeaderSize() const;
-	void writeNameDirs(LPBYTE data, size_t& pos, size_t& posDir, size_t& posData) const;
-	void writeLangDirs(LPBYTE data, size_t& pos, size_t& posDir) const;
-	void writeData(LPBYTE data, size_t& posDataEntry, size_t& posData, DWORD startVA) const;
-
-	virtual size_t getRESSize() const;
-	void writeRESData(LPBYTE data, size_t& pos) const;
+// A type or name directory, its children are entries [first, first+count) of the next level
+struct RsrcDir {
+	LPCWSTR id;
+	size_t first, count;
 };
 
-typedef std::map<LPWSTR, ResourceType*, ResCmp> TypeMap;
+// The final level, the language of a resource and its data
+struct RsrcData {
+	WORD lang;
+	bool inSource;		// if the resource was loaded from the source and can be written back to it
+	LPVOID data;		// our own copy of the data (in the arena), NULL while the data is only in the source
+	size_t capacity;	// the size of the memory at data
+	size_t offset;		// offset of the data within the source
+	size_t entry;		// offset of the data entry within the source
+	size_t length;
+};
 
-class Rsrc : Resource {
-	TypeMap types;
+// The resources are three flat levels (types, names, and languages), each level is sorted within each parent and
+// the children of each level are in the same order as their parents so the whole tree can be walked in one pass
+class Rsrc {
+	std::vector<RsrcDir> types, names;
+	std::vector<RsrcData> langs;
+	RsrcArena arena;
+	RsrcSource src;
 
 	Rsrc(const LPBYTE data, size_t size, IMAGE_SECTION_HEADER *section); // creates from ".rsrc" section in PE file
 	Rsrc(const LPBYTE data, size_t size); // creates from RES file
 	Rsrc(); // creates empty
+	Rsrc(const Rsrc&);
+	Rsrc& operator=(const Rsrc&);
 public:
 	~Rsrc();
 	
@@ -192,33 +105,47 @@ public:
 	static Rsrc* createFromRESFile(const LPBYTE data, size_t size);
 	static Rsrc* createEmpty();
 
-	LPCWSTR getId() const;
+	// Looks up a single resource straight from a ".rsrc" section without loading any of the others, NULL if it doesn't exist or the section is invalid
+	// The lang pointer version gives the lowest language, like the functions below
+	static const LPVOID getViewFromRSRCSection(const LPBYTE data, size_t size, const IMAGE_SECTION_HEADER *section, LPCWSTR type, LPCWSTR name, WORD lang, size_t *len);
+	static const LPVOID getViewFromRSRCSection(const LPBYTE data, size_t size, const IMAGE_SECTION_HEADER *section, LPCWSTR type, LPCWSTR name, WORD *lang, size_t *len);
 
 	bool exists(LPCWSTR type, LPCWSTR name, WORD lang) const;
 	bool exists(LPCWSTR type, LPCWSTR name, WORD* lang) const;
-	LPVOID get (LPCWSTR type, LPCWSTR name, WORD lang, size_t* size) const;
-	LPVOID get (LPCWSTR type, LPCWSTR name, WORD* lang, size_t* size) const;
+	LPVOID get (LPCWSTR type, LPCWSTR name, WORD lang, size_t* size) const; // must be freed
+	LPVOID get (LPCWSTR type, LPCWSTR name, WORD* lang, size_t* size) const; // must be freed
+	const LPVOID getView(LPCWSTR type, LPCWSTR name, WORD lang, size_t* size) const;  // must not be freed, only valid until the resource is changed or the source is moved
+	const LPVOID getView(LPCWSTR type, LPCWSTR name, WORD* lang, size_t* size) const; // as above
 	bool remove(LPCWSTR type, LPCWSTR name, WORD lang);
 	bool add(LPCWSTR type, LPCWSTR name, WORD lang, const LPVOID data, size_t size, DWORD overwrite = OVERWRITE_ALWAYS);
 	
 	bool isEmpty() const;
-	
-	ResourceType* operator[](LPCWSTR type);
-	const ResourceType* operator[](LPCWSTR type) const;
 
 	std::vector<LPCWSTR> getTypes() const;
 	std::vector<LPCWSTR> getNames(LPCWSTR type) const;
 	std::vector<WORD> getLangs(LPCWSTR type, LPCWSTR name) const;
 
+	// Resources from a ".rsrc" section keep reading from the section until changed, if the section moves this must be called
+	void rebase(const LPBYTE data, IMAGE_SECTION_HEADER *section);
+
 	bool cleanup();
 	LPVOID compile(size_t* size, DWORD startVA); // calls cleanup
+	bool compileInPlace(); // calls cleanup, writes changed resources back to the section they came from if nothing was added or removed and they all still fit
 	LPVOID compileRES(size_t* size); // calls cleanup
 
 private:
-	virtual size_t getDataSize() const;
-	virtual size_t getHeaderSize() const;
-	virtual size_t getThisHeaderSize() const;
-	virtual size_t getRESSize() const;
+	bool findType(LPCWSTR type, size_t *t) const;
+	bool findName(size_t t, LPCWSTR name, size_t *n) const;
+	bool findLang(size_t n, WORD lang, size_t *l) const;
+	const RsrcData *find(LPCWSTR type, LPCWSTR name, WORD lang) const;
+	const RsrcData *find(LPCWSTR type, LPCWSTR name, WORD *lang) const;
+	const LPVOID view(const RsrcData &d) const;
+	void set(RsrcData &d, const LPVOID data, size_t size);
+	bool fitsInPlace(const RsrcData &d) const;
+
+	LPCWSTR readId(const LPBYTE data, size_t size, size_t offset, const IMAGE_RESOURCE_DIRECTORY_ENTRY &entry);
+	RsrcData readData(const LPBYTE data, size_t size, DWORD start, DWORD startVA, const IMAGE_RESOURCE_DIRECTORY_ENTRY &entry);
+	void sort();
 };
 
 #endif
@@ -0,0 +1,330 @@
+/*
+ * Windows 7 Boot Updater (github.com/coderforlife/windows-7-boot-updater)
+ * Copyright (C) 2021  Jeffrey Bush - Coder for Life
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "PEFileStorage.h"
+
+#ifdef __cplusplus_cli
+#pragma unmanaged
+#endif
+
+#ifdef _WIN32
+#include <map>
+#include <vector>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define SAVE_ERR()			DWORD _err_ = GetLastError()
+#define SET_ERR()			SetLastError(_err_)
+
+PEFileStorage::PEFileStorage(bool readonly) : data(NULL), size(0), readonly(readonly) { }
+PEFileStorage::~PEFileStorage() { }
+LPBYTE PEFileStorage::getData() const { return this->data; }
+size_t PEFileStorage::getSize() const { return this->size; }
+bool PEFileStorage::isReadOnly() const { return this->readonly; }
+
+#ifdef _WIN32
+#pragma region Windows Memory Map Management Functions
+///////////////////////////////////////////////////////////////////////////////
+///// Windows Memory Map Management Functions
+///////////////////////////////////////////////////////////////////////////////
+typedef BOOL (WINAPI *UNMAP_OR_CLOSE)(void*);
+typedef std::map<LPCWSTR, std::vector<LPVOID> > MMFViews;
+static MMFViews mmfHndls, mmfViews;
+static HANDLE AddMMF    (LPCWSTR file, HANDLE hMap) { if (hMap != NULL) mmfHndls[file].push_back(hMap); return hMap; }
+static LPVOID AddMMFView(LPCWSTR file, LPVOID view) { if (view != NULL) mmfViews[file].push_back(view); return view; }
+static void _RemoveMMF(MMFViews &mmfs, LPCWSTR file, LPVOID x) {
+	MMFViews::iterator v = mmfs.find(file);
+	if (v != mmfs.end()) {
+		size_t size = v->second.size();
+		for (size_t i = 0; i < size; ++i) {
+			if (v->second[i] == x) {
+				if (size == 1) {
+					mmfs.erase(v);
+				} else {
+					if (i != size-1) // make the removed element the last element
+						v->second[i] = v->second[size-1];
+					v->second.pop_back(); // remove the last element
+				}
+				break;
+			}
+		}
+	}
+}
+static void RemoveMMF    (LPCWSTR file, HANDLE hMap) { _RemoveMMF(mmfHndls, file, hMap); }
+static void RemoveMMFView(LPCWSTR file, LPVOID view) { _RemoveMMF(mmfViews, file, view); }
+static void _UnmapAll(MMFViews &mmfs, LPCWSTR file, UNMAP_OR_CLOSE func) {
+	MMFViews::iterator v = mmfs.find(file);
+	if (v != mmfs.end()) {
+		size_t size = v->second.size();
+		for (size_t i = 0; i < size; ++i)
+			func(v->second[i]);
+		mmfs.erase(v);
+	}
+}
+void PEFileStorage::UnmapAllViewsOfFile(LPCWSTR file) {
+	_UnmapAll(mmfHndls, file, &CloseHandle);
+	_UnmapAll(mmfViews, file, (UNMAP_OR_CLOSE)&UnmapViewOfFile);
+}
+#pragma endregion
+
+#pragma region Windows Storage
+///////////////////////////////////////////////////////////////////////////////
+///// Windows Storage
+///////////////////////////////////////////////////////////////////////////////
+static LPBYTE CopyProtected(const LPBYTE data, size_t size) {
+	DWORD old_protect = 0;
+	LPBYTE x = (LPBYTE)VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (x && (!memcpy(x, data, size) || !VirtualProtect(x, size, PAGE_READONLY, &old_protect))) { SAVE_ERR(); VirtualFree(x, 0, MEM_RELEASE); SET_ERR(); return NULL; }
+	return x;
+}
+static void FreeProtected(LPBYTE data, size_t) { VirtualFree(data, 0, MEM_RELEASE); }
+
+class PEMappedFile : public PEFileStorage {
+	WCHAR path[LARGE_PATH];
+	HANDLE hFile, hMap;
+
+	bool map() {
+		return (this->hMap = AddMMF(this->path, CreateFileMapping(this->hFile, NULL, (this->readonly ? PAGE_READONLY : PAGE_READWRITE), 0, 0, NULL))) != NULL &&
+			(this->data = (LPBYTE)AddMMFView(this->path, MapViewOfFile(this->hMap, (this->readonly ? FILE_MAP_READ : FILE_MAP_ALL_ACCESS), 0, 0, 0))) != NULL;
+	}
+	void unmap() {
+		this->flush();
+		if (this->data) { UnmapViewOfFile(this->data); RemoveMMFView(this->path, this->data); this->data = NULL; }
+		if (this->hMap) { RemoveMMF(this->path, this->hMap); CloseHandle(this->hMap); this->hMap = NULL; }
+	}
+public:
+	PEMappedFile(bool readonly) : PEFileStorage(readonly), hFile(INVALID_HANDLE_VALUE), hMap(NULL) { this->path[0] = 0; }
+	~PEMappedFile() { SAVE_ERR(); this->unmap(); if (this->hFile != INVALID_HANDLE_VALUE) { CloseHandle(this->hFile); } SET_ERR(); }
+	bool open(LPCWSTR file) {
+		DWORD size;
+		if (!GetFullPathName(file, ARRAYSIZE(this->path), this->path, NULL) ||
+			(this->hFile = CreateFile(this->path, (this->readonly ? GENERIC_READ : (GENERIC_READ | GENERIC_WRITE)), FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL)) == INVALID_HANDLE_VALUE ||
+			(size = GetFileSize(this->hFile, 0)) == INVALID_FILE_SIZE) { return false; }
+		this->size = size;
+		return this->map();
+	}
+	bool isFile() const { return true; }
+	bool resize(size_t size) {
+		if (this->readonly) { SetLastError(ERROR_ACCESS_DENIED); return false; }
+		this->unmap();
+		if (SetFilePointer(this->hFile, (LONG)size, NULL, FILE_BEGIN) == INVALID_SET_FILE_POINTER || !SetEndOfFile(this->hFile)) { return false; }
+		this->size = size; // a file grows with 0s
+		return this->map();
+	}
+	bool flush() { return this->readonly || ((!this->data || FlushViewOfFile(this->data, 0)) && FlushFileBuffers(this->hFile)); }
+};
+
+class PEFileOutput : public PEFileSink {
+	WCHAR path[LARGE_PATH], temp[LARGE_PATH];
+	HANDLE hFile;
+public:
+	PEFileOutput() : hFile(INVALID_HANDLE_VALUE) { this->path[0] = 0; this->temp[0] = 0; }
+	~PEFileOutput() { SAVE_ERR(); if (this->hFile != INVALID_HANDLE_VALUE) { CloseHandle(this->hFile); DeleteFile(this->temp); } SET_ERR(); }
+	bool open(LPCWSTR file) {
+		WCHAR dir[LARGE_PATH], *name;
+		if (!GetFullPathName(file, ARRAYSIZE(this->path), this->path, NULL) || !GetFullPathName(file, ARRAYSIZE(dir), dir, &name)) { return false; }
+		if (name) { *name = 0; }
+		if (!GetTempFileName(dir, L"pe", 0, this->temp)) { return false; } // creates the file
+		if ((this->hFile = CreateFile(this->temp, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL)) == INVALID_HANDLE_VALUE) { SAVE_ERR(); DeleteFile(this->temp); SET_ERR(); return false; }
+		return true;
+	}
+	bool write(const LPVOID data, size_t size) {
+		for (size_t pos = 0; pos < size; ) {
+			DWORD n = (DWORD)((size - pos > 0x40000000) ? 0x40000000 : (size - pos)), written = 0;
+			if (!WriteFile(this->hFile, (LPBYTE)data + pos, n, &written, NULL) || written == 0) { return false; }
+			pos += written;
+		}
+		return true;
+	}
+	bool finish() {
+		if (!FlushFileBuffers(this->hFile)) { return false; }
+		CloseHandle(this->hFile);
+		this->hFile = INVALID_HANDLE_VALUE;
+		if (!MoveFileEx(this->temp, this->path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) { SAVE_ERR(); DeleteFile(this->temp); SET_ERR(); return false; }
+		return true;
+	}
+};
+#pragma endregion
+#else
+#pragma region POSIX Storage
+///////////////////////////////////////////////////////////////////////////////
+///// POSIX Storage
+///////////////////////////////////////////////////////////////////////////////
+void PEFileStorage::UnmapAllViewsOfFile(LPCWSTR) { } // mapped files can be replaced
+
+static LPBYTE CopyProtected(const LPBYTE data, size_t size) {
+	void *x = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (x == MAP_FAILED) { return NULL; }
+	memcpy(x, data, size);
+	if (mprotect(x, size, PROT_READ) != 0) { SAVE_ERR(); munmap(x, size); SET_ERR(); return NULL; }
+	return (LPBYTE)x;
+}
+static void FreeProtected(LPBYTE data, size_t size) { munmap(data, size); }
+
+// Paths are UTF-16 like on Windows, but the system wants UTF-8
+static char *ToUTF8(LPCWSTR s) {
+	size_t len = wcslen(s), j = 0;
+	char *u = (char*)malloc(len*3+1);
+	for (size_t i = 0; i < len; ++i) {
+		DWORD c = s[i];
+		if (c >= 0xD800 && c < 0xDC00 && i+1 < len && s[i+1] >= 0xDC00 && s[i+1] < 0xE000)
+			c = 0x10000 + ((c - 0xD800) << 10) + (s[++i] - 0xDC00);
+		if (c < 0x80) { u[j++] = (char)c; }
+		else if (c < 0x800) { u[j++] = (char)(0xC0 | (c >> 6)); u[j++] = (char)(0x80 | (c & 0x3F)); }
+		else if (c < 0x10000) { u[j++] = (char)(0xE0 | (c >> 12)); u[j++] = (char)(0x80 | ((c >> 6) & 0x3F)); u[j++] = (char)(0x80 | (c & 0x3F)); }
+		else { u[j++] = (char)(0xF0 | (c >> 18)); u[j++] = (char)(0x80 | ((c >> 12) & 0x3F)); u[j++] = (char)(0x80 | ((c >> 6) & 0x3F)); u[j++] = (char)(0x80 | (c & 0x3F)); }
+	}
+	u[j] = 0;
+	return u;
+}
+
+class PEMappedFile : public PEFileStorage {
+	int fd;
+
+	bool map() {
+		if (this->size == 0) { SetLastError(ERROR_INVALID_DATA); return false; } // nothing to map, and it can't be a PE file anyways
+		void *x = mmap(NULL, this->size, (this->readonly ? PROT_READ : (PROT_READ | PROT_WRITE)), MAP_SHARED, this->fd, 0);
+		if (x == MAP_FAILED) { return false; }
+		this->data = (LPBYTE)x;
+		return true;
+	}
+	void unmap() {
+		this->flush();
+		if (this->data) { munmap(this->data, this->size); this->data = NULL; }
+	}
+public:
+	PEMappedFile(bool readonly) : PEFileStorage(readonly), fd(-1) { }
+	~PEMappedFile() { SAVE_ERR(); this->unmap(); if (this->fd != -1) { close(this->fd); } SET_ERR(); }
+	bool open(LPCWSTR file) {
+		struct stat st;
+		char *path = ToUTF8(file);
+		this->fd = ::open(path, this->readonly ? O_RDONLY : O_RDWR);
+		free(path);
+		if (this->fd == -1 || fstat(this->fd, &st) != 0) { return false; }
+		this->size = (size_t)st.st_size;
+		return this->map();
+	}
+	bool isFile() const { return true; }
+	bool resize(size_t size) {
+		if (this->readonly) { SetLastError(ERROR_ACCESS_DENIED); return false; }
+		this->unmap();
+		if (ftruncate(this->fd, (off_t)size) != 0) { return false; }
+		this->size = size; // a file grows with 0s
+		return this->map();
+	}
+	bool flush() { return this->readonly || ((!this->data || msync(this->data, this->size, MS_SYNC) == 0) && fsync(this->fd) == 0); }
+	int getFd() const { return this->fd; }
+};
+
+class PEFileOutput : public PEFileSink {
+	char *path, *temp;
+	int fd;
+public:
+	PEFileOutput() : path(NULL), temp(NULL), fd(-1) { }
+	~PEFileOutput() { SAVE_ERR(); if (this->fd != -1) { close(this->fd); unlink(this->temp); } free(this->path); free(this->temp); SET_ERR(); }
+	bool open(LPCWSTR file) {
+		struct stat st;
+		this->path = ToUTF8(file);
+		this->temp = (char*)malloc(strlen(this->path) + 8);
+		strcpy(this->temp, this->path);
+		strcat(this->temp, ".XXXXXX");
+		if ((this->fd = mkstemp(this->temp)) == -1) { return false; }
+		fchmod(this->fd, (stat(this->path, &st) == 0) ? (st.st_mode & 07777) : 0644); // mkstemp only allows the owner
+		return true;
+	}
+	bool write(const LPVOID data, size_t size) {
+		for (size_t pos = 0; pos < size; ) {
+			ssize_t n = ::write(this->fd, (LPBYTE)data + pos, size - pos);
+			if (n <= 0) { if (n < 0 && errno == EINTR) { continue; } return false; }
+			pos += (size_t)n;
+		}
+		return true;
+	}
+	bool copy(const PEFileStorage *src, size_t offset, size_t size) {
+#ifdef __linux__
+		// Mapped files are coherent with the file contents so the system can copy it directly
+		const PEMappedFile *f = dynamic_cast<const PEMappedFile*>(src);
+		loff_t off = (loff_t)offset;
+		while (f && size) {
+			ssize_t n = copy_file_range(f->getFd(), &off, this->fd, NULL, size, 0);
+			if (n <= 0) { if (n < 0 && errno == EINTR) { continue; } break; } // not supported between these files, the rest is written normally
+			size -= (size_t)n;
+		}
+		offset = (size_t)off;
+#endif
+		return PEFileSink::copy(src, offset, size);
+	}
+	bool finish() {
+		if (fsync(this->fd) != 0) { return false; }
+		int fd = this->fd;
+		this->fd = -1;
+		if (close(fd) != 0 || rename(this->temp, this->path) != 0) { SAVE_ERR(); unlink(this->temp); SET_ERR(); return false; }
+		return true;
+	}
+};
+#pragma endregion
+#endif
+
+#pragma region Memory Storage
+///////////////////////////////////////////////////////////////////////////////
+///// Memory Storage
+///////////////////////////////////////////////////////////////////////////////
+// When read-only a protected copy of the data is used so anything that writes to it fails right away
+class PEMemoryStorage : public PEFileStorage {
+	LPBYTE buf;
+public:
+	PEMemoryStorage(LPVOID data, size_t size, bool readonly) : PEFileStorage(readonly), buf((LPBYTE)data) { this->size = size; }
+	~PEMemoryStorage() { if (this->data && this->data != this->buf) { FreeProtected(this->data, this->size); } free(this->buf); }
+	bool init() { return (this->data = this->readonly ? CopyProtected(this->buf, this->size) : this->buf) != NULL; }
+	bool isFile() const { return false; }
+	bool resize(size_t size) {
+		if (this->readonly) { SetLastError(ERROR_ACCESS_DENIED); return false; }
+		LPBYTE b = (LPBYTE)realloc(this->buf, size);
+		if (!b) { SetLastError(ERROR_NOT_ENOUGH_MEMORY); return false; }
+		if (size > this->size) { memset(b+this->size, 0, size-this->size); }
+		this->data = this->buf = b;
+		this->size = size;
+		return true;
+	}
+	bool flush() { return true; }
+};
+#pragma endregion
+
+PEFileStorage* PEFileStorage::createFromMemory(LPVOID data, size_t size, bool readonly) {
+	if (!data) { SetLastError(ERROR_INVALID_PARAMETER); return NULL; }
+	PEMemoryStorage *s = new PEMemoryStorage(data, size, readonly);
+	if (!s->init()) { SAVE_ERR(); delete s; SET_ERR(); return NULL; }
+	return s;
+}
+PEFileStorage* PEFileStorage::createFromFile(LPCWSTR file, bool readonly) {
+	PEMappedFile *s = new PEMappedFile(readonly);
+	if (!s->open(file)) { SAVE_ERR(); delete s; SET_ERR(); return NULL; }
+	return s;
+}
+
+PEFileSink::PEFileSink() { }
+PEFileSink::~PEFileSink() { }
+bool PEFileSink::copy(const PEFileStorage *src, size_t offset, size_t size) { return size == 0 || this->write(src->getData() + offset, size); }
+PEFileSink* PEFileSink::createForFile(LPCWSTR file) {
+	PEFileOutput *s = new PEFileOutput();
+	if (!s->open(file)) { SAVE_ERR(); delete s; SET_ERR(); return NULL; }
+	return s;
+}
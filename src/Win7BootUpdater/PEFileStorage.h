@@ -0,0 +1,62 @@
+/*
+ * Windows 7 Boot Updater (github.com/coderforlife/windows-7-boot-updater)
+ * Copyright (C) 2021  Jeffrey Bush - Coder for Life
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#define LARGE_PATH 32767
+
+// Where the bytes of a PEFile are kept, the PEFile only sees a single block of memory that may move when it is resized
+// The storage is either a memory-mapped file (Windows file mappings or POSIX mmap) or a plain heap buffer
+class PEFileStorage {
+protected:
+	LPBYTE data;
+	size_t size;
+	bool readonly;
+
+	PEFileStorage(bool readonly);
+public:
+	virtual ~PEFileStorage(); // flushes and closes the file
+
+	static PEFileStorage* createFromMemory(LPVOID data, size_t size, bool readonly = false); // data is freed when the storage is deleted (or right away if it fails)
+	static PEFileStorage* createFromFile(LPCWSTR file, bool readonly = false);
+
+	LPBYTE getData() const;
+	size_t getSize() const;
+	bool isReadOnly() const;
+	virtual bool isFile() const = 0;
+
+	virtual bool resize(size_t size) = 0; // the new bytes are 0, invalidates the data pointer, flushes
+	virtual bool flush() = 0;
+
+	static void UnmapAllViewsOfFile(LPCWSTR file); // only needed on Windows where a mapped file cannot be replaced
+};
+
+// Where PEFile::saveTo writes a new file, which is written in order from start to end
+// Unchanged parts of the source are given as ranges of its storage so files can be copied by the system without reading them into memory
+class PEFileSink {
+protected:
+	PEFileSink();
+public:
+	virtual ~PEFileSink(); // discards everything if not finished
+
+	static PEFileSink* createForFile(LPCWSTR file); // written to a temporary file in the same directory that replaces the file when finished
+
+	virtual bool write(const LPVOID data, size_t size) = 0;
+	virtual bool copy(const PEFileStorage *src, size_t offset, size_t size); // by default just writes the data of the storage
+	virtual bool finish() = 0;
+};
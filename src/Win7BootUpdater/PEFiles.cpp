@@ -56,9 +56,8 @@ static uint CheckFile(PEFile *f, ushort *lang, LPWSTR typeTest, LPWSTR htmlName,
 		LPVOID ver;
 		if (f->resourceExists(typeTest, MAKEINTRESOURCE(1), lang) &&
 			(htmlName == NULL || f->resourceExists(RT_HTML, htmlName, lang)) &&
-			(ver = f->getResource(RT_VERSION, MAKEINTRESOURCE(1), *lang, &size)) != NULL) {
+			(ver = f->getResourceView(RT_VERSION, MAKEINTRESOURCE(1), *lang, &size)) != NULL) {
 			bool matches = verStrMatches(ver, L"InternalName", internalName);
-			free(ver);
 			return matches ? ERROR_SUCCESS : GEN_ERR_PEFILE_INVALID_VER;
 		} else {
 			return GEN_ERR_PEFILE_INVALID_RES; 
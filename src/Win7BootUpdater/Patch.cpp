@@ -38,6 +38,9 @@ using namespace System::Text;
 
 #define ALIGNMENT 4
 
+// Get the minimum of 2
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+
 template<typename T> static bool Equal(array<T> ^a, array<T> ^b) {
 	if (a->Length != b->Length) return false;
 	EqualityComparer<T> ^q = EqualityComparer<T>::Default;
@@ -200,6 +203,105 @@ static bool SetPersistentData(PEFile *f, ushort id, void *data, ushort len) { //
 #pragma managed
 
 
+///////////////////////////////////////////////////////////////////////////////
+///// Patch Targets
+///////////////////////////////////////////////////////////////////////////////
+#pragma unmanaged
+size_t PatchTargets::add(IMAGE_SECTION_HEADER *sect, const unsigned char *target, size_t count, byte wildcard) {
+	size_t i;
+	for (i = 0; i < this->sections.size() && this->sections[i]->pntr != sect->PointerToRawData; ++i);
+	if (i == this->sections.size()) {
+		Section *s = new Section;
+		s->pntr = sect->PointerToRawData;
+		s->size = sect->SizeOfRawData;
+		s->scanned = false;
+		this->sections.push_back(s);
+	}
+	Target t = { i, this->sections[i]->patterns.add(target, count, wildcard) };
+	this->sections[i]->scanned = false;
+	this->targets.push_back(t);
+	return this->targets.size() - 1;
+}
+PatchTargets::~PatchTargets() { for (size_t i = 0; i < this->sections.size(); ++i) { delete this->sections[i]; } }
+Bytes PatchTargets::find(PEFile *f, size_t i) {
+	Section *s = this->sections[this->targets[i].section];
+	const size_t t = this->targets[i].pattern;
+	const SearchPattern &p = s->patterns[t];
+	const size_t m = p.length(), n = s->size;
+	unsigned char *d = f->get(s->pntr);
+	size_t pos, k;
+
+	// Find every target in the section at once
+	if (!s->scanned) {
+		s->found.resize(s->patterns.count());
+		s->patterns.find(Bytes(d, n), &s->found[0]);
+		s->writes.clear();
+		s->scanned = true;
+	}
+	if (m == 0) { return Bytes::Null; }
+
+	// If something was written over the target since then, search again
+	if ((pos = s->found[t]) != MultiPattern::NotFound && !p.matches(d+pos)) {
+		Bytes x = p.find(Bytes(d, n));
+		pos = x ? x-d : MultiPattern::NotFound;
+	}
+
+	// Anything written before the target may have made an earlier copy of it, and that copy would have to overlap the write
+	for (k = 0; k < s->writes.size(); ++k) {
+		const size_t start = (s->writes[k].first >= m-1) ? s->writes[k].first-(m-1) : 0, end = MIN(s->writes[k].second+m-1, n);
+		const size_t lim = (pos == MultiPattern::NotFound) ? end : MIN(end, pos+m-1);
+		if (start < lim) {
+			Bytes x = p.find(Bytes(d+start, lim-start));
+			if (x) { pos = x-d; }
+		}
+	}
+
+	s->found[t] = pos;
+	return (pos == MultiPattern::NotFound) ? Bytes::Null : Bytes(d+pos, n-pos);
+}
+void PatchTargets::written(DWORD pos, size_t len) {
+	for (size_t i = 0; i < this->sections.size(); ++i) {
+		Section *s = this->sections[i];
+		if (s->scanned && pos < s->pntr + s->size && pos + len > s->pntr) {
+			s->writes.push_back(std::make_pair((pos > s->pntr) ? pos-s->pntr : 0, MIN(pos+len-s->pntr, s->size)));
+		}
+	}
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+///// Patch Symbols
+///////////////////////////////////////////////////////////////////////////////
+PatchSymbols::PatchSymbols() : resolved(0), relative(false) { }
+PatchSymbols::~PatchSymbols() { for (size_t i = 0; i < this->names.size(); ++i) { free(this->names[i]); } }
+void PatchSymbols::add(char *name) {
+	for (size_t i = 0; i < this->names.size(); ++i)
+		if (strcmp(this->names[i], name) == 0) { free(name); return; }
+	this->names.push_back(name);
+	this->vas.push_back(0);
+}
+bool PatchSymbols::resolve(const PEFile *f) {
+	if (this->resolved == this->names.size()) { return true; }
+	const size_t n = this->names.size() - this->resolved;
+	PDB *pdb = PDB::Get(f);
+	const bool loaded = pdb != NULL;
+	if (loaded) {
+		pdb->getFunctionVAs(&this->names[this->resolved], n, &this->vas[this->resolved]); // the ones not found are left as 0
+		this->relative = !pdb->hasSectionHeaders();
+		delete pdb;
+	}
+	this->resolved = this->names.size(); // even when the PDB can't be loaded so it isn't tried again
+	return loaded;
+}
+uint PatchSymbols::get(const char *name, const IMAGE_SECTION_HEADER *sect) const {
+	for (size_t i = 0; i < this->resolved; ++i)
+		if (strcmp(this->names[i], name) == 0)
+			return (this->vas[i] && this->relative) ? this->vas[i] + sect->VirtualAddress : this->vas[i]; // assume they are in the original section
+	return 0;
+}
+#pragma managed
+
+
 ///////////////////////////////////////////////////////////////////////////////
 ///// Updating functions
 ///////////////////////////////////////////////////////////////////////////////
@@ -222,14 +324,9 @@ inline static bool WriteAtAndRR(PEFile *f, array<Byte> ^x, uint p, IMAGE_SECTION
 	uint va = sect->VirtualAddress + p - sect->PointerToRawData;
 	return f->set(NATIVE(x), p) && f->removeRelocs(va, va+x->Length-1);
 }
-static bool UpdateBytes(PEFile *f, array<char> ^section, Byte wildcard, array<bool> ^already_changed, array<Byte> ^target, array<Byte> ^value) {
-	// Read the section and find the string
-	IMAGE_SECTION_HEADER *sect = f->getSectionHeader(as_native(section));
-	if (sect == NULL)						{ return false; }
-	uint size = sect->SizeOfRawData, pntr = sect->PointerToRawData;
-	Bytes data(f->get(pntr), size), found = data.find(NATIVE(target), wildcard);
-	if (found == NULL)						{ return false; }
-	uint pos = (uint)(found-data)+pntr; // this is the position within the file of the target
+static bool UpdateBytesAt(PEFile *f, IMAGE_SECTION_HEADER *sect, Bytes found, Byte wildcard, array<bool> ^already_changed, array<Byte> ^target, array<Byte> ^value) {
+	uint pos = (uint)(found-f->get(0)); // this is the position within the file of the target
+	value = (array<Byte>^)value->Clone(); // patches are shared so the original cannot be changed
 
 	// Get data for the wildcards
 	for (int i = 0; i < value->Length; i++)
@@ -239,12 +336,21 @@ static bool UpdateBytes(PEFile *f, array<char> ^section, Byte wildcard, array<bo
 	// Save the new value in it's place
 	return WriteAtAndRR(f, value, pos, sect);
 }
+static bool UpdateBytes(PEFile *f, array<char> ^section, Byte wildcard, array<bool> ^already_changed, array<Byte> ^target, array<Byte> ^value) {
+	// Read the section and find the string
+	IMAGE_SECTION_HEADER *sect = f->getSectionHeader(as_native(section));
+	if (sect == NULL)						{ return false; }
+	uint size = sect->SizeOfRawData, pntr = sect->PointerToRawData;
+	Bytes data(f->get(pntr), size), found = SearchPattern(NATIVE(target), wildcard).find(data);
+	if (found == NULL)						{ return false; }
+	return UpdateBytesAt(f, sect, found, wildcard, already_changed, target, value);
+}
 static array<Byte> ^RetrieveBytes(PEFile *f, array<char> ^section, Byte wildcard, array<Byte> ^target) {
 	// Read the section and find the string
 	IMAGE_SECTION_HEADER *sect = f->getSectionHeader(as_native(section));
 	if (sect == NULL)						{ return nullptr; }
 	uint size = sect->SizeOfRawData, pntr = sect->PointerToRawData;
-	Bytes data(f->get(pntr), size), found = data.find(NATIVE(target), wildcard);
+	Bytes data(f->get(pntr), size), found = SearchPattern(NATIVE(target), wildcard).find(data);
 	if (found == NULL)						{ return nullptr; }
 
 	// Return the found data
@@ -272,6 +378,24 @@ Types::Direct::Direct(BinaryReader ^b) {
 }
 bool Types::Direct::Apply(PEFile *f) { return UpdateBytes(f, section, wildcard, already_changed, target, value); }
 bool Types::Direct::IsApplied(PEFile *f) { return RetrieveBytes(f, section, value[0], value) != nullptr; }
+size_t Types::Direct::AddTargets(PEFile *f, PatchTargets *targets) {
+	IMAGE_SECTION_HEADER *sect = f->getSectionHeader(as_native(section));
+	if (sect == NULL) { return (size_t)-1; }
+	size_t i = targets->add(sect, NATIVE(target), wildcard);
+	targets->add(sect, NATIVE(value), value[0]);
+	return i;
+}
+bool Types::Direct::Apply(PEFile *f, PatchTargets *targets, size_t i) {
+	IMAGE_SECTION_HEADER *sect = f->getSectionHeader(as_native(section));
+	if (sect == NULL || i == (size_t)-1)	{ return false; }
+	Bytes found = targets->find(f, i);
+	if (found == NULL)						{ return false; }
+	DWORD pos = (DWORD)(found-f->get(0));
+	bool retval = UpdateBytesAt(f, sect, found, wildcard, already_changed, target, value);
+	targets->written(pos, value->Length); // even when it fails the value may have been written
+	return retval;
+}
+bool Types::Direct::IsApplied(PEFile *f, PatchTargets *targets, size_t i) { return i != (size_t)-1 && targets->find(f, i+1) != NULL; }
 
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -310,7 +434,7 @@ bool Types::String::FindTarget(PEFile *f, array<byte> ^%target, uint *pos, int *
 	IMAGE_SECTION_HEADER *sect = f->getSectionHeader(as_native(section));
 	if (sect == NULL)	{ return false; }
 	uint size = sect->SizeOfRawData, pntr = sect->PointerToRawData;
-	Bytes x(f->get(pntr), size), found = x.find(NATIVE(this->target), wildcard);
+	Bytes x(f->get(pntr), size), found = SearchPattern(NATIVE(this->target), wildcard).find(x);
 	if (found == NULL)	{ return false; }
 	*pos = (uint)(found-x); // position within text
 	target = Utilities::GetManagedArray(found, this->target->Length);
@@ -400,7 +524,7 @@ Types::AddFunction::AddFunction(BinaryReader ^b) {
 			int len = name->Length;
 			if (name[len - 1] != 0) {
 				array<byte>^ temp = gcnew array<byte>(len+1);
-				temp->CopyTo(temp, 0);
+				name->CopyTo(temp, 0);
 				temp[len] = 0;
 				name = temp;
 			}
@@ -431,7 +555,13 @@ ushort Types::AddFunction::Id() {
 	for (i = 0; i < target->Length;	 ++i) { hash = hash * a + target[i];  a *= 378551; }
 	return (ushort)((((hash)&0xffff) + ((hash)>>16))&0xffff); // fit into a short
 }
-bool Types::AddFunction::Apply(PEFile *f, array<uint> ^values) {
+void Types::AddFunction::AddSymbols(PatchSymbols *symbols) {
+	for (int i = 0; i < funcPos->Length; ++i)
+		if (GetDword(func, funcPos[i]) == 0)
+			symbols->add((char*)Utilities::GetNativeArray(funcNames[i]));
+}
+bool Types::AddFunction::Apply(PEFile *f, array<uint> ^values) { return Apply(f, NULL, values); }
+bool Types::AddFunction::Apply(PEFile *f, PatchSymbols *symbols, array<uint> ^values) {
 	if (values->Length != patchPos->Length)			{ return false; }
 	
 	// Find the section that we will be modifying and adding to
@@ -448,7 +578,7 @@ bool Types::AddFunction::Apply(PEFile *f, array<uint> ^values) {
 
 	// Read the section and find the target
 	Bytes data(f->get(sect->PointerToRawData), sect->SizeOfRawData);
-	Bytes found = data.find(NATIVE(target), wildcard);
+	Bytes found = SearchPattern(NATIVE(target), wildcard).find(data);
 	if (found == NULL)								{ return false; }
 	uint pos = (uint)(found-data); // this is the position in the section of the target
 	uint va_call = sect->VirtualAddress + pos;
@@ -484,18 +614,24 @@ bool Types::AddFunction::Apply(PEFile *f, array<uint> ^values) {
 	array<Byte> ^func = (array<Byte>^)this->func->Clone();
 	for (int i = 0; i < patchPos->Length; ++i)
 		SetDword(func, patchPos[i], values[i]);
-	PDB *pdb = NULL;
+
+	// Get virtual addresses from name going through debug information
+	// The names of the other patches being applied were usually added to the symbols as well, so they are all looked up with one PDB load
+	PatchSymbols local;
+	if (symbols == NULL) { symbols = &local; }
+	this->AddSymbols(symbols);
+	symbols->resolve(f);
 	for (int i = 0; i < funcPos->Length; ++i) {
 		uint va = GetDword(func, funcPos[i]);
-		if (va == 0) { // Get virtual addresses from name going through debug information
-			if (!pdb) { pdb = PDB::Get(f); if (!pdb) { return false; } }
-			va = pdb->getFunctionVA((char*)as_native(funcNames[i]));
-			if (!pdb->hasSectionHeaders()) { va += sect->VirtualAddress; } // assume it is in the original section
+		if (va == 0) {
+			byte *name = Utilities::GetNativeArray(funcNames[i]);
+			va = symbols->get((const char*)name, sect);
+			free(name);
+			if (va == 0) { return false; }
 		}
 		// Relative distance from call to function, from the end of the call
 		SetDword(func, funcPos[i], va - va_func - funcPos[i] - 4);
 	}
-	if (pdb) { delete pdb; }
 	if (!f->set(NATIVE(func), out->PointerToRawData+addr))	{ return false; } // no RemoveRelocs since the function is outside the scope
 
 	// Update the virtual size
@@ -508,18 +644,18 @@ bool Types::AddFunction::Revert(PEFile *f) {
 	IMAGE_SECTION_HEADER *sect = f->getSectionHeader(as_native(section));
 	if (sect == NULL)								{ return true; }
 	Bytes data(f->get(sect->PointerToRawData), sect->SizeOfRawData);
-	Bytes call_found = data.find(NATIVE(w_call), call_wildcard);
+	Bytes call_found = SearchPattern(NATIVE(w_call), call_wildcard).find(data);
 	if (call_found == NULL)							{ return true; }
 	uint call_pos = (uint)(call_found-data); // this is the position in .text of the targets
 
 	// Find the func target
 	IMAGE_SECTION_HEADER *out = sect;
-	Bytes func_found = data.find(NATIVE(w_func), func_wildcard);
+	Bytes func_found = SearchPattern(NATIVE(w_func), func_wildcard).find(data);
 	if (func_found == NULL) {
 		out = f->getSectionHeader(".w7bu");
 		if (out == NULL)							{ return true; }
 		data = Bytes(f->get(out->PointerToRawData), out->SizeOfRawData);
-		func_found = data.find(NATIVE(w_func), func_wildcard);
+		func_found = SearchPattern(NATIVE(w_func), func_wildcard).find(data);
 		if (func_found == NULL)						{ return true; }
 	}
 	uint func_pos = (uint)(func_found-data);
@@ -595,6 +731,7 @@ array<PatchVersion^> ^PatchPlatform::Get(UInt64 version) {
 			results->Add(v);
 	return results->ToArray();
 }
+array<PatchVersion^> ^PatchPlatform::GetAll() { return versions; }
 array<Patch^> ^PatchPlatform::GetPatches(UInt64 version) {
 	List<Patch^> ^results = gcnew List<Patch^>();
 	for each (PatchVersion ^v in versions)
@@ -620,6 +757,7 @@ PatchPlatform ^PatchEntry::Get(UInt16 platform) {
 			return p;
 	return nullptr;
 }
+array<PatchPlatform^> ^PatchEntry::GetAll() { return platforms; }
 
 ///////////////////////////////////////////////////////////////////////////////
 ///// Structure: PatchFile
@@ -647,6 +785,19 @@ void PatchFile::Init2(Stream ^s) {
 	for (int i = 0; i < l; ++i)
 		entries[i] = gcnew PatchEntry(b);
 	b->Close();
+
+	// Index the versions by id and platform, keeping them in the order they are in the file
+	index = gcnew Dictionary<uint, List<PatchVersion^>^>();
+	for each (PatchEntry ^e in entries) {
+		for each (PatchPlatform ^p in e->GetAll()) {
+			if (e->Get(p->Type) != p) { continue; } // only the first of a platform is used
+			List<PatchVersion^> ^versions;
+			uint key = (uint)e->Id << 16 | p->Type;
+			if (!index->TryGetValue(key, versions))
+				index->Add(key, versions = gcnew List<PatchVersion^>());
+			versions->AddRange(p->GetAll());
+		}
+	}
 }
 PatchFile::PatchFile(Stream ^s) { Init1(s); Init2(s); }
 PatchFile::PatchFile(Stream ^s, UInt16 min_major, UInt16 min_minor) {
@@ -663,11 +814,11 @@ array<PatchEntry^> ^PatchFile::Get(UInt16 id) {
 }
 array<Patch^> ^PatchFile::Get(UInt16 id, UInt16 platform, UInt64 version) {
 	List<Patch^> ^results = gcnew List<Patch^>();
-	for each (PatchEntry ^e in Get(id)) {
-		PatchPlatform ^p = e->Get(platform);
-		if (p != nullptr)
-			results->AddRange(p->GetPatches(version));
-	}
+	List<PatchVersion^> ^versions;
+	if (index->TryGetValue((uint)id << 16 | platform, versions))
+		for each (PatchVersion ^v in versions)
+			if (v->Min <= version && (v->NoMax || v->Max > version))
+				results->Add(v->Get());
 	return results->ToArray();
 }
 array<Patch^> ^PatchFile::Get(PEFile *f, UInt16 id) { return Get(id, f->getFileHeader()->Machine, f->getFileVersion()); }
@@ -692,7 +843,8 @@ PatchFile ^Patch::Load(Stream ^s, ushort min_major, ushort min_minor)	{ return g
 ///// Patching Shortcut Functions
 ///////////////////////////////////////////////////////////////////////////////
 // Apply
-bool PatchFile::Apply(PEFile *f) {
+List<Types::Direct^> ^PatchFile::GetDirects(PEFile *f) {
+	List<Types::Direct^> ^results = gcnew List<Types::Direct^>();
 	PatchPlatform ^pp;
 	UInt16 platform = f->getFileHeader()->Machine; //(UInt16)(f->is64bit() ? Platforms::AMD64 : Platforms::I386);
 	UInt64 version = f->getFileVersion();
@@ -700,56 +852,77 @@ bool PatchFile::Apply(PEFile *f) {
 		if ((pp = e->Get(platform)) != nullptr)
 			for each (Patch ^p in pp->GetPatches(version))
 				if (p->Type == Types::Direct::Type)
-					if (!((Types::Direct^)p)->Apply(f)) return false;
+					results->Add((Types::Direct^)p);
+	return results;
+}
+bool PatchFile::Apply(PEFile *f) {
+	// All of the targets are found up front with a single pass over each section
+	List<Types::Direct^> ^patches = GetDirects(f);
+	PatchTargets targets;
+	array<size_t> ^indices = gcnew array<size_t>(patches->Count);
+	for (int i = 0; i < patches->Count; ++i)
+		indices[i] = patches[i]->AddTargets(f, &targets);
+	for (int i = 0; i < patches->Count; ++i)
+		if (!patches[i]->Apply(f, &targets, indices[i])) return false;
 	return true;
 }
 bool PatchFile::ApplyIgnoringApplied(PEFile *f) {
-	PatchPlatform ^pp;
-	UInt16 platform = f->getFileHeader()->Machine; //(UInt16)(f->is64bit() ? Platforms::AMD64 : Platforms::I386);
-	UInt64 version = f->getFileVersion();
-	for each (PatchEntry ^e in this->entries)
-		if ((pp = e->Get(platform)) != nullptr)
-			for each (Patch ^p in pp->GetPatches(version))
-				if (p->Type == Types::Direct::Type)
-					if (!((Types::Direct^)p)->Apply(f) && !((Types::Direct^)p)->IsApplied(f)) return false;
+	List<Types::Direct^> ^patches = GetDirects(f);
+	PatchTargets targets;
+	array<size_t> ^indices = gcnew array<size_t>(patches->Count);
+	for (int i = 0; i < patches->Count; ++i)
+		indices[i] = patches[i]->AddTargets(f, &targets);
+	for (int i = 0; i < patches->Count; ++i)
+		if (!patches[i]->Apply(f, &targets, indices[i]) && !patches[i]->IsApplied(f, &targets, indices[i])) return false;
+	return true;
+}
+bool PatchFile::Apply(PEFile *f, UInt16 id) { return Apply(f, id, (PatchSymbols*)NULL); }
+bool PatchFile::Apply(PEFile *f, UInt16 id, array<uint> ^values) { return Apply(f, id, values, NULL); }
+bool PatchFile::Apply(PEFile *f, UInt16 id, uint value) { return Apply(f, id, value, NULL); }
+bool PatchFile::Apply(PEFile *f, UInt16 id, String ^value) {
+	for each (Patch ^p in Get(f, id))
+		if (p->Type == Types::String::Type)
+			if (!((Types::String^)p)->Apply(f, value)) return false;
 	return true;
 }
-bool PatchFile::Apply(PEFile *f, UInt16 id) {
+// Apply with symbols
+void PatchFile::AddSymbols(PEFile *f, array<UInt16> ^ids, PatchSymbols *symbols) {
+	for each (UInt16 id in ids)
+		for each (Patch ^p in Get(f, id))
+			if (p->Type == Types::AddFunction::Type)
+				((Types::AddFunction^)p)->AddSymbols(symbols);
+}
+bool PatchFile::Apply(PEFile *f, UInt16 id, PatchSymbols *symbols) {
 	for each (Patch ^p in Get(f, id)) {
 		if (p->Type == Types::Direct::Type) {
 			if (!((Types::Direct^)p)->Apply(f)) return false;
 		} else if (p->Type == Types::AddFunction::Type) {
-			if (!((Types::AddFunction^)p)->Apply(f)) return false;
+			if (!((Types::AddFunction^)p)->Apply(f, symbols, gcnew array<uint>(0))) return false;
 		}
 	}
 	return true;
 }
-bool PatchFile::Apply(PEFile *f, UInt16 id, array<uint> ^values) {
+bool PatchFile::Apply(PEFile *f, UInt16 id, array<uint> ^values, PatchSymbols *symbols) {
 	for each (Patch ^p in Get(f, id)) {
 		if (p->Type == Types::Dwords::Type) {
 			if (!((Types::Dwords^)p)->Apply(f, values)) return false;
 		} else if (p->Type == Types::AddFunction::Type) {
-			if (!((Types::AddFunction^)p)->Apply(f, values)) return false;
+			if (!((Types::AddFunction^)p)->Apply(f, symbols, values)) return false;
 		}
 	}
 	return true;
 }
-bool PatchFile::Apply(PEFile *f, UInt16 id, uint value) {
+bool PatchFile::Apply(PEFile *f, UInt16 id, uint value, PatchSymbols *symbols) {
 	for each (Patch ^p in Get(f, id)) {
 		if (p->Type == Types::Dwords::Type) {
 			if (!((Types::Dwords^)p)->Apply(f, value)) return false;
 		} else if (p->Type == Types::AddFunction::Type) {
-			if (!((Types::AddFunction^)p)->Apply(f, value)) return false;
+			if (!((Types::AddFunction^)p)->Apply(f, symbols, gcnew array<uint>{value})) return false;
 		}
 	}
 	return true;
 }
-bool PatchFile::Apply(PEFile *f, UInt16 id, String ^value) {
-	for each (Patch ^p in Get(f, id))
-		if (p->Type == Types::String::Type)
-			if (!((Types::String^)p)->Apply(f, value)) return false;
-	return true;
-}
+bool PatchFile::Apply(PEFile *f, UInt16 id, String ^value, PatchSymbols *) { return Apply(f, id, value); }
 // Revert
 bool PatchFile::Revert(PEFile *f, UInt16 id) {
 	for each (Patch ^p in Get(f, id))
@@ -26,6 +26,7 @@
 
 #ifndef _M_CEE_SAFE
 #include "PEFile.h"
+#include "Bytes.h"
 #endif
 
 namespace Win7BootUpdater { namespace Patches { 
@@ -73,6 +74,7 @@ namespace Win7BootUpdater { namespace Patches {
 		PatchPlatform(System::IO::BinaryReader ^b);
 		property ushort Type { ushort get(); }
 		array<PatchVersion^> ^Get(ulong version);
+		array<PatchVersion^> ^GetAll();
 		array<Patch^> ^GetPatches(ulong version);
 	};
 
@@ -83,19 +85,59 @@ namespace Win7BootUpdater { namespace Patches {
 		PatchEntry(System::IO::BinaryReader ^b);
 		property ushort Id { ushort get(); }
 		PatchPlatform ^Get(ushort platform);
+		array<PatchPlatform^> ^GetAll();
 	};
 
 #ifndef _M_CEE_SAFE
 
 	// We can define PatchFile and Types only when unsafe
 	
+	namespace Types { ref class Direct; }
+
+	// The targets of many patches, all of the targets in a section are found with a single pass
+	// Once found, writes to the section are tracked so that find() always gives the same result as searching the section again
+	class PatchTargets {
+		typedef struct _Target { size_t section, pattern; } Target;
+		typedef struct _Section {
+			DWORD pntr, size;
+			MultiPattern patterns;
+			std::vector<size_t> found;
+			std::vector<std::pair<size_t, size_t> > writes; // the ranges written since the section was scanned
+			bool scanned;
+		} Section;
+		std::vector<Section*> sections;
+		std::vector<Target> targets;
+	public:
+		~PatchTargets();
+		size_t add(IMAGE_SECTION_HEADER *sect, const unsigned char *target, size_t count, byte wildcard); // returns the index of the target
+		Bytes find(PEFile *f, size_t i); // finds the first occurrence of a target in its section, Bytes::Null if not found
+		void written(DWORD pos, size_t len); // marks a part of the file as written, pos is the position in the file
+	};
+
+	// The functions called by the AddFunction patches of a file, looked up in its debug information
+	// The names of the patches that will be applied are gathered first so the PDB is only loaded once for the file
+	class PatchSymbols {
+		std::vector<char*> names;
+		std::vector<uint> vas;
+		size_t resolved; // the number of names looked up so far
+		bool relative; // the PDB has no section headers, so the addresses are relative to the section of the patch
+	public:
+		PatchSymbols();
+		~PatchSymbols();
+		void add(char *name); // the name must be allocated with malloc and is freed by this, duplicates are ignored
+		bool resolve(const PEFile *f); // looks up all of the names added since the last call, false if the PDB cannot be loaded
+		uint get(const char *name, const IMAGE_SECTION_HEADER *sect) const; // the VA of a function, 0 if not found, sect is the section of the patch
+	};
+
 	ref class PatchFile sealed : public System::IComparable<PatchFile^> {
 		ushort format_major, format_minor;
 		ushort file_major, file_minor;
 		ushort compression;
 		array<PatchEntry^> ^entries;
+		System::Collections::Generic::Dictionary<uint, System::Collections::Generic::List<PatchVersion^>^> ^index; // the versions for each id and platform, never changed once loaded
 		void PatchFile::Init1(System::IO::Stream ^s);
 		void PatchFile::Init2(System::IO::Stream ^s);
+		System::Collections::Generic::List<Types::Direct^> ^GetDirects(PEFile *f);
 	public:
 		PatchFile(System::IO::Stream ^s);
 		PatchFile(System::IO::Stream ^s, ushort min_major, ushort min_minor);
@@ -115,6 +157,14 @@ namespace Win7BootUpdater { namespace Patches {
 		bool Apply(PEFile *f, ushort id, uint value); // Dwords or AddFunction
 		bool Apply(PEFile *f, ushort id, string value); // String
 
+		// Adds the functions needed by the AddFunction patches with the given ids to the symbols, which are then given to the Apply functions below for the same file
+		// They are all looked up when the first of those patches is applied, so the PDB is loaded once and only if one of them is applied
+		void AddSymbols(PEFile *f, array<ushort> ^ids, PatchSymbols *symbols);
+		bool Apply(PEFile *f, ushort id, PatchSymbols *symbols);
+		bool Apply(PEFile *f, ushort id, array<uint> ^values, PatchSymbols *symbols);
+		bool Apply(PEFile *f, ushort id, uint value, PatchSymbols *symbols);
+		bool Apply(PEFile *f, ushort id, string value, PatchSymbols *symbols); // same as without the symbols, String patches don't call functions
+
 		// Shortcut Revert functions
 		bool Revert(PEFile *f, ushort id); // AddFunction
 
@@ -138,6 +188,11 @@ namespace Win7BootUpdater { namespace Patches {
 			Direct(System::IO::BinaryReader ^b);
 			bool Apply(PEFile *f);
 			bool IsApplied(PEFile *f);
+		internal:
+			// Used by PatchFile to apply many at once, adds the target and then the value returning the index of the target
+			size_t AddTargets(PEFile *f, PatchTargets *targets);
+			bool Apply(PEFile *f, PatchTargets *targets, size_t i);
+			bool IsApplied(PEFile *f, PatchTargets *targets, size_t i);
 		};
 
 		ref class Dwords sealed : public Patch {
@@ -183,6 +238,10 @@ namespace Win7BootUpdater { namespace Patches {
 			bool Apply(PEFile *f, ... array<uint> ^values);
 			bool Revert(PEFile *f);
 			array<uint> ^GetValues(PEFile *f);
+		internal:
+			// Used by PatchFile to look up the functions of many patches at once
+			void AddSymbols(PatchSymbols *symbols);
+			bool Apply(PEFile *f, PatchSymbols *symbols, array<uint> ^values);
 		};
 	}
 
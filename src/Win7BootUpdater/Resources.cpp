@@ -36,7 +36,7 @@ using namespace System::Resources;
 //using namespace System::Security::Cryptography;
 using namespace System::Text;
 using namespace System::Text::RegularExpressions;
-//using namespace System::Threading;
+using namespace System::Threading;
 
 /*#if __CLR_VER >= 40000000
 #define Yield() Thread::Yield()
@@ -128,7 +128,24 @@ Stream ^Res::GetCompressedStream(string name) { return gcnew GZipStream(resource
 	return r->GetResponse()->GetResponseStream();
 }*/
 PatchFile ^Res::GetPatch(string name) {
-	return Patch::Load(resources->GetStream(name));
+	// Each patch is only loaded once and then shared, other threads wait while one is being loaded (e.g. by Updater::PreloadPatch)
+	// The dictionary is only locked to find or add the entry, so loading one patch doesn't block getting any others
+	PatchSlot ^s;
+	Monitor::Enter(patches);
+	try {
+		if (!patches->TryGetValue(name, s))
+			patches->Add(name, s = gcnew PatchSlot());
+	} finally {
+		Monitor::Exit(patches);
+	}
+	Monitor::Enter(s);
+	try {
+		if (!s->patch) // if loading failed before it is tried again
+			s->patch = Patch::Load(resources->GetStream(name));
+		return s->patch;
+	} finally {
+		Monitor::Exit(s);
+	}
 
 	/*Monitor::Enter(patches);
 	if (!patches->ContainsKey(name)) {
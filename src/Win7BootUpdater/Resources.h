@@ -33,6 +33,9 @@ namespace Win7BootUpdater {
 		static string unique_id = nullptr;
 		static bool first_request = true;
 		static initonly System::Collections::Generic::Dictionary<string,Patches::PatchFile^> ^patches = gcnew System::Collections::Generic::Dictionary<string,Patches::PatchFile^>();*/
+		// The entry for a patch is added before it is loaded and is locked while loading so each patch is only loaded once
+		ref class PatchSlot { public: Patches::PatchFile ^patch; };
+		static initonly System::Collections::Generic::Dictionary<string,PatchSlot^> ^patches = gcnew System::Collections::Generic::Dictionary<string,PatchSlot^>();
 		static initonly System::Resources::ResourceManager ^resources = gcnew System::Resources::ResourceManager(L"Win7BootUpdater", System::Reflection::Assembly::GetExecutingAssembly());
 		//static System::IO::Stream ^GetUpdate(string file);
 
@@ -48,7 +48,6 @@ void Updater::Init() {
 	// We need to load these libraries ahead of time for WOW64 because later on we disable file path redirection
 	LoadLibrary(L"Version.dll");
 	LoadLibrary(L"Advapi32.dll");
-	LoadLibrary(L"wimgapi.dll");
 	LoadLibrary(L"Shlwapi.dll");
 	LoadLibrary(L"security.dll");
 	LoadLibrary(L"Secur32.dll");
@@ -247,7 +246,7 @@ string Updater::CreateInstaller(BootSkin ^bs, XmlDocument ^desc, System::Drawing
 	else if (!f->addResource(RT_RCDATA, MAKEINTRESOURCE(1), 0, NATIVE(bs_data)))	{ err = Msg::FailedToUpdateTheResources; }
 	else if (!f->addResource(RT_RCDATA, MAKEINTRESOURCE(2), 0, NATIVE(desc_data)))	{ err = Msg::FailedToUpdateTheResources; }
 	else if (!f->addResource(RT_RCDATA, MAKEINTRESOURCE(3), 0, NATIVE(img_data)))	{ err = Msg::FailedToUpdateTheResources; }
-	else if (!f->save() || !WriteAll(as_native(file), f->get(), f->getSize()))		{ err = Msg::FailedToSaveTheUpdated; }
+	else if (!f->saveTo(as_native(file)))											{ err = Msg::FailedToSaveTheUpdated; }
 	delete f;
 
 	return err == Msg::NO_MESSAGE ? nullptr : UI::GetMessage(err, UI::GetMessage(Msg::Installer));
@@ -18,181 +18,409 @@
 
 #include "WIM.h"
 
-#include "UI-native.h"
-#include "Files.h"
+#include "wimzip.h"
+
+#include <time.h>
 
 #ifdef __cplusplus_cli
 #pragma unmanaged
 #endif
 
-#include <wimgapi.h>
-#pragma comment(lib, "wimgapi.lib")
-
 using namespace Win7BootUpdater;
 
-void *WIM::ExtractFile(void *_wim, LPCWSTR file, size_t *size)
-{
-	TCHAR tempPath[MAX_PATH], tempWimFile[MAX_PATH], tempFile[MAX_PATH];
-	if (GetTempPath(MAX_PATH, tempPath) <= 0) return NULL;
-
-	if (GetTempFileName(tempPath, L"wim", 0, tempWimFile) == 0) return NULL;
-	if (!Files::WriteAll(tempWimFile, _wim, (uint)*size)) { DeleteFile(tempWimFile); return NULL; }
-
-	HANDLE hWim = WIMCreateFile(tempWimFile, WIM_GENERIC_READ, WIM_OPEN_EXISTING, 0, 0, NULL);
-	if (hWim == NULL) { DeleteFile(tempWimFile); return NULL; }
-	WIMSetTemporaryPath(hWim, tempPath);
-
-	HANDLE hImg = WIMLoadImage(hWim, 1);
-	if (hImg == NULL) { WIMCloseHandle(hWim); DeleteFile(tempWimFile); return NULL; }
-	
-	bool success = (GetTempFileName(tempPath, L"wex", 0, tempFile) != 0) && (WIMExtractImagePath(hImg, file, tempFile, 0) != 0);
-	WIMCloseHandle(hImg);
-	WIMCloseHandle(hWim);
-	DeleteFile(tempWimFile);
-	if (!success) { return NULL; }
-
-	Bytes data = Files::ReadAll(tempFile);
-	DeleteFile(tempFile); // TODO: doesn't work (access denied), but explorer can delete the file when holding on this line of code...
-	*size = *data;
-	return data;
-}
-
-/////////////////// WIM Creation //////////////////////////////////////////////
+/////////////////// WIM Reading ///////////////////////////////////////////////
+
+// The WIM is read directly from memory, only the parts needed to find and decompress a single file are supported
+#define WIM_MAGIC				"MSWIM\0\0\0"
+#define WIM_HDR_COMPRESSION		0x00000002
+#define WIM_HDR_XPRESS			0x00020000
+#define WIM_HDR_LZX				0x00040000
+
+#define RESHDR_METADATA			0x02
+#define RESHDR_COMPRESSED		0x04
+#define RESHDR_SPANNED			0x08
+#define RESHDR_PACKED			0x10
+
+#define DENTRY_DIRECTORY		0x10 // FILE_ATTRIBUTE_DIRECTORY
+
+#define HASH_SIZE				20 // SHA-1
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+
+#pragma pack(push, 1)
+typedef struct _ResHdr {
+	BYTE size[7];				// the size in the WIM, a 56-bit integer
+	BYTE flags;
+	ULONGLONG offset;
+	ULONGLONG original_size;
+} ResHdr;
+
+typedef struct _WimHeader {
+	BYTE magic[8];
+	DWORD header_size, version, flags, chunk_size;
+	BYTE guid[16];
+	WORD part_number, total_parts;
+	DWORD image_count;
+	ResHdr lookup_table, xml_data, boot_metadata;
+	DWORD boot_index;
+	ResHdr integrity;
+	BYTE unused[60];
+} WimHeader;
+
+typedef struct _LookupEntry {
+	ResHdr res;
+	WORD part_number;
+	DWORD ref_count;
+	BYTE hash[HASH_SIZE];
+} LookupEntry;
+
+typedef struct _Dentry {
+	ULONGLONG length;			// not including the stream entries that follow, 0 marks the end of a directory
+	DWORD attributes;
+	LONG security_id;
+	ULONGLONG subdir_offset;
+	ULONGLONG unused[2];
+	ULONGLONG creation_time, last_access_time, last_write_time;
+	BYTE hash[HASH_SIZE];		// the unnamed data stream, all 0 if empty or if it is one of the stream entries
+	DWORD reparse_tag;
+	ULONGLONG hard_link;
+	WORD num_streams, short_name_nbytes, file_name_nbytes;
+	// WCHAR file_name[], short_name[]
+} Dentry;
+
+typedef struct _StreamEntry {
+	ULONGLONG length;
+	ULONGLONG unused;
+	BYTE hash[HASH_SIZE];
+	WORD name_nbytes;
+	// WCHAR name[]
+} StreamEntry;
+#pragma pack(pop)
+
+inline static ULONGLONG roundUp8(ULONGLONG x) { return (x + 7) & ~(ULONGLONG)7; }
+inline static bool isZero(const BYTE *x, size_t n) { while (n--) { if (*x++) { return false; } } return true; }
+inline static WCHAR upper(WCHAR c) { return (c >= L'a' && c <= L'z') ? (WCHAR)(c - L'a' + L'A') : c; }
+
+// Decompresses an entire resource, the chunk table is followed by chunks that are each compressed on their own
+static LPBYTE ReadResource(const LPBYTE wim, size_t wim_size, const WimHeader *h, const ResHdr *r, size_t *size) {
+	ULONGLONG c_size = 0;
+	for (int i = 6; i >= 0; --i) { c_size = (c_size << 8) | r->size[i]; }
+	if (r->offset > wim_size || c_size > wim_size - r->offset) { SetLastError(ERROR_INVALID_DATA); return NULL; }
+	if (r->flags & (RESHDR_SPANNED | RESHDR_PACKED)) { SetLastError(ERROR_NOT_SUPPORTED); return NULL; }
+	const LPBYTE c = wim + r->offset;
+	const ULONGLONG u_size = r->original_size;
+	if (!(r->flags & RESHDR_COMPRESSED)) {
+		if (u_size != c_size) { SetLastError(ERROR_INVALID_DATA); return NULL; }
+		LPBYTE u = (LPBYTE)malloc(c_size ? (size_t)c_size : 1);
+		if (u == NULL) { SetLastError(ERROR_NOT_ENOUGH_MEMORY); return NULL; }
+		memcpy(u, c, (size_t)c_size);
+		*size = (size_t)c_size;
+		return u;
+	}
 
-typedef struct _WIMData {
-	WCHAR activity[MAX_PATH];
-	//UINT lastProgress;
-} WIMData;
-
-static DWORD WINAPI callback(DWORD msgId, WPARAM param1, LPARAM param2, PVOID pvUserData) {
-	WIMData *data = (WIMData*)pvUserData;
-
-	//First parameter: full file path for if WIM_MSG_PROCESS, message string for others
-	TCHAR *message  = (TCHAR*) param1;
-	TCHAR *filePath = (TCHAR*) param1;
-	//UINT progress   = (UINT)param1;
-
-	//Second parameter: message back to caller if WIM_MSG_PROCESS, error code for others
-	DWORD errorCode = (DWORD)  param2;
-	DWORD *msg_back = (DWORD*) param2;
-
-	switch (msgId) {
-		case WIM_MSG_PROCESS:
-			//This message is sent for each file, capturing to see if callee intends to capture the file or not.
-			if (_wcsicmp(data->activity, filePath) != 0) *msg_back = FALSE;
-			break;
-
-		case WIM_MSG_PROGRESS:
-			//if (progress > data->lastProgress + 5) {
-			//	UI::Inc(L"Compressing animation... ("+progress+L"%)");
-			//	data->lastProgress = (data->lastProgress / 5) * 5;
-			//}
-			break;
-
-		case WIM_MSG_ERROR:
-			//This message is sent upon failure error case
-			wprintf(L"ERROR: %s [err = %d]\n", message, errorCode);
-			break;
-
-		case WIM_MSG_RETRY:
-			//This message is sent when the file is being reapplied because of
-			//network timeout. Retry is done up to five times.
-			//_tprintf(TEXT("RETRY: %s [err = %d]\n"), message, errorCode);
-			break;
-
-		case WIM_MSG_INFO:
-			//This message is sent when informational message is available
-			//_tprintf(TEXT("INFO: %s [err = %d]\n"), message, errorCode);
-			break;
-
-		case WIM_MSG_WARNING:
-			//This message is sent when warning message is available
-			wprintf(L"WARNING: %s [err = %d]\n", message, errorCode);
-			break;
+	// Decide how the chunks are compressed
+	const ULONG chunk = h->chunk_size ? h->chunk_size : WIMZIP_LZX_CHUNK_SIZE;
+	ULONG (*decompress)(const BYTE*, ULONG, BYTE*, ULONG) = NULL;
+	if (!(h->flags & WIM_HDR_COMPRESSION)) {}
+	else if ((h->flags & WIM_HDR_LZX) && chunk == WIMZIP_LZX_CHUNK_SIZE) { decompress = wimzip_lzx_decompress; }
+	else if ((h->flags & WIM_HDR_XPRESS) && chunk <= WIMZIP_XPRESS_MAX_CHUNK) { decompress = wimzip_xpress_decompress; }
+	if (decompress == NULL) { SetLastError(ERROR_NOT_SUPPORTED); return NULL; }
+
+	// The chunk table has the offset of every chunk but the first, relative to the end of the table
+	// Every chunk takes at least a byte so the table limits how large the resource can be
+	const ULONGLONG n = u_size / chunk + (u_size % chunk != 0), entry = (u_size > 0xFFFFFFFF) ? 8 : 4;
+	if (n > c_size / (entry + 1) + 1) { SetLastError(ERROR_INVALID_DATA); return NULL; }
+	const ULONGLONG table = n ? (n - 1) * entry : 0;
+	const LPBYTE data = c + table;
+	const ULONGLONG data_size = c_size - table;
+	if (u_size > (size_t)-1) { SetLastError(ERROR_NOT_ENOUGH_MEMORY); return NULL; }
+	LPBYTE u = (LPBYTE)malloc(u_size ? (size_t)u_size : 1);
+	if (u == NULL) { SetLastError(ERROR_NOT_ENOUGH_MEMORY); return NULL; }
+	*size = (size_t)u_size;
+	ULONGLONG start = 0;
+	for (ULONGLONG i = 0; i < n; ++i) {
+		ULONGLONG end = data_size;
+		if (i + 1 < n) {
+			const LPBYTE e = c + i * entry;
+			end = (entry == 8) ? *(ULONGLONG*)e : *(DWORD*)e;
+		}
+		const ULONG u_len = (ULONG)MIN(chunk, u_size - i * chunk);
+		if (end <= start || end > data_size || end - start > u_len) { free(u); SetLastError(ERROR_INVALID_DATA); return NULL; }
+		const ULONG c_len = (ULONG)(end - start);
+		LPBYTE out = u + i * chunk;
+		if (c_len == u_len) { memcpy(out, data + start, c_len); } // stored without compression
+		else if (decompress(data + start, c_len, out, u_len) != u_len) { free(u); SetLastError(ERROR_INVALID_DATA); return NULL; }
+		start = end;
 	}
-	return WIM_MSG_SUCCESS;
+	return u;
 }
 
-#define END_IMAGE			L"</IMAGE>"
-#define END_IMAGE_LEN		8
-#define WIM_NAME			L"<NAME>Boot Resource WIM</NAME>"
-
-static size_t removeExtraneousWS(LPWSTR str) {
-	size_t len = wcslen(str);
-	LPWSTR s = (LPWSTR)malloc(len*sizeof(WCHAR));
-	size_t j = 0, i = 0;
-	bool keep_spaces = false;
-	for (; i < len; ++i) {
-		if (str[i] == L'<') { keep_spaces = true; }
-		else if (str[i] == L'>') { keep_spaces = false; }
-		if (keep_spaces || !iswspace(str[i])) {
-			s[j++] = str[i];
+// Finds a file or directory in a directory of the metadata resource by name, ignoring the case of ASCII letters
+static const Dentry *FindChild(const LPBYTE meta, size_t size, const Dentry *dir, LPCWSTR name, size_t len) {
+	if (!(dir->attributes & DENTRY_DIRECTORY) || dir->subdir_offset == 0) { return NULL; }
+	ULONGLONG pos = dir->subdir_offset;
+	while (pos <= size - sizeof(ULONGLONG)) {
+		const Dentry *d = (const Dentry*)(meta + pos);
+		if (d->length == 0) { break; } // end of the directory
+		if (d->length < sizeof(Dentry) || d->length > size - pos ||
+			sizeof(Dentry) + d->file_name_nbytes > d->length) { break; }
+		if (d->file_name_nbytes == len * sizeof(WCHAR)) {
+			const WCHAR *n = (const WCHAR*)(d+1);
+			size_t i = 0;
+			while (i < len && upper(n[i]) == upper(name[i])) { ++i; }
+			if (i == len) { return d; }
+		}
+		// Skip the dentry and its stream entries
+		pos += roundUp8(d->length);
+		for (WORD s = d->num_streams; s && pos <= size - sizeof(StreamEntry); --s) {
+			const StreamEntry *e = (const StreamEntry*)(meta + pos);
+			if (e->length < sizeof(StreamEntry) || e->length > size - pos) { return NULL; }
+			pos += roundUp8(e->length);
 		}
 	}
-	wcsncpy(str, s, j);
-	str[j] = 0;
-	free(s);
-	return j;
+	return NULL;
 }
 
-// 6 increments
-bool WIM::Create(LPCWSTR src, LPCWSTR dest, LPCWSTR activity) {
-	DWORD err = ERROR_SUCCESS;
-
-	WIMData data;
-	wcsncpy(data.activity, activity, MAX_PATH);
-	//data.lastProgress = 0;
-
-	HANDLE hWim = WIMCreateFile(dest, WIM_GENERIC_WRITE | WIM_GENERIC_READ, WIM_CREATE_ALWAYS, 0, WIM_COMPRESS_LZX, NULL);
-	if (hWim == NULL) {
-		return false;
+// Gets the hash of the unnamed data stream of a file, which Windows 8 and newer keep in a stream entry
+static const BYTE *FileHash(const LPBYTE meta, size_t size, const Dentry *d) {
+	if (!isZero(d->hash, HASH_SIZE)) { return d->hash; }
+	ULONGLONG pos = (const BYTE*)d - meta + roundUp8(d->length);
+	for (WORD s = d->num_streams; s && pos <= size - sizeof(StreamEntry); --s) {
+		const StreamEntry *e = (const StreamEntry*)(meta + pos);
+		if (e->length < sizeof(StreamEntry) || e->length > size - pos) { break; }
+		if (e->name_nbytes == 0) { return e->hash; }
+		pos += roundUp8(e->length);
 	}
-	UI::Inc();
-
-	TCHAR tempPath[MAX_PATH];
-	if (GetTempPath(MAX_PATH, tempPath) > 0)
-		WIMSetTemporaryPath(hWim, tempPath);
+	return d->hash;
+}
 
-	if (WIMRegisterMessageCallback(hWim, (FARPROC)&callback, &data) == INVALID_CALLBACK_VALUE) {
-		WIMCloseHandle(hWim);
-		return false;
+void *WIM::ExtractFile(void *_wim, LPCWSTR file, size_t *size)
+{
+	const LPBYTE wim = (LPBYTE)_wim;
+	const size_t wim_size = *size;
+	const WimHeader *h = (const WimHeader*)wim;
+	if (wim_size < sizeof(WimHeader) || memcmp(h->magic, WIM_MAGIC, sizeof(h->magic)) != 0 || h->header_size < sizeof(WimHeader) ||
+		h->image_count == 0) { SetLastError(ERROR_INVALID_DATA); return NULL; }
+
+	// The metadata resource of the first image is the first one in the lookup table
+	size_t table_size, count, i;
+	LookupEntry *table = (LookupEntry*)ReadResource(wim, wim_size, h, &h->lookup_table, &table_size);
+	if (table == NULL) { return NULL; }
+	count = table_size / sizeof(LookupEntry);
+	for (i = 0; i < count && !(table[i].res.flags & RESHDR_METADATA); ++i);
+	size_t meta_size;
+	LPBYTE meta = (i == count) ? NULL : ReadResource(wim, wim_size, h, &table[i].res, &meta_size);
+	if (meta == NULL) { if (i == count) { SetLastError(ERROR_INVALID_DATA); } free(table); return NULL; }
+
+	// The root directory follows the security data, whose size is its first 4 bytes
+	const Dentry *d = NULL;
+	if (meta_size >= 8) {
+		const ULONGLONG root = roundUp8(MAX(*(DWORD*)meta, 8));
+		if (root <= meta_size && sizeof(Dentry) <= meta_size - root) { d = (const Dentry*)(meta + root); }
 	}
-	UI::Inc();
-
-	HANDLE hImg = WIMCaptureImage(hWim, src, 0);
-	WIMUnregisterMessageCallback(hWim, (FARPROC)&callback);
-	if (hImg == NULL) {
-		WIMCloseHandle(hWim);
-		return false;
+	if (d == NULL) { free(meta); free(table); SetLastError(ERROR_INVALID_DATA); return NULL; }
+
+	// Follow the path one name at a time
+	while (d && *file) {
+		while (*file == L'\\' || *file == L'/') { ++file; }
+		size_t len = 0;
+		while (file[len] && file[len] != L'\\' && file[len] != L'/') { ++len; }
+		if (len) { d = FindChild(meta, meta_size, d, file, len); }
+		file += len;
 	}
-	UI::Inc();
-
-	WCHAR *xml;
-	DWORD xmlSize = 0;
-	if (!WIMGetImageInformation(hImg, (LPVOID*)&xml, &xmlSize)) {
-		err = GetLastError();
+	if (d == NULL || (d->attributes & DENTRY_DIRECTORY)) { free(meta); free(table); SetLastError(ERROR_FILE_NOT_FOUND); return NULL; }
+
+	// Find the file's data by its hash, an empty file has no data
+	const BYTE *hash = FileHash(meta, meta_size, d);
+	LPBYTE data = NULL;
+	if (isZero(hash, HASH_SIZE)) {
+		if ((data = (LPBYTE)malloc(1)) != NULL) { *size = 0; }
+		else { SetLastError(ERROR_NOT_ENOUGH_MEMORY); }
 	} else {
-		size_t xml_len = removeExtraneousWS(xml);
-		UI::Inc();
-
-		WCHAR *new_xml = (WCHAR*)malloc((xml_len+64)*sizeof(WCHAR)); // only really need 30 more, but it doesn't hurt
-		wcsncpy(new_xml, xml, xml_len-END_IMAGE_LEN);
-		new_xml[xml_len-END_IMAGE_LEN] = 0;
-		wcscat(new_xml, WIM_NAME);
-		wcscat(new_xml, END_IMAGE);
-		if (!WIMSetImageInformation(hImg, new_xml, (DWORD)(sizeof(WCHAR)*(wcslen(new_xml)+1)))) {
-			err = GetLastError();
-		}
-		free(new_xml);
-		UI::Inc();
+		for (i = 0; i < count && ((table[i].res.flags & RESHDR_METADATA) || memcmp(table[i].hash, hash, HASH_SIZE) != 0); ++i);
+		if (i == count) { SetLastError(ERROR_INVALID_DATA); }
+		else { data = ReadResource(wim, wim_size, h, &table[i].res, size); }
 	}
+	free(meta);
+	free(table);
+	return data;
+}
+
+/////////////////// WIM Creation //////////////////////////////////////////////
 
-	WIMCloseHandle(hImg);
-	if (!WIMSetBootImage(hWim, 1)) {
-		err = GetLastError();
+// SHA-1, the hash that identifies every resource in a WIM
+typedef struct _SHA1 {
+	DWORD h[5];
+	BYTE block[64];
+	ULONGLONG len;
+} SHA1;
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+static void SHA1_Block(SHA1 *s, const BYTE *p) {
+	DWORD w[80], a = s->h[0], b = s->h[1], c = s->h[2], d = s->h[3], e = s->h[4], f, k, t;
+	int i;
+	for (i = 0; i < 16; ++i) { w[i] = (p[4*i] << 24) | (p[4*i+1] << 16) | (p[4*i+2] << 8) | p[4*i+3]; }
+	for (; i < 80; ++i) { w[i] = ROTL(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1); }
+	for (i = 0; i < 80; ++i) {
+		if (i < 20)			{ f = (b & c) | (~b & d);			k = 0x5A827999; }
+		else if (i < 40)	{ f = b ^ c ^ d;					k = 0x6ED9EBA1; }
+		else if (i < 60)	{ f = (b & c) | (b & d) | (c & d);	k = 0x8F1BBCDC; }
+		else				{ f = b ^ c ^ d;					k = 0xCA62C1D6; }
+		t = ROTL(a, 5) + f + e + k + w[i];
+		e = d; d = c; c = ROTL(b, 30); b = a; a = t;
 	}
-	WIMCloseHandle(hWim);
-	UI::Inc();
+	s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d; s->h[4] += e;
+}
+static void SHA1_Init(SHA1 *s) {
+	s->h[0] = 0x67452301; s->h[1] = 0xEFCDAB89; s->h[2] = 0x98BADCFE; s->h[3] = 0x10325476; s->h[4] = 0xC3D2E1F0;
+	s->len = 0;
+}
+static void SHA1_Update(SHA1 *s, const BYTE *p, size_t n) {
+	while (n) {
+		const size_t used = (size_t)(s->len & 63), x = MIN(64 - used, n);
+		memcpy(s->block + used, p, x);
+		s->len += x; p += x; n -= x;
+		if ((s->len & 63) == 0) { SHA1_Block(s, s->block); }
+	}
+}
+static void SHA1_Final(SHA1 *s, BYTE *hash) {
+	const ULONGLONG bits = s->len * 8;
+	BYTE pad[72] = { 0x80 };
+	const size_t n = ((s->len & 63) < 56 ? 56 : 120) - (size_t)(s->len & 63);
+	for (int i = 0; i < 8; ++i) { pad[n+i] = (BYTE)(bits >> (56 - 8*i)); }
+	SHA1_Update(s, pad, n + 8);
+	for (int i = 0; i < 20; ++i) { hash[i] = (BYTE)(s->h[i/4] >> (24 - 8*(i%4))); }
+}
+static void Hash(const void *data, size_t size, BYTE *hash) { SHA1 s; SHA1_Init(&s); SHA1_Update(&s, (const BYTE*)data, size); SHA1_Final(&s, hash); }
+
+#define WIM_VERSION				0x10D00
+#define DENTRY_ARCHIVE			0x20 // FILE_ATTRIBUTE_ARCHIVE
+#define DENTRY_BASE_LENGTH		102 // the size of the Dentry without the padding the compiler would add
+#define NO_SECURITY				-1
+#define FILETIME_UNIX_EPOCH		116444736000000000ull // 1970 in 100 ns intervals since 1601
+
+static void SetResHdr(ResHdr *r, ULONGLONG size, BYTE flags, ULONGLONG offset, ULONGLONG original_size) {
+	for (int i = 0; i < 7; ++i) { r->size[i] = (BYTE)(size >> (8*i)); }
+	r->flags = flags;
+	r->offset = offset;
+	r->original_size = original_size;
+}
+
+// Writes a resource at the end of the WIM, compressing it if that makes it smaller
+static ULONGLONG WriteResource(LPBYTE wim, ULONGLONG pos, const BYTE *data, ULONG size, int format, BYTE flags, ULONG threads, ResHdr *r) {
+	ULONG c_size = size ? wimzip_compress_resource(format, data, size, wim + pos, wimzip_resource_bound(size), threads) : 0;
+	if (c_size && c_size < size) { flags |= RESHDR_COMPRESSED; }
+	else { memcpy(wim + pos, data, size); c_size = size; }
+	SetResHdr(r, c_size, flags, pos, size);
+	return pos + c_size;
+}
+
+// Builds the metadata of an image with a single file in the root directory: the (empty) security data, the root, and the file
+static LPBYTE CreateMetadata(LPCWSTR name, const BYTE *hash, ULONGLONG time, ULONG *size) {
+	const WORD name_nbytes = (WORD)(wcslen(name) * sizeof(WCHAR));
+	const ULONG root = 8, root_len = (ULONG)roundUp8(DENTRY_BASE_LENGTH), files = root + root_len + 8;
+	const ULONG file_len = (ULONG)roundUp8(DENTRY_BASE_LENGTH + name_nbytes + sizeof(WCHAR));
+	*size = files + file_len + 8;
+	LPBYTE meta = (LPBYTE)calloc(*size, 1);
+	if (meta == NULL) { SetLastError(ERROR_NOT_ENOUGH_MEMORY); return NULL; }
+	*(DWORD*)meta = 8; // total length of the security data, with no entries
+
+	Dentry *d = (Dentry*)(meta + root);
+	d->length = root_len;
+	d->attributes = DENTRY_DIRECTORY;
+	d->security_id = NO_SECURITY;
+	d->subdir_offset = files;
+	d->creation_time = d->last_access_time = d->last_write_time = time;
+
+	d = (Dentry*)(meta + files);
+	d->length = file_len;
+	d->attributes = DENTRY_ARCHIVE;
+	d->security_id = NO_SECURITY;
+	d->creation_time = d->last_access_time = d->last_write_time = time;
+	memcpy(d->hash, hash, HASH_SIZE);
+	d->file_name_nbytes = name_nbytes;
+	memcpy(meta + files + DENTRY_BASE_LENGTH, name, name_nbytes);
+	return meta;
+}
 
-	return err == ERROR_SUCCESS;
+// Builds the XML data, which is UTF-16 with a BOM and no terminator
+static LPWSTR CreateXML(ULONGLONG xml_offset, ULONGLONG size, ULONGLONG time, ULONG *nbytes) {
+	char xml[640]; // the text is about 400 characters with the largest numbers
+	const ULONG hi = (ULONG)(time >> 32), lo = (ULONG)time;
+	const int len = sprintf(xml, "\xFF<WIM><TOTALBYTES>%llu</TOTALBYTES><IMAGE INDEX=\"1\"><DIRCOUNT>0</DIRCOUNT><FILECOUNT>1</FILECOUNT>"
+		"<TOTALBYTES>%llu</TOTALBYTES><HARDLINKBYTES>0</HARDLINKBYTES>"
+		"<CREATIONTIME><HIGHPART>0x%08X</HIGHPART><LOWPART>0x%08X</LOWPART></CREATIONTIME>"
+		"<LASTMODIFICATIONTIME><HIGHPART>0x%08X</HIGHPART><LOWPART>0x%08X</LOWPART></LASTMODIFICATIONTIME>"
+		"<NAME>Boot Resource WIM</NAME></IMAGE></WIM>", (unsigned long long)xml_offset, (unsigned long long)size, hi, lo, hi, lo);
+	LPWSTR x = (LPWSTR)malloc(len * sizeof(WCHAR));
+	if (x == NULL) { SetLastError(ERROR_NOT_ENOUGH_MEMORY); return NULL; }
+	x[0] = 0xFEFF;
+	for (int i = 1; i < len; ++i) { x[i] = (WCHAR)(BYTE)xml[i]; }
+	*nbytes = len * sizeof(WCHAR);
+	return x;
+}
+
+void *WIM::Create(LPCWSTR name, const void *data, size_t size, size_t *wim_size, bool xpress, ULONG threads)
+{
+	if (size > 0xFFFFFFFF - 0x100000) { SetLastError(ERROR_INVALID_PARAMETER); return NULL; }
+	const ULONGLONG time = FILETIME_UNIX_EPOCH + (ULONGLONG)::time(NULL) * 10000000;
+	const int format = xpress ? WIMZIP_XPRESS : WIMZIP_LZX;
+	BYTE hash[HASH_SIZE] = {0};
+	if (size) { Hash(data, size, hash); }
+
+	ULONG meta_size, xml_nbytes;
+	LPBYTE meta = CreateMetadata(name, hash, time, &meta_size);
+	if (meta == NULL) { return NULL; }
+
+	// Everything is written in order: header, file, metadata, lookup table, and XML data
+	// There is room for everything to be stored uncompressed, and the XML is small
+	const size_t max_size = sizeof(WimHeader) + wimzip_resource_bound((ULONG)size) + wimzip_resource_bound(meta_size) + 2*sizeof(LookupEntry) + 0x1000;
+	LPBYTE wim = (LPBYTE)calloc(max_size, 1);
+	if (wim == NULL) { free(meta); SetLastError(ERROR_NOT_ENOUGH_MEMORY); return NULL; }
+	WimHeader *h = (WimHeader*)wim;
+	LookupEntry table[2];
+	ULONG count = 0;
+	memset(table, 0, sizeof(table));
+
+	// The file (compressed in parallel) and the metadata
+	ULONGLONG pos = sizeof(WimHeader);
+	if (size) {
+		const ULONGLONG end = WriteResource(wim, pos, (const BYTE*)data, (ULONG)size, format, 0, threads, &table[count].res);
+		if (end == pos) { free(meta); free(wim); return NULL; }
+		memcpy(table[count].hash, hash, HASH_SIZE);
+		table[count].part_number = 1; table[count++].ref_count = 1; pos = end;
+	}
+	const ULONGLONG meta_end = WriteResource(wim, pos, meta, meta_size, format, RESHDR_METADATA, 1, &table[count].res);
+	if (meta_end == pos) { free(meta); free(wim); return NULL; }
+	Hash(meta, meta_size, table[count].hash);
+	table[count].part_number = 1; table[count++].ref_count = 1; pos = meta_end;
+	h->boot_metadata = table[count-1].res;
+	free(meta);
+
+	// The lookup table and XML data are never compressed
+	memcpy(wim + pos, table, count*sizeof(LookupEntry));
+	SetResHdr(&h->lookup_table, count*sizeof(LookupEntry), 0, pos, count*sizeof(LookupEntry));
+	pos += count*sizeof(LookupEntry);
+	LPWSTR xml = CreateXML(pos, size, time, &xml_nbytes);
+	if (xml == NULL) { free(wim); return NULL; }
+	memcpy(wim + pos, xml, xml_nbytes);
+	free(xml);
+	SetResHdr(&h->xml_data, xml_nbytes, 0, pos, xml_nbytes);
+	pos += xml_nbytes;
+
+	// The header, the GUID only has to be unique so it is taken from the hash of the WIM
+	memcpy(h->magic, WIM_MAGIC, sizeof(h->magic));
+	h->header_size = sizeof(WimHeader);
+	h->version = WIM_VERSION;
+	h->flags = WIM_HDR_COMPRESSION | (xpress ? WIM_HDR_XPRESS : WIM_HDR_LZX);
+	h->chunk_size = WIMZIP_LZX_CHUNK_SIZE;
+	h->part_number = h->total_parts = 1;
+	h->image_count = 1;
+	h->boot_index = 1;
+	Hash(wim + sizeof(WimHeader), (size_t)(pos - sizeof(WimHeader)), hash);
+	memcpy(h->guid, hash, sizeof(h->guid));
+
+	LPBYTE x = (LPBYTE)realloc(wim, (size_t)pos);
+	*wim_size = (size_t)pos;
+	return x ? x : wim;
 }
@@ -19,6 +19,12 @@
 #pragma once
 
 namespace Win7BootUpdater { namespace WIM {
+	// Extracts a file from the first image of a WIM in memory, the size is the size of the WIM and becomes the size of the file
+	// The returned data must be freed, NULL if the file cannot be found or the WIM is invalid
 	void *ExtractFile(void *wim, LPCWSTR file, size_t *size);
-	bool Create(LPCWSTR src, LPCWSTR dest, LPCWSTR activity);
+
+	// Creates a WIM in memory with a single image that has a single file in its root, like the boot resource WIMs
+	// The file is compressed with LZX (or XPRESS) in 32 KB chunks using up to the given number of threads (0 for one per processor)
+	// The returned data must be freed, NULL if it fails
+	void *Create(LPCWSTR name, const void *data, size_t size, size_t *wim_size, bool xpress = false, ULONG threads = 0);
 } }
@@ -0,0 +1,236 @@
+/*
+ * Windows 7 Boot Updater (github.com/coderforlife/windows-7-boot-updater)
+ * Copyright (C) 2021  Jeffrey Bush - Coder for Life
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "WimCache.h"
+
+#include "Files.h"
+#include "WIM.h"
+
+using namespace Win7BootUpdater;
+using namespace Win7BootUpdater::Files;
+
+using namespace System;
+using namespace System::Drawing;
+using namespace System::Drawing::Imaging;
+using namespace System::IO;
+using namespace System::Runtime::InteropServices;
+using namespace System::Security::AccessControl;
+using namespace System::Security::Cryptography;
+using namespace System::Security::Principal;
+
+// Changes whenever the WIMs that are created change, so old WIMs are never used
+#define KEY_VERSION	L"WIM2"
+#define EXT			L".wim"
+
+// Each cached WIM is followed by its SHA-256 so a damaged or partially written file is never used
+// This does not stop someone from replacing a WIM and its hash together, only the permissions of the folder do that
+#define HASH_SIZE	32
+
+string WimCache::Dir::get() {
+	if (!_dir)
+		_dir = Path::Combine(Path::Combine(Environment::GetFolderPath(Environment::SpecialFolder::CommonApplicationData), L"Win7BootUpdater"), L"WimCache");
+	return _dir;
+}
+
+long long WimCache::MaxSize::get() { return _maxSize; }
+void WimCache::MaxSize::set(long long value) { _maxSize = Math::Max(value, 0LL); }
+int WimCache::Hits::get() { return _hits; }
+int WimCache::Misses::get() { return _misses; }
+
+// The cached WIMs are written into bootres.dll with administrator rights, so a WIM that a user could change would let them change what is booted
+// The folders are only used if they are owned by and can only be changed by administrators and the system, otherwise nothing is cached
+static bool IsTrusted(IdentityReference ^id) {
+	SecurityIdentifier ^sid = dynamic_cast<SecurityIdentifier^>(id);
+	return sid && (sid->IsWellKnown(WellKnownSidType::BuiltinAdministratorsSid) || sid->IsWellKnown(WellKnownSidType::LocalSystemSid));
+}
+#define WRITE_RIGHTS	(FileSystemRights::Write | FileSystemRights::Delete | FileSystemRights::DeleteSubdirectoriesAndFiles | FileSystemRights::ChangePermissions | FileSystemRights::TakeOwnership)
+static bool IsSecure(string dir) {
+	DirectorySecurity ^s = Directory::GetAccessControl(dir);
+	if (!IsTrusted(s->GetOwner(SecurityIdentifier::typeid))) { return false; }
+	for each (FileSystemAccessRule ^r in s->GetAccessRules(true, true, SecurityIdentifier::typeid))
+		if (r->AccessControlType == AccessControlType::Allow && (r->FileSystemRights & WRITE_RIGHTS) != (FileSystemRights)0 && !IsTrusted(r->IdentityReference))
+			return false;
+	return true;
+}
+static DirectorySecurity ^GetSecurity() {
+	SecurityIdentifier ^admins = gcnew SecurityIdentifier(WellKnownSidType::BuiltinAdministratorsSid, nullptr), ^system = gcnew SecurityIdentifier(WellKnownSidType::LocalSystemSid, nullptr);
+	InheritanceFlags inherit = InheritanceFlags::ContainerInherit | InheritanceFlags::ObjectInherit;
+	DirectorySecurity ^s = gcnew DirectorySecurity();
+	s->SetAccessRuleProtection(true, false); // nothing is inherited from the common application data folder
+	s->SetOwner(admins);
+	s->AddAccessRule(gcnew FileSystemAccessRule(admins, FileSystemRights::FullControl, inherit, PropagationFlags::None, AccessControlType::Allow));
+	s->AddAccessRule(gcnew FileSystemAccessRule(system, FileSystemRights::FullControl, inherit, PropagationFlags::None, AccessControlType::Allow));
+	return s;
+}
+// Checks the cache folder and the folder it is in, creating them if create is true, false if they can't be used
+static bool SecureDir(bool create) {
+	string dir = WimCache::Dir;
+	array<string> ^dirs = gcnew array<string>{ Path::GetDirectoryName(dir), dir };
+	try {
+		for each (string d in dirs) {
+			if (!Directory::Exists(d)) {
+				if (!create) { return false; }
+				Directory::CreateDirectory(d, GetSecurity());
+			}
+			if (!IsSecure(d)) { return false; }
+		}
+		return true;
+	} catch (Exception ^) {
+		return false;
+	}
+}
+
+static void HashBytes(HashAlgorithm ^h, array<byte> ^b) { h->TransformBlock(b, 0, b->Length, b, 0); }
+
+// Hashes the size and pixels of an image, row by row since the stride may include padding
+static void HashImage(HashAlgorithm ^h, Image ^img) {
+	Bitmap ^b = dynamic_cast<Bitmap^>(img);
+	bool own = b == nullptr;
+	if (own) { b = gcnew Bitmap(img); }
+	try {
+		HashBytes(h, BitConverter::GetBytes(b->Width));
+		HashBytes(h, BitConverter::GetBytes(b->Height));
+		BitmapData ^data = b->LockBits(Rectangle(0, 0, b->Width, b->Height), ImageLockMode::ReadOnly, PixelFormat::Format32bppArgb);
+		try {
+			array<byte> ^row = gcnew array<byte>(b->Width * 4);
+			for (int y = 0; y < b->Height; ++y) {
+				Marshal::Copy(IntPtr(data->Scan0.ToInt64() + (long long)y * data->Stride), row, 0, row->Length);
+				HashBytes(h, row);
+			}
+		} finally { b->UnlockBits(data); }
+	} finally { if (own) delete b; }
+}
+
+array<byte> ^WimCache::GetKey(Image ^anim, Color bgColor, Image ^bgImg) {
+	if (_maxSize == 0) { return nullptr; }
+	SHA256 ^h = SHA256::Create();
+	try {
+		HashBytes(h, Text::Encoding::ASCII->GetBytes(KEY_VERSION));
+		HashBytes(h, BitConverter::GetBytes(bgColor.ToArgb()));
+		HashImage(h, anim);
+		if (bgImg) { HashImage(h, bgImg); }
+		h->TransformFinalBlock(gcnew array<byte>(0), 0, 0);
+		return h->Hash;
+	} catch (Exception ^) {
+		return nullptr;
+	} finally { delete h; }
+}
+
+static string GetPath(array<byte> ^key) {
+	return Path::Combine(WimCache::Dir, BitConverter::ToString(key)->Replace(L"-", L"") + EXT);
+}
+
+static array<byte> ^HashData(const void *data, size_t size) {
+	SHA256 ^h = SHA256::Create();
+	UnmanagedMemoryStream ^s = gcnew UnmanagedMemoryStream((unsigned char*)data, (long long)size);
+	try {
+		return h->ComputeHash(s);
+	} finally { delete s; delete h; }
+}
+
+// Checks the hash that follows the data
+static bool CheckHash(const unsigned char *data, size_t size) {
+	try {
+		array<byte> ^hash = HashData(data, size);
+		for (int i = 0; i < HASH_SIZE; ++i)
+			if (hash[i] != data[size+i])
+				return false;
+		return true;
+	} catch (Exception ^) {
+		return false;
+	}
+}
+
+// Checks that the WIM has the bitmap with the given dimensions and that the bitmap is the size its header says
+static bool CheckBitmap(unsigned char *wim, size_t size, string file, int width, int height) {
+	void *bmp = WIM::ExtractFile(wim, as_native(L"\\" + file), &size);
+	if (bmp == NULL) { return false; }
+	const BITMAPFILEHEADER *fh = (BITMAPFILEHEADER*)bmp;
+	const BITMAPINFOHEADER *ih = (BITMAPINFOHEADER*)(fh+1);
+	bool ok = size >= sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) && fh->bfType == 0x4D42 && fh->bfSize == size && // "BM"
+		ih->biWidth == width && (ih->biHeight == height || ih->biHeight == -height) && ih->biBitCount != 0 &&
+		fh->bfOffBits + (((unsigned long long)width * ih->biBitCount + 31) / 32 * 4) * height <= size;
+	free(bmp);
+	return ok;
+}
+
+void *WimCache::Get(array<byte> ^key, string file, int width, int height, size_t *size) {
+	if (key == nullptr) { return NULL; }
+	string path = GetPath(key);
+	Bytes data;
+	if (SecureDir(false) && File::Exists(path) && (data = ReadAll(as_native(path)))) {
+		if (*data > HASH_SIZE && CheckHash(data, *data - HASH_SIZE) && CheckBitmap(data, *data - HASH_SIZE, file, width, height)) {
+			++_hits;
+			*size = *data - HASH_SIZE;
+			try {
+				File::SetLastAccessTimeUtc(path, DateTime::UtcNow); // the system may not keep track of this itself
+			} catch (Exception ^) {}
+			return data;
+		}
+		// Remove the bad WIM so it is created again and replaced
+		free(data);
+		try {
+			File::Delete(path);
+		} catch (Exception ^) {}
+	}
+	++_misses;
+	return NULL;
+}
+
+// Removes the least recently used WIMs until they all fit
+static void Trim(long long maxSize) {
+	array<FileInfo^> ^files = (gcnew DirectoryInfo(WimCache::Dir))->GetFiles(L"*" EXT);
+	array<DateTime> ^times = gcnew array<DateTime>(files->Length);
+	long long total = 0;
+	for (int i = 0; i < files->Length; ++i) {
+		times[i] = files[i]->LastAccessTimeUtc;
+		total += files[i]->Length;
+	}
+	Array::Sort(times, files);
+	for (int i = 0; i < files->Length && total > maxSize; ++i) {
+		try {
+			long long size = files[i]->Length;
+			files[i]->Delete();
+			total -= size;
+		} catch (Exception ^) {}
+	}
+}
+
+void WimCache::Add(array<byte> ^key, void *data, size_t size) {
+	if (key == nullptr || data == NULL || (long long)size > _maxSize || !SecureDir(true)) { return; }
+	try {
+		string path = GetPath(key), temp = path + L".tmp";
+		// Written to a temporary name first so a partial WIM is never used
+		array<byte> ^hash = HashData(data, size);
+		pin_ptr<byte> h = &hash[0];
+		HANDLE f = CreateFile(as_native(temp), FILE_WRITE_DATA, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (f == INVALID_HANDLE_VALUE) { return; }
+		bool written = Write(f, data, (uint)size) && Write(f, h, HASH_SIZE);
+		CloseHandle(f);
+		if (!written) { File::Delete(temp); return; }
+		if (File::Exists(path)) { File::Delete(path); }
+		File::Move(temp, path);
+		Trim(_maxSize);
+	} catch (Exception ^) {}
+}
+
+void WimCache::Clear() {
+	try {
+		if (SecureDir(false)) { Trim(0); }
+	} catch (Exception ^) {}
+}
@@ -0,0 +1,56 @@
+/*
+ * Windows 7 Boot Updater (github.com/coderforlife/windows-7-boot-updater)
+ * Copyright (C) 2021  Jeffrey Bush - Coder for Life
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+namespace Win7BootUpdater {
+	/// <remarks>The cache of finished boot animation WIMs, so applying the same animation again does not need to recompress it</remarks>
+	/// <remarks>The WIMs are kept in a folder of the common application data named by the hash of the animation and its background</remarks>
+	/// <remarks>The folder is only used when only administrators and the system can change it since the WIMs are written into bootres.dll</remarks>
+	PUBLIC ref struct WimCache abstract sealed {
+	private:
+		static string _dir = nullptr;
+		static long long _maxSize = 64 * 1024 * 1024;
+		static int _hits = 0, _misses = 0;
+
+	public:
+		/// <summary>The folder the cached WIMs are kept in</summary>
+		static property string Dir { string get(); };
+
+		/// <summary>The total size the cached WIMs are allowed to take up, once over this the least recently used WIMs are removed, 0 disables the cache</summary>
+		static property long long MaxSize { long long get(); void set(long long value); };
+
+		/// <summary>The number of times an animation was found in the cache</summary>
+		static property int Hits { int get(); };
+
+		/// <summary>The number of times an animation was not found in the cache</summary>
+		static property int Misses { int get(); };
+
+		/// <summary>Removes all of the cached WIMs</summary>
+		static void Clear();
+
+	internal:
+		// Gets the key of an animation, the hash of its pixels along with the background color and image (which may be null)
+		static array<byte> ^GetKey(System::Drawing::Image ^anim, System::Drawing::Color bgColor, System::Drawing::Image ^bgImg);
+		// Gets the WIM for a key, the data must be freed, NULL if not cached
+		// A cached WIM that does not match its hash or whose file isn't a bitmap of the given dimensions is removed and NULL is returned
+		static void *Get(array<byte> ^key, string file, int width, int height, size_t *size);
+		// Adds a WIM to the cache, removing old WIMs as necessary
+		static void Add(array<byte> ^key, void *data, size_t size);
+	};
+}
@@ -173,7 +173,7 @@ Color WinXXX::GetColorFromXml(string xml) {
 ///////////////////////////////////////////////////////////////////////////////
 ///// Updating Functions
 ///////////////////////////////////////////////////////////////////////////////
-#define APPLY_(id, x)	patch->Apply(f, PATCH_##id, x)
+#define APPLY_(id, x)	patch->Apply(f, PATCH_##id, x, &symbols)
 #define APPLY(id, x)	(APPLY_(id, x) && UI::Inc())
 #define REVERT(id)		patch->Revert(f, PATCH_##id)
 
@@ -185,9 +185,12 @@ uint WinXXX::Update(int msgCount, Color bg, string text, array<int> ^textSize, a
 	altBootres &= winresume;
 
 	// Retrieve a PEFileHandle for the file (1 increment)
-	if ((f = new PEFile(as_native(fu.path))) == NULL || !f->isLoaded() || !UI::Inc())					{ if (f) delete f; return ERROR_WINX(LOAD); }
+	if ((f = new PEFile(as_native(fu.path))) == NULL || !f->isLoaded() || !f->beginBatch() || !UI::Inc())					{ if (f) delete f; return ERROR_WINX(LOAD); }
 
 	PatchFile ^patch = Res::GetPatch(WINX_NAME);
+	PatchSymbols symbols; // the functions called by the patches applied below are looked up together, only loading the PDB once
+	bool color2 = !textColor[1].Equals(Color::White);
+	patch->AddSymbols(f, color2 ? gcnew array<ushort>{PATCH_MSG_BG, PATCH_PROP_1, PATCH_YPOS_2, PATCH_SIZE_2, PATCH_COLOR_2} : gcnew array<ushort>{PATCH_MSG_BG, PATCH_PROP_1, PATCH_YPOS_2, PATCH_SIZE_2}, &symbols);
 
 	// 0 increments
 	if (!patch->ApplyIgnoringApplied(f))							{ error = ERROR_WINX(HACK); }
@@ -197,9 +200,9 @@ uint WinXXX::Update(int msgCount, Color bg, string text, array<int> ^textSize, a
 	else if (!APPLY(MSG_BG,	C_TO_RGB(bg)))							{ error = ERROR_WINX(PROP); }
 	else if (!APPLY(TEXT_1,	text))									{ error = ERROR_WINX(COPYRIGHT); }
 	else if (!APPLY(PROP_1, text1prop) || !APPLY(YPOS_2, textPos[1]) || !APPLY(SIZE_2, textSize[1]))	{ error = ERROR_WINX(PROP); }
-	else if (!textColor[1].Equals(Color::White) && !APPLY_(COLOR_2, C_TO_RGB(textColor[1])))			{ error = ERROR_WINX(PROP); }
+	else if (color2 && !APPLY_(COLOR_2, C_TO_RGB(textColor[1])))	{ error = ERROR_WINX(PROP); }
 	else if (altBootres && !APPLY_(BOOTRES_PATH, Bootres::altPath))	{ error = ERROR_WINX(PROP); }
-	else if (!f->updatePEChkSum())									{ error = ERROR_WINX(PROP); }
+	else if (!f->commit())											{ error = ERROR_WINX(PROP); }
 
 	// Cleanup
 	if (f) delete f;
@@ -213,9 +216,11 @@ uint WinXXX::Update(bool altBootres, FileUpdater fu, bool winresume) {
 	altBootres &= winresume;
 
 	// Retrieve a PEFileHandle for the file (1 increment)
-	if ((f = new PEFile(as_native(fu.path))) == NULL || !f->isLoaded() || !UI::Inc())	{ if (f) delete f; return ERROR_WINX(LOAD); }
+	if ((f = new PEFile(as_native(fu.path))) == NULL || !f->isLoaded() || !f->beginBatch() || !UI::Inc())	{ if (f) delete f; return ERROR_WINX(LOAD); }
 
 	PatchFile ^patch = Res::GetPatch(WINX_NAME);
+	PatchSymbols symbols; // the functions called by the patches applied below are looked up together, only loading the PDB once
+	patch->AddSymbols(f, gcnew array<ushort>{PATCH_PROP_1, PATCH_BG_IMAGE}, &symbols);
 
 	// 0 increments
 	if (!patch->ApplyIgnoringApplied(f))							{ error = ERROR_WINX(HACK); }
@@ -226,8 +231,8 @@ uint WinXXX::Update(bool altBootres, FileUpdater fu, bool winresume) {
 	else if (altBootres && !APPLY_(BOOTRES_PATH, Bootres::altPath))	{ error = ERROR_WINX(PROP); }
 
 	// 4 increments
-	else if (!patch->Apply(f, PATCH_BG_IMAGE) || !UI::Inc(4))		{ error = ERROR_WINX(PROP); }
-	else if (!f->updatePEChkSum())									{ error = ERROR_WINX(PROP); }
+	else if (!patch->Apply(f, PATCH_BG_IMAGE, &symbols) || !UI::Inc(4))	{ error = ERROR_WINX(PROP); }
+	else if (!f->commit())											{ error = ERROR_WINX(PROP); }
 
 	// Cleanup
 	if (f) delete f;
@@ -361,9 +366,8 @@ uint WinXXX::UpdateRes(Image ^bg, Color color, FileUpdater fu, bool winresume) {
 string GetStartupMessage(PEFile *f, ushort lang, bool winresume) {
 	void *data;
 	size_t size;
-	if ((data = f->getResource(RT_MESSAGETABLE, MAKEINTRESOURCE(1), lang, &size)) != NULL) {
+	if ((data = f->getResourceView(RT_MESSAGETABLE, MAKEINTRESOURCE(1), lang, &size)) != NULL) {
 		MessageTable ^msgTbl = gcnew MessageTable((byte*)data, size);
-		free(data);
 		if (msgTbl->ContainsId(STARTUP_MSG_ID))
 			return msgTbl[STARTUP_MSG_ID];
 	}
@@ -384,16 +388,16 @@ static Image ^GetBackgroundImage(PEFile *f, ushort lang, bool winresume) {
 }
 static Color GetBackgroundColor(PEFile *f, ushort lang, bool winresume) {
 	// Get the resource
-	Bytes data;
-	if ((data = (BYTE*)f->getResource(RT_HTML, XSL_NAME, lang, &data)) == NULL) { return Color::Empty; }
+	void *data;
+	size_t size;
+	if ((data = f->getResourceView(RT_HTML, XSL_NAME, lang, &size)) == NULL) { return Color::Empty; }
 
 	// Find the color string
-	LPWSTR str = FindBackgroundColor(~data, winresume);
-	if (str == NULL)	{ free(data); return Color::Empty; }
+	LPWSTR str = FindBackgroundColor(data, winresume);
+	if (str == NULL)	{ return Color::Empty; }
 
 	// Copy the old color
 	string xml = gcnew String(str, 0, 4);
-	free(data);
 
 	// Get the actual color
 	return WinXXX::GetColorFromXml(xml);
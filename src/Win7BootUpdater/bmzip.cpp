@@ -17,6 +17,7 @@
  */
 
 #include "bmzip.h"
+#include "Cpu.h"
 
 // Get the minimum of 2
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
@@ -24,110 +25,187 @@
 // The character to fill in empty space
 #define FILL_BYTE	' '
 
+// The largest a single fragment can become when compressed, including the header
+#define FRAGMENT_BOUND	(2+0x1000)
+
 // Pre-calculated data for decompression and compression
 const static USHORT pow2[]  = { 16,    32,    64,    128,   256,   512,   1024,  2048,  4096  };
 const static USHORT masks[] = { 0xFFF, 0x7FF, 0x3FF, 0x1FF, 0x0FF, 0x07F, 0x03F, 0x01F, 0x00F };
 const static USHORT shift[] = { 12,    11,    10,    9,     8,     7,     6,     5,     4     };
 
 
-/////////////////// Dictionary Functions //////////////////////////////////////
-
-#define MAX_BYTE	256		// maximum byte value (+1 for 0)
-#define MAX_SIZE	4096	// maximum dictionary size
-#define NONE		-1		// value for when a value is not present in the dictionary
+/////////////////// Matching and Copying Functions ////////////////////////////
+
+// Whether to use the SSE2 versions of the functions below, decided once at startup
+// Defining BMZIP_NO_SSE2 forces the plain versions, for comparing the two
+#ifdef BMZIP_NO_SSE2
+static const bool use_sse2 = false;
+#else
+static const bool use_sse2 = CpuHasSSE2();
+#endif
+
+// Finds the length of the match between a and b, starting at j and up to max
+static inline ULONG MatchLength(const BYTE *a, const BYTE *b, ULONG j, const ULONG max) {
+	if (use_sse2) {
+		// Compare 16 bytes at a time, the first mismatch is the lowest bit not set in the mask
+		for (; j + 16 <= max; j += 16) {
+			const int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a+j)), _mm_loadu_si128((const __m128i*)(b+j))));
+			if (mask != 0xFFFF) {
+				unsigned long k = 0;
+				_BitScanForward(&k, ~mask);
+				return j + k;
+			}
+		}
+	}
+	while (j < max && a[j] == b[j]) { ++j; }
+	return j;
+}
 
-// An entry within the dictionary
-typedef struct _Entry {
-	short size;
-	USHORT pos[MAX_SIZE];
-	short first[MAX_BYTE];
-	short last[MAX_BYTE];
-} Entry;
+// Copies len bytes that start offset bytes before u to u, where the source and destination may overlap
+// With an overlap the copied bytes repeat every offset bytes
+static inline void CopyMatch(BYTE *u, const ULONG offset, ULONG len) {
+	if (offset >= len) {
+		// No overlap
+		memcpy(u, u-offset, len);
+	} else if (offset == 1) {
+		// Repeat the most recent byte len times
+		memset(u, u[-1], len);
+	} else if (use_sse2 && len >= 16) {
+		// When the offset is short, first copy enough bytes so that a multiple of the offset is at least 16 bytes back
+		// Then each 16 byte copy comes from an area that is already finished and the repeats line up
+		const ULONG step = (offset >= 16) ? offset : (offset * ((16 + offset - 1) / offset));
+		ULONG i;
+		for (i = step - offset; i; --i, ++u, --len) { *u = *(u-offset); }
+		for (; len >= 16; u += 16, len -= 16) { _mm_storeu_si128((__m128i*)u, _mm_loadu_si128((const __m128i*)(u-step))); }
+		memcpy(u, u-step, len);
+	} else {
+		// Copy offset bytes at a time from offset ago to fill up len
+		for (; offset < len; u += offset, len -= offset) { memcpy(u, u-offset, offset); }
+		memcpy(u, u-offset, len);
+	}
+}
 
-// The dictionary
-typedef struct _Dictionary {
-	Entry entries[MAX_BYTE];
-} Dictionary;
 
-// Creates and returns an uninitialized dictionary struct
-static Dictionary *Dictionary_Create() { return (Dictionary*)malloc(sizeof(Dictionary)); }
+/////////////////// Dictionary Functions //////////////////////////////////////
 
-// Destroys a dictionary struct
-static void Dictionary_Destroy(Dictionary *d) { free(d); }
+#define MAX_SIZE	4096	// maximum dictionary size
+#define NONE		0xFFFF	// value for when a value is not present in the dictionary
+
+#define HASH_BITS	12
+#define HASH_SIZE	(1 << HASH_BITS)
+#define HASH(u)		((((u)[0] << 16 | (u)[1] << 8 | (u)[2]) * 2654435761u) >> (32 - HASH_BITS))
+
+#define POS_BITS	12		// number of bits in head entries used for the position, the rest are the generation
+#define POS_MASK	((1 << POS_BITS) - 1)
+#define MAX_GEN		(0xFFFFFFFF >> POS_BITS)
+
+// The dictionary, positions are hash-chained on their first three bytes
+// Instead of clearing head for every fragment the generation is incremented, making all older entries empty
+struct _bmzip_ctx {
+	ULONG gen;				// the current generation
+	ULONG head[HASH_SIZE];	// the generation and most recent position for each hash
+	USHORT prev[MAX_SIZE];	// the previous position with the same hash as each position
+};
+typedef bmzip_ctx Dictionary;
+
+// Initializes a dictionary struct
+static void Dictionary_Init(Dictionary *d) {
+	d->gen = 0;
+	memset(d->head, 0, sizeof(d->head));
+}
 
 // Resets a dictionary struct ready to start a new fragment
 static void Dictionary_Reset(Dictionary *d) {
-	int i;
-	for (i = 0; i < ARRAYSIZE(d->entries); ++i) {
-		d->entries[i].size = 0;
-		memset(d->entries[i].first, NONE, sizeof(d->entries[i].first));
-	}
+	if (++d->gen > MAX_GEN) { Dictionary_Init(d); d->gen = 1; } // only happens once every million fragments
+}
+
+// Gets the most recent position with the given hash
+static inline USHORT Dictionary_Head(const Dictionary *d, const ULONG h) {
+	const ULONG x = d->head[h];
+	return ((x >> POS_BITS) == d->gen) ? (USHORT)(x & POS_MASK) : NONE;
 }
 
 // Adds the symbol at u[pos] to the dictionary
 static void Dictionary_Add(Dictionary *d, const BYTE *u, const USHORT pos, const ULONG len) {
 	if (len-pos >= 3) {
-		const BYTE x = u[pos], y = u[pos+1];
-		Entry *e = d->entries+x;
-		e->pos[e->size] = pos; // pos will never be >4096
-		if (e->first[y] == NONE)
-			e->first[y] = e->size;
-		e->last[y] = ++e->size; // it is 1 past last
+		const ULONG h = HASH(u+pos);
+		d->prev[pos] = Dictionary_Head(d, h); // pos will never be >4096
+		d->head[h] = (d->gen << POS_BITS) | pos;
+	}
+}
+
+bmzip_ctx *bmzip_ctx_create() {
+	bmzip_ctx *ctx = (bmzip_ctx*)malloc(sizeof(bmzip_ctx));
+	if (ctx == NULL) { SetLastError(ERROR_NOT_ENOUGH_MEMORY); return NULL; }
+	Dictionary_Init(ctx);
+	return ctx;
+}
+
+void bmzip_ctx_destroy(bmzip_ctx *ctx) { free(ctx); }
+
+// Checks if the data at u[pos] repeats the last byte or the last two bytes
+// Returns the length of the repeat, or 0 if it is not a repeat, and sets o to the position being repeated
+static ULONG FindRepeat(const BYTE *u, const ULONG pos, const ULONG max_len, ULONG *o) {
+	const BYTE x = u[pos], y = u[pos+1], z = u[pos+2];
+	ULONG l = 0;
+	if (x == z && y == u[pos-1]) {
+		if (x == y) { // x == y, x == z, x == u[pos-1]
+			// repeating the last byte
+			*o = pos-1;
+			l = MatchLength(u+pos, u+pos-1, 3, max_len);
+		} else if (pos > 1 && x == u[pos-2]) { // x == z, x == u[pos-2], y == u[pos-1]
+			// repeating the last two bytes
+			l = 3;
+			*o = pos-2;
+			while (l < max_len && u[pos+l] == y)	{ ++l;
+				if(l < max_len && u[pos+l] == x)	{ ++l; }
+				else break;
+			}
+		}
 	}
+	return l;
 }
 
 // Finds the best symbol in the dictionary for the data at u[pos]
 // Returns the length of the string found, or 0 if nothing of length >= 3 was found
-// Val is set to the LZ-bootmgr coded value for the string, based on cur
-static ULONG Dictionary_Find(const Dictionary *d, const BYTE *u, const ULONG pos, const ULONG len, const ULONG cur, ULONG *val) {
+// Off is set to how far back the string is
+// At most depth previous positions are checked, unless it is BMZIP_MAX_RATIO in which case all are checked
+// Either search stops as soon as a match reaches max_len since nothing can be longer
+// u[p+j] is either before pos or already matched, so the matches allow l > o
+static ULONG Dictionary_Find(const Dictionary *d, const BYTE *u, const ULONG pos, const ULONG len, const ULONG cur, ULONG depth, ULONG *off) {
 	ULONG max_len = len-pos;
 	if (pos > 0 && max_len > 3) {
-		const BYTE x = u[pos], y = u[pos+1];
-		const Entry *e = d->entries+x;
-		int ep = e->first[y];
-		if (ep != NONE) { // a match is possible
-			ULONG l = 0, o;
-			const BYTE z = u[pos+2];
-			int last = e->last[y];
-			if (max_len > masks[cur]+3u) max_len = masks[cur]+3u;
-
-			// try short repeats
-			if (x == z && y == u[pos-1]) {
-				if (x == y) { // x == y, x == z, x == u[pos-1]
-					// repeating the last byte
-					l = 3;
-					o = pos-1;
-					while (l < max_len && u[pos+l] == x)	{ ++l; }
-					--last;
-				} else if (pos > 1 && x == u[pos-2]) { // x == z, x == u[pos-2], y == u[pos-1]
-					// repeating the last two bytes
-					l = 3;
-					o = pos-2;
-					while (l < max_len && u[pos+l] == y)	{ ++l;
-						if(l < max_len && u[pos+l] == x)	{ ++l; }
-						else break;
-					}
-					--last;
+		ULONG l, o;
+		USHORT p;
+		const BYTE x = u[pos], y = u[pos+1], z = u[pos+2];
+		if (max_len > masks[cur]+3u) max_len = masks[cur]+3u;
+
+		// try short repeats
+		l = FindRepeat(u, pos, max_len, &o);
+
+		if (depth == BMZIP_MAX_RATIO) {
+			// do an exhaustive search, finding the oldest of the longest matches (or the newest full-length one)
+			ULONG best = l, b = o;
+			for (p = Dictionary_Head(d, HASH(u+pos)); p != NONE && best < max_len; p = d->prev[p]) {
+				if (u[p] == x && u[p+1] == y && u[p+2] == z) {
+					const ULONG j = MatchLength(u+pos, u+p, 3, max_len);
+					if (j > best || (j == best && j > l)) { best = j; b = p; } // the short repeat wins ties
 				}
 			}
-
-			// do an exhaustive search (in the possible range)
-			for (; ep < last; ++ep) {
-				const ULONG p = e->pos[ep];
-				if (u[p+1] == y && u[p+2] == z) {
-					ULONG i = ((pos-p)==3 ? p : p+3), j = 3;
-					while (j < max_len && u[pos+j] == u[i]) {
-						++j;
-						if (++i == pos) { i = p; } // allow looping back, can have l > o
-					}
+			l = best; o = b;
+		} else {
+			// search the most recent positions with the same hash
+			for (p = Dictionary_Head(d, HASH(u+pos)); p != NONE && l < max_len && depth; p = d->prev[p], --depth) {
+				if (u[p] == x && u[p+1] == y && u[p+2] == z) {
+					const ULONG j = MatchLength(u+pos, u+p, 3, max_len);
 					if (j > l) { l = j; o = p; }
 				}
 			}
+		}
 
-			if (l >= 3) {		
-				*val = ((pos-o-1) << shift[cur]) | (l-3);
-				return l;
-			}
+		if (l >= 3) {
+			*off = pos-o;
+			return l;
 		}
 	}
 	return 0;
@@ -136,7 +214,8 @@ static ULONG Dictionary_Find(const Dictionary *d, const BYTE *u, const ULONG pos
 
 /////////////////// Compression Functions /////////////////////////////////////
 
-static USHORT CompressFragment(const BYTE *u, ULONG u_len, BYTE *c, ULONG c_len, Dictionary *d) {
+// The greedy parser, always taking the longest match
+static USHORT CompressGreedy(const BYTE *u, ULONG u_len, BYTE *c, ULONG c_len, Dictionary *d, ULONG depth) {
 	ULONG c_pos = 0, cur = 0, i, pos, len, x, end;
 	USHORT u_pos = 0;
 	BYTE bits, bytes[16]; // If all are special, then it will fill 16 bytes
@@ -147,7 +226,8 @@ static USHORT CompressFragment(const BYTE *u, ULONG u_len, BYTE *c, ULONG c_len,
 
 			while (cur < ARRAYSIZE(pow2) && pow2[cur] < u_pos) { ++cur; }
 
-			if ((len = Dictionary_Find(d, u, u_pos, u_len, cur, &x)) > 0) {
+			if ((len = Dictionary_Find(d, u, u_pos, u_len, cur, depth, &x)) > 0) {
+				x = ((x-1) << shift[cur]) | (len-3);
 				bytes[pos++] = x & 0xFF;
 				bytes[pos++] = (x >> 8) & 0xFF;
 				bits |= 0x80; // set the highest bit
@@ -161,7 +241,7 @@ static USHORT CompressFragment(const BYTE *u, ULONG u_len, BYTE *c, ULONG c_len,
 			for (end = u_pos + len; u_pos < end; ++u_pos)
 				Dictionary_Add(d, u, u_pos, u_len);
 		}
-		if (c_pos >= c_len) { break; }
+		if (c_pos+pos+1 > c_len) { return 0; } // not enough room
 		if (i != 8) {
 			// We need to finish moving the value over
 			bits >>= 8-i;
@@ -175,35 +255,139 @@ static USHORT CompressFragment(const BYTE *u, ULONG u_len, BYTE *c, ULONG c_len,
 	return (u_pos < u_len) ? 0 : (USHORT)c_pos;
 }
 
-ULONG bmzip_compress(const BYTE *u, ULONG u_len, BYTE *c, ULONG c_len) {
-	ULONG c_pos = 0, u_pos = 0;
-	USHORT c_size, u_size;
+// Finds the longest match at every position of a fragment, for the lazy and optimal parsers
+// Inside a match that runs past the longest allowed length the rest of that match is already the longest, so it is reused
+static void FindAllMatches(const BYTE *u, ULONG u_len, Dictionary *d, ULONG depth, USHORT *lens, USHORT *offs) {
+	ULONG pos, cur = 0, off = 0, max_len;
+	for (pos = 0; pos < u_len; ++pos) {
+		while (cur < ARRAYSIZE(pow2) && pow2[cur] < pos) { ++cur; }
+		max_len = u_len-pos;
+		if (max_len > masks[cur]+3u) max_len = masks[cur]+3u;
+		if (pos > 0 && max_len > 3 && lens[pos-1] > max_len) {
+			lens[pos] = (USHORT)max_len;
+			offs[pos] = offs[pos-1];
+		} else {
+			lens[pos] = (USHORT)Dictionary_Find(d, u, pos, u_len, cur, depth, &off);
+			offs[pos] = (USHORT)off;
+		}
+		Dictionary_Add(d, u, (USHORT)pos, u_len);
+	}
+}
+
+// The lazy parser, skipping a match when the next position has a longer match
+// Changes lens to the length of the symbol to use at each position
+static void LazyParse(ULONG u_len, USHORT *lens) {
+	ULONG pos, l;
+	for (pos = 0; pos < u_len; pos += l) {
+		l = lens[pos];
+		if (l < 3 || (pos+1 < u_len && lens[pos+1] > l)) { lens[pos] = 1; l = 1; }
+	}
+}
+
+#define LITERAL_COST	9	// cost of a literal in bits, including its flag bit
+#define MATCH_COST		17	// cost of a match in bits, including its flag bit
+#define OPTIMAL_SHORT	32	// for matches longer than this only the lengths up to this and the full length are tried
+
+// The optimal parser, finding the cheapest way to encode the fragment using the matches
+// Since the match at each position already has the length limited by the cur at that position, any shorter length is also usable
+// Changes lens to the length of the symbol to use at each position
+static void OptimalParse(ULONG u_len, USHORT *lens, ULONG *cost) {
+	ULONG pos = u_len, best, best_len, l, j, max_j;
+	cost[u_len] = 0;
+	while (pos-- > 0) {
+		best = cost[pos+1] + LITERAL_COST;
+		best_len = 1;
+		if ((l = lens[pos]) >= 3) {
+			for (j = 3, max_j = MIN(l, OPTIMAL_SHORT); j <= max_j; ++j)
+				if (cost[pos+j] + MATCH_COST <= best) { best = cost[pos+j] + MATCH_COST; best_len = j; }
+			if (l > max_j && cost[pos+l] + MATCH_COST <= best) { best = cost[pos+l] + MATCH_COST; best_len = l; }
+		}
+		cost[pos] = best;
+		lens[pos] = (USHORT)best_len;
+	}
+}
+
+// Writes the symbols chosen by the lazy or optimal parsers
+static USHORT WriteSymbols(const BYTE *u, ULONG u_len, BYTE *c, ULONG c_len, const USHORT *lens, const USHORT *offs) {
+	ULONG c_pos = 0, u_pos = 0, cur = 0, i, pos, l, x;
+	BYTE bits, bytes[16]; // If all are special, then it will fill 16 bytes
+
+	while (u_pos < u_len) {
+		for (i = 0, pos = 0, bits = 0; i < 8 && u_pos < u_len; ++i, u_pos += l) { // Go through each bit
+			while (cur < ARRAYSIZE(pow2) && pow2[cur] < u_pos) { ++cur; }
+			if ((l = lens[u_pos]) >= 3) {
+				x = ((offs[u_pos]-1) << shift[cur]) | (l-3);
+				bytes[pos++] = x & 0xFF;
+				bytes[pos++] = (x >> 8) & 0xFF;
+				bits |= 1 << i;
+			} else {
+				l = 1;
+				bytes[pos++] = u[u_pos];
+			}
+		}
+		if (c_pos+pos+1 > c_len) { return 0; } // not enough room
+		c[c_pos] = bits;
+		memcpy(c+c_pos+1, bytes, pos);
+		c_pos += pos+1;
+	}
+	return (USHORT)c_pos;
+}
+
+// Compresses a fragment, returning the compressed size or 0 if there was not enough room
+// The depth may include one of the parsing modes
+static USHORT CompressFragment(const BYTE *u, ULONG u_len, BYTE *c, ULONG c_len, Dictionary *d, ULONG depth) {
+	USHORT lens[MAX_SIZE], offs[MAX_SIZE];
+	ULONG cost[MAX_SIZE+1];
+	if ((depth & BMZIP_PARSE_MASK) == 0) { return CompressGreedy(u, u_len, c, c_len, d, depth); }
+	FindAllMatches(u, u_len, d, depth & ~BMZIP_PARSE_MASK, lens, offs);
+	if (depth & BMZIP_OPTIMAL)	{ OptimalParse(u_len, lens, cost); }
+	else						{ LazyParse(u_len, lens); }
+	return WriteSymbols(u, u_len, c, c_len, lens, offs);
+}
+
+// Compresses a single fragment into c with its header, returning the total size or 0 if there was not enough space
+static ULONG CompressChunk(const BYTE *u, USHORT u_size, BYTE *c, ULONG c_len, Dictionary *d, ULONG depth) {
+	USHORT c_size;
 	BYTE flags;
-	Dictionary *d = Dictionary_Create();
 
-	while (c_pos < c_len-1 && u_pos < u_len) {
-		// Compress the next fragment
-		Dictionary_Reset(d);
-		u_size = (USHORT)MIN(u_len-u_pos, 0x1000);
-		c_size = CompressFragment(u+u_pos, u_size, c+c_pos+2, c_len-c_pos-2, d);
-		if (c_size == 0) { break; }
-		//if (c_size >= u_size) { _tprintf(TEXT("Warning: fragment should be uncompressed, however that flag is unknown (%04hx >= %04hx)\n"), c_size, u_size); }
-		//if (c_size > 0xFFF) { _tprintf(TEXT("Warning: fragment is larger than allowed (%04hx >= 0x1000)!\n"), c_size); }
+	if (c_len <= 2) { return 0; }
+	Dictionary_Reset(d);
+
+	// The size in the header is only 12 bits, so if the fragment doesn't compress it is stored uncompressed
+	if ((c_size = CompressFragment(u, u_size, c+2, MIN(c_len-2, 0x1000), d, depth)) != 0) {
 		flags = 0x0B;
+	} else if (c_len-2 >= u_size) {
+		memcpy(c+2, u, u_size);
+		c_size = u_size;
+		flags = 0x03;
+	} else { return 0; }
+
+	// Save header
+	c[0] = 0xFF & (c_size-1);
+	c[1] = ((flags << 4) & 0xF0) | (((c_size-1) >> 8) & 0x0F);
+
+	return 2+c_size;
+}
 
-		// Save header
-		c[c_pos] = 0xFF & (c_size-1);
-		c[c_pos+1] = ((flags << 4) & 0xF0) | (((c_size-1) >> 8) & 0x0F);
+ULONG bmzip_compress(const BYTE *u, ULONG u_len, BYTE *c, ULONG c_len, ULONG depth, bmzip_ctx *ctx) {
+	ULONG c_pos = 0, u_pos = 0, size;
+	USHORT u_size;
+	Dictionary local;
+	if (ctx == NULL) { Dictionary_Init(&local); ctx = &local; }
+
+	while (c_pos+1 < c_len && u_pos < u_len) {
+		// Compress the next fragment
+		u_size = (USHORT)MIN(u_len-u_pos, 0x1000);
+		size = CompressChunk(u+u_pos, u_size, c+c_pos, c_len-c_pos, ctx, depth);
+		if (size == 0) { break; }
 
 		// Increment positions
-		c_pos += 2+c_size;
+		c_pos += size;
 		u_pos += u_size;
 	}
 
-	Dictionary_Destroy(d);
-
 	// Return unsuccessful or size
-	if (u_pos < u_len) {
+	if (u_pos < u_len || c_pos >= c_len) {
 		SetLastError(ERROR_INSUFFICIENT_BUFFER);
 		return 0;
 	}
@@ -211,9 +395,11 @@ ULONG bmzip_compress(const BYTE *u, ULONG u_len, BYTE *c, ULONG c_len) {
 	return c_pos;
 }
 
-Bytes bmzip_compress(const Bytes &u) {
-	Bytes c = Bytes::alloc((*u)*2); // assume double is as big as compressed data is
-	ULONG size = bmzip_compress(~u, *u, ~c, *c);
+ULONG bmzip_compress_bound(ULONG u_len) { return (u_len+0xFFF)/0x1000*FRAGMENT_BOUND+1; }
+
+Bytes bmzip_compress(const Bytes &u, ULONG depth, bmzip_ctx *ctx) {
+	Bytes c = Bytes::alloc(bmzip_compress_bound((ULONG)*u));
+	ULONG size = bmzip_compress(~u, *u, ~c, *c, depth, ctx);
 	if (size == 0) { free(c); return Bytes::Null; }
 	c.setCount(size);
 	return c;
@@ -222,6 +408,8 @@ Bytes bmzip_compress(const Bytes &u) {
 
 /////////////////// Decompression Functions ///////////////////////////////////
 
+// Decompresses a single fragment, returning the decompressed size or 0 if the data is invalid or u is too small
+// The u_len must be at most 0x1000, the most a fragment can hold
 static ULONG DecompressFragment(const BYTE *c, ULONG c_len, BYTE *u, ULONG u_len) {
 	ULONG c_pos = 0, u_pos = 0, cur = 0, i, x, len, offset;
 	BYTE bits;
@@ -232,6 +420,8 @@ static ULONG DecompressFragment(const BYTE *c, ULONG c_len, BYTE *u, ULONG u_len
 		bits = c[c_pos++]; // Bit mask tells us how to handle the next 8 symbols
 		for (i = MIN(8, c_len-c_pos); (i = MIN(i, c_len-c_pos)) > 0 && bits; --i, bits >>= 1) { // Go through each bit
 			if (bits & 1) { // We have a look-behind compression symbol
+				if (c_pos+1 >= c_len) { return 0; } // symbol is cut off
+
 				// Update the current power of two available bytes
 				while (cur < ARRAYSIZE(pow2) && pow2[cur] < u_pos) { ++cur; }
 
@@ -239,6 +429,7 @@ static ULONG DecompressFragment(const BYTE *c, ULONG c_len, BYTE *u, ULONG u_len
 				x = c[c_pos] | (c[c_pos+1] << 8);
 				len = (x&masks[cur])+3;
 				offset = (x>>shift[cur])+1;
+				if (u_pos+len > u_len) { return 0; } // not enough room
 
 				//if (offset != (offset & masks[8-cur])) { _tprintf(TEXT("Warning: offset needs masking\n")); offset &= masks[8-cur]; }
 				
@@ -251,22 +442,8 @@ static ULONG DecompressFragment(const BYTE *c, ULONG c_len, BYTE *u, ULONG u_len
 					offset -= to_set;
 				}
 
-				if (offset == 1) {
-					// Repeat the most recent byte len times
-					// This is not necessary but much more efficient for this common case
-					memset(u+u_pos, u[u_pos-1], len);
-				} else if (offset != 0) {
-					// Copy offset bytes at a time from offset ago to fill up len
-					while (offset < len) { 
-						memcpy(u+u_pos, u+u_pos-offset, offset);
-						len -= offset;
-						u_pos += offset;
-					}
-
-					// Copy the remaining len bytes from offset ago
-					if (len > 0) {
-						memcpy(u+u_pos, u+u_pos-offset, len);
-					}
+				if (offset != 0) {
+					CopyMatch(u+u_pos, offset, len);
 				}
 
 				c_pos += 2;
@@ -274,11 +451,13 @@ static ULONG DecompressFragment(const BYTE *c, ULONG c_len, BYTE *u, ULONG u_len
 
 			} else {
 				// Copy current byte
+				if (u_pos >= u_len) { return 0; } // not enough room
 				u[u_pos++] = c[c_pos++];
 			}
 		}
 		if (i > 0) {
 			// Copy the remaining bytes
+			if (u_pos+i > u_len) { return 0; } // not enough room
 			memcpy(u+u_pos, c+c_pos, i);
 			c_pos += i;
 			u_pos += i;
@@ -294,7 +473,7 @@ ULONG bmzip_decompress(const BYTE *c, ULONG c_len, BYTE *u, ULONG u_len) {
 	ULONG c_pos = 0, u_pos = 0, c_size, u_size, flags;
 
 	// Go through every fragment
-	while (c_pos < c_len-1 && u_pos < u_len) {
+	while (c_pos+1 < c_len && u_pos < u_len) {
 		// Read fragment header
 		c_size = (c[c_pos] | (c[c_pos+1] << 8) & 0x0FFF)+1;
 		flags = c[c_pos+1] >> 4 & 0x0F; // Currently flags is always 1011 (0xB), I have no idea what these bits mean
@@ -308,13 +487,13 @@ ULONG bmzip_decompress(const BYTE *c, ULONG c_len, BYTE *u, ULONG u_len) {
 
 		if (flags == 0xB) {
 			// Compressed fragment
-			u_size = DecompressFragment(c+c_pos, c_size, u+u_pos, u_len-u_pos);
+			u_size = DecompressFragment(c+c_pos, c_size, u+u_pos, MIN(u_len-u_pos, 0x1000));
 		} else {
 			//_tprintf(TEXT("Warning: flags is unexpected value: %1X\n"), flags);
 
 			// Assume no compression, copy fragment directly
 			u_size = c_size;
-			if (u_pos + u_size >= u_len) { break; } // Fragment is longer than the available space
+			if (u_pos + u_size > u_len) { break; } // Fragment is longer than the available space
 			memcpy(u+u_pos, c+c_pos, u_size);
 		}
 		if (u_size == 0) { break; }
@@ -323,17 +502,323 @@ ULONG bmzip_decompress(const BYTE *c, ULONG c_len, BYTE *u, ULONG u_len) {
 	}
 
 	// Return unsuccessful or size
-	if (c_pos < c_len-1) {
+	if (c_pos+1 < c_len) {
 		SetLastError(ERROR_INSUFFICIENT_BUFFER);
 		return 0;
 	}
 	return u_pos;
 }
 
+// Finds the size of a fragment once decompressed by following the symbols without copying any data
+static ULONG FragmentSize(const BYTE *c, ULONG c_len) {
+	ULONG c_pos = 0, u_pos = 0, cur = 0, i;
+	BYTE bits;
+
+	while (c_pos < c_len) {
+		bits = c[c_pos++];
+		for (i = MIN(8, c_len-c_pos); (i = MIN(i, c_len-c_pos)) > 0 && bits; --i, bits >>= 1) {
+			if (bits & 1) {
+				if (c_pos+1 >= c_len || u_pos >= 0x1000) { return 0; }
+				while (cur < ARRAYSIZE(pow2) && pow2[cur] < u_pos) { ++cur; }
+				u_pos += ((c[c_pos] | (c[c_pos+1] << 8)) & masks[cur])+3;
+				c_pos += 2;
+			} else {
+				++c_pos;
+				++u_pos;
+			}
+		}
+		c_pos += i;
+		u_pos += i;
+	}
+	return (u_pos > 0x1000) ? 0 : u_pos;
+}
+
+ULONG bmzip_decompressed_size(const BYTE *c, ULONG c_len) {
+	ULONG c_pos = 0, u_pos = 0, c_size, u_size;
+
+	while (c_pos+1 < c_len) {
+		c_size = (c[c_pos] | (c[c_pos+1] << 8) & 0x0FFF)+1;
+		u_size = ((c[c_pos+1] >> 4 & 0x0F) == 0xB) ? FragmentSize(c+c_pos+2, MIN(c_size, c_len-c_pos-2)) : c_size;
+		c_pos += 2;
+		if (c_pos + c_size > c_len || u_size == 0) {
+			SetLastError(ERROR_INVALID_DATA);
+			return 0;
+		}
+		c_pos += c_size;
+		u_pos += u_size;
+	}
+	return u_pos;
+}
+
 Bytes bmzip_decompress(const Bytes &c) {
-	Bytes u = Bytes::alloc((*c)*2); // assume double is as big as uncompressed data is
-	ULONG size = bmzip_decompress(~c, *c, ~u, *u);
-	if (size == 0) { free(u); return Bytes::Null; }
+	ULONG size = bmzip_decompressed_size(~c, (ULONG)*c);
+	if (size == 0) { return Bytes::Null; }
+	Bytes u = Bytes::alloc(size);
+	if (!u) { return Bytes::Null; }
+	if ((size = bmzip_decompress(~c, *c, ~u, *u)) == 0) { free(u); return Bytes::Null; }
+	u.setCount(size);
+	return u;
+}
+
+
+/////////////////// Streaming Functions /////////////////////////////////////
+
+// A stream buffers at most a single fragment and gives the output of each fragment to the sink as it is finished
+struct _bmzip_stream {
+	bool compress;
+	bmzip_sink sink;
+	void *param;
+	ULONG depth;
+	ULONG in_len;				// the amount of data in in
+	BYTE in[FRAGMENT_BOUND];	// the partial fragment waiting for more data
+	BYTE out[FRAGMENT_BOUND];	// the output of a single fragment
+	Dictionary d;				// the dictionary, only used for compression
+};
+
+// Gets the number of bytes needed for the fragment at the start of in
+// For decompression this needs the header so it is 2 until at least 2 bytes are available
+static ULONG Stream_Needed(const bmzip_stream *s, const BYTE *in, ULONG in_len) {
+	return s->compress ? 0x1000 : ((in_len < 2) ? 2 : 2+(in[0] | (in[1] << 8) & 0x0FFF)+1);
+}
+
+// Processes a single complete fragment and gives the result to the sink
+static bool Stream_Fragment(bmzip_stream *s, const BYTE *in, ULONG in_len) {
+	ULONG size;
+	if (s->compress) {
+		size = CompressChunk(in, (USHORT)in_len, s->out, FRAGMENT_BOUND, &s->d, s->depth);
+	} else if ((in[1] >> 4 & 0x0F) != 0xB) {
+		return s->sink(in+2, in_len-2, s->param); // uncompressed fragment
+	} else {
+		size = DecompressFragment(in+2, in_len-2, s->out, 0x1000);
+	}
+	if (size == 0) { SetLastError(ERROR_INVALID_DATA); return false; }
+	return s->sink(s->out, size, s->param);
+}
+
+static bmzip_stream *Stream_Create(bool compress, bmzip_sink sink, void *param, ULONG depth) {
+	bmzip_stream *s = (bmzip_stream*)malloc(sizeof(bmzip_stream));
+	if (s == NULL) { SetLastError(ERROR_NOT_ENOUGH_MEMORY); return NULL; }
+	s->compress = compress;
+	s->sink = sink;
+	s->param = param;
+	s->depth = depth;
+	s->in_len = 0;
+	if (compress) { Dictionary_Init(&s->d); }
+	return s;
+}
+
+bmzip_stream *bmzip_compress_stream(bmzip_sink sink, void *param, ULONG depth) { return Stream_Create(true, sink, param, depth); }
+bmzip_stream *bmzip_decompress_stream(bmzip_sink sink, void *param) { return Stream_Create(false, sink, param, 0); }
+
+bool bmzip_stream_write(bmzip_stream *s, const BYTE *data, ULONG len) {
+	ULONG needed, copy;
+	while (len > 0) {
+		if (s->in_len == 0 && (needed = Stream_Needed(s, data, len)) <= len) {
+			// A complete fragment is available, no need to copy it
+			if (!Stream_Fragment(s, data, needed)) { return false; }
+			data += needed;
+			len -= needed;
+		} else {
+			// Buffer as much as is needed for the fragment
+			copy = MIN(Stream_Needed(s, s->in, s->in_len) - s->in_len, len);
+			memcpy(s->in+s->in_len, data, copy);
+			s->in_len += copy;
+			data += copy;
+			len -= copy;
+			if (s->in_len == Stream_Needed(s, s->in, s->in_len)) {
+				if (!Stream_Fragment(s, s->in, s->in_len)) { return false; }
+				s->in_len = 0;
+			}
+		}
+	}
+	return true;
+}
+
+bool bmzip_stream_finish(bmzip_stream *s) {
+	const static BYTE null = 0;
+	bool retval = true;
+	if (s->compress) {
+		// Compress the last partial fragment and add the extra null byte at the end
+		retval = (s->in_len == 0 || Stream_Fragment(s, s->in, s->in_len)) && s->sink(&null, 1, s->param);
+	} else if (s->in_len > 1) {
+		// Only the null byte can be left over
+		SetLastError(ERROR_INVALID_DATA);
+		retval = false;
+	}
+	s->in_len = 0;
+	return retval;
+}
+
+void bmzip_stream_destroy(bmzip_stream *s) { free(s); }
+
+
+/////////////////// Multi-threaded Functions //////////////////////////////////
+
+// Every fragment is independent, so they can be processed on separate threads and then put together
+
+// The shared state of a multi-threaded job
+typedef struct _Job Job;
+typedef void (*Worker)(Job *job);
+struct _Job {
+	Worker worker;
+	const BYTE *in;
+	ULONG in_len;
+	BYTE *out;
+	ULONG out_len;
+	ULONG depth;
+	ULONG count;		// number of fragments
+	ULONG *offsets;		// the offsets of the compressed fragments (decompression only)
+	ULONG *sizes;		// the resulting size of each fragment, 0 if it failed
+	volatile LONG next;	// the next fragment to process
+};
+
+// Compresses fragments into separate FRAGMENT_BOUND sized slots of the output
+static void CompressWorker(Job *job) {
+	ULONG i;
+	Dictionary d;
+	Dictionary_Init(&d);
+	while ((i = (ULONG)InterlockedIncrement(&job->next)-1) < job->count) {
+		const ULONG u_pos = i*0x1000;
+		job->sizes[i] = CompressChunk(job->in+u_pos, (USHORT)MIN(job->in_len-u_pos, 0x1000), job->out+i*FRAGMENT_BOUND, FRAGMENT_BOUND, &d, job->depth);
+	}
+}
+
+// Decompresses fragments directly into their final position, assuming all but the last are 0x1000 bytes
+static void DecompressWorker(Job *job) {
+	ULONG i;
+	while ((i = (ULONG)InterlockedIncrement(&job->next)-1) < job->count) {
+		const ULONG u_pos = i*0x1000, c_pos = job->offsets[i];
+		job->sizes[i] = DecompressFragment(job->in+c_pos+2, job->offsets[i+1]-c_pos-2, job->out+u_pos, MIN(job->out_len-u_pos, 0x1000));
+	}
+}
+
+#ifdef _WIN32
+#define MAX_THREADS	MAXIMUM_WAIT_OBJECTS
+typedef HANDLE Thread;
+static DWORD WINAPI ThreadProc(LPVOID param) { Job *job = (Job*)param; job->worker(job); return ERROR_SUCCESS; }
+static ULONG ProcessorCount() { SYSTEM_INFO si; GetSystemInfo(&si); return si.dwNumberOfProcessors; }
+static bool StartThread(Thread *t, Job *job) { return (*t = CreateThread(NULL, 0, ThreadProc, job, 0, NULL)) != NULL; }
+static void JoinThreads(Thread *t, ULONG n) {
+	ULONG i;
+	WaitForMultipleObjects(n, t, TRUE, INFINITE);
+	for (i = 0; i < n; ++i)
+		CloseHandle(t[i]);
+}
+#else
+#define MAX_THREADS	64
+typedef pthread_t Thread;
+static void *ThreadProc(void *param) { Job *job = (Job*)param; job->worker(job); return NULL; }
+static ULONG ProcessorCount() { long n = sysconf(_SC_NPROCESSORS_ONLN); return n > 0 ? (ULONG)n : 1; }
+static bool StartThread(Thread *t, Job *job) { return pthread_create(t, NULL, ThreadProc, job) == 0; }
+static void JoinThreads(Thread *t, ULONG n) {
+	ULONG i;
+	for (i = 0; i < n; ++i)
+		pthread_join(t[i], NULL);
+}
+#endif
+
+// Runs the job's worker on the given number of threads (including this one) until all of the fragments are processed
+static void RunWorkers(Job *job, ULONG threads) {
+	Thread t[MAX_THREADS];
+	ULONG i, n = 0;
+	if (threads == 0) { threads = ProcessorCount(); }
+	threads = MIN(MIN(threads, job->count), MAX_THREADS);
+	job->next = 0;
+	for (i = 1; i < threads; ++i)
+		if (StartThread(t+n, job)) { ++n; }
+	job->worker(job);
+	if (n) { JoinThreads(t, n); }
+}
+
+ULONG bmzip_compress_mt(const BYTE *u, ULONG u_len, BYTE *c, ULONG c_len, ULONG depth, ULONG threads) {
+	ULONG c_pos = 0, i;
+	Job job = { CompressWorker, u, u_len, NULL, 0, depth, (u_len+0xFFF)/0x1000, NULL, NULL, 0 };
+
+	if (job.count <= 1 || threads == 1) { return bmzip_compress(u, u_len, c, c_len, depth); }
+
+	// First pass: compress every fragment into its own slot
+	job.out_len = job.count*FRAGMENT_BOUND;
+	job.out = (BYTE*)malloc(job.out_len);
+	job.sizes = (ULONG*)calloc(job.count, sizeof(ULONG));
+	if (job.out == NULL || job.sizes == NULL) {
+		free(job.out);
+		free(job.sizes);
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		return 0;
+	}
+	RunWorkers(&job, threads);
+
+	// Second pass: now that the sizes are known, stitch the fragments together
+	for (i = 0; i < job.count; ++i) {
+		if (c_pos + job.sizes[i] >= c_len) { break; } // also leave room for the final null byte
+		memcpy(c+c_pos, job.out+i*FRAGMENT_BOUND, job.sizes[i]);
+		c_pos += job.sizes[i];
+	}
+	free(job.out);
+	free(job.sizes);
+
+	// Return unsuccessful or size
+	if (i < job.count) {
+		SetLastError(ERROR_INSUFFICIENT_BUFFER);
+		return 0;
+	}
+	c[c_pos++] = 0; // We need an extra null byte at the end (7 does this, Vista does not)
+	return c_pos;
+}
+
+ULONG bmzip_decompress_mt(const BYTE *c, ULONG c_len, BYTE *u, ULONG u_len, ULONG threads) {
+	ULONG c_pos = 0, i, u_pos = 0;
+	Job job = { DecompressWorker, c, c_len, u, u_len, 0, 0, NULL, NULL, 0 };
+
+	// First pass: find all of the fragments, if any are unusual let the serial version deal with them
+	while (c_pos+1 < c_len) {
+		const ULONG c_size = (c[c_pos] | (c[c_pos+1] << 8) & 0x0FFF)+1, flags = c[c_pos+1] >> 4 & 0x0F;
+		if (flags != 0xB || c_pos+2+c_size > c_len) { job.count = 0; break; }
+		c_pos += 2+c_size;
+		++job.count;
+	}
+	if (job.count <= 1 || threads == 1 || (job.count-1)*0x1000 >= u_len) { return bmzip_decompress(c, c_len, u, u_len); }
+
+	job.offsets = (ULONG*)malloc((job.count+1)*sizeof(ULONG));
+	job.sizes = (ULONG*)calloc(job.count, sizeof(ULONG));
+	if (job.offsets == NULL || job.sizes == NULL) {
+		free(job.offsets);
+		free(job.sizes);
+		return bmzip_decompress(c, c_len, u, u_len);
+	}
+	for (c_pos = 0, i = 0; i < job.count; ++i) {
+		job.offsets[i] = c_pos;
+		c_pos += 2+(c[c_pos] | (c[c_pos+1] << 8) & 0x0FFF)+1;
+	}
+	job.offsets[job.count] = c_pos;
+
+	// Second pass: decompress every fragment where it would be if they are all full
+	RunWorkers(&job, threads);
+	for (i = 0; i < job.count; ++i) {
+		if (job.sizes[i] == 0 || (i < job.count-1 && job.sizes[i] != 0x1000)) { break; }
+		u_pos += job.sizes[i];
+	}
+	free(job.offsets);
+	free(job.sizes);
+
+	// If the guess was wrong the serial version can work it out
+	return (i < job.count) ? bmzip_decompress(c, c_len, u, u_len) : u_pos;
+}
+
+Bytes bmzip_compress_mt(const Bytes &u, ULONG depth, ULONG threads) {
+	Bytes c = Bytes::alloc(bmzip_compress_bound((ULONG)*u));
+	ULONG size = bmzip_compress_mt(~u, *u, ~c, *c, depth, threads);
+	if (size == 0) { free(c); return Bytes::Null; }
+	c.setCount(size);
+	return c;
+}
+
+Bytes bmzip_decompress_mt(const Bytes &c, ULONG threads) {
+	ULONG size = bmzip_decompressed_size(~c, (ULONG)*c);
+	if (size == 0) { return Bytes::Null; }
+	Bytes u = Bytes::alloc(size);
+	if (!u) { return Bytes::Null; }
+	if ((size = bmzip_decompress_mt(~c, *c, ~u, *u, threads)) == 0) { free(u); return Bytes::Null; }
 	u.setCount(size);
 	return u;
 }
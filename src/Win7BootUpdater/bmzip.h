@@ -20,9 +20,47 @@
 
 // Equivalent to RtlDecompressBuffer and RtlCompressBuffer but much faster
 
-ULONG bmzip_compress(const BYTE *u, ULONG u_len, BYTE *c, ULONG c_len);
+// The depth is the number of previous positions searched for each match during compression
+// Larger depths take longer but may compress better, BMZIP_MAX_RATIO searches every possible position
+#define BMZIP_MAX_RATIO		0
+#define BMZIP_DEFAULT_DEPTH	32
+
+// The depth can be combined with one of these to change how matches are chosen, by default the longest match is always taken
+// Lazy parsing skips a match if the next position has a longer one, optimal parsing finds the smallest way to encode the matches found
+#define BMZIP_LAZY			0x10000
+#define BMZIP_OPTIMAL		0x20000
+#define BMZIP_PARSE_MASK	(BMZIP_LAZY | BMZIP_OPTIMAL)
+
+// The compression context holds the dictionary, a context can be reused for any number of calls but only by one thread at a time
+// When one isn't given a temporary one is used
+typedef struct _bmzip_ctx bmzip_ctx;
+bmzip_ctx *bmzip_ctx_create();
+void bmzip_ctx_destroy(bmzip_ctx *ctx);
+
+ULONG bmzip_compress(const BYTE *u, ULONG u_len, BYTE *c, ULONG c_len, ULONG depth = BMZIP_DEFAULT_DEPTH, bmzip_ctx *ctx = NULL);
 ULONG bmzip_decompress(const BYTE *c, ULONG c_len, BYTE *u, ULONG u_len);
 
+// The largest the compressed data can be and the exact size of the decompressed data (or 0 if the data is invalid)
+ULONG bmzip_compress_bound(ULONG u_len);
+ULONG bmzip_decompressed_size(const BYTE *c, ULONG c_len);
+
+// Multi-threaded versions, giving the same results as the functions above
+// The threads is the maximum number of threads to use, 0 to use one per processor
+ULONG bmzip_compress_mt(const BYTE *u, ULONG u_len, BYTE *c, ULONG c_len, ULONG depth = BMZIP_DEFAULT_DEPTH, ULONG threads = 0);
+ULONG bmzip_decompress_mt(const BYTE *c, ULONG c_len, BYTE *u, ULONG u_len, ULONG threads = 0);
+
+// Streaming versions, the input can be written in pieces of any size and the output is given to the sink one fragment at a time
+// The sink returns false to stop the stream, in which case the write or finish returns false as well
+typedef bool (*bmzip_sink)(const BYTE *data, ULONG len, void *param);
+typedef struct _bmzip_stream bmzip_stream;
+bmzip_stream *bmzip_compress_stream(bmzip_sink sink, void *param, ULONG depth = BMZIP_DEFAULT_DEPTH);
+bmzip_stream *bmzip_decompress_stream(bmzip_sink sink, void *param);
+bool bmzip_stream_write(bmzip_stream *s, const BYTE *data, ULONG len);
+bool bmzip_stream_finish(bmzip_stream *s);
+void bmzip_stream_destroy(bmzip_stream *s);
+
 #include "Bytes.h"
-Bytes bmzip_compress(const Bytes &u);
+Bytes bmzip_compress(const Bytes &u, ULONG depth = BMZIP_DEFAULT_DEPTH, bmzip_ctx *ctx = NULL);
 Bytes bmzip_decompress(const Bytes &c);
+Bytes bmzip_compress_mt(const Bytes &u, ULONG depth = BMZIP_DEFAULT_DEPTH, ULONG threads = 0);
+Bytes bmzip_decompress_mt(const Bytes &c, ULONG threads = 0);
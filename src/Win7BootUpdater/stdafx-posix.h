@@ -0,0 +1,244 @@
+/*
+ * Windows 7 Boot Updater (github.com/coderforlife/windows-7-boot-updater)
+ * Copyright (C) 2021  Jeffrey Bush - Coder for Life
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// Used instead of stdafx-native.h to build the platform-independent native code (bmzip, wimzip, Bytes, PEFile, and WIMs) on other systems
+// Only the parts of the Windows API that code uses are provided
+// Wide strings are UTF-16 like on Windows so this must be built with -fshort-wchar
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+
+typedef uint8_t BYTE;
+typedef uint16_t WORD;
+typedef uint16_t USHORT;
+typedef uint32_t ULONG;
+typedef int32_t LONG;
+typedef uint32_t DWORD;
+typedef uint64_t ULONGLONG;
+typedef int64_t LONGLONG;
+typedef unsigned int UINT;
+typedef int BOOL;
+typedef char CHAR;
+typedef wchar_t WCHAR;
+typedef char _WCHAR_MUST_BE_16_BITS[sizeof(WCHAR) == 2 ? 1 : -1];
+
+typedef BYTE *LPBYTE;
+typedef void *LPVOID;
+typedef UINT *PUINT;
+typedef WCHAR *LPWSTR;
+typedef const WCHAR *LPCWSTR;
+
+typedef unsigned char byte;
+
+#define TRUE	1
+#define FALSE	0
+
+#define ARRAYSIZE(a) (sizeof(a)/sizeof((a)[0]))
+
+// The error codes are reported through errno
+#define ERROR_SUCCESS				0
+#define ERROR_NOT_ENOUGH_MEMORY		ENOMEM
+#define ERROR_INVALID_DATA			EILSEQ
+#define ERROR_INVALID_PARAMETER		EINVAL
+#define ERROR_INSUFFICIENT_BUFFER	ENOBUFS
+#define ERROR_ACCESS_DENIED			EACCES
+#define ERROR_NOT_SUPPORTED			ENOTSUP
+#define ERROR_FILE_NOT_FOUND		ENOENT
+inline void SetLastError(DWORD err) { errno = (int)err; }
+inline DWORD GetLastError() { return (DWORD)errno; }
+
+inline LONG InterlockedIncrement(volatile LONG *x) { return __sync_add_and_fetch(x, 1); }
+
+// The C library's wide string functions expect a 32-bit wchar_t, so the few that are used are replaced
+inline size_t _wcslen16(LPCWSTR s) { size_t n = 0; while (s[n]) { ++n; } return n; }
+inline int _wcscmp16(LPCWSTR a, LPCWSTR b) { while (*a && *a == *b) { ++a; ++b; } return (int)*a - (int)*b; }
+#define wcslen _wcslen16
+#define wcscmp _wcscmp16
+
+// Resources
+#define IS_INTRESOURCE(r)	((((size_t)(r)) >> 16) == 0)
+#define MAKEINTRESOURCE(i)	((LPWSTR)(size_t)((WORD)(i)))
+#define RT_VERSION			MAKEINTRESOURCE(16)
+
+#define OVERWRITE_ALWAYS	0 //always adds the resource, even if it already exists
+#define OVERWRITE_NEVER		1 //only adds a resource is it does not already exist
+#define OVERWRITE_ONLY		2 //only adds a resource if it will overwrite another resource
+
+// The PE file format, as in winnt.h
+#define IMAGE_DOS_SIGNATURE					0x5A4D
+#define IMAGE_NT_SIGNATURE					0x00004550
+#define IMAGE_NT_OPTIONAL_HDR32_MAGIC		0x10b
+#define IMAGE_NT_OPTIONAL_HDR64_MAGIC		0x20b
+#define IMAGE_FILE_32BIT_MACHINE			0x0100
+#define IMAGE_SIZEOF_FILE_HEADER			20
+#define IMAGE_SIZEOF_SHORT_NAME				8
+#define IMAGE_NUMBEROF_DIRECTORY_ENTRIES	16
+#define IMAGE_DIRECTORY_ENTRY_RESOURCE		2
+#define IMAGE_DIRECTORY_ENTRY_SECURITY		4
+#define IMAGE_DIRECTORY_ENTRY_BASERELOC		5
+#define IMAGE_SCN_CNT_CODE					0x00000020
+#define IMAGE_SCN_CNT_INITIALIZED_DATA		0x00000040
+#define IMAGE_SCN_CNT_UNINITIALIZED_DATA	0x00000080
+#define IMAGE_SCN_MEM_EXECUTE				0x20000000
+#define IMAGE_SCN_MEM_READ					0x40000000
+#define IMAGE_SCN_MEM_WRITE					0x80000000
+#define IMAGE_REL_BASED_ABSOLUTE			0
+#define IMAGE_REL_BASED_HIGHLOW				3
+#define IMAGE_REL_BASED_DIR64				10
+
+#pragma pack(push, 2)
+typedef struct _IMAGE_DOS_HEADER {
+	WORD e_magic, e_cblp, e_cp, e_crlc, e_cparhdr, e_minalloc, e_maxalloc, e_ss, e_sp, e_csum, e_ip, e_cs, e_lfarlc, e_ovno;
+	WORD e_res[4];
+	WORD e_oemid, e_oeminfo;
+	WORD e_res2[10];
+	LONG e_lfanew;
+} IMAGE_DOS_HEADER;
+#pragma pack(pop)
+
+typedef struct _IMAGE_FILE_HEADER {
+	WORD Machine;
+	WORD NumberOfSections;
+	DWORD TimeDateStamp;
+	DWORD PointerToSymbolTable;
+	DWORD NumberOfSymbols;
+	WORD SizeOfOptionalHeader;
+	WORD Characteristics;
+} IMAGE_FILE_HEADER;
+
+typedef struct _IMAGE_DATA_DIRECTORY {
+	DWORD VirtualAddress;
+	DWORD Size;
+} IMAGE_DATA_DIRECTORY;
+
+typedef struct _IMAGE_OPTIONAL_HEADER32 {
+	WORD Magic;
+	BYTE MajorLinkerVersion, MinorLinkerVersion;
+	DWORD SizeOfCode, SizeOfInitializedData, SizeOfUninitializedData, AddressOfEntryPoint, BaseOfCode, BaseOfData;
+	DWORD ImageBase, SectionAlignment, FileAlignment;
+	WORD MajorOperatingSystemVersion, MinorOperatingSystemVersion, MajorImageVersion, MinorImageVersion, MajorSubsystemVersion, MinorSubsystemVersion;
+	DWORD Win32VersionValue, SizeOfImage, SizeOfHeaders, CheckSum;
+	WORD Subsystem, DllCharacteristics;
+	DWORD SizeOfStackReserve, SizeOfStackCommit, SizeOfHeapReserve, SizeOfHeapCommit;
+	DWORD LoaderFlags, NumberOfRvaAndSizes;
+	IMAGE_DATA_DIRECTORY DataDirectory[IMAGE_NUMBEROF_DIRECTORY_ENTRIES];
+} IMAGE_OPTIONAL_HEADER32;
+
+#pragma pack(push, 4)
+typedef struct _IMAGE_OPTIONAL_HEADER64 {
+	WORD Magic;
+	BYTE MajorLinkerVersion, MinorLinkerVersion;
+	DWORD SizeOfCode, SizeOfInitializedData, SizeOfUninitializedData, AddressOfEntryPoint, BaseOfCode;
+	ULONGLONG ImageBase;
+	DWORD SectionAlignment, FileAlignment;
+	WORD MajorOperatingSystemVersion, MinorOperatingSystemVersion, MajorImageVersion, MinorImageVersion, MajorSubsystemVersion, MinorSubsystemVersion;
+	DWORD Win32VersionValue, SizeOfImage, SizeOfHeaders, CheckSum;
+	WORD Subsystem, DllCharacteristics;
+	ULONGLONG SizeOfStackReserve, SizeOfStackCommit, SizeOfHeapReserve, SizeOfHeapCommit;
+	DWORD LoaderFlags, NumberOfRvaAndSizes;
+	IMAGE_DATA_DIRECTORY DataDirectory[IMAGE_NUMBEROF_DIRECTORY_ENTRIES];
+} IMAGE_OPTIONAL_HEADER64;
+#pragma pack(pop)
+
+#if defined(__x86_64__) || defined(__aarch64__)
+typedef IMAGE_OPTIONAL_HEADER64 IMAGE_OPTIONAL_HEADER;
+#else
+typedef IMAGE_OPTIONAL_HEADER32 IMAGE_OPTIONAL_HEADER;
+#endif
+
+typedef struct _IMAGE_NT_HEADERS32 {
+	DWORD Signature;
+	IMAGE_FILE_HEADER FileHeader;
+	IMAGE_OPTIONAL_HEADER32 OptionalHeader;
+} IMAGE_NT_HEADERS32;
+
+typedef struct _IMAGE_NT_HEADERS64 {
+	DWORD Signature;
+	IMAGE_FILE_HEADER FileHeader;
+	IMAGE_OPTIONAL_HEADER64 OptionalHeader;
+} IMAGE_NT_HEADERS64;
+
+typedef struct _IMAGE_SECTION_HEADER {
+	BYTE Name[IMAGE_SIZEOF_SHORT_NAME];
+	union { DWORD PhysicalAddress; DWORD VirtualSize; } Misc;
+	DWORD VirtualAddress;
+	DWORD SizeOfRawData;
+	DWORD PointerToRawData;
+	DWORD PointerToRelocations;
+	DWORD PointerToLinenumbers;
+	WORD NumberOfRelocations;
+	WORD NumberOfLinenumbers;
+	DWORD Characteristics;
+} IMAGE_SECTION_HEADER;
+
+typedef struct _IMAGE_BASE_RELOCATION {
+	DWORD VirtualAddress;
+	DWORD SizeOfBlock;
+} IMAGE_BASE_RELOCATION;
+
+typedef struct _IMAGE_RESOURCE_DIRECTORY {
+	DWORD Characteristics;
+	DWORD TimeDateStamp;
+	WORD MajorVersion;
+	WORD MinorVersion;
+	WORD NumberOfNamedEntries;
+	WORD NumberOfIdEntries;
+} IMAGE_RESOURCE_DIRECTORY;
+
+typedef struct _IMAGE_RESOURCE_DIRECTORY_ENTRY {
+	union {
+		struct { DWORD NameOffset:31; DWORD NameIsString:1; };
+		DWORD Name;
+		WORD Id;
+	};
+	union {
+		DWORD OffsetToData;
+		struct { DWORD OffsetToDirectory:31; DWORD DataIsDirectory:1; };
+	};
+} IMAGE_RESOURCE_DIRECTORY_ENTRY;
+
+typedef struct _IMAGE_RESOURCE_DATA_ENTRY {
+	DWORD OffsetToData;
+	DWORD Size;
+	DWORD CodePage;
+	DWORD Reserved;
+} IMAGE_RESOURCE_DATA_ENTRY;
+
+// Version information, as in winver.h
+#define VS_FF_PATCHED		0x00000004
+#define VS_FF_SPECIALBUILD	0x00000020
+
+typedef struct tagVS_FIXEDFILEINFO {
+	DWORD dwSignature, dwStrucVersion;
+	DWORD dwFileVersionMS, dwFileVersionLS, dwProductVersionMS, dwProductVersionLS;
+	DWORD dwFileFlagsMask, dwFileFlags, dwFileOS, dwFileType, dwFileSubtype;
+	DWORD dwFileDateMS, dwFileDateLS;
+} VS_FIXEDFILEINFO;
+
+// Like Visual C++, NULL is a plain 0 so that comparing a Bytes to NULL is not ambiguous
+#undef NULL
+#define NULL 0
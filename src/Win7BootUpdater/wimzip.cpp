@@ -0,0 +1,816 @@
+/*
+ * Windows 7 Boot Updater (github.com/coderforlife/windows-7-boot-updater)
+ * Copyright (C) 2021  Jeffrey Bush - Coder for Life
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "wimzip.h"
+
+#ifdef __cplusplus_cli
+#pragma unmanaged
+#endif
+
+// Get the minimum or maximum of 2
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+
+// Reads and writes little-endian values
+#define GET16(p) ((UINT)(p)[0] | ((UINT)(p)[1] << 8))
+#define GET32(p) (GET16(p) | (GET16((p)+2) << 16))
+#define PUT16(p, x) ((p)[0] = (BYTE)(x), (p)[1] = (BYTE)((x) >> 8))
+#define PUT32(p, x) (PUT16(p, x), PUT16((p)+2, (x) >> 16))
+
+// The index of the highest bit set, x must not be 0
+static inline UINT HighBit(ULONG x) { UINT i = 0; while (x >>= 1) { ++i; } return i; }
+
+// Copies len bytes that start offset bytes before u to u, where the source and destination may overlap
+static inline void CopyMatch(BYTE *u, const ULONG offset, ULONG len) {
+	if (offset >= len) { memcpy(u, u-offset, len); }
+	else { const BYTE *s = u-offset; while (len--) { *u++ = *s++; } }
+}
+
+
+/////////////////// Huffman Codes /////////////////////////////////////////////
+
+// Both formats use canonical Huffman codes which are described by just the code length of each symbol
+// Codes up to HUFF_TABLE_BITS long are found with a single table lookup, longer codes are searched for by length
+#define HUFF_TABLE_BITS	10
+#define HUFF_MAX_LEN	16
+#define HUFF_MAX_SYMS	512
+
+typedef struct _Huffman {
+	USHORT table[1 << HUFF_TABLE_BITS];	// (symbol << 5) | length, or 0 if the code is longer than the table (or unused)
+	UINT first[HUFF_MAX_LEN+1];			// the first code of each length
+	UINT count[HUFF_MAX_LEN+1];			// the number of codes of each length
+	UINT index[HUFF_MAX_LEN+1];			// the position in syms of the first code of each length
+	USHORT syms[HUFF_MAX_SYMS];			// the symbols in the order of their codes
+} Huffman;
+
+// Builds the decoding table from the code lengths, a length of 0 means the symbol is not used
+// Codes that do not use every possible bit pattern are allowed, the unused patterns fail to decode
+static bool Huffman_Init(Huffman *h, const BYTE *lens, UINT n, UINT max_len) {
+	UINT i, len, code, left = 1;
+	memset(h->count, 0, sizeof(h->count));
+	for (i = 0; i < n; ++i) {
+		if (lens[i] > max_len) { return false; }
+		++h->count[lens[i]];
+	}
+	h->count[0] = 0;
+	for (len = 1; len <= HUFF_MAX_LEN; ++len) {
+		left = (left << 1) - h->count[len];
+		if ((int)left < 0) { return false; } // over-subscribed
+	}
+	h->index[1] = 0;
+	for (len = 1; len < HUFF_MAX_LEN; ++len) { h->index[len+1] = h->index[len] + h->count[len]; }
+	UINT pos[HUFF_MAX_LEN+1];
+	memcpy(pos, h->index, sizeof(pos));
+	for (i = 0; i < n; ++i) { if (lens[i]) { h->syms[pos[lens[i]]++] = (USHORT)i; } }
+	for (code = 0, len = 1; len <= HUFF_MAX_LEN; ++len) { h->first[len] = code; code = (code + h->count[len]) << 1; }
+	memset(h->table, 0, sizeof(h->table));
+	for (len = 1; len <= HUFF_TABLE_BITS; ++len) {
+		for (i = 0; i < h->count[len]; ++i) {
+			const USHORT e = (USHORT)((h->syms[h->index[len] + i] << 5) | len);
+			const UINT start = (h->first[len] + i) << (HUFF_TABLE_BITS - len), end = start + (1 << (HUFF_TABLE_BITS - len));
+			for (code = start; code < end; ++code) { h->table[code] = e; }
+		}
+	}
+	return true;
+}
+
+// Decodes a symbol from the next 16 bits of the stream (first bit is the highest), giving the length of its code
+// Returns -1 if the bits are not a code
+static inline int Huffman_Decode(const Huffman *h, UINT bits, UINT *len) {
+	const USHORT e = h->table[bits >> (16 - HUFF_TABLE_BITS)];
+	if (e) { *len = e & 0x1F; return e >> 5; }
+	for (UINT l = HUFF_TABLE_BITS + 1; l <= HUFF_MAX_LEN; ++l) {
+		const UINT i = (bits >> (16 - l)) - h->first[l];
+		if (i < h->count[l]) { *len = l; return h->syms[h->index[l] + i]; }
+	}
+	return -1;
+}
+
+// Finds the code lengths for the given symbol frequencies, limited to max_len by flattening the frequencies until it fits
+// If only one symbol is used a second one is given a code as well so that the code is always complete
+static void Huffman_Lengths(const ULONG *freqs, UINT n, UINT max_len, BYTE *lens) {
+	ULONG f[HUFF_MAX_SYMS], w[2*HUFF_MAX_SYMS];
+	USHORT order[HUFF_MAX_SYMS], parent[2*HUFF_MAX_SYMS];
+	BYTE depth[2*HUFF_MAX_SYMS];
+	UINT used = 0, i, j;
+	memset(lens, 0, n);
+	for (i = 0; i < n; ++i) { if ((f[i] = freqs[i]) != 0) { order[used++] = (USHORT)i; } }
+	if (used == 0) { return; }
+	if (used == 1) { lens[order[0]] = 1; lens[order[0] ? 0 : 1] = 1; return; }
+	for (;;) {
+		// Sort the used symbols by frequency, most are already in order after the first time
+		for (i = 1; i < used; ++i) {
+			const USHORT x = order[i];
+			for (j = i; j > 0 && f[order[j-1]] > f[x]; --j) { order[j] = order[j-1]; }
+			order[j] = x;
+		}
+
+		// Build the tree, the leaves and the new nodes are each already sorted so the two smallest are at their fronts
+		UINT leaf = 0, node = used, next;
+		for (i = 0; i < used; ++i) { w[i] = f[order[i]]; }
+		for (next = used; next < 2*used-1; ++next) {
+			UINT a = (leaf < used && (node >= next || w[leaf] <= w[node])) ? leaf++ : node++;
+			UINT b = (leaf < used && (node >= next || w[leaf] <= w[node])) ? leaf++ : node++;
+			w[next] = w[a] + w[b];
+			parent[a] = parent[b] = (USHORT)next;
+		}
+
+		// The parents always come after their children so the depths can be found from the root down
+		UINT max = 0;
+		depth[2*used-2] = 0;
+		for (i = 2*used-2; i-- > 0; ) { depth[i] = depth[parent[i]] + 1; }
+		for (i = 0; i < used; ++i) { max = MAX(max, depth[i]); }
+		if (max <= max_len) {
+			for (i = 0; i < used; ++i) { lens[order[i]] = depth[i]; }
+			return;
+		}
+		for (i = 0; i < used; ++i) { f[order[i]] = (f[order[i]] >> 1) | 1; }
+	}
+}
+
+// Assigns the canonical codes for the code lengths, the same as the decoding table above
+static void Huffman_Codes(const BYTE *lens, UINT n, USHORT *codes) {
+	UINT count[HUFF_MAX_LEN+1], next[HUFF_MAX_LEN+1], i, len, code = 0;
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < n; ++i) { ++count[lens[i]]; }
+	count[0] = 0;
+	for (len = 1; len <= HUFF_MAX_LEN; ++len) { next[len] = code; code = (code + count[len]) << 1; }
+	for (i = 0; i < n; ++i) { codes[i] = lens[i] ? (USHORT)next[lens[i]]++ : 0; }
+}
+
+
+/////////////////// Bit Writing and Matching //////////////////////////////////
+
+// Writes bits into 16-bit little-endian words, highest bit first, going past the end is only noticed at the end
+// XPRESS needs the word after the current one reserved before any bytes are written between the words, while LZX
+// simply puts each word at the end
+typedef struct _BitWriter {
+	BYTE *c;
+	ULONG c_len, pos;	// pos is where the next word (LZX) or byte (XPRESS) goes
+	ULONG cur, next;	// XPRESS: where the current and the next word go, next is ~0 until the current word starts
+	UINT buf, n;		// the low n bits of buf are waiting to be written
+} BitWriter;
+static inline void Bits_Word(BitWriter *b, ULONG at, UINT x) { if (at + 2 <= b->c_len) { PUT16(b->c+at, x); } }
+static inline void Bits_Put(BitWriter *b, UINT x, UINT n) {
+	b->buf = (b->buf << n) | x; b->n += n;
+	if (b->n >= 16) { b->n -= 16; Bits_Word(b, b->pos, b->buf >> b->n); b->pos += 2; }
+}
+static inline void Bits_Reserve(BitWriter *b) { b->next = b->pos; Bits_Word(b, b->pos, 0); b->pos += 2; }
+static inline void Bits_PutX(BitWriter *b, UINT x, UINT n) {
+	if (n == 0) { return; }
+	if (b->next == (ULONG)~0) { Bits_Reserve(b); }
+	b->buf = (b->buf << n) | x; b->n += n;
+	if (b->n >= 16) {
+		b->n -= 16;
+		Bits_Word(b, b->cur, b->buf >> b->n);
+		b->cur = b->next; b->next = (ULONG)~0;
+		if (b->n) { Bits_Reserve(b); }
+	}
+}
+static inline void Bits_Byte(BitWriter *b, UINT x) { if (b->pos < b->c_len) { b->c[b->pos] = (BYTE)x; } ++b->pos; }
+
+// The dictionary for finding matches, positions are hash-chained on their first three bytes
+// Instead of clearing head for every chunk the generation is incremented, making all older entries empty
+#define DICT_HASH_BITS	15
+#define DICT_HASH(u)	((((u)[0] << 16 | (u)[1] << 8 | (u)[2]) * 2654435761u) >> (32 - DICT_HASH_BITS))
+#define DICT_NONE		0xFFFF
+#define DICT_MAX_GEN	0xFFFF
+#define MIN_MATCH		3
+#define MATCH_DEPTH		32
+
+struct _wimzip_ctx {
+	ULONG gen;
+	ULONG head[1 << DICT_HASH_BITS];			// the generation (high 16 bits) and most recent position for each hash
+	USHORT prev[WIMZIP_LZX_CHUNK_SIZE];			// the previous position with the same hash as each position
+	USHORT lens[WIMZIP_LZX_CHUNK_SIZE];			// the parsed chunk: the length of each match, 0 for literals
+	USHORT offs[WIMZIP_LZX_CHUNK_SIZE];			// and the offset of each match
+	BYTE e8[WIMZIP_LZX_CHUNK_SIZE];				// the chunk after the LZX E8 translation
+};
+typedef wimzip_ctx Dictionary;
+
+static void Dictionary_Reset(Dictionary *d) {
+	if (++d->gen > DICT_MAX_GEN) { memset(d->head, 0, sizeof(d->head)); d->gen = 1; }
+}
+static inline USHORT Dictionary_Head(const Dictionary *d, const ULONG h) {
+	const ULONG x = d->head[h];
+	return ((x >> 16) == d->gen) ? (USHORT)x : DICT_NONE;
+}
+static inline void Dictionary_Add(Dictionary *d, const BYTE *u, const ULONG pos, const ULONG len) {
+	if (pos + MIN_MATCH <= len) {
+		const ULONG h = DICT_HASH(u+pos);
+		d->prev[pos] = Dictionary_Head(d, h);
+		d->head[h] = (d->gen << 16) | pos;
+	}
+}
+
+// Finds the longest match for the data at pos, returning its length (0 if there are none)
+static ULONG Dictionary_Find(const Dictionary *d, const BYTE *u, const ULONG pos, ULONG max_len, const ULONG max_off, ULONG *off) {
+	ULONG best = 0, depth = MATCH_DEPTH;
+	if (max_len < MIN_MATCH) { return 0; }
+	for (USHORT p = Dictionary_Head(d, DICT_HASH(u+pos)); p != DICT_NONE && pos - p <= max_off && depth--; p = d->prev[p]) {
+		if (u[p+best] != u[pos+best]) { continue; }
+		ULONG len = 0;
+		while (len < max_len && u[p+len] == u[pos+len]) { ++len; }
+		if (len > best) {
+			best = len; *off = pos - p;
+			if (len == max_len) { break; }
+		}
+	}
+	return best >= MIN_MATCH ? best : 0;
+}
+
+// Splits a chunk into literals and matches, a match is not taken if the next position has a longer one
+static ULONG Parse(Dictionary *d, const BYTE *u, const ULONG u_len, const ULONG max_len, const ULONG max_off) {
+	ULONG pos = 0, n = 0, len, off = 0, next_len = 0, next_off = 0, i;
+	bool have_next = false;
+	Dictionary_Reset(d);
+	while (pos < u_len) {
+		if (have_next) { len = next_len; off = next_off; have_next = false; }
+		else { len = Dictionary_Find(d, u, pos, MIN(max_len, u_len - pos), max_off, &off); }
+		Dictionary_Add(d, u, pos, u_len);
+		if (len && len < max_len && pos + 1 < u_len) {
+			next_len = Dictionary_Find(d, u, pos + 1, MIN(max_len, u_len - pos - 1), max_off, &next_off);
+			have_next = true;
+			if (next_len > len) { len = 0; }
+		}
+		if (len) {
+			for (i = 1; i < len; ++i) { Dictionary_Add(d, u, pos + i, u_len); }
+			have_next = false;
+			d->lens[n] = (USHORT)len; d->offs[n++] = (USHORT)off;
+			pos += len;
+		} else {
+			d->lens[n++] = 0;
+			++pos;
+		}
+	}
+	return n;
+}
+
+wimzip_ctx *wimzip_ctx_create() {
+	wimzip_ctx *ctx = (wimzip_ctx*)malloc(sizeof(wimzip_ctx));
+	if (ctx == NULL) { SetLastError(ERROR_NOT_ENOUGH_MEMORY); return NULL; }
+	ctx->gen = DICT_MAX_GEN; // cleared on first use
+	return ctx;
+}
+
+void wimzip_ctx_destroy(wimzip_ctx *ctx) { free(ctx); }
+
+
+/////////////////// LZX ///////////////////////////////////////////////////////
+
+// The WIM version of LZX always uses a 32 KB window (the chunk), has no header, and always does the E8 translation with
+// a file size of 12000000, relative to the start of the chunk
+#define LZX_NUM_CHARS		256
+#define LZX_NUM_SLOTS		30
+#define LZX_MAIN_SYMS		(LZX_NUM_CHARS + 8*LZX_NUM_SLOTS)
+#define LZX_LEN_SYMS		249
+#define LZX_ALIGNED_SYMS	8
+#define LZX_PRE_SYMS		20
+#define LZX_MIN_MATCH		2
+#define LZX_E8_FILE_SIZE	12000000
+
+#define LZX_BLOCK_VERBATIM		1
+#define LZX_BLOCK_ALIGNED		2
+#define LZX_BLOCK_UNCOMPRESSED	3
+
+// The first offset and the number of extra bits of each offset slot, offsets are stored with 2 added to them
+static const ULONG lzx_base[LZX_NUM_SLOTS] = {
+	0, 1, 2, 3, 4, 6, 8, 12, 16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096, 6144,
+	8192, 12288, 16384, 24576
+};
+static const BYTE lzx_extra[LZX_NUM_SLOTS] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+// The bits are in 16-bit little-endian words, highest bit first, reading past the end gives 0s
+typedef struct _LZXBits {
+	const BYTE *c;
+	ULONG c_len, pos;	// pos is the byte after the last word loaded into buf
+	UINT buf, n;		// the top n bits of buf are the next bits
+} LZXBits;
+static inline void LZX_Ensure(LZXBits *b, UINT n) {
+	if (b->n < n) {
+		if (b->pos + 2 <= b->c_len) { b->buf |= GET16(b->c + b->pos) << (16 - b->n); }
+		b->pos += 2;
+		b->n += 16;
+	}
+}
+static inline UINT LZX_Read(LZXBits *b, UINT n) {
+	if (n == 0) { return 0; }
+	LZX_Ensure(b, n);
+	const UINT x = b->buf >> (32 - n);
+	b->buf <<= n; b->n -= n;
+	return x;
+}
+static inline int LZX_Decode(LZXBits *b, const Huffman *h) {
+	UINT len;
+	LZX_Ensure(b, 16);
+	const int sym = Huffman_Decode(h, b->buf >> 16, &len);
+	if (sym >= 0) { b->buf <<= len; b->n -= len; }
+	return sym;
+}
+// Skips the 1 to 16 bits of padding up to the next word, after this raw bytes can be read from pos
+static inline void LZX_Align(LZXBits *b) {
+	const ULONG bit = b->pos * 8 - b->n; // the number of bits read
+	b->pos = (bit / 16 + 1) * 2;
+	b->buf = 0; b->n = 0;
+}
+
+// Reads the code lengths of the symbols [start, end), which are stored as changes from the previous lengths
+static bool LZX_ReadLens(LZXBits *b, Huffman *pre, BYTE *lens, UINT start, UINT end) {
+	BYTE pre_lens[LZX_PRE_SYMS];
+	for (UINT i = 0; i < LZX_PRE_SYMS; ++i) { pre_lens[i] = (BYTE)LZX_Read(b, 4); }
+	if (!Huffman_Init(pre, pre_lens, LZX_PRE_SYMS, 15)) { return false; }
+	while (start < end) {
+		int sym = LZX_Decode(b, pre);
+		UINT run;
+		BYTE len = 0;
+		if (sym < 0) { return false; }
+		else if (sym <= 16) { lens[start] = (BYTE)((lens[start] + 17 - sym) % 17); ++start; continue; }
+		else if (sym == 17) { run = 4 + LZX_Read(b, 4); }
+		else if (sym == 18) { run = 20 + LZX_Read(b, 5); }
+		else {
+			run = 4 + LZX_Read(b, 1);
+			if ((sym = LZX_Decode(b, pre)) < 0 || sym > 16) { return false; }
+			len = (BYTE)((lens[start] + 17 - sym) % 17);
+		}
+		if (run > end - start) { return false; }
+		memset(lens + start, len, run);
+		start += run;
+	}
+	return true;
+}
+
+// Reverses the translation of the targets of x86 CALL instructions done during compression
+static void LZX_UndoE8(BYTE *u, ULONG u_len) {
+	if (u_len <= 10) { return; }
+	for (ULONG i = 0; i < u_len - 10; ) {
+		if (u[i] != 0xE8) { ++i; continue; }
+		const LONG abs = (LONG)GET32(u+i+1);
+		if (abs >= -(LONG)i && abs < LZX_E8_FILE_SIZE) {
+			const LONG rel = (abs >= 0) ? abs - (LONG)i : abs + LZX_E8_FILE_SIZE;
+			u[i+1] = (BYTE)rel; u[i+2] = (BYTE)(rel >> 8); u[i+3] = (BYTE)(rel >> 16); u[i+4] = (BYTE)(rel >> 24);
+		}
+		i += 5;
+	}
+}
+
+// The trees together are large so they are kept off of the stack
+typedef struct _LZXTrees {
+	Huffman main, len, aligned, pre;
+	BYTE main_lens[LZX_MAIN_SYMS], len_lens[LZX_LEN_SYMS];
+} LZXTrees;
+
+static ULONG LZX_Decompress(LZXTrees *t, const BYTE *c, ULONG c_len, BYTE *u, ULONG u_len) {
+	LZXBits b = { c, c_len, 0, 0, 0 };
+	ULONG u_pos = 0, R[3] = { 1, 1, 1 };
+	memset(t->main_lens, 0, sizeof(t->main_lens));
+	memset(t->len_lens, 0, sizeof(t->len_lens));
+
+	while (u_pos < u_len) {
+		// Read the block header
+		const UINT type = LZX_Read(&b, 3);
+		ULONG size = LZX_Read(&b, 1) ? WIMZIP_LZX_CHUNK_SIZE : LZX_Read(&b, 16);
+		if (size == 0) { return 0; }
+		const ULONG end = u_pos + MIN(size, u_len - u_pos);
+
+		if (type == LZX_BLOCK_UNCOMPRESSED) {
+			// The recent offsets and the data are stored directly, followed by a padding byte if the size is odd
+			LZX_Align(&b);
+			size = end - u_pos;
+			if (b.pos + 12 + size > c_len) { return 0; }
+			R[0] = GET32(c+b.pos); R[1] = GET32(c+b.pos+4); R[2] = GET32(c+b.pos+8);
+			memcpy(u+u_pos, c+b.pos+12, size);
+			b.pos += 12 + size + (size & 1);
+			u_pos = end;
+			continue;
+		} else if (type == LZX_BLOCK_ALIGNED) {
+			BYTE aligned_lens[LZX_ALIGNED_SYMS];
+			for (UINT i = 0; i < LZX_ALIGNED_SYMS; ++i) { aligned_lens[i] = (BYTE)LZX_Read(&b, 3); }
+			if (!Huffman_Init(&t->aligned, aligned_lens, LZX_ALIGNED_SYMS, 7)) { return 0; }
+		} else if (type != LZX_BLOCK_VERBATIM) { return 0; }
+
+		// Read the main and length trees, the main tree's lengths are given in two parts
+		if (!LZX_ReadLens(&b, &t->pre, t->main_lens, 0, LZX_NUM_CHARS) ||
+			!LZX_ReadLens(&b, &t->pre, t->main_lens, LZX_NUM_CHARS, LZX_MAIN_SYMS) ||
+			!Huffman_Init(&t->main, t->main_lens, LZX_MAIN_SYMS, 16) ||
+			!LZX_ReadLens(&b, &t->pre, t->len_lens, 0, LZX_LEN_SYMS) ||
+			!Huffman_Init(&t->len, t->len_lens, LZX_LEN_SYMS, 16)) { return 0; }
+
+		// Decode the symbols, matches may run past the end of the block
+		while (u_pos < end) {
+			int sym = LZX_Decode(&b, &t->main);
+			if (sym < 0) { return 0; }
+			if (sym < LZX_NUM_CHARS) { u[u_pos++] = (BYTE)sym; continue; }
+			sym -= LZX_NUM_CHARS;
+			const UINT slot = sym >> 3;
+			ULONG len = sym & 7, off;
+			if (len == 7) {
+				const int x = LZX_Decode(&b, &t->len);
+				if (x < 0) { return 0; }
+				len += x;
+			}
+			len += LZX_MIN_MATCH;
+			if (slot < 3) {
+				// One of the three most recent offsets, which is moved to the front
+				off = R[slot]; R[slot] = R[0]; R[0] = off;
+			} else {
+				const UINT extra = lzx_extra[slot];
+				if (type == LZX_BLOCK_ALIGNED && extra >= 3) {
+					off = LZX_Read(&b, extra - 3) << 3;
+					const int x = LZX_Decode(&b, &t->aligned);
+					if (x < 0) { return 0; }
+					off += x;
+				} else {
+					off = LZX_Read(&b, extra);
+				}
+				off += lzx_base[slot] - 2;
+				R[2] = R[1]; R[1] = R[0]; R[0] = off;
+			}
+			if (off == 0 || off > u_pos || len > u_len - u_pos) { return 0; }
+			CopyMatch(u+u_pos, off, len);
+			u_pos += len;
+		}
+	}
+
+	LZX_UndoE8(u, u_len);
+	return u_len;
+}
+
+ULONG wimzip_lzx_decompress(const BYTE *c, ULONG c_len, BYTE *u, ULONG u_len) {
+	if (u_len > WIMZIP_LZX_CHUNK_SIZE) { SetLastError(ERROR_INVALID_PARAMETER); return 0; }
+	LZXTrees *t = (LZXTrees*)malloc(sizeof(LZXTrees));
+	if (t == NULL) { SetLastError(ERROR_NOT_ENOUGH_MEMORY); return 0; }
+	const ULONG len = LZX_Decompress(t, c, c_len, u, u_len);
+	free(t);
+	if (len == 0) { SetLastError(ERROR_INVALID_DATA); }
+	return len;
+}
+
+// Translates the targets of x86 CALL instructions from relative to absolute before compression
+static void LZX_DoE8(BYTE *u, ULONG u_len) {
+	if (u_len <= 10) { return; }
+	for (ULONG i = 0; i < u_len - 10; ) {
+		if (u[i] != 0xE8) { ++i; continue; }
+		const LONG rel = (LONG)GET32(u+i+1);
+		if (rel >= -(LONG)i && rel < LZX_E8_FILE_SIZE) {
+			const LONG abs = (rel < LZX_E8_FILE_SIZE - (LONG)i) ? rel + (LONG)i : rel - LZX_E8_FILE_SIZE;
+			PUT32(u+i+1, (ULONG)abs);
+		}
+		i += 5;
+	}
+}
+
+// Gets the offset slot for a match and its extra bits, updating the recent offsets
+static inline UINT LZX_Slot(ULONG off, ULONG *R, ULONG *extra) {
+	UINT slot;
+	for (slot = 0; slot < 3 && R[slot] != off; ++slot);
+	if (slot < 3) { R[slot] = R[0]; R[0] = off; *extra = 0; return slot; }
+	const ULONG f = off + 2;
+	const UINT hb = HighBit(f);
+	slot = (f < 4) ? f : (2*hb + ((f >> (hb-1)) & 1));
+	*extra = f - lzx_base[slot];
+	R[2] = R[1]; R[1] = R[0]; R[0] = off;
+	return slot;
+}
+
+// Writes the code lengths of a tree using a pretree, each chunk is a single block so the previous lengths are all 0
+static void LZX_WriteLens(BitWriter *b, const BYTE *lens, UINT n) {
+	BYTE syms[LZX_MAIN_SYMS], extra[LZX_MAIN_SYMS], pre_lens[LZX_PRE_SYMS];
+	ULONG freqs[LZX_PRE_SYMS];
+	USHORT codes[LZX_PRE_SYMS];
+	UINT count = 0, i, run;
+	memset(freqs, 0, sizeof(freqs));
+	// First turn the lengths into pretree symbols, combining runs
+	for (i = 0; i < n; i += run) {
+		for (run = 1; i + run < n && lens[i+run] == lens[i]; ++run);
+		if (lens[i] == 0 && run >= 20) { run = MIN(run, 51); syms[count] = 18; extra[count] = (BYTE)(run - 20); }
+		else if (lens[i] == 0 && run >= 4) { syms[count] = 17; extra[count] = (BYTE)(run - 4); }
+		else if (run >= 4) { run = MIN(run, 5); syms[count] = 19; extra[count] = (BYTE)(run - 4); ++freqs[(17 - lens[i]) % 17]; }
+		else { run = 1; syms[count] = (BYTE)((17 - lens[i]) % 17); }
+		++freqs[syms[count++]];
+	}
+	// Then write the pretree and the symbols, run is now the position in the lengths
+	Huffman_Lengths(freqs, LZX_PRE_SYMS, 15, pre_lens);
+	Huffman_Codes(pre_lens, LZX_PRE_SYMS, codes);
+	for (i = 0; i < LZX_PRE_SYMS; ++i) { Bits_Put(b, pre_lens[i], 4); }
+	for (i = 0, run = 0; i < count; ++i) {
+		const BYTE x = syms[i];
+		Bits_Put(b, codes[x], pre_lens[x]);
+		if (x == 17) { Bits_Put(b, extra[i], 4); run += extra[i] + 4; }
+		else if (x == 18) { Bits_Put(b, extra[i], 5); run += extra[i] + 20; }
+		else if (x == 19) { const BYTE y = (BYTE)((17 - lens[run]) % 17); Bits_Put(b, extra[i], 1); Bits_Put(b, codes[y], pre_lens[y]); run += extra[i] + 4; }
+		else { ++run; }
+	}
+}
+
+// Compresses a chunk as a single verbatim or aligned block, whichever is smaller
+static ULONG LZX_Compress(wimzip_ctx *d, const BYTE *in, ULONG u_len, BYTE *c, ULONG c_len) {
+	ULONG main_freqs[LZX_MAIN_SYMS], len_freqs[LZX_LEN_SYMS], aligned_freqs[LZX_ALIGNED_SYMS], R[3], pos, extra, i;
+	BYTE main_lens[LZX_MAIN_SYMS], len_lens[LZX_LEN_SYMS], aligned_lens[LZX_ALIGNED_SYMS];
+	USHORT main_codes[LZX_MAIN_SYMS], len_codes[LZX_LEN_SYMS], aligned_codes[LZX_ALIGNED_SYMS];
+	UINT slot;
+
+	// Find the matches in the translated data
+	const BYTE *u = d->e8;
+	memcpy(d->e8, in, u_len);
+	LZX_DoE8(d->e8, u_len);
+	const ULONG n = Parse(d, u, u_len, LZX_MIN_MATCH + 7 + LZX_LEN_SYMS - 1, WIMZIP_LZX_CHUNK_SIZE - 3);
+
+	// Count the symbols
+	memset(main_freqs, 0, sizeof(main_freqs));
+	memset(len_freqs, 0, sizeof(len_freqs));
+	memset(aligned_freqs, 0, sizeof(aligned_freqs));
+	ULONG verbatim_bits = 0, aligned_bits = 3*LZX_ALIGNED_SYMS;
+	R[0] = R[1] = R[2] = 1;
+	for (i = 0, pos = 0; i < n; ++i) {
+		const ULONG len = d->lens[i];
+		if (len == 0) { ++main_freqs[u[pos++]]; continue; }
+		slot = LZX_Slot(d->offs[i], R, &extra);
+		const ULONG l = len - LZX_MIN_MATCH;
+		++main_freqs[LZX_NUM_CHARS + 8*slot + MIN(l, 7)];
+		if (l >= 7) { ++len_freqs[l - 7]; }
+		if (slot >= 3 && lzx_extra[slot] >= 3) { ++aligned_freqs[extra & 7]; verbatim_bits += lzx_extra[slot]; aligned_bits += lzx_extra[slot] - 3; }
+		pos += len;
+	}
+	Huffman_Lengths(main_freqs, LZX_MAIN_SYMS, 16, main_lens);
+	Huffman_Lengths(len_freqs, LZX_LEN_SYMS, 16, len_lens);
+	Huffman_Lengths(aligned_freqs, LZX_ALIGNED_SYMS, 7, aligned_lens);
+	for (i = 0; i < LZX_ALIGNED_SYMS; ++i) { aligned_bits += aligned_freqs[i] * aligned_lens[i]; }
+	const UINT type = (aligned_bits < verbatim_bits) ? LZX_BLOCK_ALIGNED : LZX_BLOCK_VERBATIM;
+	Huffman_Codes(main_lens, LZX_MAIN_SYMS, main_codes);
+	Huffman_Codes(len_lens, LZX_LEN_SYMS, len_codes);
+	Huffman_Codes(aligned_lens, LZX_ALIGNED_SYMS, aligned_codes);
+
+	// Write the block header and the trees
+	BitWriter b = { c, c_len, 0, 0, 0, 0, 0 };
+	Bits_Put(&b, type, 3);
+	if (u_len == WIMZIP_LZX_CHUNK_SIZE) { Bits_Put(&b, 1, 1); } else { Bits_Put(&b, 0, 1); Bits_Put(&b, u_len, 16); }
+	if (type == LZX_BLOCK_ALIGNED) { for (i = 0; i < LZX_ALIGNED_SYMS; ++i) { Bits_Put(&b, aligned_lens[i], 3); } }
+	LZX_WriteLens(&b, main_lens, LZX_NUM_CHARS);
+	LZX_WriteLens(&b, main_lens + LZX_NUM_CHARS, LZX_MAIN_SYMS - LZX_NUM_CHARS);
+	LZX_WriteLens(&b, len_lens, LZX_LEN_SYMS);
+
+	// Write the symbols
+	R[0] = R[1] = R[2] = 1;
+	for (i = 0, pos = 0; i < n && b.pos <= c_len; ++i) {
+		const ULONG len = d->lens[i];
+		if (len == 0) { const BYTE x = u[pos++]; Bits_Put(&b, main_codes[x], main_lens[x]); continue; }
+		slot = LZX_Slot(d->offs[i], R, &extra);
+		const ULONG l = len - LZX_MIN_MATCH;
+		const UINT x = LZX_NUM_CHARS + 8*slot + MIN(l, 7);
+		Bits_Put(&b, main_codes[x], main_lens[x]);
+		if (l >= 7) { Bits_Put(&b, len_codes[l - 7], len_lens[l - 7]); }
+		if (slot < 3) {}
+		else if (type == LZX_BLOCK_ALIGNED && lzx_extra[slot] >= 3) {
+			Bits_Put(&b, extra >> 3, lzx_extra[slot] - 3);
+			Bits_Put(&b, aligned_codes[extra & 7], aligned_lens[extra & 7]);
+		} else { Bits_Put(&b, extra, lzx_extra[slot]); }
+		pos += len;
+	}
+	if (b.n) { Bits_Put(&b, 0, 16 - b.n); }
+	return (b.pos <= c_len) ? b.pos : 0;
+}
+
+ULONG wimzip_lzx_compress(const BYTE *u, ULONG u_len, BYTE *c, ULONG c_len, wimzip_ctx *ctx) {
+	if (u_len == 0 || u_len > WIMZIP_LZX_CHUNK_SIZE) { SetLastError(ERROR_INVALID_PARAMETER); return 0; }
+	wimzip_ctx *d = ctx ? ctx : wimzip_ctx_create();
+	if (d == NULL) { return 0; }
+	const ULONG len = LZX_Compress(d, u, u_len, c, c_len);
+	if (d != ctx) { wimzip_ctx_destroy(d); }
+	if (len == 0) { SetLastError(ERROR_INSUFFICIENT_BUFFER); }
+	return len;
+}
+
+
+/////////////////// XPRESS ////////////////////////////////////////////////////
+
+// The data starts with the 4-bit code lengths of the 512 symbols followed by the bits which are in 16-bit little-endian
+// words, highest bit first, with the extra bytes of long match lengths between the words
+// This follows the decoder in [MS-XCA] exactly since when the words are read decides where the extra bytes are
+// Outside of WIMs there is a new set of code lengths every 64 KB, but WIM chunks are never that large
+#define XPRESS_NUM_CHARS	256
+#define XPRESS_NUM_SYMS		512
+#define XPRESS_MIN_MATCH	3
+
+// Reads the next word into the bits once there are fewer than 16 bits available beyond the next 16
+#define XPRESS_REFILL() if (extra < 0) { if (c_pos + 2 <= c_len) { bits |= GET16(c+c_pos) << -extra; } c_pos += 2; extra += 16; }
+
+static ULONG XPRESS_Decompress(Huffman *h, const BYTE *c, ULONG c_len, BYTE *u, ULONG u_len) {
+	// Read the code lengths and the first 32 bits
+	if (c_len < XPRESS_NUM_SYMS/2 + 4) { return 0; }
+	BYTE lens[XPRESS_NUM_SYMS];
+	for (UINT i = 0; i < XPRESS_NUM_SYMS/2; ++i) { lens[2*i] = c[i] & 0xF; lens[2*i+1] = c[i] >> 4; }
+	if (!Huffman_Init(h, lens, XPRESS_NUM_SYMS, 15)) { return 0; }
+	ULONG c_pos = XPRESS_NUM_SYMS/2, u_pos = 0;
+	UINT bits = (GET16(c+c_pos) << 16) | GET16(c+c_pos+2);
+	int extra = 16; // the number of bits available beyond the next 16
+	c_pos += 4;
+
+	while (u_pos < u_len) {
+		UINT n;
+		int sym = Huffman_Decode(h, bits >> 16, &n);
+		if (sym < 0) { return 0; }
+		bits <<= n; extra -= n;
+		XPRESS_REFILL();
+		if (sym < XPRESS_NUM_CHARS) { u[u_pos++] = (BYTE)sym; continue; }
+
+		// A match, long lengths take extra bytes
+		sym -= XPRESS_NUM_CHARS;
+		ULONG len = sym & 0xF, off;
+		n = sym >> 4;
+		if (len == 15) {
+			if (c_pos >= c_len) { return 0; }
+			len = c[c_pos++];
+			if (len == 255) {
+				if (c_pos + 2 > c_len) { return 0; }
+				len = GET16(c+c_pos);
+				c_pos += 2;
+				if (len < 15) { return 0; }
+				len -= 15;
+			}
+			len += 15;
+		}
+		len += XPRESS_MIN_MATCH;
+		off = (n ? (bits >> (32 - n)) : 0) | (1 << n);
+		bits <<= n; extra -= n;
+		XPRESS_REFILL();
+		if (off > u_pos || len > u_len - u_pos) { return 0; }
+		CopyMatch(u+u_pos, off, len);
+		u_pos += len;
+	}
+	return u_len;
+}
+
+static ULONG XPRESS_Compress(wimzip_ctx *d, const BYTE *u, ULONG u_len, BYTE *c, ULONG c_len) {
+	ULONG freqs[XPRESS_NUM_SYMS], i, pos;
+	BYTE lens[XPRESS_NUM_SYMS];
+	USHORT codes[XPRESS_NUM_SYMS];
+	if (c_len < XPRESS_NUM_SYMS/2 + 4) { return 0; }
+
+	// Find the matches and count the symbols
+	const ULONG n = Parse(d, u, u_len, 0xFFFF + XPRESS_MIN_MATCH, 0xFFFF);
+	memset(freqs, 0, sizeof(freqs));
+	for (i = 0, pos = 0; i < n; ++i) {
+		const ULONG len = d->lens[i];
+		if (len == 0) { ++freqs[u[pos++]]; continue; }
+		++freqs[XPRESS_NUM_CHARS + (HighBit(d->offs[i]) << 4) + MIN(len - XPRESS_MIN_MATCH, 15)];
+		pos += len;
+	}
+	Huffman_Lengths(freqs, XPRESS_NUM_SYMS, 15, lens);
+	Huffman_Codes(lens, XPRESS_NUM_SYMS, codes);
+	for (i = 0; i < XPRESS_NUM_SYMS/2; ++i) { c[i] = (BYTE)(lens[2*i] | (lens[2*i+1] << 4)); }
+
+	// Write the symbols, the first two words are reserved from the start
+	BitWriter b = { c, c_len, XPRESS_NUM_SYMS/2 + 4, XPRESS_NUM_SYMS/2, XPRESS_NUM_SYMS/2 + 2, 0, 0 };
+	Bits_Word(&b, b.cur, 0); Bits_Word(&b, b.next, 0);
+	for (i = 0, pos = 0; i < n && b.pos <= c_len; ++i) {
+		const ULONG len = d->lens[i];
+		if (len == 0) { const BYTE x = u[pos++]; Bits_PutX(&b, codes[x], lens[x]); continue; }
+		const ULONG l = len - XPRESS_MIN_MATCH, off = d->offs[i];
+		const UINT bits = HighBit(off), x = XPRESS_NUM_CHARS + (bits << 4) + MIN(l, 15);
+		Bits_PutX(&b, codes[x], lens[x]);
+		if (l >= 15) {
+			if (l - 15 < 255) { Bits_Byte(&b, l - 15); }
+			else { Bits_Byte(&b, 255); Bits_Byte(&b, l); Bits_Byte(&b, l >> 8); }
+		}
+		Bits_PutX(&b, off & ((1 << bits) - 1), bits);
+		pos += len;
+	}
+	if (b.n) { Bits_PutX(&b, 0, 16 - b.n); }
+	return (b.pos <= c_len) ? b.pos : 0;
+}
+
+ULONG wimzip_xpress_compress(const BYTE *u, ULONG u_len, BYTE *c, ULONG c_len, wimzip_ctx *ctx) {
+	if (u_len == 0 || u_len > WIMZIP_LZX_CHUNK_SIZE) { SetLastError(ERROR_INVALID_PARAMETER); return 0; }
+	wimzip_ctx *d = ctx ? ctx : wimzip_ctx_create();
+	if (d == NULL) { return 0; }
+	const ULONG len = XPRESS_Compress(d, u, u_len, c, c_len);
+	if (d != ctx) { wimzip_ctx_destroy(d); }
+	if (len == 0) { SetLastError(ERROR_INSUFFICIENT_BUFFER); }
+	return len;
+}
+
+ULONG wimzip_xpress_decompress(const BYTE *c, ULONG c_len, BYTE *u, ULONG u_len) {
+	if (u_len > WIMZIP_XPRESS_MAX_CHUNK) { SetLastError(ERROR_INVALID_PARAMETER); return 0; }
+	Huffman *h = (Huffman*)malloc(sizeof(Huffman));
+	if (h == NULL) { SetLastError(ERROR_NOT_ENOUGH_MEMORY); return 0; }
+	const ULONG len = XPRESS_Decompress(h, c, c_len, u, u_len);
+	free(h);
+	if (len == 0) { SetLastError(ERROR_INVALID_DATA); }
+	return len;
+}
+
+
+/////////////////// Resources /////////////////////////////////////////////////
+
+// Every chunk is independent, so they can be compressed on separate threads and then put together
+
+// The shared state of a multi-threaded job
+typedef struct _Job {
+	ULONG (*compress)(const BYTE*, ULONG, BYTE*, ULONG, wimzip_ctx*);
+	const BYTE *in;
+	ULONG in_len;
+	BYTE *out;			// each chunk is compressed into its own chunk-sized slot
+	ULONG count;		// number of chunks
+	ULONG *sizes;		// the compressed size of each chunk, 0 if it didn't get smaller
+	volatile LONG next;	// the next chunk to process
+} Job;
+
+static void Worker(Job *job) {
+	ULONG i;
+	wimzip_ctx *d = wimzip_ctx_create();
+	if (d == NULL) { return; } // the other threads (or the caller) will do the work
+	while ((i = (ULONG)InterlockedIncrement(&job->next)-1) < job->count) {
+		const ULONG u_pos = i*WIMZIP_LZX_CHUNK_SIZE, u_len = MIN(job->in_len-u_pos, WIMZIP_LZX_CHUNK_SIZE);
+		job->sizes[i] = job->compress(job->in+u_pos, u_len, job->out+u_pos, u_len-1, d);
+	}
+	wimzip_ctx_destroy(d);
+}
+
+#ifdef _WIN32
+#define MAX_THREADS	MAXIMUM_WAIT_OBJECTS
+typedef HANDLE Thread;
+static DWORD WINAPI ThreadProc(LPVOID param) { Worker((Job*)param); return ERROR_SUCCESS; }
+static ULONG ProcessorCount() { SYSTEM_INFO si; GetSystemInfo(&si); return si.dwNumberOfProcessors; }
+static bool StartThread(Thread *t, Job *job) { return (*t = CreateThread(NULL, 0, ThreadProc, job, 0, NULL)) != NULL; }
+static void JoinThreads(Thread *t, ULONG n) {
+	ULONG i;
+	WaitForMultipleObjects(n, t, TRUE, INFINITE);
+	for (i = 0; i < n; ++i)
+		CloseHandle(t[i]);
+}
+#else
+#define MAX_THREADS	64
+typedef pthread_t Thread;
+static void *ThreadProc(void *param) { Worker((Job*)param); return NULL; }
+static ULONG ProcessorCount() { long n = sysconf(_SC_NPROCESSORS_ONLN); return n > 0 ? (ULONG)n : 1; }
+static bool StartThread(Thread *t, Job *job) { return pthread_create(t, NULL, ThreadProc, job) == 0; }
+static void JoinThreads(Thread *t, ULONG n) {
+	ULONG i;
+	for (i = 0; i < n; ++i)
+		pthread_join(t[i], NULL);
+}
+#endif
+
+ULONG wimzip_resource_bound(ULONG u_len) {
+	const ULONG n = (u_len + WIMZIP_LZX_CHUNK_SIZE - 1) / WIMZIP_LZX_CHUNK_SIZE;
+	return (n ? (n-1)*sizeof(DWORD) : 0) + u_len;
+}
+
+ULONG wimzip_compress_resource(int format, const BYTE *u, ULONG u_len, BYTE *c, ULONG c_len, ULONG threads) {
+	Thread t[MAX_THREADS];
+	ULONG i, n = 0, c_pos;
+	Job job = { (format == WIMZIP_LZX) ? wimzip_lzx_compress : wimzip_xpress_compress, u, u_len, NULL,
+		(u_len + WIMZIP_LZX_CHUNK_SIZE - 1) / WIMZIP_LZX_CHUNK_SIZE, NULL, 0 };
+	if (format != WIMZIP_LZX && format != WIMZIP_XPRESS) { SetLastError(ERROR_INVALID_PARAMETER); return 0; }
+	if (c_len < wimzip_resource_bound(u_len)) { SetLastError(ERROR_INSUFFICIENT_BUFFER); return 0; }
+	if (job.count == 0) { return 0; }
+
+	// First pass: compress every chunk into its own slot, on as many threads as allowed (including this one)
+	job.out = (BYTE*)malloc(u_len);
+	job.sizes = (ULONG*)calloc(job.count, sizeof(ULONG));
+	if (job.out == NULL || job.sizes == NULL) {
+		free(job.out);
+		free(job.sizes);
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		return 0;
+	}
+	if (threads == 0) { threads = ProcessorCount(); }
+	threads = MIN(MIN(threads, job.count), MAX_THREADS);
+	for (i = 1; i < threads; ++i)
+		if (StartThread(t+n, &job)) { ++n; }
+	Worker(&job);
+	if (n) { JoinThreads(t, n); }
+	if (job.next < (LONG)job.count) { // every thread failed to get a context
+		free(job.out);
+		free(job.sizes);
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		return 0;
+	}
+
+	// Second pass: now that the sizes are known write the chunk table and stitch the chunks together
+	c_pos = (job.count-1)*sizeof(DWORD);
+	for (i = 0; i < job.count; ++i) {
+		const ULONG u_pos = i*WIMZIP_LZX_CHUNK_SIZE;
+		if (i) { PUT32(c+(i-1)*sizeof(DWORD), c_pos - (job.count-1)*sizeof(DWORD)); }
+		if (job.sizes[i]) { memcpy(c+c_pos, job.out+u_pos, job.sizes[i]); c_pos += job.sizes[i]; }
+		else { const ULONG len = MIN(u_len-u_pos, WIMZIP_LZX_CHUNK_SIZE); memcpy(c+c_pos, u+u_pos, len); c_pos += len; }
+	}
+	free(job.out);
+	free(job.sizes);
+	return c_pos;
+}
@@ -0,0 +1,49 @@
+/*
+ * Windows 7 Boot Updater (github.com/coderforlife/windows-7-boot-updater)
+ * Copyright (C) 2021  Jeffrey Bush - Coder for Life
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// The compression formats used for the chunks of WIM resources, LZX and XPRESS (the LZ77+Huffman variant)
+// Every chunk is compressed on its own and the uncompressed size of each chunk is known from the WIM
+
+// LZX is only supported with the standard 32 KB chunks, XPRESS with chunks up to 64 KB (but only compresses 32 KB chunks)
+#define WIMZIP_LZX_CHUNK_SIZE		0x8000
+#define WIMZIP_XPRESS_MAX_CHUNK		0x10000
+
+#define WIMZIP_XPRESS	1
+#define WIMZIP_LZX		2
+
+// The compression context holds the dictionary, a context can be reused for any number of calls but only by one thread at a time
+// When one isn't given a temporary one is used
+typedef struct _wimzip_ctx wimzip_ctx;
+wimzip_ctx *wimzip_ctx_create();
+void wimzip_ctx_destroy(wimzip_ctx *ctx);
+
+// Compresses a single chunk of at most 32 KB, returning the compressed size or 0 if it does not fit in c_len
+ULONG wimzip_lzx_compress(const BYTE *u, ULONG u_len, BYTE *c, ULONG c_len, wimzip_ctx *ctx = NULL);
+ULONG wimzip_xpress_compress(const BYTE *u, ULONG u_len, BYTE *c, ULONG c_len, wimzip_ctx *ctx = NULL);
+
+// Decompresses a single chunk, returning u_len or 0 if the data is invalid
+ULONG wimzip_lzx_decompress(const BYTE *c, ULONG c_len, BYTE *u, ULONG u_len);
+ULONG wimzip_xpress_decompress(const BYTE *c, ULONG c_len, BYTE *u, ULONG u_len);
+
+// Compresses an entire resource as it is stored in a WIM: a table of where each chunk starts followed by the 32 KB chunks
+// Chunks that do not get smaller are stored as-is, the chunks are compressed in parallel using up to the given number of
+// threads (0 for one per processor), returns the compressed size or 0 if it does not fit in c_len
+ULONG wimzip_compress_resource(int format, const BYTE *u, ULONG u_len, BYTE *c, ULONG c_len, ULONG threads = 0);
+ULONG wimzip_resource_bound(ULONG u_len); // the largest the compressed resource can be
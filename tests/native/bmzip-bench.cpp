@@ -0,0 +1,150 @@
+/*
+ * Windows 7 Boot Updater (github.com/coderforlife/windows-7-boot-updater)
+ * Copyright (C) 2021  Jeffrey Bush - Coder for Life
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Benchmark of bmzip over synthetic data and any captured payloads (such as an uncompressed bootmgr) given on the command line
+// Reports the compression and decompression speed in MB/s, the ratio, and the peak RSS of the process so far
+//
+// Usage: bmzip-bench [-t seconds] [file ...]
+
+#include "bmzip.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include <string>
+#include <vector>
+
+typedef std::vector<BYTE> Buffer;
+
+struct Mode { const char *name; ULONG depth; bool mt; };
+static const Mode modes[] = {
+	{ "greedy",      BMZIP_DEFAULT_DEPTH,                   false },
+	{ "lazy",        BMZIP_DEFAULT_DEPTH | BMZIP_LAZY,      false },
+	{ "optimal",     BMZIP_DEFAULT_DEPTH | BMZIP_OPTIMAL,   false },
+	{ "optimal-mt",  BMZIP_DEFAULT_DEPTH | BMZIP_OPTIMAL,   true  },
+	{ "max-ratio",   BMZIP_MAX_RATIO | BMZIP_OPTIMAL,       false },
+};
+
+static double min_time = 0.5;
+
+static double Now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static long PeakRSS() {
+	struct rusage r;
+	getrusage(RUSAGE_SELF, &r);
+	return r.ru_maxrss; // in KB on Linux
+}
+
+// Synthetic inputs, each 256 KB
+static Buffer Zeros() { return Buffer(0x40000, 0); }
+static Buffer Random() {
+	Buffer b(0x40000);
+	srand(1);
+	for (size_t i = 0; i < b.size(); ++i) { b[i] = (BYTE)rand(); }
+	return b;
+}
+static Buffer Text() {
+	static const char *words[] = { "boot", "manager ", "windows", " ", "loader", "\r\n", "the ", "resource", ".mui", "error", "\\Windows\\", "system32" };
+	Buffer b(0x40000);
+	srand(2);
+	for (size_t i = 0; i < b.size(); ) {
+		const char *w = words[rand() % ARRAYSIZE(words)];
+		for (; *w && i < b.size(); ++w, ++i) { b[i] = (BYTE)*w; }
+	}
+	return b;
+}
+// Looks like the code and tables of an executable: repeated instruction patterns, small constants, and padding
+static Buffer Code() {
+	static const BYTE ops[][4] = { { 0x8B, 0xFF, 0x55, 0x8B }, { 0xEC, 0x83, 0xEC, 0x10 }, { 0x53, 0x56, 0x57, 0x8B }, { 0xE8, 0, 0, 0 }, { 0xC3, 0xCC, 0xCC, 0xCC }, { 0x33, 0xC0, 0x5F, 0x5E } };
+	Buffer b(0x40000);
+	srand(3);
+	for (size_t i = 0; i + 4 <= b.size(); i += 4) {
+		memcpy(&b[i], ops[rand() % ARRAYSIZE(ops)], 4);
+		if (b[i] == 0xE8) { b[i+1] = (BYTE)rand(); b[i+2] = (BYTE)(rand() & 3); }
+		if ((i & 0xFFF) >= 0xF00) { memset(&b[i], 0, 4); }
+	}
+	return b;
+}
+
+static bool LoadFile(const char *path, Buffer &b) {
+	FILE *f = fopen(path, "rb");
+	if (!f) { return false; }
+	BYTE temp[0x10000];
+	size_t n;
+	while ((n = fread(temp, 1, sizeof(temp), f)) > 0) { b.insert(b.end(), temp, temp + n); }
+	fclose(f);
+	return !b.empty();
+}
+
+static bool Run(const std::string &name, const Buffer &u) {
+	const ULONG u_len = (ULONG)u.size();
+	Buffer c(bmzip_compress_bound(u_len)), d(u_len);
+	for (size_t m = 0; m < ARRAYSIZE(modes); ++m) {
+		const Mode &mode = modes[m];
+		ULONG c_len = 0, n = 0, iters;
+		double start = Now(), comp, decomp;
+
+		// compress until the minimum time has passed
+		for (iters = 0; iters == 0 || Now() - start < min_time; ++iters) {
+			c_len = mode.mt ? bmzip_compress_mt(&u[0], u_len, &c[0], (ULONG)c.size(), mode.depth) : bmzip_compress(&u[0], u_len, &c[0], (ULONG)c.size(), mode.depth);
+			if (c_len == 0) { fprintf(stderr, "%s/%s: compression failed\n", name.c_str(), mode.name); return false; }
+		}
+		comp = (Now() - start) / iters;
+
+		// decompress until the minimum time has passed
+		start = Now();
+		for (iters = 0; iters == 0 || Now() - start < min_time; ++iters) {
+			n = mode.mt ? bmzip_decompress_mt(&c[0], c_len, &d[0], u_len) : bmzip_decompress(&c[0], c_len, &d[0], u_len);
+		}
+		decomp = (Now() - start) / iters;
+		if (n != u_len || d != u) { fprintf(stderr, "%s/%s: round trip failed\n", name.c_str(), mode.name); return false; }
+
+		printf("%-24s %-11s %10lu %10lu %7.3f %10.2f %10.2f %10ld\n", name.c_str(), mode.name, (unsigned long)u_len, (unsigned long)c_len,
+			(double)c_len / u_len, u_len / comp / 1e6, u_len / decomp / 1e6, PeakRSS());
+		fflush(stdout);
+	}
+	return true;
+}
+
+int main(int argc, char *argv[]) {
+	bool ok = true;
+	int i = 1;
+	if (argc > 2 && strcmp(argv[1], "-t") == 0) { min_time = atof(argv[2]); i = 3; }
+
+	printf("%-24s %-11s %10s %10s %7s %10s %10s %10s\n", "input", "mode", "size", "comp size", "ratio", "comp MB/s", "dec MB/s", "peak KB");
+	ok = Run("zeros", Zeros()) && ok;
+	ok = Run("random", Random()) && ok;
+	ok = Run("text", Text()) && ok;
+	ok = Run("code", Code()) && ok;
+	for (; i < argc; ++i) {
+		Buffer b;
+		std::string name = argv[i];
+		size_t slash = name.find_last_of('/');
+		if (slash != std::string::npos) { name = name.substr(slash + 1); }
+		if (!LoadFile(argv[i], b)) { fprintf(stderr, "%s: unable to read\n", argv[i]); ok = false; }
+		else { ok = Run(name, b) && ok; }
+	}
+	return ok ? 0 : 1;
+}
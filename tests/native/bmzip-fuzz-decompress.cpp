@@ -0,0 +1,58 @@
+/*
+ * Windows 7 Boot Updater (github.com/coderforlife/windows-7-boot-updater)
+ * Copyright (C) 2021  Jeffrey Bush - Coder for Life
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Fuzz target feeding untrusted data to the decompressor, which must reject or decode it without going out of bounds
+// The raw input is decompressed as is, then the input is compressed and decompressed again with one byte corrupted
+
+#include "bmzip.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <vector>
+
+// Decompresses into buffers sized exactly to what is claimed so any overrun is caught
+static void Decompress(const BYTE *c, ULONG c_len) {
+	const ULONG u_len = bmzip_decompressed_size(c, c_len);
+	if (u_len > 0x1000000) { return; }
+	std::vector<BYTE> u(u_len ? u_len : 1);
+	bmzip_decompress(c, c_len, &u[0], u_len);
+	bmzip_decompress_mt(c, c_len, &u[0], u_len, 4);
+	if (u_len > 1) { bmzip_decompress(c, c_len, &u[0], u_len / 2); } // too small
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	if (size < 1 || size > 0x100000) { return 0; }
+
+	// copy the input so that reading past it is caught even when the fuzzer's own buffer is larger
+	std::vector<BYTE> raw(data, data + size);
+	Decompress(&raw[0], (ULONG)size);
+
+	// the first 3 bytes choose where to corrupt the compressed data and with what
+	if (size > 3) {
+		const BYTE *u = data + 3;
+		const ULONG u_len = (ULONG)(size - 3);
+		std::vector<BYTE> c(bmzip_compress_bound(u_len));
+		ULONG c_len = bmzip_compress(u, u_len, &c[0], (ULONG)c.size());
+		if (c_len == 0) { abort(); }
+		c[(data[0] | (data[1] << 8)) % c_len] ^= data[2] ? data[2] : 0x80;
+		c.resize(c_len);
+		Decompress(&c[0], c_len);
+	}
+	return 0;
+}
@@ -0,0 +1,83 @@
+/*
+ * Windows 7 Boot Updater (github.com/coderforlife/windows-7-boot-updater)
+ * Copyright (C) 2021  Jeffrey Bush - Coder for Life
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Fuzz target checking that decompress(compress(x)) == x for every way of compressing
+// The first byte of the input picks the depth and parser, the rest is the data
+// The streaming functions are given the data in pieces of random sizes and must give the same results
+
+#include "bmzip.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+typedef std::vector<BYTE> Buffer;
+
+static bool Append(const BYTE *data, ULONG len, void *param) { ((Buffer*)param)->insert(((Buffer*)param)->end(), data, data + len); return true; }
+
+// Writes all of in to the stream in pieces, the sizes come from a generator seeded by the input so a run can be repeated
+static bool Stream(bmzip_stream *s, const Buffer &in, ULONG seed) {
+	if (s == NULL) { return false; }
+	bool ok = true;
+	for (size_t i = 0; ok && i < in.size(); ) {
+		seed = seed * 1103515245 + 12345;
+		const ULONG r = seed >> 16, max = (r & 3) == 0 ? 0x2400 : 0x40; // mostly small pieces with some across many fragments
+		size_t n = r % (max + 1); // including empty writes
+		if (n > in.size() - i) { n = in.size() - i; }
+		ok = bmzip_stream_write(s, &in[i], (ULONG)n);
+		i += n;
+	}
+	ok = ok && bmzip_stream_finish(s);
+	bmzip_stream_destroy(s);
+	return ok;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	static const ULONG parsers[] = { 0, BMZIP_LAZY, BMZIP_OPTIMAL, BMZIP_OPTIMAL };
+	if (size < 1 || size > 0x100000) { return 0; }
+
+	const ULONG depth = (data[0] & 0x3F) | parsers[data[0] >> 6]; // a depth of 0 is BMZIP_MAX_RATIO
+	const BYTE *u = data + 1;
+	const ULONG u_len = (ULONG)(size - 1);
+	if (u_len == 0) { return 0; }
+
+	Buffer c(bmzip_compress_bound(u_len)), d(u_len);
+	const ULONG c_len = bmzip_compress(u, u_len, &c[0], (ULONG)c.size(), depth);
+	if (c_len == 0 || c_len > c.size()) { abort(); }
+
+	// the multi-threaded version must give the same bytes
+	Buffer c_mt(c.size());
+	if (bmzip_compress_mt(u, u_len, &c_mt[0], (ULONG)c_mt.size(), depth, 4) != c_len || memcmp(&c[0], &c_mt[0], c_len) != 0) { abort(); }
+
+	// decompress into a buffer of exactly the right size so any overrun is caught
+	c.resize(c_len);
+	if (bmzip_decompressed_size(&c[0], c_len) != u_len) { abort(); }
+	if (bmzip_decompress(&c[0], c_len, &d[0], u_len) != u_len || memcmp(&d[0], u, u_len) != 0) { abort(); }
+	std::fill(d.begin(), d.end(), 0);
+	if (bmzip_decompress_mt(&c[0], c_len, &d[0], u_len, 4) != u_len || memcmp(&d[0], u, u_len) != 0) { abort(); }
+
+	// the stream must give the same bytes however the input is split up, and decompress back to the input however that is split up
+	ULONG seed = u_len;
+	for (ULONG i = 0; i < u_len; ++i) { seed = seed * 31 + u[i]; }
+	Buffer in(u, u + u_len), c_s, d_s;
+	if (!Stream(bmzip_compress_stream(Append, &c_s, depth), in, seed) || c_s != c) { abort(); }
+	if (!Stream(bmzip_decompress_stream(Append, &d_s), c_s, ~seed) || d_s != in) { abort(); }
+	return 0;
+}
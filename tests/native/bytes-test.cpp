@@ -0,0 +1,161 @@
+/*
+ * Windows 7 Boot Updater (github.com/coderforlife/windows-7-boot-updater)
+ * Copyright (C) 2021  Jeffrey Bush - Coder for Life
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Randomized tests of SearchPattern, MultiPattern, and Bytes::find against a naive search
+// Small alphabets give many overlapping and repeated matches, short haystacks cover the edges and long ones the SSE2 path
+//
+// Usage: bytes-test [rounds [seed]]
+
+#include "Bytes.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+typedef std::vector<BYTE> Buffer;
+
+static const size_t NotFound = MultiPattern::NotFound;
+
+static int failures = 0;
+#define CHECK(x) do { if (!(x)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); ++failures; } } while (0)
+
+// A small deterministic generator so a failure can be repeated with the same seed
+static unsigned int state;
+static unsigned int Rand() { state = state * 1103515245 + 12345; return (state >> 8) & 0xFFFFFF; }
+static size_t Rand(size_t n) { return n ? Rand() % n : 0; }
+
+// The first position of target in data the slow way, bytes equal to the wildcard match anything unless the target starts with it
+static size_t NaiveFind(const Buffer &data, const Buffer &target, bool wildcards, BYTE wildcard) {
+	const size_t n = data.size(), m = target.size();
+	if (m == 0 || n < m) { return NotFound; }
+	const bool wild = wildcards && target[0] != wildcard;
+	for (size_t i = 0; i <= n - m; ++i) {
+		size_t j;
+		for (j = 0; j < m && (data[i+j] == target[j] || (wild && target[j] == wildcard)); ++j);
+		if (j == m) { return i; }
+	}
+	return NotFound;
+}
+
+static size_t Pos(const Bytes &x, const Buffer &data) { return x ? (size_t)(~x - &data[0]) : NotFound; }
+
+// Random bytes from the first alphabet values, or from all 256 when alphabet is 0
+static void Fill(Buffer &b, size_t n, unsigned int alphabet) {
+	b.resize(n);
+	for (size_t i = 0; i < n; ++i) { b[i] = (BYTE)(alphabet ? Rand(alphabet) : Rand(256)); }
+}
+
+// A target that is usually taken from the data (so it is found, possibly earlier than where it was taken from) and sometimes random
+static void MakeTarget(Buffer &t, const Buffer &data, unsigned int alphabet, BYTE wildcard, bool wildcards) {
+	const size_t lens[] = { 1, 2, 3, 1, 2, 3, 4, 5, 8, 15, 16, 17, 31, 32, 33, 40 };
+	const size_t m = lens[Rand(sizeof(lens)/sizeof(lens[0]))];
+	if (data.size() >= m && Rand(4) != 0) {
+		const size_t at = Rand(data.size() - m + 1);
+		t.assign(data.begin() + at, data.begin() + at + m);
+	} else {
+		Fill(t, m, alphabet);
+	}
+	if (wildcards) {
+		for (size_t j = 1; j < m; ++j) { if (Rand(4) == 0) { t[j] = wildcard; } }
+		if (Rand(8) == 0) { t[0] = wildcard; } // then there are no wildcards at all
+	}
+}
+
+static void TestRound(size_t n, unsigned int alphabet) {
+	Buffer data, t;
+	Fill(data, n, alphabet);
+	Bytes d(n ? &data[0] : NULL, n);
+	const BYTE wildcard = (BYTE)(alphabet ? Rand(alphabet) : Rand(256));
+
+	// Single targets, through SearchPattern and all of the Bytes::find overloads
+	for (int k = 0; k < 8; ++k) {
+		const bool wildcards = Rand(2) != 0;
+		MakeTarget(t, data, alphabet, wildcard, wildcards);
+		const size_t expected = NaiveFind(data, t, wildcards, wildcard);
+		if (wildcards) {
+			SearchPattern p(&t[0], t.size(), wildcard);
+			CHECK(Pos(p.find(d), data) == expected);
+			CHECK(Pos(d.find(&t[0], t.size(), wildcard), data) == expected);
+			CHECK(Pos(d.find(Bytes(&t[0], t.size()), wildcard), data) == expected);
+			if (expected != NotFound) { CHECK(p.matches(&data[expected])); }
+		} else {
+			SearchPattern p(&t[0], t.size());
+			CHECK(Pos(p.find(d), data) == expected);
+			CHECK(Pos(d.find(&t[0], t.size()), data) == expected);
+			CHECK(Pos(d.find(Bytes(&t[0], t.size())), data) == expected);
+			if (expected != NotFound) { CHECK(p.matches(&data[expected])); }
+		}
+	}
+
+	// Many targets at once, including duplicates and targets that are prefixes or suffixes of each other
+	MultiPattern mp;
+	std::vector<Buffer> targets;
+	std::vector<bool> wilds;
+	const size_t count = 1 + Rand(24);
+	for (size_t k = 0; k < count; ++k) {
+		const bool wildcards = Rand(2) != 0;
+		if (!targets.empty() && Rand(6) == 0) {
+			t = targets[Rand(targets.size())];
+			if (t.size() > 1) { t.resize(1 + Rand(t.size())); }
+		} else {
+			MakeTarget(t, data, alphabet, wildcard, wildcards);
+		}
+		CHECK(mp.add(&t[0], t.size(), wildcards ? wildcard : t[0]) == k);
+		targets.push_back(t);
+		wilds.push_back(wildcards);
+	}
+	CHECK(mp.count() == count);
+	std::vector<size_t> pos(count);
+	mp.find(d, &pos[0]);
+	for (size_t k = 0; k < count; ++k) {
+		CHECK(pos[k] == NaiveFind(data, targets[k], wilds[k], wildcard));
+		CHECK(mp[k].length() == targets[k].size());
+	}
+
+	// Finding again gives the same result
+	std::vector<size_t> again(count);
+	mp.find(d, &again[0]);
+	CHECK(again == pos);
+}
+
+int main(int argc, char *argv[]) {
+	const int rounds = (argc > 1) ? atoi(argv[1]) : 2000;
+	state = (argc > 2) ? (unsigned int)strtoul(argv[2], NULL, 0) : 1;
+
+	const unsigned int alphabets[] = { 1, 2, 3, 4, 16, 0 };
+	for (int r = 0; r < rounds && failures < 20; ++r) {
+		const size_t n = (r % 10 == 0) ? 1000 + Rand(8000) : Rand(100);
+		TestRound(n, alphabets[r % (sizeof(alphabets)/sizeof(alphabets[0]))]);
+	}
+
+	// Edge cases: empty data and empty targets are never found
+	BYTE x = 0x41;
+	CHECK(!SearchPattern(&x, 1).find(Bytes()));
+	CHECK(!SearchPattern(&x, 0).find(Bytes(&x, 1)));
+	MultiPattern mp;
+	size_t pos;
+	mp.add(&x, 0, 0);
+	mp.find(Bytes(&x, 1), &pos);
+	CHECK(pos == NotFound);
+
+	if (failures) { fprintf(stderr, "%d checks failed\n", failures); return 1; }
+	printf("%d rounds passed\n", rounds);
+	return 0;
+}
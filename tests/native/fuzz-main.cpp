@@ -0,0 +1,86 @@
+/*
+ * Windows 7 Boot Updater (github.com/coderforlife/windows-7-boot-updater)
+ * Copyright (C) 2021  Jeffrey Bush - Coder for Life
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Stand-in for the libFuzzer driver when the compiler doesn't provide one
+// Runs the fuzz target on each file given, or on -runs=N generated inputs (-seed=S changes them)
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+typedef std::vector<uint8_t> Input;
+
+// Makes an input that compresses in interesting ways: runs, short repeats, copies of earlier data, and noise
+static void Generate(Input &in) {
+	const size_t size = rand() % 4 == 0 ? rand() % 0x6000 : rand() % 0x400;
+	in.resize(size);
+	for (size_t i = 0; i < size; ) {
+		size_t n = 1 + rand() % 64, j;
+		if (n > size - i) { n = size - i; }
+		switch (rand() % 5) {
+		case 0: memset(&in[i], rand(), n); break;
+		case 1: for (j = 0; j < n; ++j) { in[i+j] = (uint8_t)rand(); } break;
+		case 2: for (j = 0; j < n; ++j) { in[i+j] = (uint8_t)(rand() % 4); } break;
+		case 3: if (i > 0) { const size_t o = 1 + rand() % (i < 0x1000 ? i : 0x1000); for (j = 0; j < n; ++j) { in[i+j] = in[i+j-o]; } } else { n = 0; } break;
+		case 4: for (j = 0; j < n; ++j) { in[i+j] = (uint8_t)(j % 3); } break;
+		}
+		i += n;
+	}
+}
+
+static bool LoadFile(const char *path, Input &in) {
+	FILE *f = fopen(path, "rb");
+	if (!f) { return false; }
+	uint8_t temp[0x10000];
+	size_t n;
+	while ((n = fread(temp, 1, sizeof(temp), f)) > 0) { in.insert(in.end(), temp, temp + n); }
+	fclose(f);
+	return true;
+}
+
+int main(int argc, char *argv[]) {
+	long runs = 1000;
+	unsigned seed = 1;
+	bool files = false;
+	for (int i = 1; i < argc; ++i) {
+		if (strncmp(argv[i], "-runs=", 6) == 0) { runs = atol(argv[i] + 6); }
+		else if (strncmp(argv[i], "-seed=", 6) == 0) { seed = (unsigned)atol(argv[i] + 6); }
+		else if (argv[i][0] == '-') { /* ignore other libFuzzer options */ }
+		else {
+			Input in;
+			if (!LoadFile(argv[i], in)) { fprintf(stderr, "%s: unable to read\n", argv[i]); return 1; }
+			LLVMFuzzerTestOneInput(in.empty() ? NULL : &in[0], in.size());
+			files = true;
+		}
+	}
+	if (!files) {
+		Input in;
+		srand(seed);
+		for (long r = 0; r < runs; ++r) {
+			Generate(in);
+			LLVMFuzzerTestOneInput(in.empty() ? NULL : &in[0], in.size());
+		}
+		printf("Done %ld runs\n", runs);
+	}
+	return 0;
+}
@@ -0,0 +1,383 @@
+/*
+ * Windows 7 Boot Updater (github.com/coderforlife/windows-7-boot-updater)
+ * Copyright (C) 2021  Jeffrey Bush - Coder for Life
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Tests of PEFile with both storage backends: opening read-only and read-write, adding a resource, saving, reopening, and the checksum
+// Also resources updated in place and laid out again, batches, and removing relocations
+//
+// Usage: pefile-test file.exe (which must have a .rsrc section) temp-dir
+
+#define _DECLARE_ALL_PE_FILE_RESOURCES_
+#include "PEFile.h"
+#include "PEFileStorage.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+typedef std::vector<BYTE> Buffer;
+typedef std::vector<WCHAR> WString; // not std::wstring, the library's instances of it have 32-bit characters
+
+#define RT_RCDATA_ID	MAKEINTRESOURCE(10)
+#define RT_MANIFEST_ID	MAKEINTRESOURCE(24)
+#define TEST_NAME		MAKEINTRESOURCE(0x7B7)
+#define TEST_LANG		0x0409
+
+static int failures = 0;
+#define CHECK(x) do { if (!(x)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); ++failures; } } while (0)
+
+static WString Widen(const std::string &s) { WString w(s.begin(), s.end()); w.push_back(0); return w; } // paths are ASCII
+
+static bool LoadFile(const std::string &path, Buffer &b) {
+	FILE *f = fopen(path.c_str(), "rb");
+	if (!f) { return false; }
+	BYTE temp[0x10000];
+	size_t n;
+	while ((n = fread(temp, 1, sizeof(temp), f)) > 0) { b.insert(b.end(), temp, temp + n); }
+	fclose(f);
+	return !b.empty();
+}
+static bool SaveFile(const std::string &path, const Buffer &b) {
+	FILE *f = fopen(path.c_str(), "wb");
+	if (!f) { return false; }
+	bool ok = fwrite(&b[0], 1, b.size(), f) == b.size();
+	return fclose(f) == 0 && ok;
+}
+
+static LPVOID Copy(const Buffer &b) { return memcpy(malloc(b.size()), &b[0], b.size()); }
+
+static DWORD GetChkSum(const PEFile *f) { return f->is64bit() ? f->getNtHeaders64()->OptionalHeader.CheckSum : f->getNtHeaders32()->OptionalHeader.CheckSum; }
+static void SetChkSum(Buffer &b, DWORD check) {
+	PEFile f(Copy(b), b.size());
+	DWORD &c = f.is64bit() ? f.getNtHeaders64()->OptionalHeader.CheckSum : f.getNtHeaders32()->OptionalHeader.CheckSum;
+	c = check;
+	memcpy(&b[0], f.get(), f.getSize() < b.size() ? f.getSize() : b.size());
+}
+
+// The checksum as computed from scratch over the whole file
+static DWORD CorrectChkSum(const Buffer &b) {
+	PEFile f(Copy(b), b.size());
+	f.updatePEChkSum(true);
+	return GetChkSum(&f);
+}
+static DWORD CorrectChkSum(PEFile *f) {
+	Buffer b(f->get(), f->get() + f->getSize());
+	return CorrectChkSum(b);
+}
+
+static const char data1[] = "resource added by pefile-test";
+static const char data2[] = "a different resource, of a different size, added by pefile-test";
+
+static void CheckResource(const PEFile *f, const char *data, size_t size) {
+	size_t sz = 0;
+	const LPVOID r = f->getResourceView(RT_RCDATA_ID, TEST_NAME, TEST_LANG, &sz);
+	CHECK(r != NULL && sz == size && memcmp(r, data, size) == 0);
+}
+
+static void TestReadOnly(PEFile *f, const Buffer &orig) {
+	CHECK(f->isLoaded());
+	CHECK(f->isReadOnly());
+	CHECK(f->getSize() == orig.size() && memcmp(f->get(), &orig[0], orig.size()) == 0);
+	CHECK(f->getSectionHeader(".rsrc") != NULL);
+	CHECK(!f->addResource(RT_RCDATA_ID, TEST_NAME, TEST_LANG, (LPVOID)data1, sizeof(data1)));
+	CHECK(!f->save());
+}
+
+// Adds a resource, saves, and checks the result which is left in saved
+static void TestAddResource(PEFile *f, Buffer &saved) {
+	CHECK(f->isLoaded());
+	CHECK(!f->isReadOnly());
+	CHECK(f->addResource(RT_RCDATA_ID, TEST_NAME, TEST_LANG, (LPVOID)data1, sizeof(data1)));
+	CHECK(f->save());
+	CheckResource(f, data1, sizeof(data1));
+	CHECK(GetChkSum(f) == CorrectChkSum(f));
+
+	// change it again so the checksum has to follow two saves
+	CHECK(f->addResource(RT_RCDATA_ID, TEST_NAME, TEST_LANG, (LPVOID)data2, sizeof(data2)));
+	CHECK(f->save());
+	CheckResource(f, data2, sizeof(data2));
+	CHECK(GetChkSum(f) == CorrectChkSum(f));
+	saved.assign(f->get(), f->get() + f->getSize());
+}
+
+// Removing every resource leaves an empty tree which still compiles and saves
+static void TestRemoveAll(PEFile *f) {
+	CHECK(f->isLoaded());
+	CHECK(f->removeResource(RT_RCDATA_ID, TEST_NAME, TEST_LANG));
+	CHECK(!f->resourceExists(RT_RCDATA_ID, TEST_NAME, TEST_LANG));
+	CHECK(f->save());
+	CHECK(GetChkSum(f) == CorrectChkSum(f));
+
+	Rsrc *r = Rsrc::createEmpty();
+	size_t size = 0;
+	LPVOID data = r->compile(&size, 0x1000);
+	CHECK(data != NULL && size == sizeof(IMAGE_RESOURCE_DIRECTORY));
+	free(data);
+	delete r;
+}
+
+static void TestReopen(PEFile *f, const Buffer &saved) {
+	CHECK(f->isLoaded());
+	CHECK(f->getSize() == saved.size() && memcmp(f->get(), &saved[0], saved.size()) == 0);
+	CheckResource(f, data2, sizeof(data2));
+	CHECK(GetChkSum(f) == CorrectChkSum(f));
+}
+
+// Checks that nothing outside of [start, end) changed except the checksum
+static void CheckUnchangedOutside(PEFile *f, const Buffer &orig, size_t start, size_t end) {
+	const size_t check = (LPBYTE)(f->is64bit() ? &f->getNtHeaders64()->OptionalHeader.CheckSum : &f->getNtHeaders32()->OptionalHeader.CheckSum) - f->get();
+	const LPBYTE d = f->get();
+	CHECK(memcmp(d, &orig[0], check) == 0);
+	CHECK(memcmp(d+check+sizeof(DWORD), &orig[check+sizeof(DWORD)], start-check-sizeof(DWORD)) == 0);
+	CHECK(memcmp(d+end, &orig[end], orig.size()-end) == 0);
+}
+
+// A changed resource that still fits is written where it was, the section doesn't move or change size and the other resources are untouched
+static void TestInPlace(PEFile *f, const Buffer &orig) {
+	const IMAGE_SECTION_HEADER before = *f->getSectionHeader(".rsrc");
+	WORD lang = 0, vlang = 0;
+	size_t size = 0, vsize = 0;
+	const LPBYTE m = (LPBYTE)f->getResourceView(RT_MANIFEST_ID, MAKEINTRESOURCE(1), &lang, &size);
+	const LPBYTE v = (LPBYTE)f->getResourceView(RT_VERSION, MAKEINTRESOURCE(1), &vlang, &vsize);
+	CHECK(m != NULL && v != NULL && size > 16);
+	if (!m || !v || size <= 16) { return; }
+	const size_t mpos = m - f->get(), vpos = v - f->get();
+	Buffer changed(m, m + size - 16); // smaller and different
+	for (size_t i = 0; i < changed.size(); ++i) { changed[i] ^= 0x20; }
+
+	CHECK(f->addResource(RT_MANIFEST_ID, MAKEINTRESOURCE(1), lang, &changed[0], changed.size()));
+	CHECK(f->save());
+	const IMAGE_SECTION_HEADER *after = f->getSectionHeader(".rsrc");
+	CHECK(after->PointerToRawData == before.PointerToRawData && after->SizeOfRawData == before.SizeOfRawData);
+	CHECK(after->VirtualAddress == before.VirtualAddress && after->Misc.VirtualSize == before.Misc.VirtualSize);
+	CHECK(f->getSize() == orig.size());
+
+	size_t sz = 0;
+	const LPBYTE m2 = (LPBYTE)f->getResourceView(RT_MANIFEST_ID, MAKEINTRESOURCE(1), lang, &sz);
+	CHECK(m2 == f->get() + mpos && sz == changed.size() && memcmp(m2, &changed[0], sz) == 0);
+	CHECK(memcmp(f->get() + mpos + sz, &Buffer(size - sz, 0)[0], size - sz) == 0); // the rest of the old data is cleared
+	CHECK(memcmp(f->get() + vpos, &orig[vpos], vsize) == 0);
+	CheckUnchangedOutside(f, orig, before.PointerToRawData, before.PointerToRawData + before.SizeOfRawData);
+	CHECK(GetChkSum(f) == CorrectChkSum(f));
+}
+
+// A resource that no longer fits makes the section laid out again, moving everything after it
+static void TestLayout(PEFile *f, const Buffer &orig) {
+	const IMAGE_SECTION_HEADER before = *f->getSectionHeader(".rsrc"), reloc = *f->getSectionHeader(".reloc");
+	WORD lang = 0, vlang = 0;
+	size_t size = 0, vsize = 0;
+	CHECK(f->getResourceView(RT_MANIFEST_ID, MAKEINTRESOURCE(1), &lang, &size) != NULL);
+	const LPBYTE v = (LPBYTE)f->getResourceView(RT_VERSION, MAKEINTRESOURCE(1), &vlang, &vsize);
+	CHECK(v != NULL);
+	if (!v) { return; }
+	const Buffer version(v, v + vsize), big(before.SizeOfRawData, 'x');
+
+	CHECK(f->addResource(RT_MANIFEST_ID, MAKEINTRESOURCE(1), lang, (LPVOID)&big[0], big.size()));
+	CHECK(f->save());
+	const IMAGE_SECTION_HEADER *after = f->getSectionHeader(".rsrc");
+	CHECK(after->PointerToRawData == before.PointerToRawData && after->SizeOfRawData > before.SizeOfRawData);
+	CHECK(f->getSectionHeader(".reloc")->PointerToRawData == reloc.PointerToRawData + after->SizeOfRawData - before.SizeOfRawData);
+	CHECK(f->getSize() == orig.size() + after->SizeOfRawData - before.SizeOfRawData);
+
+	size_t sz = 0;
+	const LPBYTE m = (LPBYTE)f->getResourceView(RT_MANIFEST_ID, MAKEINTRESOURCE(1), lang, &sz);
+	CHECK(m != NULL && sz == big.size() && memcmp(m, &big[0], sz) == 0);
+	const LPBYTE v2 = (LPBYTE)f->getResourceView(RT_VERSION, MAKEINTRESOURCE(1), vlang, &sz);
+	CHECK(v2 != NULL && sz == vsize && memcmp(v2, &version[0], sz) == 0);
+	CHECK(memcmp(f->get(f->getSectionHeader(".reloc")->PointerToRawData), &orig[reloc.PointerToRawData], reloc.SizeOfRawData) == 0);
+	CHECK(GetChkSum(f) == CorrectChkSum(f));
+}
+
+// The same file with the DOS stub removed so there is room after the section headers to add two more sections
+// The section headers can only use the rest of the file alignment block they end in, whatever SizeOfHeaders says
+static Buffer WithHeaderRoom(const Buffer &orig) {
+	Buffer b = orig;
+	IMAGE_DOS_HEADER *dosh = (IMAGE_DOS_HEADER*)&b[0];
+	const size_t pe = dosh->e_lfanew, hdrs = sizeof(IMAGE_DOS_HEADER);
+	const IMAGE_FILE_HEADER *fh = (IMAGE_FILE_HEADER*)&b[pe+4];
+	const size_t len = 4 + sizeof(IMAGE_FILE_HEADER) + fh->SizeOfOptionalHeader + fh->NumberOfSections*sizeof(IMAGE_SECTION_HEADER);
+	memmove(&b[hdrs], &b[pe], len);
+	memset(&b[hdrs+len], 0, pe-hdrs);
+	dosh->e_lfanew = (LONG)hdrs;
+	return b;
+}
+
+// Heap storage that counts what a PEFile does with it and keeps what it held when deleted
+struct StorageLog { int resizes, flushes; Buffer final; };
+class LoggedStorage : public PEFileStorage {
+	PEFileStorage *inner;
+	StorageLog *log;
+public:
+	LoggedStorage(const Buffer &b, StorageLog *log) : PEFileStorage(false), inner(PEFileStorage::createFromMemory(Copy(b), b.size())), log(log) {
+		this->data = this->inner->getData();
+		this->size = this->inner->getSize();
+	}
+	~LoggedStorage() { this->log->final.assign(this->data, this->data + this->size); delete this->inner; }
+	bool isFile() const { return false; }
+	bool resize(size_t size) {
+		++this->log->resizes;
+		bool ok = this->inner->resize(size);
+		this->data = this->inner->getData();
+		this->size = this->inner->getSize();
+		return ok;
+	}
+	bool flush() { ++this->log->flushes; return this->inner->flush(); }
+};
+
+// Nested batches only finish with the outermost commit, and until then the storage is not flushed or resized within the room reserved
+static void TestBatch(PEFile *f, const StorageLog *log, Buffer &committed) {
+	const int sections = f->getSectionHeaderCount();
+	CHECK(f->beginBatch(0x4000));
+	CHECK(f->beginBatch()); // nested
+	const int resizes = log ? log->resizes : 0, flushes = log ? log->flushes : 0;
+	for (int i = 0; i < 8; ++i) { CHECK(f->getExpandedSectionHdr(i & 1, 0x200) != NULL); }
+	CHECK(f->createSection(".batch", 0x200, CHARS_INIT_DATA_SECTION_R) != NULL);
+	CHECK(f->flush());
+	CHECK(f->commit()); // only ends the nested batch
+	if (log) { CHECK(log->resizes == resizes && log->flushes == flushes); }
+	CHECK(f->commit());
+	if (log) { CHECK(log->resizes == resizes + 1 && log->flushes == flushes + 1); } // trimmed and flushed once
+	CHECK(!f->commit()); // no batch left
+	CHECK(f->getSectionHeaderCount() == sections + 1);
+	CHECK(GetChkSum(f) == CorrectChkSum(f));
+	committed.assign(f->get(), f->get() + f->getSize());
+}
+
+// Starts a batch with room to spare and leaves it open, the file must still end up with the right size when the PEFile is deleted
+static void TestOpenBatch(PEFile *f, Buffer &expected) {
+	CHECK(f->beginBatch(0x4000));
+	CHECK(f->createSection(".open", 0x200, CHARS_INIT_DATA_SECTION_R) != NULL);
+	expected.assign(f->get(), f->get() + f->getSize());
+}
+
+// Relocations are found through the index by RVA, which has to follow .reloc when createSection moves it
+static DWORD FindReloc(PEFile *f, DWORD *rva) { // the offset in .reloc of the first relocation that isn't padding
+	const IMAGE_SECTION_HEADER *s = f->getSectionHeader(".reloc");
+	if (!s) { return 0; }
+	const IMAGE_BASE_RELOCATION *b = (IMAGE_BASE_RELOCATION*)f->get(s->PointerToRawData);
+	const WORD *r = (WORD*)(b+1);
+	for (DWORD i = 0; i < (b->SizeOfBlock - sizeof(IMAGE_BASE_RELOCATION)) / sizeof(WORD); ++i) {
+		if (r[i] >> 12) { *rva = b->VirtualAddress + (r[i] & 0xFFF); return (DWORD)((LPBYTE)(r+i) - (LPBYTE)b); }
+	}
+	return 0;
+}
+static WORD GetReloc(PEFile *f, DWORD off) { return *(WORD*)f->get(f->getSectionHeader(".reloc")->PointerToRawData + off); }
+static void TestRelocs(PEFile *f) {
+	DWORD rva = 0;
+	const DWORD off = FindReloc(f, &rva);
+	CHECK(off != 0);
+	if (!off) { return; }
+	const WORD reloc = GetReloc(f, off), removed = reloc & 0x0FFF; // IMAGE_REL_BASED_ABSOLUTE
+
+	CHECK(f->removeRelocs(rva+1, rva+0x10) && GetReloc(f, off) == reloc); // not in either range
+	CHECK(f->removeRelocs(rva-0x10, rva-1) && GetReloc(f, off) == reloc);
+	CHECK(!f->removeRelocs(rva, rva-1));
+	CHECK(f->removeRelocs(rva, rva) && GetReloc(f, off) == removed);
+	CHECK(f->removeRelocs(rva-0x10, rva+0x10) && GetReloc(f, off) == removed); // already removed
+	CHECK(f->removeRelocs(rva, rva, true) && GetReloc(f, off) == reloc);
+
+	// Adding a section before .reloc moves it, the same relocation must be changed in its new place and nothing written to the old one
+	const DWORD pntr = f->getSectionHeader(".reloc")->PointerToRawData;
+	CHECK(f->createSection(".test", 0x400, CHARS_INIT_DATA_SECTION_R) != NULL);
+	CHECK(f->getSectionHeader(".reloc")->PointerToRawData > pntr);
+	CHECK(GetReloc(f, off) == reloc);
+	CHECK(f->removeRelocs(rva-0x10, rva+0x10) && GetReloc(f, off) == removed);
+	CHECK(*(WORD*)f->get(pntr + off) == 0);
+	CHECK(f->removeRelocs(rva, rva, true) && GetReloc(f, off) == reloc);
+	CHECK(f->removeRelocs(rva, rva) && GetReloc(f, off) == removed);
+	CHECK(f->save());
+	CHECK(GetChkSum(f) == CorrectChkSum(f));
+}
+
+int main(int argc, char *argv[]) {
+	if (argc != 3) { fprintf(stderr, "Usage: %s file.exe temp-dir\n", argv[0]); return 2; }
+	Buffer orig, saved, from_file, from_mem;
+	if (!LoadFile(argv[1], orig)) { fprintf(stderr, "%s: unable to read\n", argv[1]); return 2; }
+	const std::string path = std::string(argv[2]) + "/pefile-test.exe", path2 = std::string(argv[2]) + "/pefile-test-saved.exe";
+	const WString wpath = Widen(path), wpath2 = Widen(path2);
+
+	// Memory backend
+	{ PEFile f(Copy(orig), orig.size(), true); TestReadOnly(&f, orig); }
+	{ PEFile f(Copy(orig), orig.size()); TestAddResource(&f, from_mem); }
+	{ PEFile f(Copy(from_mem), from_mem.size(), true); TestReopen(&f, from_mem); }
+
+	// File backend
+	CHECK(SaveFile(path, orig));
+	{ PEFile f(&wpath[0], true); TestReadOnly(&f, orig); }
+	{ PEFile f(&wpath[0]); TestAddResource(&f, from_file); }
+	{ PEFile f(&wpath[0], true); TestReopen(&f, from_file); }
+	CHECK(LoadFile(path, saved) && saved == from_file);
+	CHECK(from_file == from_mem); // both backends give the same file
+	{ PEFile f(&wpath[0]); TestRemoveAll(&f); }
+
+	// Saving to another file leaves the original alone
+	CHECK(SaveFile(path, orig));
+	{
+		PEFile f(&wpath[0]);
+		CHECK(f.addResource(RT_RCDATA_ID, TEST_NAME, TEST_LANG, (LPVOID)data2, sizeof(data2)));
+		CHECK(f.saveTo(&wpath2[0]));
+	}
+	{ PEFile f(&wpath2[0], true); CheckResource(&f, data2, sizeof(data2)); CHECK(GetChkSum(&f) == CorrectChkSum(&f)); }
+	saved.clear();
+	CHECK(LoadFile(path, saved) && saved == orig);
+
+	// A wrong stored checksum must not carry into the saved file
+	Buffer wrong = orig;
+	SetChkSum(wrong, CorrectChkSum(orig) + 0x10);
+	{ PEFile f(Copy(wrong), wrong.size()); TestAddResource(&f, saved); }
+	CHECK(SaveFile(path, wrong));
+	{ PEFile f(&wpath[0]); TestAddResource(&f, saved); }
+
+	// Resources changed in place and laid out again
+	{ PEFile f(Copy(orig), orig.size()); TestInPlace(&f, orig); }
+	{ PEFile f(Copy(orig), orig.size()); TestLayout(&f, orig); }
+	CHECK(SaveFile(path, orig));
+	{ PEFile f(&wpath[0]); TestInPlace(&f, orig); }
+	CHECK(SaveFile(path, orig));
+	{ PEFile f(&wpath[0]); TestLayout(&f, orig); }
+
+	// Batches, committed and left open, in a copy of the file with room for more sections
+	const Buffer roomy = WithHeaderRoom(orig);
+	StorageLog log = { 0, 0 };
+	Buffer batch_mem, batch_file, open_mem, open_file;
+	{ PEFile f(new LoggedStorage(roomy, &log)); TestBatch(&f, &log, batch_mem); }
+	CHECK(log.final == batch_mem);
+	{ PEFile f(new LoggedStorage(roomy, &log)); TestOpenBatch(&f, open_mem); }
+	CHECK(log.final == open_mem);
+	CHECK(SaveFile(path, roomy));
+	{ PEFile f(&wpath[0]); TestBatch(&f, NULL, batch_file); }
+	saved.clear();
+	CHECK(LoadFile(path, saved) && saved == batch_file && batch_file == batch_mem);
+	CHECK(SaveFile(path, roomy));
+	{ PEFile f(&wpath[0]); TestOpenBatch(&f, open_file); }
+	saved.clear();
+	CHECK(LoadFile(path, saved) && saved == open_file && open_file == open_mem);
+
+	// Relocations
+	{ PEFile f(Copy(roomy), roomy.size()); TestRelocs(&f); }
+	CHECK(SaveFile(path, roomy));
+	{ PEFile f(&wpath[0]); TestRelocs(&f); }
+
+	remove(path.c_str());
+	remove(path2.c_str());
+	if (failures) { fprintf(stderr, "%d checks failed\n", failures); return 1; }
+	printf("All checks passed\n");
+	return 0;
+}
@@ -0,0 +1,378 @@
+/*
+ * Windows 7 Boot Updater (github.com/coderforlife/windows-7-boot-updater)
+ * Copyright (C) 2021  Jeffrey Bush - Coder for Life
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Tests of the LZX and XPRESS chunk compression and of creating and reading WIMs
+// The chunks are round-tripped and checked against streams written by hand from the format descriptions, since the
+// compressor never writes some of what the decompressor has to read (like uncompressed LZX blocks)
+//
+// Usage: wimzip-test [seed]
+//        wimzip-test file.wim name expected-file    extracts a file from a WIM made by Windows and compares it
+
+#include "wimzip.h"
+#include "WIM.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+using namespace Win7BootUpdater;
+
+typedef std::vector<BYTE> Buffer;
+typedef std::vector<WCHAR> WString; // not std::wstring, the library's instances of it have 32-bit characters
+
+#define WIM_HEADER_SIZE	208
+#define LZX_VERBATIM	1
+#define LZX_ALIGNED		2
+
+static int failures = 0;
+#define CHECK(x) do { if (!(x)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); ++failures; } } while (0)
+
+// A small deterministic generator so a failure can be repeated with the same seed
+static unsigned int state;
+static unsigned int Rand() { state = state * 1103515245 + 12345; return (state >> 8) & 0xFFFFFF; }
+static size_t Rand(size_t n) { return n ? Rand() % n : 0; }
+
+static WString Widen(const std::string &s) { WString w(s.begin(), s.end()); w.push_back(0); return w; } // names are ASCII
+
+static bool LoadFile(const char *path, Buffer &b) {
+	FILE *f = fopen(path, "rb");
+	if (!f) { return false; }
+	BYTE temp[0x10000];
+	size_t n;
+	while ((n = fread(temp, 1, sizeof(temp), f)) > 0) { b.insert(b.end(), temp, temp + n); }
+	fclose(f);
+	return !b.empty();
+}
+
+///// Test Data /////
+
+static void Random(Buffer &b, size_t n) { b.resize(n); for (size_t i = 0; i < n; ++i) { b[i] = (BYTE)Rand(256); } }
+static void Run(Buffer &b, size_t n) { b.assign(n, (BYTE)Rand(256)); }
+
+// Words from a small vocabulary, compresses well with mostly short offsets
+static void Text(Buffer &b, size_t n) {
+	static const char *words[] = { "the ", "boot ", "screen ", "animation ", "resource ", "of ", "Windows ", "7 ", "and ", "a ", "WIM\r\n" };
+	b.clear();
+	while (b.size() < n) { const char *w = words[Rand(sizeof(words)/sizeof(words[0]))]; b.insert(b.end(), w, w + strlen(w)); }
+	b.resize(n);
+}
+
+// Like x86 code: a few random bytes then a CALL whose target is the same absolute address each time
+// The E8 translation makes every CALL the same 5 bytes, without it they all differ; the opcode can be changed to JMP which isn't translated
+static void Calls(Buffer &b, size_t n, BYTE opcode) {
+	const LONG target = 0x4000 + (LONG)Rand(0x1000);
+	b.clear();
+	while (b.size() + 5 <= n) {
+		for (size_t k = 3; k; --k) { BYTE x; while ((x = (BYTE)Rand(256)) == 0xE8); b.push_back(x); }
+		const LONG rel = target - (LONG)b.size();
+		b.push_back(opcode);
+		for (int k = 0; k < 4; ++k) { b.push_back((BYTE)(rel >> (8*k))); }
+	}
+	b.resize(n, 0x90);
+}
+
+// CALL targets that are at and around the edges of the E8 translation, including at the end of the chunk where they are never translated
+static void EdgeCalls(Buffer &b, size_t n) {
+	const LONG size = 12000000;
+	Random(b, n);
+	for (size_t i = 0; i + 5 <= n; i += 5 + Rand(8)) {
+		const LONG edges[] = { 0, -1, -(LONG)i, -(LONG)i - 1, size - 1, size, size - (LONG)i, size - (LONG)i - 1, (LONG)Rand(), -(LONG)Rand() };
+		const LONG rel = edges[Rand(sizeof(edges)/sizeof(edges[0]))];
+		b[i] = 0xE8;
+		for (int k = 0; k < 4; ++k) { b[i+1+k] = (BYTE)(rel >> (8*k)); }
+	}
+}
+
+// Copies from far back with offsets that are all multiples of 8, so the low 3 bits of every LZX offset are the same and an aligned block is smaller
+static void Aligned(Buffer &b, size_t n) {
+	Random(b, n < 0x1000 ? n : 0x1000);
+	while (b.size() < n) {
+		const size_t off = 8 * (64 + Rand(b.size() / 8 - 64)), len = 8 + Rand(17);
+		for (size_t k = 0; k < len; ++k) { b.push_back(b[b.size() - off]); }
+		b.push_back((BYTE)Rand(256));
+	}
+	b.resize(n);
+}
+
+///// Chunks /////
+
+typedef ULONG (*Compress)(const BYTE*, ULONG, BYTE*, ULONG, wimzip_ctx*);
+typedef ULONG (*Decompress)(const BYTE*, ULONG, BYTE*, ULONG);
+
+// Compresses a chunk into a buffer large enough that it always fits, false if it fails
+static bool Compressed(Compress compress, const Buffer &u, Buffer &c, wimzip_ctx *ctx) {
+	c.resize(2 * u.size() + 1024);
+	const ULONG len = compress(&u[0], (ULONG)u.size(), &c[0], (ULONG)c.size(), ctx);
+	c.resize(len);
+	return len != 0;
+}
+
+// Decompresses into a buffer of exactly the right size so that writing past it is caught by the sanitizers
+static bool Decompressed(Decompress decompress, const Buffer &c, const Buffer &u) {
+	BYTE *out = (BYTE*)malloc(u.size());
+	const ULONG len = decompress(c.empty() ? NULL : &c[0], (ULONG)c.size(), out, (ULONG)u.size());
+	const bool same = len == u.size() && memcmp(out, &u[0], u.size()) == 0;
+	CHECK(len == 0 || len == u.size());
+	free(out);
+	return same;
+}
+
+// Truncated and damaged chunks must be rejected or decompressed without reading or writing out of bounds
+static void Damage(Decompress decompress, const Buffer &c, const Buffer &u) {
+	const size_t step = c.size() / 64 + 1;
+	for (size_t n = 0; n < c.size(); n += (n < 300) ? 1 : step) {
+		Buffer t(c.begin(), c.begin() + n);
+		Decompressed(decompress, t, u);
+	}
+	for (int k = 0; k < 40; ++k) {
+		Buffer t(c);
+		for (size_t flips = 1 + Rand(4); flips; --flips) { t[Rand(t.size())] ^= (BYTE)(1 << Rand(8)); }
+		Decompressed(decompress, t, u);
+	}
+}
+
+static int LZXBlockType(const Buffer &c) { return c.size() >= 2 ? c[1] >> 5 : -1; } // the first 3 bits of the first little-endian word
+
+static void TestChunks() {
+	const size_t sizes[] = { 1, 2, 3, 4, 10, 11, 12, 100, 1000, 4096, 20000, 32767, 32768 };
+	const Compress compress[] = { wimzip_lzx_compress, wimzip_xpress_compress };
+	const Decompress decompress[] = { wimzip_lzx_decompress, wimzip_xpress_decompress };
+	void (*const makers[])(Buffer&, size_t) = { Random, Run, Text, EdgeCalls, Aligned };
+	wimzip_ctx *ctx = wimzip_ctx_create();
+	CHECK(ctx != NULL);
+	Buffer u, c;
+	for (int f = 0; f < 2; ++f) {
+		for (size_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); ++s) {
+			for (size_t m = 0; m < sizeof(makers)/sizeof(makers[0]); ++m) {
+				if (makers[m] == Aligned && sizes[s] < 0x2000) { continue; }
+				makers[m](u, sizes[s]);
+				// With and without a context that is reused
+				CHECK(Compressed(compress[f], u, c, (s & 1) ? ctx : NULL));
+				CHECK(Decompressed(decompress[f], c, u));
+				if (sizes[s] >= 1000 && (m == 1 || m == 2)) { CHECK(c.size() < u.size() / 2); }
+				if (s % 4 == 0 || sizes[s] == 32768) { Damage(decompress[f], c, u); }
+			}
+		}
+
+		// Too large, empty, and not enough room
+		u.assign(WIMZIP_LZX_CHUNK_SIZE + 1, 0);
+		c.resize(u.size());
+		CHECK(compress[f](&u[0], (ULONG)u.size(), &c[0], (ULONG)c.size(), ctx) == 0);
+		CHECK(compress[f](&u[0], 0, &c[0], (ULONG)c.size(), ctx) == 0);
+		Random(u, 1000);
+		CHECK(compress[f](&u[0], (ULONG)u.size(), &c[0], 100, ctx) == 0);
+	}
+
+	// A chunk that is all matches with offsets that are multiples of 8 is written as an aligned block, and text as a verbatim one
+	Aligned(u, WIMZIP_LZX_CHUNK_SIZE);
+	CHECK(Compressed(wimzip_lzx_compress, u, c, ctx) && LZXBlockType(c) == LZX_ALIGNED);
+	CHECK(Decompressed(wimzip_lzx_decompress, c, u));
+	Text(u, WIMZIP_LZX_CHUNK_SIZE);
+	CHECK(Compressed(wimzip_lzx_compress, u, c, ctx) && LZXBlockType(c) == LZX_VERBATIM);
+
+	// The E8 translation turns CALLs to the same place into repeats, JMPs are left alone
+	Buffer calls, jmps;
+	Calls(u, WIMZIP_LZX_CHUNK_SIZE, 0xE8);
+	CHECK(Compressed(wimzip_lzx_compress, u, calls, ctx));
+	CHECK(Decompressed(wimzip_lzx_decompress, calls, u));
+	Calls(u, WIMZIP_LZX_CHUNK_SIZE, 0xE9);
+	CHECK(Compressed(wimzip_lzx_compress, u, jmps, ctx));
+	CHECK(calls.size() < jmps.size() * 3 / 4);
+
+	wimzip_ctx_destroy(ctx);
+}
+
+// Streams written by hand following the format descriptions, not by the compressor
+static void TestKnownChunks() {
+	// LZX: an uncompressed block of 5 bytes, the 20-bit header (type 3, not 32 KB, size) is padded to 32 bits and the odd size to a word
+	static const BYTE lzx_hello[] = { 0x00,0x60, 0x00,0x50, 1,0,0,0, 1,0,0,0, 1,0,0,0, 'H','e','l','l','o', 0 };
+	// LZX: two uncompressed blocks in one chunk
+	static const BYTE lzx_two[] = { 0x00,0x60, 0x00,0x50, 1,0,0,0, 1,0,0,0, 1,0,0,0, 'H','e','l','l','o', 0,
+		0x00,0x60, 0x00,0x30, 1,0,0,0, 1,0,0,0, 1,0,0,0, 'a','b','c', 0 };
+	// LZX: the E8 translation is undone after decompression: at 2 the absolute 0x20 is relative 0x1E, at 7 the absolute -1 is
+	// 12000000-1 relative, and at 12 it is within the last 10 bytes so it is left alone
+	static const BYTE lzx_e8[] = { 0x01,0x60, 0x00,0x20, 1,0,0,0, 1,0,0,0, 1,0,0,0,
+		0x90,0x90, 0xE8,0x20,0x00,0x00,0x00, 0xE8,0xFF,0xFF,0xFF,0xFF, 0xE8,0x05,0x00,0x00,0x00, 0x90 };
+	static const BYTE lzx_e8_u[] = { 0x90,0x90, 0xE8,0x1E,0x00,0x00,0x00, 0xE8,0xFF,0x1A,0xB7,0x00, 0xE8,0x05,0x00,0x00,0x00, 0x90 };
+	// LZX: an unknown block type
+	static const BYTE lzx_bad[] = { 0x00,0xE0, 0x00,0x50, 1,0,0,0, 1,0,0,0, 1,0,0,0, 'H','e','l','l','o', 0 };
+
+	Buffer c, u;
+	c.assign(lzx_hello, lzx_hello + sizeof(lzx_hello)); u.assign((const BYTE*)"Hello", (const BYTE*)"Hello" + 5);
+	CHECK(Decompressed(wimzip_lzx_decompress, c, u));
+	c.resize(c.size() - 3);
+	CHECK(!Decompressed(wimzip_lzx_decompress, c, u));
+	c.assign(lzx_two, lzx_two + sizeof(lzx_two)); u.assign((const BYTE*)"Helloabc", (const BYTE*)"Helloabc" + 8);
+	CHECK(Decompressed(wimzip_lzx_decompress, c, u));
+	c.assign(lzx_e8, lzx_e8 + sizeof(lzx_e8)); u.assign(lzx_e8_u, lzx_e8_u + sizeof(lzx_e8_u));
+	CHECK(Decompressed(wimzip_lzx_decompress, c, u));
+	c.assign(lzx_bad, lzx_bad + sizeof(lzx_bad)); u.assign((const BYTE*)"Hello", (const BYTE*)"Hello" + 5);
+	CHECK(!Decompressed(wimzip_lzx_decompress, c, u));
+
+	// XPRESS: every symbol has a 9-bit code (so a symbol's code is its value), "abc" then a match of 9 at offset 3 (symbol
+	// 256 + (1 << 4) + 9-3 with the 1 low bit of the offset)
+	c.assign(256, 0x99);
+	static const BYTE xpress_abc[] = { 0x98,0x30, 0x71,0x8C, 0x00,0x68 };
+	c.insert(c.end(), xpress_abc, xpress_abc + sizeof(xpress_abc));
+	u.assign((const BYTE*)"abcabcabcabc", (const BYTE*)"abcabcabcabc" + 12);
+	CHECK(Decompressed(wimzip_xpress_decompress, c, u));
+	// XPRESS: "a" then a match of 39 at offset 1, the length needs an extra byte which comes after the word loaded before it
+	c.resize(256);
+	static const BYTE xpress_run[] = { 0xC3,0x30, 0x00,0xC0, 0x00,0x00, 39-3-15 };
+	c.insert(c.end(), xpress_run, xpress_run + sizeof(xpress_run));
+	u.assign(40, 'a');
+	CHECK(Decompressed(wimzip_xpress_decompress, c, u));
+	c.pop_back();
+	CHECK(!Decompressed(wimzip_xpress_decompress, c, u));
+	// XPRESS: code lengths that aren't a valid code
+	c.assign(256 + 4, 0x11);
+	CHECK(!Decompressed(wimzip_xpress_decompress, c, u));
+}
+
+///// WIMs /////
+
+static void *Extract(const Buffer &wim, const char *name, size_t *size) {
+	// A copy of exactly the right size so reading past it is caught by the sanitizers
+	void *w = malloc(wim.size() ? wim.size() : 1);
+	if (!wim.empty()) { memcpy(w, &wim[0], wim.size()); }
+	*size = wim.size();
+	void *data = WIM::ExtractFile(w, &Widen(name)[0], size);
+	free(w);
+	return data;
+}
+
+static bool Extracts(const Buffer &wim, const char *name, const Buffer &expected) {
+	size_t size;
+	void *data = Extract(wim, name, &size);
+	const bool same = data && size == expected.size() && (size == 0 || memcmp(data, &expected[0], size) == 0);
+	free(data);
+	return same;
+}
+
+static bool Create(const Buffer &data, bool xpress, ULONG threads, Buffer &wim) {
+	size_t size;
+	void *w = WIM::Create(&Widen("activity.bmp")[0], data.empty() ? NULL : &data[0], data.size(), &size, xpress, threads);
+	if (w == NULL) { return false; }
+	wim.assign((BYTE*)w, (BYTE*)w + size);
+	free(w);
+	return true;
+}
+
+static void TestWIM() {
+	const size_t sizes[] = { 0, 1, 5000, WIMZIP_LZX_CHUNK_SIZE, WIMZIP_LZX_CHUNK_SIZE + 1, 150000 };
+	Buffer data, wim, part;
+	size_t size;
+	for (int xpress = 0; xpress < 2; ++xpress) {
+		for (size_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); ++s) {
+			// Mixed data so some chunks are compressed and some are stored
+			data.clear();
+			while (data.size() < sizes[s]) {
+				const size_t n = sizes[s] - data.size() < 20000 ? sizes[s] - data.size() : 20000;
+				switch (Rand(3)) { case 0: Text(part, n); break; case 1: Random(part, n); break; default: Calls(part, n, 0xE8); break; }
+				data.insert(data.end(), part.begin(), part.end());
+			}
+			for (ULONG threads = 1; threads <= 3; threads += 2) {
+				CHECK(Create(data, xpress != 0, threads, wim));
+				CHECK(Extracts(wim, "activity.bmp", data));
+				CHECK(Extracts(wim, "\\activity.bmp", data));
+				CHECK(Extracts(wim, "/ACTIVITY.BMP", data));
+			}
+			CHECK(Extract(wim, "other.bmp", &size) == NULL && GetLastError() == ERROR_FILE_NOT_FOUND);
+			CHECK(Extract(wim, "activity.bmp\\x", &size) == NULL);
+			CHECK(Extract(wim, "", &size) == NULL); // the root directory is not a file
+		}
+	}
+}
+
+// Every prefix of a WIM and random damage to it must fail or extract the file without reading out of bounds
+static void TestDamagedWIM() {
+	Buffer data, wim;
+	Text(data, 3 * WIMZIP_LZX_CHUNK_SIZE + 1000);
+	for (int xpress = 0; xpress < 2; ++xpress) {
+		CHECK(Create(data, xpress != 0, 1, wim));
+		size_t size;
+		const size_t step = wim.size() / 500 + 1;
+		for (size_t n = 0; n < wim.size(); n += (n < WIM_HEADER_SIZE + 16) ? 1 : step) {
+			Buffer t(wim.begin(), wim.begin() + n);
+			void *x = Extract(t, "activity.bmp", &size);
+			CHECK(x == NULL || (size == data.size() && memcmp(x, &data[0], size) == 0));
+			free(x);
+		}
+		for (int k = 0; k < 300; ++k) {
+			Buffer t(wim);
+			for (size_t flips = 1 + Rand(4); flips; --flips) {
+				// Mostly the header and the small resources at the end, which are where the structure is
+				const size_t at = Rand(2) ? Rand(WIM_HEADER_SIZE) : (Rand(2) ? t.size() - 1 - Rand(1000) : Rand(t.size()));
+				t[at] ^= (BYTE)(1 << Rand(8));
+			}
+			free(Extract(t, "activity.bmp", &size));
+		}
+
+		// Specific damage: the magic, no images, and the chunk table of the file (which is right after the header)
+		Buffer t(wim);
+		t[0] = 'X';
+		CHECK(Extract(t, "activity.bmp", &size) == NULL && GetLastError() == ERROR_INVALID_DATA);
+		t = wim;
+		memset(&t[44], 0, 4); // image_count
+		CHECK(Extract(t, "activity.bmp", &size) == NULL);
+		t = wim;
+		memset(&t[WIM_HEADER_SIZE], 0, 4); // the second chunk starts where the first does
+		CHECK(Extract(t, "activity.bmp", &size) == NULL);
+		t = wim;
+		memset(&t[WIM_HEADER_SIZE + 4], 0xFF, 4); // the third chunk starts past the end
+		CHECK(Extract(t, "activity.bmp", &size) == NULL);
+		t = wim;
+		std::swap_ranges(&t[WIM_HEADER_SIZE], &t[WIM_HEADER_SIZE + 4], &t[WIM_HEADER_SIZE + 4]); // the third chunk starts before the second
+		CHECK(Extract(t, "activity.bmp", &size) == NULL);
+	}
+}
+
+// A WIM made by Windows (wimgapi or DISM), the only way to know the format is read the way Windows writes it
+static int TestGolden(const char *path, const char *name, const char *expected_path) {
+	Buffer wim, expected;
+	if (!LoadFile(path, wim) || !LoadFile(expected_path, expected)) { fprintf(stderr, "Unable to read %s or %s\n", path, expected_path); return 1; }
+	CHECK(Extracts(wim, name, expected));
+
+	// And it is the same after being written again in both formats
+	Buffer again;
+	for (int xpress = 0; xpress < 2; ++xpress) {
+		CHECK(Create(expected, xpress != 0, 0, again));
+		CHECK(Extracts(again, "activity.bmp", expected));
+	}
+	if (failures) { fprintf(stderr, "%d checks failed\n", failures); return 1; }
+	printf("%s passed\n", path);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc == 4) { return TestGolden(argv[1], argv[2], argv[3]); }
+	state = (argc > 1) ? (unsigned int)strtoul(argv[1], NULL, 0) : 1;
+
+	TestKnownChunks();
+	TestChunks();
+	TestWIM();
+	TestDamagedWIM();
+
+	if (failures) { fprintf(stderr, "%d checks failed\n", failures); return 1; }
+	printf("All tests passed\n");
+	return 0;
+}
@@ -0,0 +1,152 @@
+/*
+ * Windows 7 Boot Updater (github.com/coderforlife/windows-7-boot-updater)
+ * Copyright (C) 2021  Jeffrey Bush - Coder for Life
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Command line front end of PEFileDiff, for producing the differences and delta between two PE files and applying the delta
+// Built along with the native sources of Win7BootUpdater (see CMakeLists.txt at the top of the repository)
+//
+// Usage:
+//   pe-diff diff  original updated          lists the resources and the ranges of the sections that are different
+//   pe-diff delta original updated delta    writes a delta that recreates the updated file from the original
+//   pe-diff apply original delta updated    recreates the updated file from the original and the delta
+//
+// Exits with 0 on success, 1 on failure, and 2 for bad arguments
+
+#include "PEFileDiff.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int Fail(const char *msg, const char *file) {
+	DWORD err = GetLastError();
+	if (file)	fprintf(stderr, "pe-diff: %s %s (error %u)\n", msg, file, (unsigned)err);
+	else		fprintf(stderr, "pe-diff: %s (error %u)\n", msg, (unsigned)err);
+	return 1;
+}
+
+// Reads an entire file into memory that must be freed
+static LPVOID Read(const char *path, size_t *size) {
+	FILE *f = fopen(path, "rb");
+	if (!f) { SetLastError(errno); return NULL; }
+	size_t cap = 0x10000, n;
+	LPBYTE data = (LPBYTE)malloc(cap);
+	*size = 0;
+	while (data && (n = fread(data + *size, 1, cap - *size, f)) > 0) {
+		if ((*size += n) == cap) {
+			LPBYTE temp = (LPBYTE)realloc(data, cap *= 2);
+			if (!temp) { free(data); }
+			data = temp;
+		}
+	}
+	if (!data || ferror(f)) { SetLastError(data ? errno : ERROR_NOT_ENOUGH_MEMORY); free(data); data = NULL; }
+	fclose(f);
+	return data;
+}
+
+static bool Write(const char *path, const LPVOID data, size_t size) {
+	FILE *f = fopen(path, "wb");
+	if (!f) { SetLastError(errno); return false; }
+	bool ok = fwrite(data, 1, size, f) == size;
+	if (fclose(f) != 0) { ok = false; }
+	if (!ok) { SetLastError(errno); remove(path); }
+	return ok;
+}
+
+// Loads a PE file into memory, the PEFile owns the data
+static PEFile *Load(const char *path) {
+	size_t size;
+	LPVOID data = Read(path, &size);
+	if (!data) { return NULL; }
+	PEFile *f = new PEFile(data, size, true);
+	if (!f->isLoaded()) { delete f; SetLastError(ERROR_INVALID_DATA); return NULL; }
+	return f;
+}
+
+// Prints a resource ID as a number or as its name (non-ASCII characters are shown as ?)
+static void PrintId(LPCWSTR id) {
+	if (IS_INTRESOURCE(id)) { printf("#%u", (unsigned)(size_t)id); return; }
+	for (; *id; ++id) { putchar((*id >= 0x20 && *id < 0x7F) ? (char)*id : '?'); }
+}
+
+static int Diff(const char *origPath, const char *updatedPath) {
+	static const char *changes[] = { "added", "removed", "changed" };
+	PEFile *orig = Load(origPath), *updated = orig ? Load(updatedPath) : NULL;
+	if (!orig)		{ return Fail("unable to load", origPath); }
+	if (!updated)	{ delete orig; return Fail("unable to load", updatedPath); }
+
+	PEFileDiff *d = PEFileDiff::create(orig, updated);
+	if (!d) { delete orig; delete updated; return Fail("unable to read the resources", NULL); }
+	const std::vector<PEResourceDiff> &res = d->getResources();
+	for (size_t i = 0; i < res.size(); ++i) {
+		printf("resource %-7s ", changes[res[i].change]);
+		PrintId(res[i].type);
+		putchar('/');
+		PrintId(res[i].name);
+		printf("/%u\n", (unsigned)res[i].lang);
+	}
+	const std::vector<PESectionDiff> &sects = d->getSections();
+	for (size_t i = 0; i < sects.size(); ++i)
+		printf("section  %-8s 0x%08x-0x%08x (%u bytes)\n", sects[i].name, (unsigned)sects[i].offset, (unsigned)(sects[i].offset + sects[i].size), (unsigned)sects[i].size);
+
+	delete d;
+	delete orig;
+	delete updated;
+	return 0;
+}
+
+static int Delta(const char *origPath, const char *updatedPath, const char *deltaPath) {
+	size_t origSize, updatedSize = 0, size;
+	LPVOID orig = Read(origPath, &origSize), updated = orig ? Read(updatedPath, &updatedSize) : NULL, delta;
+	if (!orig)		{ return Fail("unable to read", origPath); }
+	if (!updated)	{ free(orig); return Fail("unable to read", updatedPath); }
+	int retval = 0;
+	if (!(delta = PEFileDiff::CreateDelta(orig, origSize, updated, updatedSize, &size)))	{ retval = Fail("unable to create the delta", NULL); }
+	else if (!Write(deltaPath, delta, size))											{ retval = Fail("unable to write", deltaPath); }
+	else { printf("%u bytes to %u bytes with a %u byte delta\n", (unsigned)origSize, (unsigned)updatedSize, (unsigned)size); }
+	free(delta);
+	free(orig);
+	free(updated);
+	return retval;
+}
+
+static int Apply(const char *origPath, const char *deltaPath, const char *updatedPath) {
+	size_t origSize, deltaSize = 0, size;
+	LPVOID orig = Read(origPath, &origSize), delta = orig ? Read(deltaPath, &deltaSize) : NULL, updated;
+	if (!orig)	{ return Fail("unable to read", origPath); }
+	if (!delta)	{ free(orig); return Fail("unable to read", deltaPath); }
+	int retval = 0;
+	if (!(updated = PEFileDiff::ApplyDelta(orig, origSize, delta, deltaSize, &size)))	{ retval = Fail("the delta does not apply to", origPath); }
+	else if (!Write(updatedPath, updated, size))									{ retval = Fail("unable to write", updatedPath); }
+	free(updated);
+	free(orig);
+	free(delta);
+	return retval;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc == 4 && strcmp(argv[1], "diff") == 0)	{ return Diff(argv[2], argv[3]); }
+	if (argc == 5 && strcmp(argv[1], "delta") == 0)	{ return Delta(argv[2], argv[3], argv[4]); }
+	if (argc == 5 && strcmp(argv[1], "apply") == 0)	{ return Apply(argv[2], argv[3], argv[4]); }
+	fprintf(stderr,
+		"Usage:\n"
+		"  pe-diff diff  original updated          lists the resources and the ranges of the sections that are different\n"
+		"  pe-diff delta original updated delta    writes a delta that recreates the updated file from the original\n"
+		"  pe-diff apply original delta updated    recreates the updated file from the original and the delta\n");
+	return 2;
+}